@@ -0,0 +1,135 @@
+// Compare the previous AnyValue layout (kind + std::variant + AnyType) with
+// the compact 16-byte AnyValue on copy heavy table operations.
+//
+// usage: bench_any_value [num_rows]
+
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "fmt/core.h"
+#include "lumidb/types.hh"
+
+using namespace std;
+using namespace lumidb;
+
+// the AnyValue layout before the compact representation
+struct LegacyAnyValue {
+  ValueTypeKind kind;
+  std::variant<float, std::string> value;
+  AnyType type;
+
+  static LegacyAnyValue from_string(std::string str) {
+    return {ValueTypeKind::T_STRING, std::move(str),
+            AnyType::from_value_type(ValueTypeKind::T_STRING)};
+  }
+
+  static LegacyAnyValue from_float(float value) {
+    return {ValueTypeKind::T_FLOAT, value,
+            AnyType::from_value_type(ValueTypeKind::T_FLOAT)};
+  }
+
+  float as_float() const { return std::get<float>(value); }
+};
+
+struct CompactValue : AnyValue {
+  using AnyValue::AnyValue;
+
+  static CompactValue from_string(std::string str) {
+    return CompactValue(std::string_view(str));
+  }
+  static CompactValue from_float(float value) { return CompactValue(value); }
+};
+
+template <typename Fn>
+double measure_ms(Fn &&fn) {
+  auto start = chrono::steady_clock::now();
+  fn();
+  auto end = chrono::steady_clock::now();
+  return chrono::duration<double, milli>(end - start).count();
+}
+
+struct BenchResult {
+  double build_ms;
+  double clone_ms;
+  double filter_ms;
+  double select_ms;
+};
+
+// rows: (name, class, score1, score2, score3)
+template <typename Value>
+BenchResult run_bench(size_t num_rows) {
+  using Row = vector<Value>;
+  vector<Row> rows;
+  BenchResult result;
+
+  result.build_ms = measure_ms([&]() {
+    rows.reserve(num_rows);
+    for (size_t i = 0; i < num_rows; i++) {
+      rows.push_back({
+          Value::from_string(fmt::format("stu-{}", i)),
+          Value::from_string(fmt::format("class-{}-of-grade-2023", i % 64)),
+          Value::from_float(float(i % 100)),
+          Value::from_float(float(i % 77)),
+          Value::from_float(float(i % 31)),
+      });
+    }
+  });
+
+  size_t sink = 0;
+
+  result.clone_ms = measure_ms([&]() {
+    vector<Row> cloned = rows;
+    sink += cloned.size();
+  });
+
+  result.filter_ms = measure_ms([&]() {
+    vector<Row> filtered;
+    for (auto &row : rows) {
+      if (row[2].as_float() > 50) {
+        filtered.push_back(row);
+      }
+    }
+    sink += filtered.size();
+  });
+
+  result.select_ms = measure_ms([&]() {
+    vector<Row> selected;
+    selected.reserve(rows.size());
+    for (auto &row : rows) {
+      selected.push_back({row[0], row[1], row[3]});
+    }
+    sink += selected.size();
+  });
+
+  if (sink == 0) {
+    fmt::print("unexpected empty result\n");
+  }
+
+  return result;
+}
+
+int main(int argc, char **argv) {
+  size_t num_rows = 1000000;
+  if (argc > 1) {
+    num_rows = std::strtoull(argv[1], nullptr, 10);
+  }
+
+  fmt::print("rows: {}, columns: 5 (2 strings, 3 floats)\n\n", num_rows);
+  fmt::print("{:<10}{:>10}{:>12}{:>12}{:>12}{:>12}\n", "layout", "sizeof",
+             "build(ms)", "clone(ms)", "filter(ms)", "select(ms)");
+
+  auto print_result = [](const char *name, size_t size, BenchResult r) {
+    fmt::print("{:<10}{:>10}{:>12.1f}{:>12.1f}{:>12.1f}{:>12.1f}\n", name, size,
+               r.build_ms, r.clone_ms, r.filter_ms, r.select_ms);
+  };
+
+  print_result("legacy", sizeof(LegacyAnyValue),
+               run_bench<LegacyAnyValue>(num_rows));
+  print_result("compact", sizeof(CompactValue),
+               run_bench<CompactValue>(num_rows));
+
+  return 0;
+}
@@ -0,0 +1,141 @@
+// Compare the scalar, SSE2 and AVX2 versions of the float kernels, on their
+// own, in the filter stage of `where` and behind whole `where` and `avg`
+// queries, over a single float? column. `filter` selects the rows of every
+// chunk like a batch of a scan is filtered, the queries add the pipeline
+// around it.
+//
+// usage: bench_simd [num_rows]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+
+#include "fmt/core.h"
+#include "lumidb/db.hh"
+#include "lumidb/predicate.hh"
+#include "lumidb/query.hh"
+#include "lumidb/simd.hh"
+#include "lumidb/table.hh"
+
+using namespace std;
+using namespace lumidb;
+
+// best of a few runs
+template <typename Fn>
+double measure_ms(Fn &&fn) {
+  double best = 1e300;
+  for (int i = 0; i < 5; i++) {
+    auto start = chrono::steady_clock::now();
+    fn();
+    auto end = chrono::steady_clock::now();
+    best = min(best, chrono::duration<double, milli>(end - start).count());
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  size_t num_rows = 10000000;
+  if (argc > 1) {
+    num_rows = std::strtoull(argv[1], nullptr, 10);
+  }
+
+  auto db = create_database({.num_workers = 1}).unwrap();
+  auto run = [&](const char *query) {
+    auto res = db->execute(parse_query(query).unwrap()).get();
+    if (res.has_error()) {
+      fmt::print("query failed: {}\n", query);
+      exit(1);
+    }
+    return res.unwrap();
+  };
+
+  // scores in [0, 100), one in 50 null
+  run(R"(create_table("t") | add_field("score", "float?"))");
+  auto table = db->get_table("t").unwrap();
+  vector<ValueList> rows;
+  for (size_t i = 0; i < num_rows; i++) {
+    uint32_t hash = uint32_t(i) * 2654435761u;
+    rows.push_back({i % 50 == 0 ? AnyValue::from_null()
+                                : AnyValue::from_float(float(hash % 10000) /
+                                                       100)});
+    if (rows.size() == 100000 || i + 1 == num_rows) {
+      table->add_row_list(rows);
+      rows.clear();
+    }
+  }
+  auto &column = table->column(0);
+  Predicate predicate(column.type(), CompareOperator::LT,
+                      AnyValue::from_float(50));
+
+  fmt::print("rows: {}, column: float?, detected: {}\n\n", num_rows,
+             simd::isa_name(simd::detected_isa()));
+  fmt::print("{:<8}{:>14}{:>14}{:>14}{:>14}{:>14}{:>14}\n", "isa",
+             "compare(ms)", "sum(ms)", "min/max(ms)", "filter(ms)", "where(ms)",
+             "avg(ms)");
+
+  size_t sink = 0;
+  for (auto isa : {simd::Isa::Scalar, simd::Isa::SSE2, simd::Isa::AVX2}) {
+    if (isa > simd::detected_isa()) {
+      continue;
+    }
+    simd::set_isa(isa);
+
+    vector<uint64_t> bits(kColumnChunkSize / 64);
+    double compare_ms = measure_ms([&]() {
+      for (size_t c = 0; c < column.num_chunks(); c++) {
+        auto &chunk = column.chunk(c);
+        simd::compare_floats(CompareOperator::LT, chunk.floats.data(),
+                             chunk.size, 50, bits.data());
+        sink += bits[0];
+      }
+    });
+
+    double sum_ms = measure_ms([&]() {
+      for (size_t c = 0; c < column.num_chunks(); c++) {
+        auto &chunk = column.chunk(c);
+        sink += simd::summarize_floats(chunk.floats.data(), chunk.size).sum;
+      }
+    });
+
+    vector<uint64_t> non_null(kColumnChunkSize / 64);
+    double min_max_ms = measure_ms([&]() {
+      for (size_t c = 0; c < column.num_chunks(); c++) {
+        auto &chunk = column.chunk(c);
+        for (size_t i = 0; i < chunk.null_bits.size(); i++) {
+          non_null[i] = ~chunk.null_bits[i];
+        }
+        auto summary = simd::summarize_floats(chunk.floats.data(), chunk.size,
+                                              non_null.data());
+        sink += summary.max - summary.min;
+      }
+    });
+
+    double filter_ms = measure_ms([&]() {
+      for (size_t c = 0; c < column.num_chunks(); c++) {
+        size_t begin = c * kColumnChunkSize;
+        sink += predicate.select(column, begin, begin + column.chunk(c).size)
+                    .size();
+      }
+    });
+
+    double where_ms = measure_ms([&]() {
+      sink += run(R"(query("t") | where("score", "<", 50) | count())")
+                  ->num_rows();
+    });
+    double avg_ms = measure_ms([&]() {
+      sink += run(R"(query("t") | avg("score"))")->num_rows();
+    });
+
+    fmt::print(
+        "{:<8}{:>14.1f}{:>14.1f}{:>14.1f}{:>14.1f}{:>14.1f}{:>14.1f}\n",
+        simd::isa_name(isa), compare_ms, sum_ms, min_max_ms, filter_ms,
+        where_ms, avg_ms);
+  }
+
+  if (sink == 0) {
+    fmt::print("unexpected empty result\n");
+  }
+
+  return 0;
+}
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <future>
 #include <memory>
+#include <optional>
 #include <string>
 #include <utility>
 #include <vector>
@@ -10,11 +12,17 @@
 #include "lumidb/query.hh"
 #include "lumidb/types.hh"
 
+class ThreadPool;
+
 namespace lumidb {
 
 class Function;
 class Plugin;
 class Table;
+class WriteAheadLog;
+struct WalOptions;
+class Checkpointer;
+struct CheckpointOptions;
 
 using FunctionPtr = std::shared_ptr<Function>;
 using TablePtr = std::shared_ptr<Table>;
@@ -45,8 +53,17 @@ struct ReportErrorParams {
   Error error;
 };
 
+// a snapshot file owned by the write-ahead log, identified by the checksum of
+// its meta
+struct SnapshotSource {
+  std::string path;
+  uint64_t checksum;
+};
+
 struct CreateTableParams {
   TablePtr table;
+  // the snapshot copy the table was loaded from, logged instead of its rows
+  std::optional<SnapshotSource> source;
 };
 
 struct LoadPluginParams {
@@ -71,6 +88,10 @@ class Database {
 
   // table related methods
   virtual Result<TablePtr> create_table(const CreateTableParams &params) = 0;
+  // create every table or none of them, fails if any of them exists
+  virtual Result<bool> create_table_list(
+      const std::vector<CreateTableParams> &params_list) = 0;
+  // waits for the running writer of the table, the later ones fail
   virtual Result<bool> drop_table(const std::string &name) = 0;
   virtual Result<TablePtr> get_table(const std::string &name) const = 0;
   virtual Result<TablePtrList> list_tables() const = 0;
@@ -93,9 +114,36 @@ class Database {
   virtual Result<FunctionPtrList> list_functions() const = 0;
 
   // execute is thread-safe, it returns a future, it may be executed in a
-  // separate thread
+  // separate thread. Executions run concurrently: readers work on a
+  // `Table::snapshot()` without locking, only writers of the same table are
+  // serialized, by `Table::modify()`.
   virtual std::future<Result<TablePtr>> execute(const Query &query) = 0;
 
+  // workers shared by the executions, functions may use it to run their work
+  // in parallel
+  virtual ThreadPool *thread_pool() = 0;
+
+  // bytes a sort may hold in memory before it spills sorted runs to temp
+  // files, 0 means unlimited
+  virtual size_t sort_memory_budget() const = 0;
+
+  // write-ahead log every change to the tables is recorded in, nullptr until
+  // `open_wal`
+  virtual WriteAheadLog *wal() = 0;
+
+  // replay the log on top of the current tables, e.g. loaded from a snapshot,
+  // then record every later change to it. Must be called before queries are
+  // executed.
+  virtual Result<bool> open_wal(const WalOptions &options) = 0;
+
+  // checkpoints the tables in the background, nullptr until
+  // `start_checkpointer`
+  virtual Checkpointer *checkpointer() = 0;
+
+  // start checkpointing the tables to a snapshot, and truncating the
+  // write-ahead log if it is opened. Must be called after `open_wal`.
+  virtual Result<bool> start_checkpointer(const CheckpointOptions &options) = 0;
+
   // helper function, used in functions or plugins for simplicity (a better
   // design would be seperate below methods into a different interface)
   virtual void report_error(const ReportErrorParams &params) = 0;
@@ -105,7 +153,12 @@ class Database {
 
 using DatabasePtr = std::shared_ptr<Database>;
 
-struct CreateDatabaseParams {};
+struct CreateDatabaseParams {
+  // number of query workers, 0 means one per hardware thread
+  size_t num_workers = 0;
+  // see `Database::sort_memory_budget`
+  size_t sort_memory_budget = size_t(1) << 30;
+};
 
 Result<DatabasePtr> create_database(const CreateDatabaseParams &params);
 }  // namespace lumidb
@@ -1,115 +1,224 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <exception>
+#include <functional>
 #include <future>
-#include <iostream>
+#include <memory>
 #include <mutex>
 #include <optional>
-#include <queue>
 #include <thread>
-
-// Thread-safe Channel
-template <typename T>
-class Channel {
+#include <vector>
+
+// Work-stealing thread pool
+//
+// Each worker owns a task deque, it pops its own tasks from the back and
+// steals from the front of other workers' deques when it runs out of work.
+// Tasks submitted from outside the pool are spread over the deques round
+// robin. Workers only take the shared lock to park once every deque is empty.
+class ThreadPool {
  public:
-  struct RecvItem {
-    std::optional<T> value;
-    bool closed;
-  };
-
-  Channel() = default;
-  ~Channel() = default;
+  using Task = std::function<void()>;
+  using RangeTask = std::function<void(size_t begin, size_t end)>;
 
-  Channel(const Channel &) = delete;
-  Channel &operator=(const Channel &) = delete;
+  // num_workers == 0 means one worker per hardware thread
+  explicit ThreadPool(size_t num_workers = 0) {
+    if (num_workers == 0) {
+      num_workers = std::max(1u, std::thread::hardware_concurrency());
+    }
 
-  Channel(Channel &&) = delete;
-  Channel &operator=(Channel &&) = delete;
+    for (size_t i = 0; i < num_workers; i++) {
+      queues_.emplace_back(std::make_unique<WorkerQueue>());
+    }
+    for (size_t i = 0; i < num_workers; i++) {
+      threads_.emplace_back([this, i]() { run_worker(i); });
+    }
+  }
 
-  void close() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    closed_ = true;
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_.store(true);
+    }
     cv_.notify_all();
+    for (auto &thread : threads_) {
+      thread.join();
+    }
   }
 
-  void send(T value) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    queue_.push(std::move(value));
-    cv_.notify_one();
-  }
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
 
-  RecvItem recv() {
-    std::unique_lock<std::mutex> lock(mutex_);
+  size_t num_workers() const { return threads_.size(); }
 
-    cv_.wait(lock, [this]() { return !queue_.empty() || closed_; });
+  // true if called from one of the pool workers
+  bool in_worker() const { return current_pool() == this; }
 
-    if (queue_.empty()) {
-      return {std::nullopt, closed_};
+  // task must not throw, see parallel_for for work that may fail
+  void add_task(Task task) {
+    size_t idx = in_worker() ? current_worker_index()
+                             : next_queue_.fetch_add(1) % queues_.size();
+    {
+      auto &queue = *queues_[idx];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(std::move(task));
+      pending_.fetch_add(1);
+    }
+    // a worker parks only after it saw no pending task, so an idle pool is
+    // always woken up
+    if (num_parked_.load() > 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_one();
     }
+  }
 
-    T value = std::move(queue_.front());
-    queue_.pop();
+  // Run task over [0, n) split into morsels of morsel_size. The calling
+  // thread takes part in the work, so it is safe to call from a worker, and
+  // returns when every morsel is done. If task throws, the morsels left are
+  // skipped and the first exception is rethrown to the caller.
+  void parallel_for(size_t n, size_t morsel_size, const RangeTask &task) {
+    if (n == 0) {
+      return;
+    }
+    morsel_size = std::max<size_t>(morsel_size, 1);
+    size_t num_morsels = (n + morsel_size - 1) / morsel_size;
+    if (num_morsels == 1) {
+      task(0, n);
+      return;
+    }
 
-    return {std::move(value), closed_};
-  }
+    struct State {
+      std::atomic<size_t> next_morsel{0};
+      std::atomic<bool> failed{false};
+      size_t done_morsels = 0;
+      std::exception_ptr error;
+      std::mutex mutex;
+      std::condition_variable cv;
+    };
+    auto state = std::make_shared<State>();
+
+    // claim morsels until none are left, the state outlives helpers that
+    // start after the work is done
+    auto work = [state, n, morsel_size, num_morsels, &task]() {
+      size_t done = 0;
+      while (true) {
+        size_t morsel = state->next_morsel.fetch_add(1);
+        if (morsel >= num_morsels) {
+          break;
+        }
+        done++;
+        if (state->failed.load()) {
+          continue;
+        }
+        size_t begin = morsel * morsel_size;
+        try {
+          task(begin, std::min(n, begin + morsel_size));
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(state->mutex);
+          if (!state->error) {
+            state->error = std::current_exception();
+          }
+          state->failed.store(true);
+        }
+      }
 
- private:
-  std::queue<T> queue_;
-  std::condition_variable cv_;
-  std::mutex mutex_;
-  bool closed_ = false;
-};
+      if (done > 0) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->done_morsels += done;
+        if (state->done_morsels == num_morsels) {
+          state->cv.notify_all();
+        }
+      }
+    };
 
-// Helper function to run tasks in another thread
+    size_t num_helpers = std::min(num_workers(), num_morsels - 1);
+    for (size_t i = 0; i < num_helpers; i++) {
+      add_task(work);
+    }
+    work();
 
-class ThreadExecutor {
- public:
-  using Task = std::function<void()>;
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cv.wait(lock,
+                   [&]() { return state->done_morsels == num_morsels; });
+    if (state->error) {
+      std::rethrow_exception(state->error);
+    }
+  }
 
-  ThreadExecutor() {
-    thread_ = std::thread([this]() { run_thread(); });
-    worker_thread_id_ = thread_.get_id();
+ private:
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
   };
-  ~ThreadExecutor() {
-    channel_.close();
-    thread_.join();
+
+  static ThreadPool *&current_pool() {
+    thread_local ThreadPool *pool = nullptr;
+    return pool;
   }
-  ThreadExecutor(const ThreadExecutor &) = delete;
-  ThreadExecutor &operator=(const ThreadExecutor &) = delete;
 
-  void add_task(Task task) {
-    // if same thread, run in current thread instantly, to avoid deadlock
-    if (std::this_thread::get_id() == worker_thread_id_) {
-      task();
-      return;
-    }
+  static size_t &current_worker_index() {
+    thread_local size_t idx = 0;
+    return idx;
+  }
 
-    channel_.send(std::move(task));
+  bool pop_task(size_t idx, Task &task) {
+    // own queue first (LIFO), then steal from the others (FIFO)
+    for (size_t i = 0; i < queues_.size(); i++) {
+      auto &queue = *queues_[(idx + i) % queues_.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.tasks.empty()) {
+        continue;
+      }
+
+      if (i == 0) {
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+      } else {
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+      }
+      pending_.fetch_sub(1);
+      return true;
+    }
+    return false;
   }
 
- private:
-  void run_thread() {
+  void run_worker(size_t idx) {
+    current_pool() = this;
+    current_worker_index() = idx;
+
+    Task task;
     while (true) {
-      auto [value, closed] = channel_.recv();
-      if (closed) {
-        break;
+      if (pop_task(idx, task)) {
+        task();
+        task = nullptr;
+        continue;
       }
 
-      try {
-        if (value.has_value()) {
-          value.value()();
-        }
-
-      } catch (std::exception &e) {
-        std::cerr << "ThreadExecutor: failed to run task: " << e.what()
-                  << std::endl;
+      // every deque was empty, park until a task is added
+      std::unique_lock<std::mutex> lock(mutex_);
+      num_parked_.fetch_add(1);
+      cv_.wait(lock, [this]() { return pending_.load() > 0 || stopped_; });
+      num_parked_.fetch_sub(1);
+      if (pending_.load() == 0 && stopped_) {
+        break;
       }
     }
   }
 
  private:
-  std::thread thread_;
-  std::thread::id worker_thread_id_;
-  Channel<Task> channel_;
-};
\ No newline at end of file
+  std::vector<std::unique_ptr<WorkerQueue>> queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<size_t> next_queue_{0};
+
+  // number of tasks in the deques, changed under the lock of a deque
+  std::atomic<size_t> pending_{0};
+  // parked workers wait on cv_ under mutex_
+  std::atomic<size_t> num_parked_{0};
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::atomic<bool> stopped_{false};
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "lumidb/predicate.hh"
+#include "lumidb/table.hh"
+#include "lumidb/types.hh"
+
+// Boolean filter expressions of `where`.
+//
+// A `FilterExpr` is a tree of `Predicate`s on fields joined by and, or and
+// not. Rows are evaluated a batch at a time and a node only evaluates the
+// rows its earlier siblings left undecided: a row failing a child of an and,
+// or passing a child of an or, is not passed to the later children, and a
+// node stops once no row is left. Each and / or node measures the
+// selectivity and the cost per row of its children as it runs, and reorders
+// them so that the child deciding the most rows per unit of cost runs first.
+// The rows that pass keep the order of the input.
+
+namespace lumidb {
+
+class FilterExpr {
+ public:
+  enum class Kind {
+    // a predicate on a field
+    Predicate = 0,
+    And,
+    Or,
+    Not,
+  };
+
+  // the column of a field index of the expression
+  using ColumnOf = std::function<const Column &(size_t field_index)>;
+
+  static FilterExpr predicate(size_t field_index, Predicate predicate);
+  // and of the children, nested ands are flattened and a single child is
+  // returned as is. Passes every row if there is no child.
+  static FilterExpr all_of(std::vector<FilterExpr> children);
+  // or of the children, like `all_of`. Passes no row if there is no child.
+  static FilterExpr any_of(std::vector<FilterExpr> children);
+  static FilterExpr negate(FilterExpr child);
+
+  // parse an expression over the fields of schema, like
+  //
+  //   语文 >= 60 and not (数学 < 60 or 英语 is_null)
+  //
+  // Terms are `<field> <op> <value>`, `<field> between <low> and <high>`,
+  // `<field> in (<value>, ...)`, `<field> is_null` and `<field> not_null`,
+  // see `Predicate::parse`. A value is a number, a quoted string or null. A
+  // field is a word, or any name quoted in backticks. `not` binds tighter
+  // than `and`, which binds tighter than `or`.
+  static Result<FilterExpr> parse(std::string_view text,
+                                  const TableSchema &schema);
+  // the field indices of the terms of an expression, which fails to parse
+  // like `parse`, without compiling the predicates
+  static Result<std::vector<size_t>> fields_of(std::string_view text,
+                                               const TableSchema &schema);
+
+  Kind kind() const { return kind_; }
+  // the field and predicate of a predicate node
+  size_t field_index() const { return field_index_; }
+  const Predicate &leaf() const { return *predicate_; }
+  const std::vector<FilterExpr> &children() const { return children_; }
+
+  // set bit i of bitmap if rows[i] passes
+  void evaluate(const ColumnOf &column_of, const RowIndicesList &rows,
+                SelectionBitmap &bitmap) const;
+
+  // the rows that pass, in their order
+  RowIndicesList select(const ColumnOf &column_of,
+                        const RowIndicesList &rows) const;
+  // the rows of the view that pass, the field indices are of the view
+  TableView filter(const TableView &view) const;
+
+  // some cell of the chunk may pass, false only if the zone maps rule every
+  // cell out
+  bool may_match(const ColumnOf &column_of, size_t chunk_index) const;
+  // some row of the view may pass, see `TableView::may_match`
+  bool may_match(const TableView &view) const;
+
+  // a superset of the passing rows in row order, looked up in indexes as
+  // `Predicate::lookup`: a predicate is looked up, an and looks up one of
+  // its children and an or the union of all of them. std::nullopt if no
+  // index can answer. Exact for a predicate and an or of exact lookups.
+  std::optional<RowIndicesList> lookup(const Table &table) const;
+  // like above, only for views of every base row
+  std::optional<TableView> lookup(const TableView &view) const;
+
+ private:
+  // selectivity and cost of the children of an and / or, shared between the
+  // threads evaluating batches
+  struct Stats;
+
+  FilterExpr(Kind kind, std::vector<FilterExpr> children);
+
+  // evaluate the children of an and / or on the pending rows, and drop the
+  // rows a child decides: the rows failing a child of an and, or passing a
+  // child of an or, whose positions are then set in bitmap. positions are
+  // those of the pending rows in the evaluated rows, only needed for an or.
+  void evaluate_children(const ColumnOf &column_of, RowIndicesList &pending,
+                         std::vector<size_t> *positions,
+                         SelectionBitmap &bitmap) const;
+  std::optional<RowIndicesList> lookup(
+      const Table &table, const std::function<size_t(size_t)> &base_field)
+      const;
+
+ private:
+  Kind kind_;
+  size_t field_index_ = 0;
+  std::optional<Predicate> predicate_;
+  std::vector<FilterExpr> children_;
+  std::shared_ptr<Stats> stats_;
+};
+
+}  // namespace lumidb
@@ -1,13 +1,18 @@
 #pragma once
 
+#include <algorithm>
 #include <any>
 #include <memory>
+#include <numeric>
 #include <optional>
 #include <string>
 
 #include "lumidb/db.hh"
+#include "lumidb/filter.hh"
+#include "lumidb/pipeline.hh"
 #include "lumidb/table.hh"
 #include "lumidb/types.hh"
+#include "lumidb/utils.hh"
 
 namespace lumidb {
 
@@ -148,21 +153,75 @@ std::vector<FunctionPtr> get_builtin_functions();
 namespace datas {
 class Filters {
  public:
-  void add_and_filter(Table::RowPredictor filter) {
-    and_filters.emplace_back(std::move(filter));
+  // an and filter on fields of the table, a predicate or a boolean
+  // expression of predicates. Lets `candidates` use the indexes of the
+  // fields.
+  void add_expr_filter(FilterExpr expr) {
+    expr_filters.push_back(std::move(expr));
   }
 
-  bool perdict(const ValueList& row, size_t row_idx) const {
-    for (auto& filter : and_filters) {
-      if (!filter(row, row_idx)) {
-        return false;
+  // rows that may pass the filters, looked up in the indexes of the fields
+  // as `FilterExpr::lookup`, else the rows of the chunks the zone maps don't
+  // rule out. std::nullopt means every row is a candidate.
+  std::optional<RowIndicesList> candidates(const Table& table) const {
+    for (auto& expr : expr_filters) {
+      if (auto rows = expr.lookup(table); rows) {
+        return rows;
       }
     }
-    return true;
+
+    auto column_of = [&](size_t field_index) -> const Column& {
+      return table.column(field_index);
+    };
+    bool pruned = false;
+    RowIndicesList rows;
+    for (size_t begin = 0; begin < table.num_rows();
+         begin += kColumnChunkSize) {
+      size_t chunk_index = begin / kColumnChunkSize;
+      bool may_match = std::all_of(
+          expr_filters.begin(), expr_filters.end(),
+          [&](auto& expr) { return expr.may_match(column_of, chunk_index); });
+      if (!may_match) {
+        pruned = true;
+        continue;
+      }
+      size_t end = std::min(table.num_rows(), begin + kColumnChunkSize);
+      for (size_t row = begin; row < end; row++) {
+        rows.push_back(row);
+      }
+    }
+    if (!pruned) {
+      return std::nullopt;
+    }
+    return rows;
+  }
+
+  // the rows passing every filter, in row order. The filters are evaluated
+  // as the conjuncts of one `FilterExpr`, a batch of candidates at a time so
+  // the conjuncts are reordered as their selectivity is observed.
+  RowIndicesList select(const Table& table) const {
+    auto candidates = this->candidates(table);
+    if (!candidates) {
+      candidates.emplace(table.num_rows());
+      std::iota(candidates->begin(), candidates->end(), 0);
+    }
+
+    auto expr = FilterExpr::all_of(expr_filters);
+    auto column_of = [&](size_t field_index) -> const Column& {
+      return table.column(field_index);
+    };
+    RowIndicesList rows, batch;
+    for (size_t begin = 0; begin < candidates->size(); begin += kBatchSize) {
+      size_t end = std::min(candidates->size(), begin + kBatchSize);
+      batch.assign(candidates->begin() + begin, candidates->begin() + end);
+      auto selected = expr.select(column_of, batch);
+      rows.insert(rows.end(), selected.begin(), selected.end());
+    }
+    return rows;
   }
 
  private:
-  std::vector<Table::RowPredictor> and_filters;
+  std::vector<FilterExpr> expr_filters;
 };
 
 struct FieldNameUpdateItem {
@@ -181,8 +240,20 @@ struct CreateTableRootData {
 };
 
 struct InsertRootData {
+  // rows added by `add_row`, staged in a table of the same schema, or a csv
+  // file streamed into the table on finalize
+  struct Source {
+    TablePtr rows;
+    MappedFilePtr file;
+    std::optional<CSVReader> csv;
+  };
+
   TablePtr table;
-  std::vector<ValueList> rows;
+  // in the order of the function chain
+  std::vector<Source> sources;
+  // publish a version per staged source and per csv batch, instead of a
+  // single version with every row
+  bool commit_batches = false;
 };
 
 struct UpdateRootData {
@@ -197,7 +268,9 @@ struct DeleteRootData {
 };
 
 struct QueryRootData {
-  TablePtr table;
+  // leaf functions stack streaming operators on the pipeline, the root pulls
+  // it batch by batch in finalize
+  OperatorPtr pipeline;
 };
 
 }  // namespace datas
@@ -279,11 +352,12 @@ std::optional<Ptr<T>> any_cast_ptr(std::any value) {
   return {};
 }
 
-// Can used in plugins
+// Can used in plugins, a table shared with other executions must be passed as
+// a `Table::snapshot()`
 static Result<bool> execute_query_root(RootFunctionExecuteContext& ctx,
                                        TablePtr table) {
   auto data = std::make_shared<datas::QueryRootData>();
-  data->table = table;
+  data->pipeline = std::make_shared<ScanOperator>(TableView(table));
 
   ctx.user_data = data;
   return true;
@@ -296,7 +370,11 @@ static Result<bool> finalize_query_root(RootFunctionFinalizeContext& ctx) {
   }
   auto data = data_res.value();
 
-  ctx.result = data->table;
+  auto result = collect(*data->pipeline);
+  if (auto error = data->pipeline->error(); error.has_value()) {
+    return error.value();
+  }
+  ctx.result = result.materialize();
   return true;
 }
 }  // namespace helper
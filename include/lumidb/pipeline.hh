@@ -0,0 +1,355 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "lumidb/executor.hh"
+#include "lumidb/filter.hh"
+#include "lumidb/table.hh"
+#include "lumidb/types.hh"
+
+// Pull-based, batch-at-a-time execution of query chains.
+//
+// `query(...)` starts a pipeline with a scan, every leaf function stacks a
+// streaming operator on top of it, and the root pulls batches of at most
+// `kBatchSize` rows in finalize. A batch is a `TableView` with a small
+// selection vector, so intermediates never copy rows.
+
+namespace lumidb {
+
+// rows per batch, the row indices and the touched column slices of a batch
+// stay in L2
+constexpr size_t kBatchSize = 2048;
+
+class Operator;
+using OperatorPtr = std::shared_ptr<Operator>;
+
+class Operator {
+ public:
+  virtual ~Operator() = default;
+
+  // base and projection of the produced batches, used to resolve fields
+  // while the pipeline is built. Every batch of an operator shares the same
+  // base table and fields.
+  virtual const TableView &shape() const = 0;
+
+  const TableSchema &schema() const { return shape().schema(); }
+
+  // next non-empty batch, std::nullopt when exhausted
+  virtual std::optional<TableView> next() = 0;
+
+  // all remaining rows as a single view, if the operator can produce it
+  // cheaper than batch by batch
+  virtual std::optional<TableView> remaining() { return std::nullopt; }
+
+  // the error that ended the batches early, checked once `next` returns
+  // std::nullopt. Operators report the errors of their child too.
+  virtual std::optional<Error> error() const { return std::nullopt; }
+};
+
+// pull every batch of the operator and merge them into a single view
+TableView collect(Operator &op);
+
+class ScanOperator : public Operator {
+ public:
+  explicit ScanOperator(TableView source) : source_(std::move(source)) {}
+
+  // the scanned view, including the rows already produced
+  const TableView &source() const { return source_; }
+
+  const TableView &shape() const override { return source_; }
+  std::optional<TableView> next() override;
+  std::optional<TableView> remaining() override;
+
+ private:
+  TableView source_;
+  size_t offset_ = 0;
+};
+
+// With a pool, one batch per worker is pulled and filtered in parallel.
+class FilterOperator : public Operator {
+ public:
+  // batches are filtered by the kernels of the predicates of the expression,
+  // and skipped if their zone maps rule the expression out
+  FilterOperator(OperatorPtr child, FilterExpr expr, ThreadPool *pool = nullptr)
+      : child_(std::move(child)), expr_(std::move(expr)), pool_(pool) {}
+
+  FilterOperator(OperatorPtr child, size_t field_index, Predicate predicate,
+                 ThreadPool *pool = nullptr)
+      : FilterOperator(std::move(child),
+                       FilterExpr::predicate(field_index, std::move(predicate)),
+                       pool) {}
+
+  const TableView &shape() const override { return child_->shape(); }
+  std::optional<TableView> next() override;
+  std::optional<Error> error() const override { return child_->error(); }
+
+  const OperatorPtr &child() const { return child_; }
+  // the expression the batches are filtered by
+  const FilterExpr &expr() const { return expr_; }
+
+ private:
+  OperatorPtr child_;
+  FilterExpr expr_;
+  ThreadPool *pool_;
+  std::deque<TableView> ready_;
+};
+
+class ProjectOperator : public Operator {
+ public:
+  ProjectOperator(OperatorPtr child, std::vector<size_t> field_indices)
+      : child_(std::move(child)),
+        field_indices_(std::move(field_indices)),
+        shape_(child_->shape().select(field_indices_)) {}
+
+  const TableView &shape() const override { return shape_; }
+  std::optional<TableView> next() override;
+  std::optional<TableView> remaining() override;
+  std::optional<Error> error() const override { return child_->error(); }
+
+ private:
+  OperatorPtr child_;
+  std::vector<size_t> field_indices_;
+  TableView shape_;
+};
+
+// stops pulling its child once `count` rows are produced
+class LimitOperator : public Operator {
+ public:
+  LimitOperator(OperatorPtr child, size_t count)
+      : child_(std::move(child)), count_(count) {}
+
+  const TableView &shape() const override { return child_->shape(); }
+  std::optional<TableView> next() override;
+  std::optional<Error> error() const override { return child_->error(); }
+
+ private:
+  OperatorPtr child_;
+  size_t count_;
+  size_t produced_ = 0;
+};
+
+// bytes a row takes while it is sorted in memory: its index in the input,
+// the output and the entries of `sort_rows`
+constexpr size_t kSortRowBytes = 48;
+
+// pipeline breaker: consumes its child, then streams the sorted rows. The
+// rows are sorted in parallel if a pool is given, see `sort_rows`.
+//
+// Once the rows would take more than the memory budget, every budget's worth
+// of rows is sorted into a run of base row indices spilled to a temp file.
+// The runs are merged as batches are pulled, holding a batch of every run in
+// memory. The cells stay in the base table, only the order is spilled.
+class SortOperator : public Operator {
+ public:
+  // memory_budget is in bytes, 0 means unlimited
+  SortOperator(OperatorPtr child, std::vector<size_t> field_indices, bool asc,
+               ThreadPool *pool = nullptr, size_t memory_budget = 0);
+  ~SortOperator();
+
+  const OperatorPtr &child() const { return child_; }
+  const std::vector<size_t> &field_indices() const { return field_indices_; }
+  bool asc() const { return asc_; }
+
+  // runs spilled to temp files, 0 if the rows were sorted in memory
+  size_t num_runs() const { return num_runs_; }
+
+  const TableView &shape() const override { return child_->shape(); }
+  std::optional<TableView> next() override;
+  std::optional<TableView> remaining() override;
+  // a spilled run that can't be read back fails the sort
+  std::optional<Error> error() const override;
+
+ private:
+  struct Run;
+
+  void sort();
+  // sort the rows and write them to a new run, kept in memory if the temp
+  // file can't be written
+  void spill(RowIndicesList rows);
+  // the next row of lhs comes after the next row of rhs
+  bool after(const Run &lhs, const Run &rhs) const;
+
+ private:
+  OperatorPtr child_;
+  std::vector<size_t> field_indices_;
+  bool asc_;
+  ThreadPool *pool_;
+  size_t memory_budget_;
+  std::vector<const Column *> columns_;
+  bool done_ = false;
+  std::optional<ScanOperator> sorted_;
+  // min-heap of the runs with rows left, by `after`
+  std::vector<std::unique_ptr<Run>> runs_;
+  size_t num_runs_ = 0;
+  std::optional<Error> error_;
+};
+
+// pipeline breaker: a sort followed by a limit. Only the first `count` rows
+// are kept while the child is consumed, see `TopKRows`.
+class TopKOperator : public Operator {
+ public:
+  TopKOperator(OperatorPtr child, std::vector<size_t> field_indices, bool asc,
+               size_t count)
+      : child_(std::move(child)),
+        field_indices_(std::move(field_indices)),
+        asc_(asc),
+        count_(count) {}
+
+  const TableView &shape() const override { return child_->shape(); }
+  std::optional<TableView> next() override;
+  std::optional<TableView> remaining() override;
+  std::optional<Error> error() const override { return child_->error(); }
+
+ private:
+  void select();
+
+ private:
+  OperatorPtr child_;
+  std::vector<size_t> field_indices_;
+  bool asc_;
+  size_t count_;
+  std::optional<ScanOperator> selected_;
+};
+
+struct AggregateSpec {
+  // acc is null before the first value
+  using Updater = std::function<void(AnyValue &acc, const AnyValue &elem)>;
+  using Finisher = std::function<AnyValue(const AnyValue &acc, size_t rows)>;
+
+  // output fields are named `<name>(<field>)`
+  std::string name;
+  std::function<AnyType(const AnyType &field_type)> result_type;
+  Updater update;
+  // optional, called once all rows are consumed
+  Finisher finish = nullptr;
+  // optional, merges a partial accumulator into acc, defaults to update
+  Updater combine = nullptr;
+  // optional, the partial accumulator of every cell of a column chunk taken
+  // from its zone map, std::nullopt if it can't be
+  std::function<std::optional<AnyValue>(const Column &column,
+                                        size_t chunk_index)>
+      summarize = nullptr;
+};
+
+// pipeline breaker: folds every batch into one accumulator per field and
+// produces a single row. The input is split into morsels of at most
+// kBatchSize rows that are folded into partial accumulators, in parallel if a
+// pool is given, and combined in input order. Morsels covering a whole column
+// chunk are summarized from the zone map if the spec can.
+class AggregateOperator : public Operator {
+ public:
+  AggregateOperator(OperatorPtr child, AggregateSpec spec,
+                    std::vector<size_t> field_indices,
+                    ThreadPool *pool = nullptr);
+
+  const TableView &shape() const override { return shape_; }
+  std::optional<TableView> next() override;
+  std::optional<TableView> remaining() override;
+  std::optional<Error> error() const override { return child_->error(); }
+
+ private:
+  struct Morsel {
+    const TableView *view;
+    size_t begin;
+    size_t end;
+  };
+
+  std::optional<AnyValue> summarize(const Morsel &morsel,
+                                    const Column &column) const;
+  void fold_morsels(const std::vector<Morsel> &morsels,
+                    std::vector<AnyValue> &results);
+  TableView aggregate();
+
+ private:
+  OperatorPtr child_;
+  AggregateSpec spec_;
+  std::vector<size_t> field_indices_;
+  ThreadPool *pool_;
+  TableView shape_;
+  bool done_ = false;
+};
+
+// an aggregate computed per group by a `GroupByOperator`
+struct GroupAggregate {
+  enum class Kind { Count, Sum, Avg, Min, Max };
+
+  Kind kind;
+  // the aggregated field, std::nullopt counts the rows of a group. Sum and
+  // avg take float fields, and read null as 0 like `avg`.
+  std::optional<size_t> field_index;
+  // of the output field, named `<kind>(<field>)` or `count(*)`
+  AnyType result_type;
+};
+
+// pipeline breaker: groups the rows by the values of key fields, compared
+// with `Column::same`, and computes aggregates per group. Produces a row per
+// group, holding the keys then the aggregates, in the order the groups first
+// appear. Without key fields every row falls in a single group, which is
+// produced even if there is no row.
+//
+// Rows are assigned to groups through an open-addressing hash table of group
+// ids, then every aggregate is folded over its column into a typed state per
+// group. With a pool and enough rows, the rows are hashed in parallel and
+// scattered into partitions by hash, and the partitions are grouped and
+// aggregated in parallel, each one in a small hash table of its own.
+//
+// Without key fields, any number of aggregates are computed in a single pass
+// over morsels of the input, in parallel with a pool. The batches of a
+// streaming input are morsels folded as they are pulled, never collected. A
+// morsel is folded a column at a time straight from the column buffers, and
+// the count, min and max of a whole chunk are taken from its zone map when it
+// can tell.
+class GroupByOperator : public Operator {
+ public:
+  GroupByOperator(OperatorPtr child, std::vector<size_t> key_indices,
+                  ThreadPool *pool = nullptr);
+
+  const OperatorPtr &child() const { return child_; }
+  const std::vector<size_t> &key_indices() const { return key_indices_; }
+
+  // add an output field, must be called before the first batch is pulled.
+  // Fails if the output already has a field of the same name.
+  Result<bool> add_aggregate(GroupAggregate aggregate);
+
+  const TableView &shape() const override { return shape_; }
+  std::optional<TableView> next() override;
+  std::optional<TableView> remaining() override;
+  std::optional<Error> error() const override { return child_->error(); }
+
+ private:
+  struct Partition;
+  struct Partial;
+  // rows [begin, end) of a view
+  struct Morsel {
+    const TableView *view;
+    size_t begin;
+    size_t end;
+  };
+
+  void group(const TableView &input, const std::vector<uint64_t> &hashes,
+             Partition &partition) const;
+  void fold(const TableView &input, Partition &partition) const;
+  // without keys, append the partial aggregates of every morsel
+  void fold_all(const std::vector<Morsel> &morsels,
+                std::vector<Partial> &partials) const;
+  // the aggregates of n rows from the partials of their morsels
+  ValueList combine_all(const std::vector<Partial> &partials, size_t n) const;
+  void aggregate_all();
+  void aggregate();
+
+ private:
+  OperatorPtr child_;
+  std::vector<size_t> key_indices_;
+  std::vector<GroupAggregate> aggregates_;
+  ThreadPool *pool_;
+  TableView shape_;
+  std::optional<ScanOperator> result_;
+};
+
+}  // namespace lumidb
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "lumidb/query.hh"
+#include "lumidb/table.hh"
+#include "lumidb/types.hh"
+
+// Logical plans of `query` chains.
+//
+// Leaf functions stack their operators in the order they are written. Before
+// a chain runs, its relational stages right after `query(...)`, `where`,
+// `select`, `sort`, `sort_desc` and `limit`, are turned into a logical plan,
+// rewritten, and turned back into a chain that runs cheaper:
+//
+//   - filters move below sorts, so fewer rows are sorted and the filters on
+//     the scan can be looked up in indexes. They never move across a limit.
+//   - the selects collapse into a single projection right after the filters
+//     on the scan, holding the output fields and the fields later stages
+//     read, and a final one if the output needs fewer fields.
+//   - a limit right after a sort, once the selects in between are gone, is
+//     folded into a top-K.
+//   - redundant stages are dropped: repeated filters, selects of every field
+//     in order, limits after limits, sorts whose order a later sort
+//     overrides, and sorts only counted by a `count` after them.
+//
+// Sorts keep ties in input order and filters keep the order of rows, so the
+// rewritten chain produces the same rows. A chain whose stages don't
+// resolve, such as fields that don't exist, is run as written to fail with
+// the same errors.
+
+namespace lumidb {
+
+class QueryPlan {
+ public:
+  struct Node {
+    enum class Kind {
+      // `where`
+      Filter = 0,
+      // `select`
+      Project,
+      // `sort` or `sort_desc`, a top-K with a limit
+      Sort,
+      Limit,
+    };
+
+    Kind kind;
+    // the function as written, of filters and sorts
+    QueryFunction function;
+    // the fields a filter or sort reads, the output fields of a projection
+    std::vector<std::string> fields;
+    // of a limit, and of a sort folded into a top-K
+    std::optional<float> limit;
+  };
+
+  // the plan of a `query` chain over a table of the schema, std::nullopt if
+  // the chain doesn't start with `query` or a stage doesn't resolve
+  static std::optional<QueryPlan> build(const Query &query,
+                                        const TableSchema &schema);
+
+  // apply the rewrite rules
+  void optimize();
+
+  const std::vector<Node> &nodes() const { return nodes_; }
+
+  // the chain of the plan, the functions after the relational stages follow
+  // as written
+  Query to_query() const;
+
+ private:
+  // fields the nodes from begin on read
+  std::vector<std::string> fields_read(size_t begin) const;
+
+  // remove the projections, returning the output fields of the last one
+  std::optional<std::vector<std::string>> take_projections();
+  void push_down_filters();
+  void drop_redundant_sorts();
+  void fold_limits();
+  void push_down_projection(std::optional<std::vector<std::string>> output);
+
+ private:
+  QueryFunction root_;
+  std::vector<std::string> table_fields_;
+  std::vector<Node> nodes_;
+  std::vector<QueryFunction> rest_;
+};
+
+// the query rewritten by its plan, or as is if it has none
+Query optimize_query(const Query &query, const TableSchema &schema);
+
+}  // namespace lumidb
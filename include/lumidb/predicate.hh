@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "lumidb/table.hh"
+#include "lumidb/types.hh"
+
+// Compiled predicates of `where`.
+//
+// A predicate on the cells of a field, `field <op> value`, `between`, `in`,
+// `is_null` or `not_null`, is compiled once into kernels, instantiated per
+// column storage, test and nullability. A kernel runs over the cells of many
+// rows straight from the column buffers and sets a bit per passing row in a
+// selection bitmap, 64 rows per word. The values are unpacked for the storage
+// up front, so a cell costs a load and a compare instead of a std::function
+// call and a copy into an `AnyValue`, and `in` lists become a hash set. Ranges
+// of rows are evaluated chunk by chunk, and chunks without null cells skip the
+// null bitmap. Float cells of a range are compared by the vector kernels of
+// `simd.hh`.
+
+namespace lumidb {
+
+// bit i % 64 of word i / 64 is set if the i-th evaluated row passes
+using SelectionBitmap = std::vector<uint64_t>;
+
+// a test of the cells of a field, with the semantics of
+// `AnyValue::get_comparator`
+class Predicate {
+ public:
+  enum class Kind {
+    // `cell <op> value`
+    Compare = 0,
+    // `cell >= low` and `cell <= high`
+    Between,
+    // the cell equals one of the values
+    In,
+    IsNull,
+    NotNull,
+  };
+
+  Predicate(const AnyType &field_type, CompareOperator op, AnyValue value);
+
+  static Predicate between(const AnyType &field_type, AnyValue low,
+                           AnyValue high);
+  static Predicate in(const AnyType &field_type, ValueList values);
+  static Predicate is_null(const AnyType &field_type);
+  static Predicate not_null(const AnyType &field_type);
+
+  // the predicate of `where(field, op, values...)`, op is a compare
+  // operator, "between", "in", "is_null" or "not_null"
+  static Result<Predicate> parse(const AnyType &field_type,
+                                 std::string_view op, ValueList values);
+  // fails like `parse` with that many values, without compiling the predicate
+  static Result<bool> check(std::string_view op, size_t num_values);
+
+  Kind kind() const { return kind_; }
+  // the operator of a compare predicate
+  CompareOperator op() const { return op_; }
+  // the value of a compare predicate
+  const AnyValue &value() const { return values_[0]; }
+  // the value of a compare predicate, low and high of between, the values of
+  // in, none for is_null and not_null
+  const ValueList &values() const { return values_; }
+
+  // test a single cell, as the kernels do
+  bool test(const AnyValue &cell) const;
+
+  // some cell of the chunk may pass, false only if the zone map of the chunk
+  // rules every cell out
+  bool may_match(const Column &column, size_t chunk_index) const;
+  // some row of the view may pass, see `TableView::may_match`
+  bool may_match(const TableView &view, size_t field_index) const;
+
+  // the passing rows in row order, looked up in the hash index of the field
+  // for `=` and `in`, or as a single range of an ordered index that starts
+  // with the field for the other compares, `between`, `is_null` and
+  // `not_null`. std::nullopt if no index can answer the predicate.
+  std::optional<RowIndicesList> lookup(const Table &table,
+                                       size_t field_index) const;
+  // like above, only for views of every base row
+  std::optional<TableView> lookup(const TableView &view,
+                                  size_t field_index) const;
+
+  // evaluate the rows [begin, end) of the column into bitmap
+  void evaluate(const Column &column, size_t begin, size_t end,
+                SelectionBitmap &bitmap) const;
+  // evaluate the given rows of the column into bitmap, in their order
+  void evaluate(const Column &column, const RowIndicesList &rows,
+                SelectionBitmap &bitmap) const;
+
+  // the passing rows, in order
+  RowIndicesList select(const Column &column, size_t begin, size_t end) const;
+  RowIndicesList select(const Column &column,
+                        const RowIndicesList &rows) const;
+
+  // the rows of the view whose field passes
+  TableView filter(const TableView &view, size_t field_index) const;
+
+ private:
+  friend struct PredicateKernels;
+
+  // set the bits of the rows [begin, end) of a chunk in bits, from bit pos
+  // on. bits must be zeroed.
+  using RangeKernel = void (*)(const Predicate &predicate,
+                               const Column::Chunk &chunk, size_t begin,
+                               size_t end, uint64_t *bits, size_t pos);
+  // set the bits of count rows of the column in bits
+  using GatherKernel = void (*)(const Predicate &predicate,
+                                const Column &column, const size_t *rows,
+                                size_t count, uint64_t *bits);
+
+ private:
+  Predicate(Kind kind, CompareOperator op, ValueList values);
+
+  // pick the kernels of the field storage
+  void compile(const AnyType &field_type);
+
+  bool contains(float cell) const;
+  bool contains(std::string_view cell) const;
+
+ private:
+  Kind kind_;
+  CompareOperator op_ = CompareOperator::EQ;
+  ValueList values_;
+
+  // the values unpacked for the storage, high is the upper bound of between
+  float number_ = 0;
+  float high_number_ = 0;
+  std::string string_;
+  std::string high_string_;
+  // the values of in, floats by the index keys of the cells equal to them as
+  // `Column::lookup_keys`, strings by their hash
+  std::unordered_map<uint64_t, std::vector<float>> float_members_;
+  std::unordered_map<size_t, std::vector<std::string>> string_members_;
+  // in has a NaN value, which is equal to every float
+  bool has_nan_member_ = false;
+
+  // result of null cells, and of non-null cells if no value has the kind of
+  // the storage
+  bool null_result_;
+  bool other_kind_result_;
+
+  // indexed by whether the chunk or column has null cells
+  RangeKernel range_kernels_[2];
+  GatherKernel gather_kernels_[2];
+};
+
+}  // namespace lumidb
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#include "lumidb/types.hh"
+
+// Vectorized kernels over float cells.
+//
+// Every kernel has an AVX2, an SSE2 and a scalar version with the same
+// results. The version is picked at runtime from the instruction sets the CPU
+// supports, so the library is built for the baseline target and still uses
+// AVX2 where it is available. Only x86 builds have vector versions.
+
+namespace lumidb {
+namespace simd {
+
+enum class Isa {
+  Scalar = 0,
+  SSE2,
+  AVX2,
+};
+
+const char *isa_name(Isa isa);
+
+// the best instruction set of the CPU the kernels have a version for
+Isa detected_isa();
+
+// the instruction set the kernels use, `detected_isa()` unless lowered
+Isa isa();
+
+// use the kernels of isa, capped at `detected_isa()`, e.g. to compare with
+// the scalar kernels. Must not be called while kernels run.
+void set_isa(Isa isa);
+
+// set bit i of bits if `cells[i] <op> value` as `AnyValue::get_comparator`
+// compares floats. Writes (n + 63) / 64 words, the bits past n are 0.
+void compare_floats(CompareOperator op, const float *cells, size_t n,
+                    float value, uint64_t *bits);
+
+// aggregates of the cells selected by a mask
+struct FloatSummary {
+  size_t count = 0;
+  // NaN if a selected cell is NaN
+  double sum = 0;
+  // of the selected cells that aren't NaN, +inf / -inf if there is none
+  float min = std::numeric_limits<float>::infinity();
+  float max = -std::numeric_limits<float>::infinity();
+  bool has_nan = false;
+};
+
+// summarize the cells whose bit is set in mask, every cell if mask is
+// nullptr. The sum is accumulated in doubles.
+FloatSummary summarize_floats(const float *cells, size_t n,
+                              const uint64_t *mask = nullptr);
+
+}  // namespace simd
+}  // namespace lumidb
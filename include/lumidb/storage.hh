@@ -0,0 +1,320 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lumidb/db.hh"
+#include "lumidb/executor.hh"
+#include "lumidb/table.hh"
+#include "lumidb/types.hh"
+
+// Persistence of the tables of a database.
+//
+// A snapshot is a binary, columnar image of tables written by
+// `save_snapshot`. Every column chunk is stored as a block laid out like its
+// in-memory buffers (the null bitmap, then the floats or the string offsets
+// and bytes), so loading a snapshot maps the file and copies the blocks into
+// chunks in parallel instead of parsing values. Schemas, zone maps and the
+// fields of the indexes are kept in a meta section at the end of the file.
+//
+// Layout, in native byte order:
+//
+//   header  magic "LUMISNAP", u32 version, u32 byte order tag,
+//           u64 meta offset, u64 meta size
+//   blocks  column chunks, 8-byte aligned
+//   meta    tables, schemas, indexes, and per chunk its block offset, size,
+//           cells, null cells, zone map and block checksum
+//   u64     checksum of the meta
+//
+// Blocks are verified against their checksums as they are loaded.
+//
+// The write-ahead log records every change to the tables after the last
+// snapshot: created and dropped tables, inserted, updated and deleted rows and
+// created indexes. A record is appended by the writer of the change before
+// its version is published, and committed once it is, so concurrent commits
+// are made durable by a single write and sync (group commit). Every table
+// keeps the log sequence number of its last change, saved with snapshots, so
+// replaying the log on top of a snapshot skips the records it already holds.
+//
+// A record is framed as u64 payload size, u64 lsn, u64 checksum, payload.
+// Replay stops at the first torn or corrupted record.
+//
+// A table created by loading a snapshot file is loaded from a copy of the
+// file next to the log and logged as a reference to the copy instead of its
+// rows. The log owns its copies, they are removed once truncating drops the
+// records referring to them.
+//
+// A checkpoint writes a snapshot of every table, taken as a copy-on-write
+// version so writers keep going while it is saved, then drops the records the
+// snapshot holds from the log. The tables are snapshotted one by one, each
+// one is consistent with its lsn, and replaying the remaining records brings
+// all of them up to date.
+
+namespace lumidb {
+
+// bumped on incompatible changes of the snapshot layout
+constexpr uint32_t kSnapshotVersion = 2;
+
+// called once a table is written to a snapshot
+using SnapshotProgress = std::function<void(const Table &table)>;
+
+// write the tables to a snapshot file. The file is written and synced next to
+// path, then renamed over it, so an existing snapshot is never left
+// half-written.
+Result<bool> save_snapshot(const std::string &path, const TablePtrList &tables,
+                           const SnapshotProgress &progress = nullptr);
+
+// read every table of a snapshot, the chunks are loaded in parallel if a pool
+// is given. The checksum of its meta, which identifies the file, is stored in
+// snapshot_checksum if given.
+Result<TablePtrList> load_snapshot(const std::string &path,
+                                   ThreadPool *pool = nullptr,
+                                   uint64_t *snapshot_checksum = nullptr);
+
+// when committed records are made durable
+enum class WalSync {
+  // write and sync on every commit, concurrent commits share a sync
+  Commit = 0,
+  // write and sync in the background every `WalOptions::interval`, a commit
+  // doesn't wait, so the changes of the last interval can be lost
+  Interval,
+  // write on every commit and leave syncing to the OS, the changes survive
+  // a crash of the process but not of the machine
+  Off,
+};
+
+struct WalOptions {
+  std::string path;
+  WalSync sync = WalSync::Commit;
+  std::chrono::milliseconds interval{100};
+};
+
+// parse a sync policy: `commit`, `off` or an interval like `100ms`
+Result<WalOptions> parse_wal_sync(const std::string &policy,
+                                  WalOptions options = {});
+
+// an encoded change to the tables
+class WalRecord {
+ public:
+  enum class Type : uint8_t {
+    CreateTable = 1,
+    DropTable,
+    Insert,
+    Update,
+    Delete,
+    CreateIndex,
+    CreateOrderedIndex,
+    InsertPart,
+    CreateTableFromSnapshot,
+  };
+
+  // the schema, indexes and rows of a new table
+  static WalRecord create_table(const Table &table);
+  // the schema of a table loaded from a snapshot copied by the log, which is
+  // read again on replay instead of its rows
+  static WalRecord create_table(const Table &table,
+                                const SnapshotSource &source);
+  static WalRecord drop_table(const std::string &name);
+  // rows from first_row on, appended to the table
+  static WalRecord insert(const Table &table, size_t first_row);
+  // rows from first_row on, the part-th record of an insert logged batch by
+  // batch. The parts are replayed at once with the last one, an insert
+  // whose last part is missing is not replayed.
+  static WalRecord insert_part(const Table &table, size_t first_row,
+                               uint64_t part, bool last);
+  // the cells of the rows after they were updated
+  static WalRecord update(const Table &table, const RowIndicesList &rows);
+  // rows deleted from the table, as numbered before the delete
+  static WalRecord remove(const Table &table, const RowIndicesList &rows);
+  static WalRecord create_index(const Table &table, size_t field_index);
+  static WalRecord create_ordered_index(const Table &table,
+                                        const std::vector<size_t> &fields);
+
+  const std::string &payload() const { return payload_; }
+
+ private:
+  friend class WriteAheadLog;
+
+  explicit WalRecord(std::string payload) : payload_(std::move(payload)) {}
+
+ private:
+  std::string payload_;
+};
+
+class WriteAheadLog;
+using WriteAheadLogPtr = std::shared_ptr<WriteAheadLog>;
+
+class WriteAheadLog {
+ public:
+  // open the log for appending, records are numbered from next_lsn
+  static Result<WriteAheadLogPtr> open(const WalOptions &options,
+                                       uint64_t next_lsn);
+
+  // makes the appended records durable
+  ~WriteAheadLog();
+
+  WriteAheadLog(const WriteAheadLog &) = delete;
+  WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+  const WalOptions &options() const { return options_; }
+
+  // buffer a record and return its lsn, in the order of the calls. The
+  // payload is moved into the buffer, not copied under the lock.
+  uint64_t append(WalRecord &&record);
+
+  // make the records up to lsn durable as the sync policy requires, waits
+  // for a write and sync in progress and then syncs every record buffered
+  // meanwhile at once
+  Result<bool> commit(uint64_t lsn);
+
+  // bytes of the records written to the file
+  uint64_t size() const;
+
+  // copy a snapshot file next to the log and sync it, the tables loaded from
+  // the copy are logged as a reference to it. Returns the path of the copy,
+  // the checksum is left to the caller loading it.
+  Result<SnapshotSource> copy_snapshot(const std::string &path);
+
+  // drop the records held by a snapshot of the tables, listed when the
+  // snapshot was taken, and the snapshot copies only those referred to. The
+  // kept records are copied to a new file while records are appended to the
+  // current one, which is only locked to copy those and swap the files. Must
+  // not be called concurrently.
+  Result<bool> truncate(const TablePtrList &tables);
+
+ private:
+  WriteAheadLog(WalOptions options, std::FILE *file, uint64_t next_lsn,
+                uint64_t size);
+
+  // write the buffered records, and sync them if sync, without the lock held
+  void flush(std::unique_lock<std::mutex> &lock, bool sync);
+  void run_flusher();
+
+  // a buffered record
+  struct Frame {
+    uint64_t header[3];
+    std::string payload;
+  };
+
+ private:
+  WalOptions options_;
+  std::FILE *file_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable flushed_;
+  std::vector<Frame> buffer_;
+  uint64_t next_lsn_;
+  // last lsn buffered, written and synced
+  uint64_t buffered_lsn_;
+  uint64_t written_lsn_;
+  uint64_t synced_lsn_;
+  uint64_t size_;
+  bool flushing_ = false;
+  std::optional<Error> error_;
+  // snapshot copies made, to name them
+  uint64_t snapshot_copies_ = 0;
+
+  // flushes every interval with `WalSync::Interval`
+  std::thread flusher_;
+  std::condition_variable stop_flusher_;
+  bool stopping_ = false;
+};
+
+// apply the records of the log at path to the tables of db, skipping the
+// changes a table already holds, and return the lsn of the last record, 0 if
+// there is none. A missing log is empty. The log is truncated before the
+// first torn or corrupted record, so new records are appended after the
+// replayed ones.
+Result<uint64_t> replay_wal(const std::string &path, Database &db);
+
+struct CheckpointOptions {
+  // the snapshot written by every checkpoint
+  std::string path;
+  // checkpoint every interval, 0 means only on demand or by log size
+  std::chrono::milliseconds interval{0};
+  // checkpoint once the write-ahead log grew by as many bytes since the last
+  // checkpoint, 0 means never
+  uint64_t wal_size = uint64_t(64) << 20;
+};
+
+struct CheckpointInfo {
+  enum class State { Running, Done, Failed };
+
+  uint64_t id;
+  State state;
+  // manual, interval or wal_size
+  std::string trigger;
+  std::chrono::system_clock::time_point started;
+  // elapsed so far while running
+  std::chrono::steady_clock::duration duration;
+  // progress of the snapshot
+  size_t tables;
+  size_t tables_written;
+  size_t rows_written;
+  uint64_t snapshot_size;
+  // sizes of the write-ahead log before and after the truncation
+  uint64_t wal_size_before;
+  uint64_t wal_size_after;
+  std::string error;
+};
+
+class Checkpointer;
+using CheckpointerPtr = std::shared_ptr<Checkpointer>;
+
+// Checkpoints the tables of a database on a background thread, executions
+// only wait for the checkpoints they request.
+class Checkpointer {
+ public:
+  // the checkpointer reads the tables and the write-ahead log of db, and must
+  // be destroyed before them
+  static Result<CheckpointerPtr> start(Database &db, CheckpointOptions options);
+
+  // waits for the running checkpoint
+  ~Checkpointer();
+
+  Checkpointer(const Checkpointer &) = delete;
+  Checkpointer &operator=(const Checkpointer &) = delete;
+
+  const CheckpointOptions &options() const { return options_; }
+
+  // run a checkpoint that starts after the call and wait for it
+  Result<CheckpointInfo> checkpoint();
+
+  // the last checkpoints, the oldest first, including a running one
+  std::vector<CheckpointInfo> history() const;
+
+ private:
+  Checkpointer(Database &db, CheckpointOptions options);
+
+  void run();
+  CheckpointInfo run_checkpoint(const std::string &trigger);
+  // update the running checkpoint
+  void update(const std::function<void(CheckpointInfo &info)> &updater);
+
+ private:
+  Database &db_;
+  CheckpointOptions options_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable finished_;
+  std::deque<CheckpointInfo> history_;
+  std::chrono::steady_clock::time_point running_since_;
+  uint64_t next_id_ = 1;
+  uint64_t finished_id_ = 0;
+  bool requested_ = false;
+  bool stopping_ = false;
+  std::thread thread_;
+};
+
+}  // namespace lumidb
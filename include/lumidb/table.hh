@@ -1,11 +1,19 @@
 #pragma once
 
 #include <algorithm>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <ostream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "db.hh"
@@ -94,12 +102,587 @@ class TableSchema {
   std::map<std::string, size_t> field_index_map_;
 };
 
+// cells per column chunk
+constexpr size_t kColumnChunkSize = 2048;
+
+// Column-major storage of a single field.
+//
+// `float`/`float?` fields are kept in float buffers and `string`/`string?`
+// fields in buffers of string values (short strings inline, long strings
+// shared with every copy of the value), null cells are tracked by a bitmap.
+// Fields of other types (`any`, `null`) fall back to generic value buffers.
+//
+// Cells are stored in chunks of `kColumnChunkSize`. The list of chunks and the
+// chunks themselves are shared between copies of a column and copied before
+// they are modified, so copying a column copies a single pointer, and
+// modifying a copy copies the chunk pointers once and only the touched
+// chunks.
+//
+// A column can be hash indexed for equality lookups, every chunk then keeps a
+// hash table of its non-null cells that is updated along with the cells.
+//
+// Chunks of float and string columns keep a zone map, the min and max of
+// their non-null cells, so scans can skip the chunks a predicate rules out.
+class Column {
+ public:
+  enum class Storage {
+    Float = 0,
+    String,
+    Generic,
+  };
+
+  // only the buffer of the column storage is used. Null cells hold 0 or an
+  // empty string.
+  struct Chunk {
+    std::vector<float> floats;
+    std::vector<AnyValue> strings;
+    std::vector<AnyValue> values;
+    std::vector<uint64_t> null_bits;
+    size_t size = 0;
+    size_t null_count = 0;
+
+    // index key => offsets of the cells, only used by indexed columns
+    std::unordered_map<uint64_t, std::vector<uint16_t>> index;
+
+    // zone map, not kept for generic storage. min/max are null while the
+    // chunk has no non-null cell, NaN cells are left out. Updates only widen
+    // the bounds: once a cell holding a bound is overwritten, they may be
+    // wider than the cells and `exact_bounds` is cleared.
+    AnyValue min;
+    AnyValue max;
+    bool exact_bounds = true;
+    bool has_nan = false;
+  };
+
+  using ChunkList = std::vector<std::shared_ptr<Chunk>>;
+
+  explicit Column(AnyType type)
+      : type_(type),
+        storage_(storage_of(type)),
+        chunks_(std::make_shared<ChunkList>()) {}
+
+  static Storage storage_of(const AnyType &type) {
+    if (type.is_float() || type.is_null_float()) {
+      return Storage::Float;
+    }
+    if (type.is_string() || type.is_null_string()) {
+      return Storage::String;
+    }
+    return Storage::Generic;
+  }
+
+  const AnyType &type() const { return type_; }
+  Storage storage() const { return storage_; }
+  size_t size() const { return size_; }
+
+  size_t num_chunks() const { return chunks_->size(); }
+  const Chunk &chunk(size_t chunk_index) const {
+    return *(*chunks_)[chunk_index];
+  }
+
+  // two columns share the whole chunk list, a snapshot copies no chunk pointer
+  bool shares_chunks(const Column &other) const {
+    return chunks_ == other.chunks_;
+  }
+
+  // two columns share the chunk, it was not modified since they were copied
+  bool shares_chunk(const Column &other, size_t chunk_index) const {
+    return (*chunks_)[chunk_index] == (*other.chunks_)[chunk_index];
+  }
+
+  bool has_nulls() const { return null_count_ > 0; }
+
+  bool is_null(size_t idx) const {
+    return is_null_in(chunk_at(idx), idx % kColumnChunkSize);
+  }
+
+  AnyValue get(size_t idx) const {
+    return get_in(chunk_at(idx), idx % kColumnChunkSize);
+  }
+
+  // compare two cells in the order of their sort keys, like
+  // `compare_values` with NaN after every other float and equal to NaN.
+  // Every sort orders cells this way. Returns -1, 0 or 1
+  int compare(size_t lhs, size_t rhs) const {
+    int res = compare_values(lhs, rhs);
+    if (res != 0 || storage_ == Storage::String) {
+      return res;
+    }
+    bool nan1 = is_nan(lhs), nan2 = is_nan(rhs);
+    return nan1 == nan2 ? 0 : (nan1 ? 1 : -1);
+  }
+
+  // compare two cells with the same semantics as `AnyValue::operator<`, NaN
+  // is neither less nor greater than any float. Returns -1, 0 or 1
+  int compare_values(size_t lhs, size_t rhs) const {
+    auto &chunk1 = chunk_at(lhs);
+    auto &chunk2 = chunk_at(rhs);
+    size_t off1 = lhs % kColumnChunkSize, off2 = rhs % kColumnChunkSize;
+
+    if (storage_ == Storage::Generic) {
+      auto &v1 = chunk1.values[off1];
+      auto &v2 = chunk2.values[off2];
+      return v1 < v2 ? -1 : (v2 < v1 ? 1 : 0);
+    }
+
+    bool null1 = is_null_in(chunk1, off1), null2 = is_null_in(chunk2, off2);
+    if (null1 || null2) {
+      return null1 == null2 ? 0 : (null1 ? -1 : 1);
+    }
+
+    if (storage_ == Storage::Float) {
+      auto v1 = chunk1.floats[off1], v2 = chunk2.floats[off2];
+      return v1 < v2 ? -1 : (v2 < v1 ? 1 : 0);
+    }
+    int res = chunk1.strings[off1].as_string_view().compare(
+        chunk2.strings[off2].as_string_view());
+    return res < 0 ? -1 : (res > 0 ? 1 : 0);
+  }
+
+  bool is_nan(size_t idx) const {
+    auto &chunk = chunk_at(idx);
+    size_t off = idx % kColumnChunkSize;
+    if (storage_ == Storage::Generic) {
+      auto &value = chunk.values[off];
+      return value.is_float() && std::isnan(value.as_float());
+    }
+    // null cells of float columns hold 0
+    return storage_ == Storage::Float && std::isnan(chunk.floats[off]);
+  }
+
+  // order-preserving 64-bit key of a segment of a cell. Segment 0 holds the
+  // kind of the value in the top byte, nulls first, then the bits of a float
+  // mapped to unsigned order or the first 6 bytes of a string, every later
+  // segment of a string the next 7 bytes. The low byte of a string key is the
+  // number of bytes left from the segment on, capped at one more than the
+  // segment holds. Cells with different keys compare like their keys, cells
+  // with equal keys are equal unless `sort_key_continues`. NaN is keyed after
+  // every other float.
+  uint64_t sort_key(size_t idx, size_t segment = 0) const;
+
+  // cells with this key of a segment differ after it, in the next segment
+  static bool sort_key_continues(uint64_t key, size_t segment) {
+    if (segment == 0) {
+      return key >> 56 == static_cast<uint64_t>(ValueTypeKind::T_STRING) &&
+             (key & 0xff) > 6;
+    }
+    return (key & 0xff) > 7;
+  }
+
+  // the cells hold the same value. Floats are compared exactly, with -0 and 0
+  // the same and every NaN the same, so unlike `AnyValue::operator==` this is
+  // transitive and cells can be grouped by it.
+  bool same(size_t lhs, size_t rhs) const;
+
+  // hash of a cell, the `same` cells have the same hash
+  uint64_t hash(size_t idx) const;
+
+  // the cell holds exactly `value`, floats are compared bitwise
+  bool holds(size_t idx, const AnyValue &value) const {
+    auto &chunk = chunk_at(idx);
+    size_t off = idx % kColumnChunkSize;
+
+    if (storage_ == Storage::Generic) {
+      return identical(chunk.values[off], value);
+    }
+    if (is_null_in(chunk, off) || value.is_null()) {
+      return is_null_in(chunk, off) == value.is_null();
+    }
+    if (storage_ == Storage::Float) {
+      return same_bits(chunk.floats[off], value.as_float());
+    }
+    return chunk.strings[off].as_string_view() == value.as_string_view();
+  }
+
+  bool indexed() const { return indexed_; }
+
+  // index every cell, later modifications keep the index up to date
+  void create_index() {
+    if (indexed_) {
+      return;
+    }
+
+    indexed_ = true;
+    for (size_t c = 0; c < chunks_->size(); c++) {
+      auto &chunk = mutable_chunk(c);
+      for (size_t off = 0; off < chunk.size; off++) {
+        index_cell(chunk, off);
+      }
+    }
+  }
+
+  // the index can answer `lookup(value)`
+  bool can_lookup(const AnyValue &value) const {
+    if (!indexed_ || value.is_null()) {
+      return false;
+    }
+    // NaN compares equal to every float
+    return !value.is_float() || !std::isnan(value.as_float());
+  }
+
+  // indices of the cells equal to value as `AnyValue::operator==`, in row
+  // order. Requires `can_lookup(value)`.
+  RowIndicesList lookup(const AnyValue &value) const;
+
+  // index key of a non-null value, values that compare equal have the same
+  // key or, for floats, the key of an adjacent bucket
+  static uint64_t index_key(const AnyValue &value);
+  // the sorted keys of every non-null value equal to a value that
+  // `can_lookup`, to probe an index with
+  static std::vector<uint64_t> lookup_keys(const AnyValue &value);
+
+  // some cell of the chunk may satisfy `cell <op> value`, false only if the
+  // zone map rules every cell out
+  bool may_match(size_t chunk_index, CompareOperator op,
+                 const AnyValue &value) const;
+
+  // some cell may be NaN, which breaks the order of `AnyValue::operator<`.
+  // Not tracked for generic storage.
+  bool may_hold_nan() const {
+    if (storage_ == Storage::Generic) {
+      return true;
+    }
+    return std::any_of(chunks_->begin(), chunks_->end(),
+                       [](auto &chunk) { return chunk->has_nan; });
+  }
+
+  // the first greatest / least non-null cell of the chunk, as the max and
+  // min aggregations pick it, or null if the chunk has none. std::nullopt if
+  // the zone map can't tell.
+  std::optional<AnyValue> chunk_max(size_t chunk_index) const;
+  std::optional<AnyValue> chunk_min(size_t chunk_index) const;
+
+  void reserve(size_t n) {
+    mutable_chunks().reserve((n + kColumnChunkSize - 1) / kColumnChunkSize);
+  }
+
+  // value must be checked against the column type by the caller
+  void push_back(const AnyValue &value) {
+    auto &chunk = append_chunk();
+    switch (storage_) {
+      case Storage::Float:
+        chunk.floats.push_back(value.is_null() ? 0 : value.as_float());
+        break;
+      case Storage::String:
+        chunk.strings.push_back(value.is_null() ? AnyValue::from_string("")
+                                                : value);
+        break;
+      case Storage::Generic:
+        chunk.values.push_back(value);
+        break;
+    }
+    append_null_bit(chunk, value.is_null());
+    if (indexed_) {
+      index_cell(chunk, chunk.size - 1);
+    }
+    widen_zone(chunk, chunk.size - 1);
+  }
+
+  // value must be checked against the column type by the caller. Setting the
+  // value a cell already holds leaves its chunk shared.
+  void set(size_t idx, const AnyValue &value) {
+    if (holds(idx, value)) {
+      return;
+    }
+
+    auto &chunk = mutable_chunk(idx / kColumnChunkSize);
+    size_t off = idx % kColumnChunkSize;
+    if (indexed_) {
+      unindex_cell(chunk, off);
+    }
+    unzone_cell(chunk, off);
+    switch (storage_) {
+      case Storage::Float:
+        chunk.floats[off] = value.is_null() ? 0 : value.as_float();
+        break;
+      case Storage::String:
+        chunk.strings[off] =
+            value.is_null() ? AnyValue::from_string("") : value;
+        break;
+      case Storage::Generic:
+        chunk.values[off] = value;
+        break;
+    }
+    set_null_bit(chunk, off, value.is_null());
+    if (indexed_) {
+      index_cell(chunk, off);
+    }
+    widen_zone(chunk, off);
+  }
+
+  // append every cell of a column with the same storage. If this column ends
+  // at a chunk boundary, the chunks of other are shared instead of copied,
+  // otherwise they are copied a slice of a buffer at a time.
+  void append(const Column &other) {
+    if (size_ % kColumnChunkSize == 0 && !indexed_ && !other.indexed_) {
+      auto &chunks = mutable_chunks();
+      chunks.insert(chunks.end(), other.chunks_->begin(), other.chunks_->end());
+      size_ += other.size_;
+      null_count_ += other.null_count_;
+      return;
+    }
+
+    reserve(size_ + other.size_);
+    for (auto &chunk : *other.chunks_) {
+      append_slice(*chunk, 0, chunk->size);
+    }
+  }
+
+  // append a chunk built elsewhere, e.g. read from a snapshot. This column
+  // must end at a chunk boundary, the cells are indexed if it is indexed.
+  void add_chunk(std::shared_ptr<Chunk> chunk) {
+    size_ += chunk->size;
+    null_count_ += chunk->null_count;
+    mutable_chunks().push_back(std::move(chunk));
+    if (indexed_) {
+      auto &last = mutable_chunk(chunks_->size() - 1);
+      for (size_t off = 0; off < last.size; off++) {
+        index_cell(last, off);
+      }
+    }
+  }
+
+  // gather cells by row indices, create new column
+  Column take(const RowIndicesList &indices) const {
+    Column out(type_);
+    out.reserve(indices.size());
+    for (auto idx : indices) {
+      out.push_from(*this, idx);
+    }
+    return out;
+  }
+
+  // keep cells whose `keep[idx]` is true, in place. Chunks before the first
+  // removed cell stay shared.
+  void retain(const std::vector<bool> &keep) {
+    auto first = std::find(keep.begin(), keep.begin() + size_, false);
+    if (first == keep.begin() + size_) {
+      return;
+    }
+
+    size_t first_chunk = (first - keep.begin()) / kColumnChunkSize;
+
+    Column out(type_);
+    out.indexed_ = indexed_;
+    out.chunks_->assign(chunks_->begin(), chunks_->begin() + first_chunk);
+    for (auto &chunk : *out.chunks_) {
+      out.size_ += chunk->size;
+      out.null_count_ += chunk->null_count;
+    }
+
+    for (size_t i = first_chunk * kColumnChunkSize; i < size_; i++) {
+      if (keep[i]) {
+        out.push_from(*this, i);
+      }
+    }
+    *this = std::move(out);
+  }
+
+ private:
+  const Chunk &chunk_at(size_t idx) const {
+    return *(*chunks_)[idx / kColumnChunkSize];
+  }
+
+  AnyValue get_in(const Chunk &chunk, size_t off) const {
+    switch (storage_) {
+      case Storage::Float:
+        return is_null_in(chunk, off) ? AnyValue::from_null()
+                                      : AnyValue::from_float(chunk.floats[off]);
+      case Storage::String:
+        return is_null_in(chunk, off) ? AnyValue::from_null()
+                                      : chunk.strings[off];
+      case Storage::Generic:
+        return chunk.values[off];
+    }
+    return AnyValue::from_null();
+  }
+
+  bool is_null_in(const Chunk &chunk, size_t off) const {
+    if (storage_ == Storage::Generic) {
+      return chunk.values[off].is_null();
+    }
+    return (chunk.null_bits[off / 64] >> (off % 64)) & 1;
+  }
+
+  static bool same_bits(float lhs, float rhs) {
+    return std::memcmp(&lhs, &rhs, sizeof(float)) == 0;
+  }
+
+  static bool identical(const AnyValue &lhs, const AnyValue &rhs) {
+    if (lhs.kind() != rhs.kind()) {
+      return false;
+    }
+    if (lhs.is_null()) {
+      return true;
+    }
+    if (lhs.is_float()) {
+      return same_bits(lhs.as_float(), rhs.as_float());
+    }
+    return lhs.as_string_view() == rhs.as_string_view();
+  }
+
+  // copy the chunk list first if it is shared with another column, its
+  // chunks are then shared by both lists
+  ChunkList &mutable_chunks() {
+    if (chunks_.use_count() > 1) {
+      chunks_ = std::make_shared<ChunkList>(*chunks_);
+    }
+    return *chunks_;
+  }
+
+  // copy the chunk first if it is shared with another column
+  Chunk &mutable_chunk(size_t chunk_index) {
+    auto &chunk = mutable_chunks()[chunk_index];
+    if (chunk.use_count() > 1) {
+      chunk = std::make_shared<Chunk>(*chunk);
+    }
+    return *chunk;
+  }
+
+  // chunk the next cell is appended to
+  Chunk &append_chunk() {
+    auto &chunks = mutable_chunks();
+    if (chunks.empty() || chunks.back()->size == kColumnChunkSize) {
+      chunks.push_back(std::make_shared<Chunk>());
+      return *chunks.back();
+    }
+    return mutable_chunk(chunks.size() - 1);
+  }
+
+  void push_from(const Column &src, size_t idx) {
+    auto &src_chunk = src.chunk_at(idx);
+    size_t src_off = idx % kColumnChunkSize;
+
+    auto &chunk = append_chunk();
+    switch (storage_) {
+      case Storage::Float:
+        chunk.floats.push_back(src_chunk.floats[src_off]);
+        break;
+      case Storage::String:
+        chunk.strings.push_back(src_chunk.strings[src_off]);
+        break;
+      case Storage::Generic:
+        chunk.values.push_back(src_chunk.values[src_off]);
+        break;
+    }
+    append_null_bit(chunk, src.is_null_in(src_chunk, src_off));
+    if (indexed_) {
+      index_cell(chunk, chunk.size - 1);
+    }
+    widen_zone(chunk, chunk.size - 1);
+  }
+
+  // append the cells [begin, end) of a chunk with the same storage
+  void append_slice(const Chunk &src, size_t begin, size_t end);
+
+  void index_cell(Chunk &chunk, size_t off);
+  void unindex_cell(Chunk &chunk, size_t off);
+
+  // zone map maintenance, `widen_zone` after a cell is written and
+  // `unzone_cell` before it is overwritten
+  void widen_zone(Chunk &chunk, size_t off);
+  // widen by the cells [begin, end) appended at the end of the chunk
+  void widen_zone(Chunk &chunk, size_t begin, size_t end);
+  void unzone_cell(Chunk &chunk, size_t off);
+
+  void append_null_bit(Chunk &chunk, bool null) {
+    if (chunk.size % 64 == 0) {
+      chunk.null_bits.push_back(0);
+    }
+    chunk.size++;
+    size_++;
+    set_null_bit(chunk, chunk.size - 1, null);
+  }
+
+  void set_null_bit(Chunk &chunk, size_t off, bool null) {
+    uint64_t mask = uint64_t(1) << (off % 64);
+    bool was_null = chunk.null_bits[off / 64] & mask;
+    if (null == was_null) {
+      return;
+    }
+
+    if (null) {
+      chunk.null_bits[off / 64] |= mask;
+      chunk.null_count++;
+      null_count_++;
+    } else {
+      chunk.null_bits[off / 64] &= ~mask;
+      chunk.null_count--;
+      null_count_--;
+    }
+  }
+
+ private:
+  AnyType type_;
+  Storage storage_;
+  size_t size_ = 0;
+  size_t null_count_ = 0;
+  bool indexed_ = false;
+
+  // never null
+  std::shared_ptr<ChunkList> chunks_;
+};
+
+// rows ordered by the cells of the columns as `Column::compare`, ties keep
+// their order. The rows are split into a run per pool worker, every run is
+// radix sorted by the first sort key of the rows (see `Column::sort_key`) and
+// the runs are merged. Groups of rows with equal keys are then radix sorted
+// by their next key, the next segment of a string or the key of the next
+// column, and so on, small groups are compared cell by cell.
+RowIndicesList sort_rows(const std::vector<const Column *> &columns,
+                         RowIndicesList rows, bool asc,
+                         ThreadPool *pool = nullptr);
+
+// synchronization of a multi-versioned table, a copied table gets its own
+class TableSync {
+ public:
+  TableSync() = default;
+  TableSync(const TableSync &) {}
+  TableSync &operator=(const TableSync &) { return *this; }
+
+  // guards the current version while it is copied or replaced
+  std::mutex &version_mutex() const { return version_mutex_; }
+  // serializes writers
+  std::mutex &write_mutex() const { return write_mutex_; }
+
+  // whether the table was dropped from its database, under the write mutex
+  bool dropped() const { return dropped_; }
+  void set_dropped() { dropped_ = true; }
+
+ private:
+  mutable std::mutex version_mutex_;
+  mutable std::mutex write_mutex_;
+  bool dropped_ = false;
+};
+
+// Rows of a table ordered by one or more fields as `Column::compare`, ties in
+// row order. The order is kept as sorted runs: appended rows become a new run,
+// which is merged into the run before it while that one holds at most twice
+// as many rows. An append costs O(log n) amortized instead of a merge of
+// every row, and there are O(log n) runs. The runs are shared between the
+// versions of a table and replaced when a write changes them.
+struct OrderedIndex {
+  std::vector<size_t> fields;
+  std::vector<std::shared_ptr<const RowIndicesList>> runs;
+};
+
+// `cell <op> value`, one side of a range of an ordered index
+struct RangeBound {
+  CompareOperator op;
+  AnyValue value;
+};
+
 class Table {
  public:
   using RowPredictor = std::function<bool(const ValueList &, size_t row_index)>;
   using RowUpdater = std::function<void(ValueList &, size_t row_index)>;
 
-  Table(std::string name, TableSchema schema) : name_(name), schema_(schema) {}
+  Table(std::string name, TableSchema schema) : name_(name), schema_(schema) {
+    columns_.reserve(schema_.fields_size());
+    for (auto &field : schema_.fields()) {
+      columns_.emplace_back(field.type);
+    }
+  }
 
   static TablePtr create_ptr(std::string name, TableSchema schema) {
     return std::make_shared<Table>(name, schema);
@@ -107,7 +690,48 @@ class Table {
 
   const std::string &name() const { return name_; }
   const TableSchema &schema() const { return schema_; }
-  const std::vector<ValueList> &rows() const { return rows_; }
+
+  // Tables in the database are shared by concurrent executions and are
+  // multi-versioned. Readers work on a `snapshot()` of the current version,
+  // writers build the next version with `modify()`, so readers never block
+  // writers and never see a partial write. The other methods don't
+  // synchronize, they are meant for snapshots and tables private to an
+  // execution. The schema never changes once the table is created.
+  using Writer = std::function<Result<bool>(Table &)>;
+
+  // immutable copy of the current version, shares the column chunks
+  TablePtr snapshot() const;
+
+  // run writer on a copy of the current version and publish the copy as the
+  // next version if it succeeds, writers run one at a time. Returns a
+  // snapshot of the published version.
+  Result<TablePtr> modify(const Writer &writer);
+
+  // make the writers of a table dropped from its database fail, once the
+  // running one is done, so its changes are logged before the drop
+  void mark_dropped();
+
+  // number of versions published by `modify()` when the snapshot was taken
+  uint64_t version() const { return version_; }
+
+  // log sequence number of the last change to the table recorded in the
+  // write-ahead log, replaying skips the records it already holds
+  uint64_t wal_lsn() const { return wal_lsn_; }
+  void set_wal_lsn(uint64_t lsn) { wal_lsn_ = lsn; }
+
+  // materialize all rows, prefer `column()` for scans
+  std::vector<ValueList> rows() const {
+    std::vector<ValueList> rows;
+    rows.reserve(num_rows_);
+    for (size_t i = 0; i < num_rows_; i++) {
+      rows.push_back(get_row(i));
+    }
+    return rows;
+  }
+
+  const Column &column(size_t field_index) const {
+    return columns_[field_index];
+  }
 
   Result<bool> add_row_list(const std::vector<ValueList> &values_list) {
     for (auto &values : values_list) {
@@ -117,8 +741,44 @@ class Table {
       }
     }
 
-    rows_.insert(rows_.end(), values_list.begin(), values_list.end());
+    for (auto &column : columns_) {
+      column.reserve(num_rows_ + values_list.size());
+    }
+    size_t first_row = num_rows_;
+    for (auto &values : values_list) {
+      push_row(values);
+    }
+    index_appended_rows(first_row);
+
+    return true;
+  }
+
+  // append the rows of columns laid out like the schema, e.g. parsed from a
+  // file. The cells must be checked against the field types by the caller.
+  void add_columns(const std::vector<Column> &columns) {
+    size_t first_row = num_rows_;
+    for (size_t i = 0; i < columns_.size(); i++) {
+      columns_[i].append(columns[i]);
+    }
+    num_rows_ = columns_.empty() ? 0 : columns_[0].size();
+    index_appended_rows(first_row);
+  }
+
+  // append every row of a table whose fields have the same types
+  Result<bool> add_table(const Table &other) {
+    auto &fields = other.schema().fields();
+    if (fields.size() != schema_.fields_size()) {
+      return Error("row size not matched with schema");
+    }
+    for (size_t i = 0; i < fields.size(); i++) {
+      if (!fields[i].type.is_subtype_of(schema_.get_field(i).type) ||
+          other.columns_[i].storage() != columns_[i].storage()) {
+        return Error("field type not matched with schema, field: {}",
+                     schema_.get_field(i).name);
+      }
+    }
 
+    add_columns(other.columns_);
     return true;
   }
 
@@ -128,51 +788,162 @@ class Table {
       return res1.unwrap_err();
     }
 
-    rows_.push_back(values);
+    push_row(values);
+    index_appended_rows(num_rows_ - 1);
 
     return true;
   }
 
   // if predict return true, delete the row
   Result<bool> delete_rows(const RowPredictor &predict) {
-    std::vector<ValueList> new_rows;
+    std::vector<bool> keep(num_rows_);
+    size_t num_kept = 0;
+
+    ValueList row;
+    for (size_t i = 0; i < num_rows_; i++) {
+      fill_row(row, i);
+      keep[i] = !predict(row, i);
+      num_kept += keep[i];
+    }
+
+    return retain_rows(keep, num_kept);
+  }
 
-    for (size_t i = 0; i < rows_.size(); i++) {
-      auto &row = rows_[i];
-      if (!predict(row, i)) {
-        new_rows.push_back(row);
+  // like `delete_rows(predict)`, only the given rows are candidates
+  Result<bool> delete_rows(const RowIndicesList &row_indices,
+                           const RowPredictor &predict) {
+    std::vector<bool> keep(num_rows_, true);
+    size_t num_kept = num_rows_;
+
+    ValueList row;
+    for (auto i : row_indices) {
+      fill_row(row, i);
+      if (keep[i] && predict(row, i)) {
+        keep[i] = false;
+        num_kept--;
       }
     }
 
-    rows_ = new_rows;
-    return true;
+    return retain_rows(keep, num_kept);
+  }
+
+  // delete the given rows, without reading them
+  Result<bool> delete_rows(const RowIndicesList &row_indices) {
+    std::vector<bool> keep(num_rows_, true);
+    size_t num_kept = num_rows_;
+    for (auto i : row_indices) {
+      num_kept -= keep[i];
+      keep[i] = false;
+    }
+
+    return retain_rows(keep, num_kept);
   }
 
   Result<bool> update_row(const RowUpdater &updater) {
-    for (size_t i = 0; i < rows_.size(); i++) {
-      auto &row = rows_[i];
-      updater(row, i);
+    ValueList row;
+    RowIndicesList reordered;
+    for (size_t i = 0; i < num_rows_; i++) {
+      update_row_at(row, i, updater, reordered);
+    }
+    reindex_rows(reordered);
+
+    return true;
+  }
+
+  // like `update_row(updater)`, only the given rows are passed to updater
+  Result<bool> update_rows(const RowIndicesList &row_indices,
+                           const RowUpdater &updater) {
+    ValueList row;
+    RowIndicesList reordered;
+    for (auto i : row_indices) {
+      update_row_at(row, i, updater, reordered);
+    }
+    reindex_rows(reordered);
+
+    return true;
+  }
+
+  // hash index the field for equality lookups, see `Column::lookup`
+  Result<bool> create_index(size_t field_index) {
+    if (field_index >= columns_.size()) {
+      return Error("index field index out of range: {}", field_index);
     }
 
+    columns_[field_index].create_index();
     return true;
   }
 
+  // keep the rows ordered by the fields, see `OrderedIndex`
+  Result<bool> create_ordered_index(const std::vector<size_t> &field_indices);
+
+  const std::vector<OrderedIndex> &ordered_indexes() const {
+    return ordered_indexes_;
+  }
+
+  // ordered index on exactly these fields, nullptr if there is none
+  const OrderedIndex *ordered_index(
+      const std::vector<size_t> &field_indices) const;
+
+  // the first count rows in the order of the index, its runs merged
+  std::shared_ptr<const RowIndicesList> ordered_rows(
+      const OrderedIndex &index,
+      size_t count = std::numeric_limits<size_t>::max()) const;
+
+  // rows whose field satisfies every bound as `AnyValue::get_comparator`, in
+  // row order. The bounds are `EQ`, `LT`, `LE`, `GT` or `GE`, so the rows
+  // are a single range of an ordered index that starts with the field.
+  // std::nullopt if there is no such index, or the order can't be trusted
+  // because a bound or a cell may be NaN.
+  std::optional<RowIndicesList> range(
+      size_t field_index, const std::vector<RangeBound> &bounds) const;
+  std::optional<RowIndicesList> range(size_t field_index, CompareOperator op,
+                                      const AnyValue &value) const {
+    return range(field_index, {{op, value}});
+  }
+
+  // compare two rows by the fields as `Column::compare`
+  int compare_rows(size_t lhs, size_t rhs,
+                   const std::vector<size_t> &field_indices) const {
+    for (auto field_index : field_indices) {
+      int res = columns_[field_index].compare(lhs, rhs);
+      if (res != 0) {
+        return res;
+      }
+    }
+    return 0;
+  }
+
   std::ostream &dump(std::ostream &out) const;
 
-  size_t num_rows() const { return rows_.size(); }
+  size_t num_rows() const { return num_rows_; }
 
-  const ValueList &get_row(size_t row_index) const { return rows_[row_index]; }
+  ValueList get_row(size_t row_index) const {
+    ValueList row;
+    fill_row(row, row_index);
+    return row;
+  }
 
   Result<Table> filter(const RowPredictor &predict) const {
-    Table new_table(name_, schema_);
+    RowIndicesList indices;
 
-    for (size_t i = 0; i < rows_.size(); i++) {
-      auto &row = rows_[i];
+    ValueList row;
+    for (size_t i = 0; i < num_rows_; i++) {
+      fill_row(row, i);
       if (predict(row, i)) {
-        new_table.rows_.push_back(row);
+        indices.push_back(i);
       }
     }
 
+    return take(indices);
+  }
+
+  // gather rows by row indices, create new table
+  Table take(const RowIndicesList &indices) const {
+    Table new_table(name_, schema_);
+    for (size_t i = 0; i < columns_.size(); i++) {
+      new_table.columns_[i] = columns_[i].take(indices);
+    }
+    new_table.num_rows_ = indices.size();
     return new_table;
   }
 
@@ -185,15 +956,10 @@ class Table {
     }
 
     Table new_table(name_, new_schema);
-
-    for (auto &row : rows_) {
-      ValueList new_row;
-      for (auto field_index : field_indices) {
-        new_row.push_back(row[field_index]);
-      }
-
-      new_table.rows_.push_back(new_row);
+    for (size_t i = 0; i < field_indices.size(); i++) {
+      new_table.columns_[i] = columns_[field_indices[i]];
     }
+    new_table.num_rows_ = num_rows_;
 
     return new_table;
   }
@@ -208,36 +974,23 @@ class Table {
     return select(res1.unwrap());
   }
 
-  // sort rows by field indices, create new table
-  Result<Table> sort(const std::vector<size_t> &field_indices, bool asc) const {
-    Table new_table = clone();
-
-    std::sort(
-        new_table.rows_.begin(), new_table.rows_.end(),
-        [&](const ValueList &row1, const ValueList &row2) {
-          for (auto field_index : field_indices) {
-            if (field_index >= row1.size() || field_index >= row2.size()) {
-              return false;
-            }
-
-            auto &value1 = row1[field_index];
-            auto &value2 = row2[field_index];
-
-            bool less_res = value1 < value2;
-            if (less_res) {
-              return asc;
-            }
-
-            bool greater_res = value1 > value2;
-            if (greater_res) {
-              return !asc;
-            }
-          }
+  // sort rows by field indices, create new table, see `sort_rows`
+  Result<Table> sort(const std::vector<size_t> &field_indices, bool asc,
+                     ThreadPool *pool = nullptr) const {
+    std::vector<const Column *> columns;
+    for (auto field_index : field_indices) {
+      if (field_index >= columns_.size()) {
+        return Error("sort field index out of range: {}", field_index);
+      }
+      columns.push_back(&columns_[field_index]);
+    }
 
-          return false;
-        });
+    RowIndicesList indices(num_rows_);
+    for (size_t i = 0; i < num_rows_; i++) {
+      indices[i] = i;
+    }
 
-    return new_table;
+    return take(sort_rows(columns, std::move(indices), asc, pool));
   }
 
   // sort rows by field names, create new table
@@ -252,19 +1005,21 @@ class Table {
   }
 
   Result<Table> limit(size_t offset, size_t count) const {
-    Table new_table = Table(name_, schema_);
+    RowIndicesList indices;
 
-    for (size_t i = offset; i < rows_.size() && i < offset + count; i++) {
-      new_table.rows_.push_back(rows_[i]);
+    for (size_t i = offset; i < num_rows_ && i < offset + count; i++) {
+      indices.push_back(i);
     }
 
-    return new_table;
+    return take(indices);
   }
 
   template <typename AggFunction>
   Result<AnyValue> aggregate(const AggFunction &agg_func) {
     AnyValue agg_value;
-    for (auto &row : rows_) {
+    ValueList row;
+    for (size_t i = 0; i < num_rows_; i++) {
+      fill_row(row, i);
       agg_value = agg_func(agg_value, row);
     }
     return agg_value;
@@ -279,15 +1034,289 @@ class Table {
   // clone a new table, used as a temporary table
   Table clone() const {
     Table table(name_, schema_);
-    table.rows_ = rows_;
+    table.columns_ = columns_;
+    table.num_rows_ = num_rows_;
     return table;
   }
 
+ private:
+  friend class TableView;
+
+  void push_row(const ValueList &values) {
+    for (size_t i = 0; i < columns_.size(); i++) {
+      columns_[i].push_back(values[i]);
+    }
+    num_rows_++;
+  }
+
+  void fill_row(ValueList &row, size_t row_index) const {
+    row.resize(columns_.size());
+    for (size_t i = 0; i < columns_.size(); i++) {
+      row[i] = columns_[i].get(row_index);
+    }
+  }
+
+  // rows whose ordered index fields changed are added to reordered
+  void update_row_at(ValueList &row, size_t row_index,
+                     const RowUpdater &updater, RowIndicesList &reordered) {
+    fill_row(row, row_index);
+    updater(row, row_index);
+
+    bool moved = false;
+    for (size_t j = 0; j < columns_.size(); j++) {
+      if (columns_[j].holds(row_index, row[j])) {
+        continue;
+      }
+      columns_[j].set(row_index, row[j]);
+      moved = moved || is_ordered_indexed(j);
+    }
+    if (moved) {
+      reordered.push_back(row_index);
+    }
+  }
+
+  Result<bool> retain_rows(const std::vector<bool> &keep, size_t num_kept) {
+    if (num_kept == num_rows_) {
+      return true;
+    }
+
+    for (auto &column : columns_) {
+      column.retain(keep);
+    }
+    num_rows_ = num_kept;
+    remap_ordered_indexes(keep);
+    return true;
+  }
+
+  bool is_ordered_indexed(size_t field_index) const {
+    for (auto &index : ordered_indexes_) {
+      auto &fields = index.fields;
+      if (std::find(fields.begin(), fields.end(), field_index) !=
+          fields.end()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // ordered index maintenance, rows are ordered by (fields, row index)
+  bool index_less(size_t lhs, size_t rhs,
+                  const std::vector<size_t> &fields) const {
+    int res = compare_rows(lhs, rhs, fields);
+    return res != 0 ? res < 0 : lhs < rhs;
+  }
+  void index_appended_rows(size_t first_row);
+  void reindex_rows(const RowIndicesList &rows);
+  void remap_ordered_indexes(const std::vector<bool> &keep);
+  // add a sorted run to the index and merge the runs it outgrows
+  void add_index_run(OrderedIndex &index, RowIndicesList run) const;
+
  private:
   std::string name_;
   TableSchema schema_{};
 
-  std::vector<ValueList> rows_{};
+  std::vector<Column> columns_{};
+  size_t num_rows_ = 0;
+  std::vector<OrderedIndex> ordered_indexes_{};
+
+  uint64_t version_ = 0;
+  uint64_t wal_lsn_ = 0;
+  TableSync sync_;
+};
+
+// bytes of csv lines parsed by a task at a time
+constexpr size_t kCSVRangeSize = 1 << 20;
+
+// Streams csv data, e.g. a mapped file, straight into the columns of tables of
+// the schema, batch by batch. The header names every field in any order.
+// The data must outlive the reader.
+class CSVReader {
+ public:
+  // reads and checks the header
+  static Result<CSVReader> open(std::string_view data,
+                                const TableSchema &schema,
+                                std::string_view delim = ",");
+
+  bool done() const { return pos_ == data_.data() + data_.size(); }
+
+  // bytes of the data consumed so far
+  size_t offset() const { return pos_ - data_.data(); }
+
+  // parse the next batch of lines and append them to table, a table of the
+  // schema. A batch is a range of about range_size bytes per pool worker,
+  // the ranges are parsed in parallel. On error nothing is appended.
+  Result<bool> read_batch(Table &table, ThreadPool *pool = nullptr,
+                          size_t range_size = kCSVRangeSize);
+
+ private:
+  CSVReader() = default;
+
+ private:
+  std::string_view data_;
+  TableSchema schema_;
+  std::string delim_;
+  std::vector<std::string> headers_;
+  // csv column => schema field
+  std::vector<size_t> field_indices_;
+  const char *pos_ = nullptr;
+  // rows read so far
+  size_t num_rows_ = 0;
+};
+
+// read every row of csv data into a table of the schema, see `CSVReader`
+Result<Table> load_csv_table(std::string_view data, const TableSchema &schema,
+                             ThreadPool *pool = nullptr,
+                             std::string_view delim = ",");
+
+// The first `count` rows of a stream of base rows by the order of some base
+// columns, kept in a bounded heap, so taking them costs O(n log count) and
+// O(count) memory. Ties keep the order the rows are pushed in, like a stable
+// sort followed by a limit.
+class TopKRows {
+ public:
+  TopKRows(std::vector<const Column *> columns, bool asc, size_t count)
+      : columns_(std::move(columns)), asc_(asc), count_(count) {}
+
+  void push(size_t row);
+
+  // the kept rows in order, the heap is left empty
+  RowIndicesList take();
+
+ private:
+  struct Entry {
+    size_t row;
+    // push order, breaks ties
+    size_t seq;
+  };
+
+  bool before(const Entry &lhs, const Entry &rhs) const;
+
+ private:
+  std::vector<const Column *> columns_;
+  bool asc_;
+  size_t count_;
+  size_t pushed_ = 0;
+  // max-heap by `before`, the last kept row on top
+  std::vector<Entry> heap_;
+};
+
+// A zero-copy view over a table: the base table, a selection vector of base
+// row indices and the projected base field indices. Query leaf functions pass
+// views along, rows are copied only when the view is materialized.
+class TableView {
+ public:
+  TableView() = default;
+  explicit TableView(TablePtr table);
+
+  const TablePtr &table() const { return table_; }
+  const TableSchema &schema() const { return schema_; }
+
+  size_t num_rows() const {
+    return rows_ != nullptr ? rows_->size() : table_->num_rows();
+  }
+
+  // base row index of the idx-th row in the view
+  size_t row_index(size_t idx) const {
+    return rows_ != nullptr ? (*rows_)[idx] : idx;
+  }
+
+  // base field index of the projected field
+  size_t base_field_index(size_t field_index) const {
+    return fields_[field_index];
+  }
+
+  // base column of the projected field
+  const Column &column(size_t field_index) const {
+    return table_->column(fields_[field_index]);
+  }
+
+  AnyValue get(size_t idx, size_t field_index) const {
+    return column(field_index).get(row_index(idx));
+  }
+
+  // the view exposes every row and field of the base table in order
+  bool is_identity() const;
+
+  // the view selects every base row in order, its fields may be projected
+  bool selects_all_rows() const { return rows_ == nullptr; }
+
+  // the selection vector, nullptr if the view selects every base row
+  const RowIndicesList *selection() const { return rows_.get(); }
+
+  // some row of the view may satisfy `field <op> value`, false only if the
+  // zone maps of the chunks the rows lie in rule every row out
+  bool may_match(size_t field_index, CompareOperator op,
+                 const AnyValue &value) const;
+  // some row of the view lies in a chunk of the field for which
+  // chunk_may_match(column, chunk_index) holds
+  bool may_match(size_t field_index,
+                 const std::function<bool(const Column &, size_t)>
+                     &chunk_may_match) const;
+  // some row of the view lies in a chunk of the base table for which
+  // chunk_may_match(chunk_index) holds
+  bool may_match(
+      const std::function<bool(size_t chunk_index)> &chunk_may_match) const;
+
+  TableView limit(size_t offset, size_t count) const;
+
+  // rows whose field equals value, looked up in the index of the base column.
+  // Only for views of every base row, std::nullopt if the index can't be used.
+  std::optional<TableView> lookup(size_t field_index,
+                                  const AnyValue &value) const;
+
+  // rows whose field satisfies the bounds, looked up in an ordered index of
+  // the base table as `Table::range`, like `lookup`
+  std::optional<TableView> range(size_t field_index,
+                                 const std::vector<RangeBound> &bounds) const;
+  std::optional<TableView> range(size_t field_index, CompareOperator op,
+                                 const AnyValue &value) const {
+    return range(field_index, {{op, value}});
+  }
+
+  // same base and fields, with the given base row indices as selection
+  TableView with_rows(RowIndicesList rows) const;
+
+  // select fields by field indices of the view
+  TableView select(const std::vector<size_t> &field_indices) const;
+  Result<TableView> select(const std::vector<std::string> &field_names) const;
+
+  // ordered index of the base table on fields of the view, nullptr if there
+  // is none
+  const OrderedIndex *ordered_index(
+      const std::vector<size_t> &field_indices) const;
+
+  // sort rows by field indices of the view, only the selection is reordered,
+  // see `sort_rows`. Ties keep their order. With an ordered index of the base
+  // table on the fields, the rows are taken in index order instead.
+  TableView sort(const std::vector<size_t> &field_indices, bool asc,
+                 ThreadPool *pool = nullptr) const;
+  Result<TableView> sort(const std::vector<std::string> &field_names,
+                         bool asc) const;
+
+  // the first count rows of `sort`, without sorting the others. A view of
+  // every base row walks an ordered index on the fields until count rows are
+  // taken, else they are kept in a `TopKRows`.
+  TableView top_k(const std::vector<size_t> &field_indices, bool asc,
+                  size_t count) const;
+
+  // copy the selected rows and fields into a new table, an identity view
+  // returns the base table itself
+  TablePtr materialize() const;
+
+ private:
+  TableView(TablePtr table, std::shared_ptr<const RowIndicesList> rows,
+            std::vector<size_t> fields);
+
+  // the first count rows of the view in index order
+  TableView sort_by_index(const OrderedIndex &index, bool asc,
+                          size_t count = SIZE_MAX) const;
+
+ private:
+  TablePtr table_;
+  // nullptr means all rows of the base table
+  std::shared_ptr<const RowIndicesList> rows_;
+  std::vector<size_t> fields_;
+  TableSchema schema_;
 };
 
 std::ostream &operator<<(std::ostream &out, const Table &table);
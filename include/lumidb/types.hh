@@ -1,13 +1,18 @@
 #pragma once
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <iomanip>
+#include <new>
 #include <optional>
 #include <ostream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
-#include <variant>
 #include <vector>
 
 #include "fmt/core.h"
@@ -39,7 +44,18 @@ class Logger {
 
 using LoggerPtr = std::shared_ptr<Logger>;
 
-int compare_float(float a, float b, float epsilon = 0.0001);
+// -1, 0 or 1, floats within epsilon of each other compare equal
+inline int compare_float(float a, float b, float epsilon = 0.0001) {
+  float diff = a - b;
+  if (diff < -epsilon) {
+    return -1;
+  } else if (diff > epsilon) {
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
 std::string float2string(float v);
 
 using plugin_id_t = std::string;
@@ -54,7 +70,7 @@ enum class TypeKind {
   T_NULL_STRING,
 };
 
-enum class ValueTypeKind : int {
+enum class ValueTypeKind : uint8_t {
   T_NULL = 0,
   T_FLOAT,
   T_STRING,
@@ -64,6 +80,9 @@ enum class CompareOperator {
   EQ = 0,
   LT,
   GT,
+  LE,
+  GE,
+  NE,
 };
 
 enum class Status {
@@ -250,49 +269,75 @@ class AnyType {
 };
 
 // Immutable value type
+//
+// A value takes 16 bytes: the payload, the inline string size and the kind
+// tag. Strings up to `kInlineCapacity` bytes are stored inline, longer strings
+// live in a shared reference counted buffer, so copying a value never
+// allocates.
 class AnyValue {
  public:
   using Comparator =
       std::function<bool(const AnyValue &lhs, const AnyValue &rhs)>;
 
-  AnyValue() : AnyValue(ValueTypeKind::T_NULL, {}) {}
-  AnyValue(std::string_view str)
-      : AnyValue(ValueTypeKind::T_STRING, std::string(str)) {}
-  AnyValue(std::string str) : AnyValue(ValueTypeKind::T_STRING, str) {}
-  AnyValue(float value) : AnyValue(ValueTypeKind::T_FLOAT, value) {}
+  static constexpr size_t kInlineCapacity = 14;
+
+  AnyValue() = default;
+  AnyValue(std::string_view str) { init_string(str); }
+  AnyValue(const std::string &str) { init_string(str); }
+  AnyValue(float value) : kind_(ValueTypeKind::T_FLOAT) {
+    std::memcpy(data_, &value, sizeof(value));
+  }
+
+  AnyValue(const AnyValue &other) { copy_from(other); }
+  AnyValue(AnyValue &&other) noexcept { move_from(other); }
+
+  AnyValue &operator=(const AnyValue &other) {
+    if (this != &other) {
+      release();
+      copy_from(other);
+    }
+    return *this;
+  }
+
+  AnyValue &operator=(AnyValue &&other) noexcept {
+    if (this != &other) {
+      release();
+      move_from(other);
+    }
+    return *this;
+  }
+
+  ~AnyValue() { release(); }
 
   ValueTypeKind kind() const { return kind_; }
-  AnyType type() const { return type_; }
+  AnyType type() const { return AnyType::from_value_type(kind_); }
 
   static Result<AnyValue> parse_from_string(const AnyType &type,
                                             std::string_view str);
 
+  static Result<CompareOperator> parse_compare_operator(std::string_view op);
   static Comparator get_comparator(CompareOperator op);
   static Result<Comparator> get_comparator(std::string op);
 
-  static AnyValue from_string(std::string_view str) {
-    return AnyValue(ValueTypeKind::T_STRING, std::string(str));
-  }
-  static AnyValue from_string(std::string str) {
-    return AnyValue(ValueTypeKind::T_STRING, str);
+  static AnyValue from_string(std::string_view str) { return AnyValue(str); }
+  static AnyValue from_string(const std::string &str) {
+    return AnyValue(std::string_view(str));
   }
   static AnyValue from_string(const char *str) {
-    return AnyValue(ValueTypeKind::T_STRING, std::string(str));
+    return AnyValue(std::string_view(str));
   }
 
-  static AnyValue from_float(float value) {
-    return AnyValue(ValueTypeKind::T_FLOAT, value);
-  }
+  static AnyValue from_float(float value) { return AnyValue(value); }
 
-  static AnyValue from_null() { return AnyValue(ValueTypeKind::T_NULL, {}); }
+  static AnyValue from_null() { return AnyValue(); }
 
   bool operator<(const AnyValue &other) const {
     if (kind_ != other.kind_) return kind_ < other.kind_;
     switch (kind_) {
       case ValueTypeKind::T_FLOAT:
-        return as_float() < other.as_float();
+        return float_or_zero() < other.float_or_zero();
       case ValueTypeKind::T_STRING:
-        return as_string() < other.as_string();
+        return as_string_view() < other.as_string_view();
       case ValueTypeKind::T_NULL:
         return false;
     }
@@ -306,9 +351,9 @@ class AnyValue {
     if (kind_ != other.kind_) return false;
     switch (kind_) {
       case ValueTypeKind::T_FLOAT:
-        return compare_float(as_float(), other.as_float()) == 0;
+        return compare_float(float_or_zero(), other.float_or_zero()) == 0;
       case ValueTypeKind::T_STRING:
-        return as_string() == other.as_string();
+        return as_string_view() == other.as_string_view();
       case ValueTypeKind::T_NULL:
         return true;
     }
@@ -318,28 +363,120 @@ class AnyValue {
   bool operator!=(const AnyValue &other) const { return !(*this == other); }
 
   bool is_instance_of(const AnyType &type) const {
-    return this->type_.is_subtype_of(type);
+    return this->type().is_subtype_of(type);
   }
 
   bool is_null() const { return kind_ == ValueTypeKind::T_NULL; }
   bool is_string() const { return kind_ == ValueTypeKind::T_STRING; }
   bool is_float() const { return kind_ == ValueTypeKind::T_FLOAT; }
 
-  float as_float() const { return std::get<float>(value_); }
-  const std::string &as_string() const { return std::get<std::string>(value_); }
+  float as_float() const {
+    if (kind_ != ValueTypeKind::T_FLOAT) {
+      throw std::runtime_error("value is not a float: " + type().name());
+    }
+    return float_or_zero();
+  }
+
+  // lenient as_float for the aggregate loops, null and strings are read as 0
+  float float_or_zero() const {
+    float value = 0;
+    if (kind_ == ValueTypeKind::T_FLOAT) {
+      std::memcpy(&value, data_, sizeof(value));
+    }
+    return value;
+  }
+
+  std::string_view as_string_view() const {
+    if (kind_ != ValueTypeKind::T_STRING) {
+      return {};
+    }
+    if (inline_size_ != kSharedMarker) {
+      return std::string_view(data_, inline_size_);
+    }
+    auto shared = shared_string();
+    return std::string_view(shared->data, shared->size);
+  }
+
+  std::string as_string() const { return std::string(as_string_view()); }
 
   std::string format_to_string() const;
 
  private:
-  AnyValue(ValueTypeKind kind, std::variant<float, std::string> value)
-      : kind_(kind), value_(value), type_(AnyType::from_value_type(kind)) {}
+  struct SharedString {
+    std::atomic<uint32_t> refs;
+    // the full byte length of `data`, never truncated
+    size_t size;
+    char data[1];
+  };
+
+  static constexpr uint8_t kSharedMarker = 0xff;
+
+  SharedString *shared_string() const {
+    SharedString *shared;
+    std::memcpy(&shared, data_, sizeof(shared));
+    return shared;
+  }
+
+  bool is_shared_string() const {
+    return kind_ == ValueTypeKind::T_STRING && inline_size_ == kSharedMarker;
+  }
+
+  void init_string(std::string_view str) {
+    kind_ = ValueTypeKind::T_STRING;
+    if (str.size() <= kInlineCapacity) {
+      inline_size_ = static_cast<uint8_t>(str.size());
+      std::memcpy(data_, str.data(), str.size());
+      return;
+    }
+
+    auto shared = static_cast<SharedString *>(
+        std::malloc(offsetof(SharedString, data) + str.size()));
+    if (shared == nullptr) {
+      throw std::bad_alloc();
+    }
+    new (&shared->refs) std::atomic<uint32_t>(1);
+    shared->size = str.size();
+    std::memcpy(shared->data, str.data(), str.size());
+
+    inline_size_ = kSharedMarker;
+    std::memcpy(data_, &shared, sizeof(shared));
+  }
+
+  void copy_from(const AnyValue &other) {
+    std::memcpy(data_, other.data_, sizeof(data_));
+    inline_size_ = other.inline_size_;
+    kind_ = other.kind_;
+    if (is_shared_string()) {
+      shared_string()->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void move_from(AnyValue &other) {
+    std::memcpy(data_, other.data_, sizeof(data_));
+    inline_size_ = other.inline_size_;
+    kind_ = other.kind_;
+    other.kind_ = ValueTypeKind::T_NULL;
+  }
+
+  void release() {
+    if (is_shared_string()) {
+      auto shared = shared_string();
+      if (shared->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        std::free(shared);
+      }
+    }
+    kind_ = ValueTypeKind::T_NULL;
+  }
 
  private:
-  ValueTypeKind kind_;
-  std::variant<float, std::string> value_;
-  AnyType type_;
+  // float, SharedString* or inline string bytes
+  alignas(8) char data_[kInlineCapacity] = {};
+  uint8_t inline_size_ = 0;
+  ValueTypeKind kind_ = ValueTypeKind::T_NULL;
 };
 
+static_assert(sizeof(AnyValue) == 16, "AnyValue should be 16 bytes");
+
 std::ostream &operator<<(std::ostream &os, const AnyValue &value);
 
 }  // namespace lumidb
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <atomic>
+#include <cstdint>
 #include <istream>
+#include <memory>
 #include <optional>
 #include <string>
 #include <string_view>
@@ -41,6 +43,41 @@ struct CSVObject {
 
 Result<CSVObject> parse_csv(std::istream &is, std::string_view delim = ",");
 
+// first '\n' in [begin, end), or end if there is none
+const char *find_newline(const char *begin, const char *end);
+
+// 64-bit checksum of a buffer to detect corrupted files, not a cryptographic
+// hash. Continue a checksum by passing the previous one as seed.
+uint64_t checksum(const void *data, size_t size, uint64_t seed = 0);
+
+class MappedFile;
+using MappedFilePtr = std::shared_ptr<MappedFile>;
+
+// Read-only contents of a whole file, memory mapped where the platform
+// supports it and read into memory otherwise
+class MappedFile {
+ public:
+  static Result<MappedFilePtr> open(const std::string &path);
+
+  MappedFile() = default;
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  std::string_view data() const { return {data_, size_}; }
+
+  // hint that the first `size` bytes won't be read again, so their pages can
+  // be dropped from memory. The data stays readable.
+  void release(size_t size);
+
+ private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  bool mapped_ = false;
+  std::string buffer_;
+};
+
 // Set which preserves the insertion order
 template <typename T>
 class InsertOrderSet {
@@ -1,11 +1,15 @@
+#include <chrono>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <optional>
 #include <string>
 #include <vector>
 
 #include "argumentum/argparse.h"
 #include "lumidb/db.hh"
 #include "lumidb/repl.hh"
+#include "lumidb/storage.hh"
 
 using namespace std;
 using namespace argumentum;
@@ -13,6 +17,13 @@ using namespace lumidb;
 
 struct CliOptions {
   std::vector<string> in_scripts;
+  std::optional<string> snapshot;
+  std::optional<string> wal;
+  string wal_sync = "commit";
+  int checkpoint_interval = 0;
+  int checkpoint_wal_mb = 64;
+  int num_workers = 0;
+  int sort_memory_mb = 1024;
 };
 
 int main(int argc, char **argv) {
@@ -28,17 +39,111 @@ int main(int argc, char **argv) {
       .minargs(0)
       .help("The input script file.");
 
+  params.add_parameter(opts.snapshot, "--snapshot")
+      .nargs(1)
+      .help(
+          "The snapshot file to load the tables from, before the scripts, and "
+          "to checkpoint them to. A missing file starts an empty database.");
+
+  params.add_parameter(opts.wal, "--wal")
+      .nargs(1)
+      .help(
+          "The write-ahead log, replayed after the snapshot and appended with "
+          "every later change.");
+
+  params.add_parameter(opts.wal_sync, "--wal-sync")
+      .nargs(1)
+      .help("When the log is synced: commit (default), off or <N>ms.");
+
+  params.add_parameter(opts.checkpoint_interval, "--checkpoint-interval")
+      .nargs(1)
+      .help(
+          "Seconds between background checkpoints to the snapshot, 0 (default) "
+          "means only by log size or on demand.");
+
+  params.add_parameter(opts.checkpoint_wal_mb, "--checkpoint-wal-mb")
+      .nargs(1)
+      .help(
+          "Checkpoint once the log grew by as many MiB, 64 by default, 0 "
+          "means never.");
+
+  params.add_parameter(opts.num_workers, "--workers")
+      .nargs(1)
+      .help("Number of query workers, 0 means one per hardware thread.");
+
+  params.add_parameter(opts.sort_memory_mb, "--sort-memory-mb")
+      .nargs(1)
+      .help(
+          "MiB a sort may hold in memory before it spills to temp files, 1024 "
+          "by default, 0 means unlimited.");
+
   if (!parser.parse_args(argc, argv)) {
     return 1;
   }
 
-  auto db_res = lumidb::create_database(lumidb::CreateDatabaseParams{});
+  if (opts.checkpoint_interval < 0 || opts.checkpoint_wal_mb < 0) {
+    std::cerr << "invalid checkpoint interval or log size" << std::endl;
+    return 1;
+  }
+
+  if (opts.sort_memory_mb < 0) {
+    std::cerr << "invalid sort memory: " << opts.sort_memory_mb << std::endl;
+    return 1;
+  }
+
+  if (opts.num_workers < 0) {
+    std::cerr << "invalid number of workers: " << opts.num_workers
+              << std::endl;
+    return 1;
+  }
+
+  auto db_res = lumidb::create_database(lumidb::CreateDatabaseParams{
+      .num_workers = static_cast<size_t>(opts.num_workers),
+      .sort_memory_budget = size_t(opts.sort_memory_mb) << 20,
+  });
   if (db_res.has_error()) {
     std::cout << db_res.unwrap_err().to_string() << std::endl;
     return 1;
   }
 
-  auto repl = lumidb::REPL(db_res.unwrap());
+  auto db = db_res.unwrap();
+
+  if (opts.snapshot.has_value() && std::filesystem::exists(*opts.snapshot)) {
+    auto load_res = db->execute({{{"load_snapshot",
+                                   {AnyValue::from_string(*opts.snapshot)}}}})
+                        .get();
+    if (load_res.has_error()) {
+      std::cerr << load_res.unwrap_err().to_string() << std::endl;
+      return 1;
+    }
+  }
+
+  if (opts.wal.has_value()) {
+    auto wal_options = parse_wal_sync(opts.wal_sync, {.path = *opts.wal});
+    if (wal_options.has_error()) {
+      std::cerr << wal_options.unwrap_err().to_string() << std::endl;
+      return 1;
+    }
+    auto wal_res = db->open_wal(wal_options.unwrap());
+    if (wal_res.has_error()) {
+      std::cerr << wal_res.unwrap_err().to_string() << std::endl;
+      return 1;
+    }
+  }
+
+  if (opts.snapshot.has_value()) {
+    auto checkpoint_res = db->start_checkpointer({
+        .path = *opts.snapshot,
+        .interval = std::chrono::seconds(opts.checkpoint_interval),
+        .wal_size = uint64_t(opts.checkpoint_wal_mb) << 20,
+    });
+    if (checkpoint_res.has_error()) {
+      std::cerr << checkpoint_res.unwrap_err().to_string() << std::endl;
+      return 1;
+    }
+  }
+
+  auto repl = lumidb::REPL(db);
 
   // run pre scripts
   for (auto &script : opts.in_scripts) {
@@ -1,5 +1,6 @@
 #include "lumidb/db.hh"
 
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <future>
@@ -8,13 +9,16 @@
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <set>
 #include <string>
 #include <vector>
 
 #include "fmt/core.h"
 #include "lumidb/executor.hh"
 #include "lumidb/function.hh"
+#include "lumidb/plan.hh"
 #include "lumidb/plugin.hh"
+#include "lumidb/storage.hh"
 #include "lumidb/table.hh"
 #include "lumidb/types.hh"
 #include "lumidb/utils.hh"
@@ -32,25 +36,94 @@ class StdLogger : public Logger {
 // Database in memory
 class MemoryDatabase : public lumidb::Database {
  public:
-  MemoryDatabase() = default;
+  explicit MemoryDatabase(const CreateDatabaseParams &params)
+      : sort_memory_budget_(params.sort_memory_budget),
+        executor_(params.num_workers) {}
 
   // table related methods
   virtual Result<TablePtr> create_table(
       const CreateTableParams &params) override {
-    std::lock_guard lock(mutex_);
-    auto [_, ok] = tables_.insert({params.table->name(), params.table});
-    if (!ok) {
-      return Error("table already exists: {}", params.table->name());
+    auto res = create_table_list({params});
+    if (res.has_error()) {
+      return res.unwrap_err();
     }
-
-    ++version_;
     return params.table;
   }
-  virtual Result<bool> drop_table(const std::string &name) override {
-    std::lock_guard lock(mutex_);
-    if (tables_.erase(name)) {
+  virtual Result<bool> create_table_list(
+      const std::vector<CreateTableParams> &params_list) override {
+    // encoded before the lock is taken, the tables may hold rows. A table
+    // loaded from a snapshot is logged as a reference to it.
+    std::vector<WalRecord> records;
+    if (wal_ != nullptr) {
+      for (auto &params : params_list) {
+        records.push_back(
+            params.source.has_value()
+                ? WalRecord::create_table(*params.table, *params.source)
+                : WalRecord::create_table(*params.table));
+      }
+    }
+
+    uint64_t lsn = 0;
+    {
+      std::lock_guard lock(mutex_);
+      std::set<std::string> names;
+      for (auto &params : params_list) {
+        auto &name = params.table->name();
+        if (tables_.find(name) != tables_.end() || !names.insert(name).second) {
+          return Error("table already exists: {}", name);
+        }
+      }
+      for (size_t i = 0; i < params_list.size(); i++) {
+        auto &table = params_list[i].table;
+        // logged under the lock, in order with the drops of the same name
+        if (!records.empty()) {
+          lsn = wal_->append(std::move(records[i]));
+          table->set_wal_lsn(lsn);
+        }
+        tables_.insert({table->name(), table});
+      }
+
       ++version_;
     }
+
+    // the records before lsn are committed with it
+    if (lsn != 0) {
+      return wal_->commit(lsn);
+    }
+    return true;
+  }
+  virtual Result<bool> drop_table(const std::string &name) override {
+    TablePtr table;
+    {
+      std::lock_guard lock(mutex_);
+      auto it = tables_.find(name);
+      if (it == tables_.end()) {
+        return true;
+      }
+      table = it->second;
+    }
+
+    // the writers holding the table from before the drop fail from here on,
+    // a running one is done first, so no change to it is logged after the
+    // drop, where replay would apply it to a table created after
+    table->mark_dropped();
+
+    uint64_t lsn = 0;
+    {
+      std::lock_guard lock(mutex_);
+      auto it = tables_.find(name);
+      if (it != tables_.end() && it->second == table) {
+        tables_.erase(it);
+        if (wal_ != nullptr) {
+          lsn = wal_->append(WalRecord::drop_table(name));
+        }
+        ++version_;
+      }
+    }
+
+    if (lsn != 0) {
+      return wal_->commit(lsn);
+    }
     return true;
   }
   virtual Result<TablePtr> get_table(const std::string &name) const override {
@@ -188,14 +261,95 @@ class MemoryDatabase : public lumidb::Database {
     auto promise = std::make_shared<std::promise<Result<TablePtr>>>();
     auto future = promise->get_future();
 
-    executor_.add_task([this, query, promise = std::move(promise)]() mutable {
-      auto res = _execute(query);
-      promise->set_value(res);
-    });
+    // a failed parallel task is rethrown here, it fails the query
+    auto task = [this, query, promise = std::move(promise)]() mutable {
+      try {
+        promise->set_value(_execute(query));
+      } catch (const std::exception &e) {
+        promise->set_value(Error("failed to execute query: {}", e.what()));
+      }
+    };
+
+    // a nested execution waiting on a queued task could block every worker,
+    // run it in place instead
+    if (executor_.in_worker()) {
+      task();
+    } else {
+      executor_.add_task(std::move(task));
+    }
 
     return future;
   }
 
+  virtual ThreadPool *thread_pool() override { return &executor_; }
+
+  virtual size_t sort_memory_budget() const override {
+    return sort_memory_budget_;
+  }
+
+  virtual WriteAheadLog *wal() override { return wal_.get(); }
+
+  virtual Result<bool> open_wal(const WalOptions &options) override {
+    if (wal_ != nullptr) {
+      return Error("wal already opened: {}", wal_->options().path);
+    }
+
+    auto last_lsn = replay_wal(options.path, *this);
+    if (last_lsn.has_error()) {
+      return last_lsn.unwrap_err();
+    }
+
+    // tables loaded from a snapshot may hold changes of a truncated log
+    uint64_t next_lsn = last_lsn.unwrap();
+    {
+      std::lock_guard lock(mutex_);
+      for (auto &it : tables_) {
+        next_lsn = std::max(next_lsn, it.second->wal_lsn());
+      }
+    }
+
+    auto wal = WriteAheadLog::open(options, next_lsn + 1);
+    if (wal.has_error()) {
+      return wal.unwrap_err();
+    }
+    wal_ = wal.unwrap();
+    return true;
+  }
+
+  virtual Checkpointer *checkpointer() override { return checkpointer_.get(); }
+
+  virtual Result<bool> start_checkpointer(
+      const CheckpointOptions &options) override {
+    if (checkpointer_ != nullptr) {
+      return Error("checkpointer already started: {}",
+                   checkpointer_->options().path);
+    }
+
+    auto checkpointer = Checkpointer::start(*this, options);
+    if (checkpointer.has_error()) {
+      return checkpointer.unwrap_err();
+    }
+    checkpointer_ = checkpointer.unwrap();
+    return true;
+  }
+
+  // the schema of the table a query chain reads, to plan it by
+  std::optional<TableSchema> _query_schema(const Query &query) const {
+    auto &functions = query.functions;
+    if (functions.empty() || functions[0].name != "query" ||
+        functions[0].arguments.size() != 1 ||
+        !functions[0].arguments[0].is_string()) {
+      return std::nullopt;
+    }
+
+    std::lock_guard lock(mutex_);
+    auto it = tables_.find(functions[0].arguments[0].as_string());
+    if (it == tables_.end()) {
+      return std::nullopt;
+    }
+    return it->second->schema();
+  }
+
   // execute query, return result as a table
   Result<TablePtr> _execute(const Query &query) {
     // resolve function and its arguments
@@ -205,10 +359,15 @@ class MemoryDatabase : public lumidb::Database {
     funcs.reserve(query.functions.size());
     args_list.reserve(query.functions.size());
 
+    // rewrite a query chain by its logical plan, see `QueryPlan`. The schema
+    // is copied, planning doesn't hold the lock.
+    auto schema = _query_schema(query);
+    auto planned = schema ? optimize_query(query, schema.value()) : query;
+
     // lock here
     {
       std::lock_guard lock(mutex_);
-      for (auto &func : query.functions) {
+      for (auto &func : planned.functions) {
         auto func_ptr_res = this->_get_function(func.name);
         if (func_ptr_res.has_error()) {
           return func_ptr_res.unwrap_err().add_message("failed to resolve");
@@ -350,15 +509,21 @@ class MemoryDatabase : public lumidb::Database {
   IdGenerator plugin_id_gen_;
   std::atomic_int64_t version_ = 0;
 
-  ThreadExecutor executor_;
-
   // !! data race here, we can't use std::atomic_shared_ptr until c++20
   LoggerPtr logger_ = std::make_shared<StdLogger>();
+
+  // destroyed after the executor, once no execution can log
+  WriteAheadLogPtr wal_;
+  // destroyed after the executor, once no execution waits for a checkpoint,
+  // and before the tables, the log and the logger it uses
+  CheckpointerPtr checkpointer_;
+  size_t sort_memory_budget_;
+  ThreadPool executor_;
 };
 
 Result<DatabasePtr> lumidb::create_database(
     const CreateDatabaseParams &params) {
-  auto db = std::make_shared<MemoryDatabase>();
+  auto db = std::make_shared<MemoryDatabase>(params);
 
   // register builtin functions
   auto buildin_funcs = get_builtin_functions();
@@ -0,0 +1,589 @@
+#include "lumidb/filter.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <numeric>
+#include <string>
+
+using namespace lumidb;
+
+// Stats
+
+namespace {
+
+// the order is recomputed after this many evaluations of a node
+constexpr size_t kReorderInterval = 16;
+// rows after which the measurements of a child are halved, so the order
+// follows changes of the data
+constexpr double kStatsWindow = 1 << 20;
+
+}  // namespace
+
+struct FilterExpr::Stats {
+  struct Child {
+    double rows = 0;
+    double passed = 0;
+    double nanos = 0;
+  };
+
+  std::mutex mutex;
+  // the order to evaluate the children in
+  std::vector<size_t> order;
+  std::vector<Child> children;
+  size_t num_evaluations = 0;
+
+  explicit Stats(size_t num_children)
+      : order(num_children), children(num_children) {
+    std::iota(order.begin(), order.end(), 0);
+  }
+
+  std::vector<size_t> current_order() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return order;
+  }
+
+  void record(size_t child, size_t rows, size_t passed, double nanos) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &stats = children[child];
+    stats.rows += rows;
+    stats.passed += passed;
+    stats.nanos += nanos;
+    if (stats.rows > kStatsWindow) {
+      stats.rows /= 2;
+      stats.passed /= 2;
+      stats.nanos /= 2;
+    }
+  }
+
+  // the children deciding a row at the least cost go first: for an and, a
+  // child decides the rows it fails, for an or the rows it passes. Children
+  // not measured yet go first to be measured.
+  void evaluated(bool is_and) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (++num_evaluations % kReorderInterval != 0) {
+      return;
+    }
+
+    std::vector<double> ranks(children.size());
+    for (size_t i = 0; i < children.size(); i++) {
+      auto &stats = children[i];
+      if (stats.rows == 0) {
+        continue;
+      }
+      double pass_rate = stats.passed / stats.rows;
+      double decide_rate = is_and ? 1 - pass_rate : pass_rate;
+      ranks[i] = stats.nanos / stats.rows / std::max(decide_rate, 1e-6);
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t l, size_t r) { return ranks[l] < ranks[r]; });
+  }
+};
+
+// FilterExpr
+
+FilterExpr::FilterExpr(Kind kind, std::vector<FilterExpr> children)
+    : kind_(kind), children_(std::move(children)) {
+  if (kind_ == Kind::And || kind_ == Kind::Or) {
+    stats_ = std::make_shared<Stats>(children_.size());
+  }
+}
+
+FilterExpr FilterExpr::predicate(size_t field_index, Predicate predicate) {
+  FilterExpr expr(Kind::Predicate, {});
+  expr.field_index_ = field_index;
+  expr.predicate_.emplace(std::move(predicate));
+  return expr;
+}
+
+static std::vector<FilterExpr> flatten(FilterExpr::Kind kind,
+                                       std::vector<FilterExpr> children) {
+  std::vector<FilterExpr> flat;
+  for (auto &child : children) {
+    if (child.kind() == kind) {
+      flat.insert(flat.end(), child.children().begin(),
+                  child.children().end());
+    } else {
+      flat.push_back(std::move(child));
+    }
+  }
+  return flat;
+}
+
+FilterExpr FilterExpr::all_of(std::vector<FilterExpr> children) {
+  auto flat = flatten(Kind::And, std::move(children));
+  if (flat.size() == 1) {
+    return std::move(flat[0]);
+  }
+  return FilterExpr(Kind::And, std::move(flat));
+}
+
+FilterExpr FilterExpr::any_of(std::vector<FilterExpr> children) {
+  auto flat = flatten(Kind::Or, std::move(children));
+  if (flat.size() == 1) {
+    return std::move(flat[0]);
+  }
+  return FilterExpr(Kind::Or, std::move(flat));
+}
+
+FilterExpr FilterExpr::negate(FilterExpr child) {
+  return FilterExpr(Kind::Not, {std::move(child)});
+}
+
+void FilterExpr::evaluate(const ColumnOf &column_of,
+                          const RowIndicesList &rows,
+                          SelectionBitmap &bitmap) const {
+  switch (kind_) {
+    case Kind::Predicate:
+      predicate_->evaluate(column_of(field_index_), rows, bitmap);
+      return;
+    case Kind::Not: {
+      children_[0].evaluate(column_of, rows, bitmap);
+      for (auto &word : bitmap) {
+        word = ~word;
+      }
+      if (rows.size() % 64 != 0) {
+        bitmap.back() &= (uint64_t(1) << (rows.size() % 64)) - 1;
+      }
+      return;
+    }
+    case Kind::And:
+    case Kind::Or: {
+      bitmap.assign((rows.size() + 63) / 64, 0);
+      RowIndicesList pending = rows;
+      std::vector<size_t> positions(rows.size());
+      std::iota(positions.begin(), positions.end(), 0);
+      evaluate_children(column_of, pending, &positions, bitmap);
+      // passed every child of an and
+      if (kind_ == Kind::And) {
+        for (auto pos : positions) {
+          bitmap[pos / 64] |= uint64_t(1) << (pos % 64);
+        }
+      }
+      return;
+    }
+  }
+}
+
+void FilterExpr::evaluate_children(const ColumnOf &column_of,
+                                   RowIndicesList &pending,
+                                   std::vector<size_t> *positions,
+                                   SelectionBitmap &bitmap) const {
+  bool is_and = kind_ == Kind::And;
+  SelectionBitmap passed_bits;
+  for (auto i : stats_->current_order()) {
+    if (pending.empty()) {
+      break;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    children_[i].evaluate(column_of, pending, passed_bits);
+    auto end = std::chrono::steady_clock::now();
+
+    // set the bits of the rows that passed a child of an or, then keep the
+    // rows that passed a child of an and, or failed a child of an or
+    size_t num_passed = 0, num_pending = 0;
+    for (size_t w = 0; w < passed_bits.size(); w++) {
+      uint64_t passed = passed_bits[w];
+      uint64_t kept = is_and ? passed : ~passed;
+      if (w == passed_bits.size() - 1 && pending.size() % 64 != 0) {
+        kept &= (uint64_t(1) << (pending.size() % 64)) - 1;
+      }
+      num_passed += __builtin_popcountll(passed);
+      for (passed = is_and ? 0 : passed; passed != 0; passed &= passed - 1) {
+        size_t pos = (*positions)[w * 64 + __builtin_ctzll(passed)];
+        bitmap[pos / 64] |= uint64_t(1) << (pos % 64);
+      }
+      for (; kept != 0; kept &= kept - 1) {
+        size_t j = w * 64 + __builtin_ctzll(kept);
+        pending[num_pending] = pending[j];
+        if (positions != nullptr) {
+          (*positions)[num_pending] = (*positions)[j];
+        }
+        num_pending++;
+      }
+    }
+    stats_->record(
+        i, pending.size(), num_passed,
+        std::chrono::duration<double, std::nano>(end - start).count());
+    pending.resize(num_pending);
+    if (positions != nullptr) {
+      positions->resize(num_pending);
+    }
+  }
+  stats_->evaluated(is_and);
+}
+
+RowIndicesList FilterExpr::select(const ColumnOf &column_of,
+                                  const RowIndicesList &rows) const {
+  SelectionBitmap bitmap;
+  // the rows an and leaves pending passed, in order
+  if (kind_ == Kind::And) {
+    RowIndicesList pending = rows;
+    evaluate_children(column_of, pending, nullptr, bitmap);
+    return pending;
+  }
+  evaluate(column_of, rows, bitmap);
+
+  RowIndicesList selected;
+  for (size_t i = 0; i < bitmap.size(); i++) {
+    for (uint64_t word = bitmap[i]; word != 0; word &= word - 1) {
+      selected.push_back(rows[i * 64 + __builtin_ctzll(word)]);
+    }
+  }
+  return selected;
+}
+
+TableView FilterExpr::filter(const TableView &view) const {
+  if (kind_ == Kind::Predicate) {
+    return predicate_->filter(view, field_index_);
+  }
+
+  RowIndicesList all;
+  auto rows = view.selection();
+  if (rows == nullptr) {
+    all.resize(view.num_rows());
+    std::iota(all.begin(), all.end(), 0);
+    rows = &all;
+  }
+  return view.with_rows(select(
+      [&](size_t field_index) -> const Column & {
+        return view.column(field_index);
+      },
+      *rows));
+}
+
+bool FilterExpr::may_match(const ColumnOf &column_of,
+                           size_t chunk_index) const {
+  auto may_match = [&](const FilterExpr &child) {
+    return child.may_match(column_of, chunk_index);
+  };
+  switch (kind_) {
+    case Kind::Predicate:
+      return predicate_->may_match(column_of(field_index_), chunk_index);
+    case Kind::And:
+      return std::all_of(children_.begin(), children_.end(), may_match);
+    case Kind::Or:
+      return std::any_of(children_.begin(), children_.end(), may_match);
+    case Kind::Not:
+      return true;
+  }
+  return true;
+}
+
+bool FilterExpr::may_match(const TableView &view) const {
+  return view.may_match([&](size_t chunk_index) {
+    return may_match(
+        [&](size_t field_index) -> const Column & {
+          return view.column(field_index);
+        },
+        chunk_index);
+  });
+}
+
+std::optional<RowIndicesList> FilterExpr::lookup(const Table &table) const {
+  return lookup(table, [](size_t field_index) { return field_index; });
+}
+
+std::optional<TableView> FilterExpr::lookup(const TableView &view) const {
+  if (!view.selects_all_rows()) {
+    return std::nullopt;
+  }
+  auto rows = lookup(*view.table(), [&](size_t field_index) {
+    return view.base_field_index(field_index);
+  });
+  if (!rows) {
+    return std::nullopt;
+  }
+  return view.with_rows(std::move(rows.value()));
+}
+
+std::optional<RowIndicesList> FilterExpr::lookup(
+    const Table &table,
+    const std::function<size_t(size_t)> &base_field) const {
+  switch (kind_) {
+    case Kind::Predicate:
+      return predicate_->lookup(table, base_field(field_index_));
+    case Kind::And:
+      for (auto &child : children_) {
+        if (auto rows = child.lookup(table, base_field); rows) {
+          return rows;
+        }
+      }
+      return std::nullopt;
+    case Kind::Or: {
+      if (children_.empty()) {
+        return RowIndicesList{};
+      }
+      RowIndicesList rows;
+      for (auto &child : children_) {
+        auto matched = child.lookup(table, base_field);
+        if (!matched) {
+          return std::nullopt;
+        }
+        rows.insert(rows.end(), matched->begin(), matched->end());
+      }
+      std::sort(rows.begin(), rows.end());
+      rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+      return rows;
+    }
+    case Kind::Not:
+      return std::nullopt;
+  }
+  return std::nullopt;
+}
+
+// parse
+
+namespace {
+
+class FilterParser {
+ public:
+  // with fields, the expression is only checked and the fields of its terms
+  // are collected, the predicates aren't compiled
+  FilterParser(std::string_view text, const TableSchema &schema,
+               std::vector<size_t> *fields = nullptr)
+      : text_(text), schema_(schema), fields_(fields) {}
+
+  Result<FilterExpr> parse() {
+    auto expr = parse_or();
+    if (expr.has_error()) {
+      return expr;
+    }
+    skip_spaces();
+    if (pos_ < text_.size()) {
+      return error("unexpected input");
+    }
+    return expr;
+  }
+
+ private:
+  Result<FilterExpr> parse_or() {
+    return parse_list("or", &FilterParser::parse_and, FilterExpr::any_of);
+  }
+
+  Result<FilterExpr> parse_and() {
+    return parse_list("and", &FilterParser::parse_not, FilterExpr::all_of);
+  }
+
+  // operands joined by the keyword
+  Result<FilterExpr> parse_list(
+      std::string_view keyword, Result<FilterExpr> (FilterParser::*operand)(),
+      FilterExpr (*join)(std::vector<FilterExpr>)) {
+    std::vector<FilterExpr> operands;
+    do {
+      auto expr = (this->*operand)();
+      if (expr.has_error()) {
+        return expr;
+      }
+      operands.push_back(expr.unwrap());
+    } while (accept_word(keyword));
+
+    if (operands.size() == 1) {
+      return std::move(operands[0]);
+    }
+    return join(std::move(operands));
+  }
+
+  Result<FilterExpr> parse_not() {
+    if (accept_word("not")) {
+      auto expr = parse_not();
+      if (expr.has_error()) {
+        return expr;
+      }
+      return FilterExpr::negate(expr.unwrap());
+    }
+
+    if (accept("(")) {
+      auto expr = parse_or();
+      if (expr.has_error()) {
+        return expr;
+      }
+      if (!accept(")")) {
+        return error("expected ')'");
+      }
+      return expr;
+    }
+
+    return parse_term();
+  }
+
+  Result<FilterExpr> parse_term() {
+    auto field_name = parse_field();
+    if (field_name.empty()) {
+      return error("expected a field");
+    }
+    auto field_index = schema_.get_field_index(field_name);
+    if (field_index.has_error()) {
+      return field_index.unwrap_err();
+    }
+
+    std::string op;
+    ValueList values;
+    if (accept_word("between")) {
+      op = "between";
+      if (!parse_value(values) || !accept_word("and") ||
+          !parse_value(values)) {
+        return error("expected '<low> and <high>' after between");
+      }
+    } else if (accept_word("in")) {
+      op = "in";
+      if (!accept("(")) {
+        return error("expected '(' after in");
+      }
+      do {
+        if (!parse_value(values)) {
+          return error("expected a value");
+        }
+      } while (accept(","));
+      if (!accept(")")) {
+        return error("expected ')'");
+      }
+    } else if (accept_word("is_null")) {
+      op = "is_null";
+    } else if (accept_word("not_null")) {
+      op = "not_null";
+    } else {
+      for (auto candidate : {"<=", ">=", "!=", "=", "<", ">"}) {
+        if (accept(candidate)) {
+          op = candidate;
+          break;
+        }
+      }
+      if (op.empty()) {
+        return error("expected an operator");
+      }
+      if (!parse_value(values)) {
+        return error("expected a value");
+      }
+    }
+
+    size_t index = field_index.unwrap();
+    if (fields_ != nullptr) {
+      if (auto res = Predicate::check(op, values.size()); res.has_error()) {
+        return res.unwrap_err();
+      }
+      fields_->push_back(index);
+      // stands for the term in the expression, which is thrown away
+      return FilterExpr::all_of({});
+    }
+    auto predicate = Predicate::parse(schema_.get_field(index).type, op,
+                                      std::move(values));
+    if (predicate.has_error()) {
+      return predicate.unwrap_err();
+    }
+    return FilterExpr::predicate(index, predicate.unwrap());
+  }
+
+  // a word or a name quoted in backticks, empty if there is none
+  std::string parse_field() {
+    skip_spaces();
+    if (accept("`")) {
+      size_t end = text_.find('`', pos_);
+      if (end == std::string_view::npos) {
+        return "";
+      }
+      std::string name(text_.substr(pos_, end - pos_));
+      pos_ = end + 1;
+      return name;
+    }
+    return std::string(next_word());
+  }
+
+  // append a number, a quoted string or null to values
+  bool parse_value(ValueList &values) {
+    skip_spaces();
+    if (pos_ < text_.size() && (text_[pos_] == '"' || text_[pos_] == '\'')) {
+      char quote = text_[pos_];
+      size_t end = text_.find(quote, pos_ + 1);
+      if (end == std::string_view::npos) {
+        return false;
+      }
+      values.push_back(
+          AnyValue::from_string(text_.substr(pos_ + 1, end - pos_ - 1)));
+      pos_ = end + 1;
+      return true;
+    }
+
+    auto word = next_word();
+    if (word == "null") {
+      values.push_back(AnyValue::from_null());
+      return true;
+    }
+    std::string number(word);
+    char *end = nullptr;
+    float value = std::strtof(number.c_str(), &end);
+    if (number.empty() || end != number.c_str() + number.size()) {
+      return false;
+    }
+    values.push_back(AnyValue::from_float(value));
+    return true;
+  }
+
+  // the next run of characters that aren't spaces, quotes, parentheses,
+  // commas or operators, consumed
+  std::string_view next_word() {
+    skip_spaces();
+    size_t begin = pos_;
+    while (pos_ < text_.size() &&
+           std::string_view(" \t\r\n()<>=!,'\"`").find(text_[pos_]) ==
+               std::string_view::npos) {
+      pos_++;
+    }
+    return text_.substr(begin, pos_ - begin);
+  }
+
+  bool accept_word(std::string_view word) {
+    size_t saved = pos_;
+    if (next_word() == word) {
+      return true;
+    }
+    pos_ = saved;
+    return false;
+  }
+
+  bool accept(std::string_view token) {
+    skip_spaces();
+    if (text_.substr(pos_, token.size()) == token) {
+      pos_ += token.size();
+      return true;
+    }
+    return false;
+  }
+
+  void skip_spaces() {
+    while (pos_ < text_.size() &&
+           std::string_view(" \t\r\n").find(text_[pos_]) !=
+               std::string_view::npos) {
+      pos_++;
+    }
+  }
+
+  Error error(std::string_view message) const {
+    return Error("{} at offset {} of filter: {}", message, pos_, text_);
+  }
+
+ private:
+  std::string_view text_;
+  const TableSchema &schema_;
+  std::vector<size_t> *fields_;
+  size_t pos_ = 0;
+};
+
+}  // namespace
+
+Result<FilterExpr> FilterExpr::parse(std::string_view text,
+                                     const TableSchema &schema) {
+  return FilterParser(text, schema).parse();
+}
+
+Result<std::vector<size_t>> FilterExpr::fields_of(std::string_view text,
+                                                  const TableSchema &schema) {
+  std::vector<size_t> fields;
+  auto res = FilterParser(text, schema, &fields).parse();
+  if (res.has_error()) {
+    return res.unwrap_err();
+  }
+  return fields;
+}
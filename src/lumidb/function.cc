@@ -2,10 +2,13 @@
 
 #include <algorithm>
 #include <any>
+#include <chrono>
 #include <cstddef>
+#include <ctime>
 #include <fstream>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <set>
 #include <string>
@@ -16,7 +19,9 @@
 #include "fmt/core.h"
 #include "fmt/ostream.h"
 #include "lumidb/db.hh"
+#include "lumidb/pipeline.hh"
 #include "lumidb/plugin.hh"
+#include "lumidb/storage.hh"
 #include "lumidb/table.hh"
 #include "lumidb/types.hh"
 #include "lumidb/utils.hh"
@@ -76,7 +81,7 @@ class DescTableFunction : public helper::BaseRootFunction {
     if (table_res.has_error()) {
       return table_res.unwrap_err();
     }
-    auto table = table_res.unwrap();
+    auto table = table_res.unwrap()->snapshot();
 
     TableSchema out_schema;
     for (auto &field : table->schema().fields()) {
@@ -378,6 +383,127 @@ class AddFieldFunction : public helper::BaseLeafFunction {
   }
 };
 
+// Write-ahead log
+
+// append the record of a change at the end of its table writer, so the
+// records of a table are in the order of its versions
+static uint64_t log_change(WriteAheadLog &wal, Table &table,
+                           WalRecord &&record) {
+  uint64_t lsn = wal.append(std::move(record));
+  table.set_wal_lsn(lsn);
+  return lsn;
+}
+
+// wait until the logged change of a published version is durable
+static Result<bool> commit_change(WriteAheadLog *wal, uint64_t lsn) {
+  if (wal == nullptr || lsn == 0) {
+    return true;
+  }
+  return wal->commit(lsn);
+}
+
+// Index
+
+class CreateIndexFunction : public helper::BaseRootFunction {
+ public:
+  CreateIndexFunction() : BaseFunction("create_index") {
+    set_signature({AnyType::from_string(), AnyType::from_string()});
+    add_description(
+        "create_index(table, field) create a hash index on the field, used by "
+        "where(field, '=', value)");
+  }
+
+  Result<bool> execute_root(RootFunctionExecuteContext &ctx) override {
+    return true;
+  }
+
+  Result<bool> finalize_root(RootFunctionFinalizeContext &ctx) override {
+    auto table_name = ctx.args[0].as_string();
+    auto field_name = ctx.args[1].as_string();
+
+    auto table_res = ctx.db->get_table(table_name);
+    if (table_res.has_error()) {
+      return table_res.unwrap_err();
+    }
+    auto table = table_res.unwrap();
+
+    auto field_idx_res = table->schema().get_field_index(field_name);
+    if (field_idx_res.has_error()) {
+      return field_idx_res.unwrap_err();
+    }
+    size_t field_idx = field_idx_res.unwrap();
+
+    auto wal = ctx.db->wal();
+    uint64_t lsn = 0;
+    auto res = table->modify([&](Table &t) -> Result<bool> {
+      auto res = t.create_index(field_idx);
+      if (res.is_ok() && wal != nullptr) {
+        lsn = log_change(*wal, t, WalRecord::create_index(t, field_idx));
+      }
+      return res;
+    });
+    if (res.has_error()) {
+      return res.unwrap_err();
+    }
+
+    return commit_change(wal, lsn);
+  }
+};
+
+class CreateOrderedIndexFunction : public helper::BaseRootFunction {
+ public:
+  CreateOrderedIndexFunction() : BaseFunction("create_ordered_index") {
+    set_signature_variadic(AnyType::from_string());
+    add_description(
+        "create_ordered_index(table, field1, field2, ...) create an ordered "
+        "index on the fields, used by where(field1, '<' or '>', value) and "
+        "sort/sort_desc on exactly these fields");
+  }
+
+  Result<bool> execute_root(RootFunctionExecuteContext &ctx) override {
+    if (ctx.args.size() < 2) {
+      return Error("create_ordered_index needs a table and at least one field");
+    }
+    return true;
+  }
+
+  Result<bool> finalize_root(RootFunctionFinalizeContext &ctx) override {
+    auto table_name = ctx.args[0].as_string();
+
+    auto table_res = ctx.db->get_table(table_name);
+    if (table_res.has_error()) {
+      return table_res.unwrap_err();
+    }
+    auto table = table_res.unwrap();
+
+    std::vector<size_t> field_indices;
+    for (size_t i = 1; i < ctx.args.size(); i++) {
+      auto field_idx_res =
+          table->schema().get_field_index(ctx.args[i].as_string());
+      if (field_idx_res.has_error()) {
+        return field_idx_res.unwrap_err();
+      }
+      field_indices.push_back(field_idx_res.unwrap());
+    }
+
+    auto wal = ctx.db->wal();
+    uint64_t lsn = 0;
+    auto res = table->modify([&](Table &t) -> Result<bool> {
+      auto res = t.create_ordered_index(field_indices);
+      if (res.is_ok() && wal != nullptr) {
+        lsn = log_change(*wal, t,
+                         WalRecord::create_ordered_index(t, field_indices));
+      }
+      return res;
+    });
+    if (res.has_error()) {
+      return res.unwrap_err();
+    }
+
+    return commit_change(wal, lsn);
+  }
+};
+
 // Insert
 
 class InsertRootFunction : public helper::BaseRootFunction {
@@ -405,22 +531,97 @@ class InsertRootFunction : public helper::BaseRootFunction {
   }
 
   Result<bool> finalize_root(RootFunctionFinalizeContext &ctx) override {
-    // auto data = std::any_cast()
-
     auto data_res = any_cast_ptr<datas::InsertRootData>(ctx.user_data);
     if (!data_res.has_value()) {
       return Error("invalid user data");
     }
 
     auto data = data_res.value();
+    auto pool = ctx.db->thread_pool();
+    auto wal = ctx.db->wal();
+    uint64_t lsn = 0;
 
-    // get table
-    auto res = data->table->add_row_list(data->rows);
-    if (res.has_error()) {
-      return res.unwrap_err();
+    auto log_rows = [&](Table &table, size_t first_row) {
+      if (wal != nullptr && table.num_rows() > first_row) {
+        lsn = log_change(*wal, table, WalRecord::insert(table, first_row));
+      }
+    };
+
+    if (!data->commit_batches) {
+      // every batch is logged as it is appended, as a part of one insert
+      // replayed at once, so no record holds the rows of the whole insert
+      auto res = data->table->modify([&](Table &table) -> Result<bool> {
+        auto &sources = data->sources;
+        uint64_t part = 0;
+        for (size_t i = 0; i < sources.size(); i++) {
+          auto &source = sources[i];
+          do {
+            size_t first_row = table.num_rows();
+            auto res = append_source(table, source, pool);
+            if (res.has_error()) {
+              return res;
+            }
+            if (wal != nullptr) {
+              bool last = i + 1 == sources.size() &&
+                          (!source.csv.has_value() || source.csv->done());
+              lsn = log_change(
+                  *wal, table,
+                  WalRecord::insert_part(table, first_row, part++, last));
+            }
+          } while (source.csv.has_value() && !source.csv->done());
+        }
+        return true;
+      });
+      if (res.has_error()) {
+        return res.unwrap_err();
+      }
+
+      ctx.result = res.unwrap();
+      return commit_change(wal, lsn);
+    }
+
+    // a failed batch leaves the versions published before it
+    ctx.result = data->table->snapshot();
+    for (auto &source : data->sources) {
+      do {
+        auto res = data->table->modify([&](Table &table) -> Result<bool> {
+          size_t first_row = table.num_rows();
+          auto res = append_source(table, source, pool);
+          if (res.is_ok()) {
+            log_rows(table, first_row);
+          }
+          return res;
+        });
+        if (res.has_error()) {
+          // the batches published before it are logged all the same
+          if (auto commit = commit_change(wal, lsn); commit.has_error()) {
+            return Error("{}, and failed to commit the log: {}",
+                         res.unwrap_err().to_string(),
+                         commit.unwrap_err().to_string());
+          }
+          return res.unwrap_err();
+        }
+        ctx.result = res.unwrap();
+      } while (source.csv.has_value() && !source.csv->done());
+    }
+    return commit_change(wal, lsn);
+  }
+
+ private:
+  // append the staged rows, or the next csv batch. The consumed part of a
+  // csv file is released as it is now held by the columns.
+  static Result<bool> append_source(Table &table,
+                                    datas::InsertRootData::Source &source,
+                                    ThreadPool *pool) {
+    if (!source.csv.has_value()) {
+      return table.add_table(*source.rows);
     }
 
-    ctx.result = data->table;
+    auto res = source.csv->read_batch(table, pool);
+    if (res.has_error()) {
+      return res;
+    }
+    source.file->release(source.csv->offset());
     return true;
   }
 };
@@ -447,7 +648,15 @@ class AddRowFunction : public helper::BaseLeafFunction {
       return Error("invalid row");
     }
 
-    data->rows.emplace_back(ctx.args);
+    auto &sources = data->sources;
+    if (sources.empty() || sources.back().rows == nullptr) {
+      sources.push_back({.rows = Table::create_ptr("", table->schema())});
+    }
+
+    auto res = sources.back().rows->add_row(ctx.args);
+    if (res.has_error()) {
+      return res.unwrap_err();
+    }
 
     return true;
   }
@@ -456,9 +665,12 @@ class AddRowFunction : public helper::BaseLeafFunction {
 class LoadCSVFunction : public helper::BaseLeafFunction {
  public:
   LoadCSVFunction()
-      : BaseFunction("load_csv",
-                     FunctionSignature::make({AnyType::from_string()})) {
-    add_description("load_csv from file");
+      : BaseFunction("load_csv", FunctionSignature::make_variadic(
+                                     {AnyType::from_string()})) {
+    add_description(
+        "load_csv(<path>, [commit]), load_csv from file, commit is `atomic` "
+        "to publish every row at once (default) or `batch` to publish the "
+        "rows batch by batch");
   }
 
   Result<bool> execute_leaf(LeafFunctionExecuteContext &ctx) override {
@@ -470,57 +682,33 @@ class LoadCSVFunction : public helper::BaseLeafFunction {
 
     auto table = data->table;
 
-    std::ifstream ifs(ctx.args[0].as_string());
-    if (!ifs) {
-      return Error("failed to open csv file: {}", ctx.args[0].as_string());
+    if (ctx.args.size() < 1 || ctx.args.size() > 2) {
+      return Error("load_csv requires 1 or 2 arguments");
     }
 
-    auto csv_res = parse_csv(ifs);
-    if (!csv_res) {
-      return csv_res.unwrap_err();
-    }
-
-    auto field_indices_res =
-        table->schema().get_field_indices(csv_res->headers);
-    if (!field_indices_res) {
-      return field_indices_res.unwrap_err().add_message("invalid csv file");
+    if (ctx.args.size() == 2) {
+      auto commit = ctx.args[1].as_string();
+      if (commit == "batch") {
+        data->commit_batches = true;
+      } else if (commit != "atomic") {
+        return Error("invalid commit: {}, expected atomic or batch", commit);
+      }
     }
 
-    auto field_indices = field_indices_res.unwrap();
-    if (field_indices.size() != table->schema().fields_size()) {
-      return Error("invalid csv file, field size mismatch");
+    auto file_res = MappedFile::open(ctx.args[0].as_string());
+    if (file_res.has_error()) {
+      return Error("failed to open csv file: {}", ctx.args[0].as_string());
     }
+    auto file = file_res.unwrap();
 
-    auto &fields = table->schema().fields();
-
-    std::vector<ValueList> rows;
-
-    // start to insert
-    for (size_t csv_row_idx = 0; csv_row_idx < csv_res->rows.size();
-         csv_row_idx++) {
-      ValueList row(field_indices.size());
-
-      auto &csv_row = csv_res->rows[csv_row_idx];
-
-      for (size_t i = 0; i < field_indices.size(); i++) {
-        size_t field_index = field_indices[i];
-        // parse value from string
-        auto res = AnyValue::parse_from_string(fields[i].type, csv_row[i]);
-        if (res.has_error()) {
-          return res.unwrap_err().add_message(
-              "failed to parse value from csv file, row_no={}, col_no={}, "
-              "header={}, value={}",
-              csv_row_idx, i, csv_res->headers[i], csv_row[i]);
-        }
-
-        row[field_index] = res.unwrap();
-      }
-
-      rows.emplace_back(std::move(row));
+    // only the header is read here, the rows are parsed straight into the
+    // columns of the table on finalize, batch by batch
+    auto csv_res = CSVReader::open(file->data(), table->schema());
+    if (csv_res.has_error()) {
+      return csv_res.unwrap_err();
     }
 
-    data->rows.insert(data->rows.end(), rows.begin(), rows.end());
-
+    data->sources.push_back({.file = file, .csv = csv_res.unwrap()});
     return true;
   }
 };
@@ -537,28 +725,16 @@ class QueryRootFunction : public helper::BaseRootFunction {
   Result<bool> execute_root(RootFunctionExecuteContext &ctx) override {
     auto table_name = ctx.args[0].as_string();
 
-    auto data = std::make_shared<datas::QueryRootData>();
-
     auto table_res = ctx.db->get_table(table_name);
     if (table_res.has_error()) {
       return table_res.unwrap_err();
     }
 
-    data->table = table_res.unwrap();
-    ctx.user_data = data;
-
-    return true;
+    return helper::execute_query_root(ctx, table_res.unwrap()->snapshot());
   }
 
   Result<bool> finalize_root(RootFunctionFinalizeContext &ctx) override {
-    auto data_res = any_cast_ptr<datas::QueryRootData>(ctx.user_data);
-    if (!data_res.has_value()) {
-      return Error("invalid user data");
-    }
-    auto data = data_res.value();
-
-    ctx.result = data->table;
-    return true;
+    return helper::finalize_query_root(ctx);
   }
 };
 
@@ -576,16 +752,17 @@ class SelectFunction : public helper::BaseLeafFunction {
       return Error("invalid root func: {}", ctx.root_func->name());
     }
     auto data = data_res.value();
-    auto table = data->table;
 
     auto field_names = value_list_to_strings(ctx.args);
 
-    auto select_table_res = table->select(field_names);
-    if (select_table_res.has_error()) {
-      return select_table_res.unwrap_err();
+    auto field_indices_res =
+        data->pipeline->schema().get_field_indices(field_names);
+    if (field_indices_res.has_error()) {
+      return field_indices_res.unwrap_err();
     }
 
-    data->table = make_table_ptr(select_table_res.unwrap());
+    data->pipeline = std::make_shared<ProjectOperator>(
+        data->pipeline, field_indices_res.unwrap());
 
     return true;
   }
@@ -605,21 +782,44 @@ class LimitFunction : public helper::BaseLeafFunction {
       return Error("invalid root func: {}", ctx.root_func->name());
     }
     auto data = data_res.value();
-    auto table = data->table;
 
     auto limit = ctx.args[0].as_float();
 
-    auto new_table_res = table->limit(0, limit);
-    if (new_table_res.has_error()) {
-      return new_table_res.unwrap_err();
+    // only the first rows of a sort are needed
+    if (auto sort = std::dynamic_pointer_cast<SortOperator>(data->pipeline)) {
+      data->pipeline = std::make_shared<TopKOperator>(
+          sort->child(), sort->field_indices(), sort->asc(), limit);
+      return true;
     }
 
-    data->table = make_table_ptr(new_table_res.unwrap());
+    data->pipeline = std::make_shared<LimitOperator>(data->pipeline, limit);
 
     return true;
   }
 };
 
+static Result<bool> add_sort_operator(datas::QueryRootData &data,
+                                      const ValueList &args, bool asc,
+                                      Database &db) {
+  if (args.size() == 0) {
+    return Error("sort fields can not be empty");
+  }
+
+  auto field_names = value_list_to_strings(args);
+
+  auto field_indices_res =
+      data.pipeline->schema().get_field_indices(field_names);
+  if (field_indices_res.has_error()) {
+    return field_indices_res.unwrap_err();
+  }
+
+  data.pipeline = std::make_shared<SortOperator>(
+      data.pipeline, field_indices_res.unwrap(), asc, db.thread_pool(),
+      db.sort_memory_budget());
+
+  return true;
+}
+
 class SortFunction : public helper::BaseLeafFunction {
  public:
   SortFunction() : BaseFunction("sort") {
@@ -633,24 +833,8 @@ class SortFunction : public helper::BaseLeafFunction {
     if (!data_res.has_value()) {
       return Error("invalid root func: {}", ctx.root_func->name());
     }
-    auto data = data_res.value();
-    auto table = data->table;
-
-    if (ctx.args.size() == 0) {
-      return Error("sort fields can not be empty");
-    }
-
-    auto field_names = value_list_to_strings(ctx.args);
 
-    auto new_table_res = table->sort(field_names, true);
-
-    if (new_table_res.has_error()) {
-      return new_table_res.unwrap_err();
-    }
-
-    data->table = make_table_ptr(new_table_res.unwrap());
-
-    return true;
+    return add_sort_operator(*data_res.value(), ctx.args, true, *ctx.db);
   }
 };
 
@@ -667,175 +851,216 @@ class SortDescFunction : public helper::BaseLeafFunction {
     if (!data_res.has_value()) {
       return Error("invalid root func: {}", ctx.root_func->name());
     }
-    auto data = data_res.value();
-    auto table = data->table;
 
-    if (ctx.args.size() == 0) {
-      return Error("sort fields can not be empty");
-    }
-
-    auto field_names = value_list_to_strings(ctx.args);
-
-    auto new_table_res = table->sort(field_names, false);
-
-    if (new_table_res.has_error()) {
-      return new_table_res.unwrap_err();
-    }
-
-    data->table = make_table_ptr(new_table_res.unwrap());
-
-    return true;
+    return add_sort_operator(*data_res.value(), ctx.args, false, *ctx.db);
   }
 };
 
 class WhereFunction : public helper::BaseLeafFunction {
  public:
   WhereFunction() : BaseFunction("where") {
-    set_signature(
-        {AnyType::from_string(), AnyType::from_string(), AnyType::from_any()});
+    set_signature_variadic(AnyType::from_any());
 
     add_description(
-        "where filter row, (<field>, <op>, <value>), support ('<', '=', '>') "
-        "op currently");
+        "where filter row, (<field>, <op>, <value>) with op one of '=', '!=', "
+        "'<', '<=', '>', '>=', (<field>, 'between', <low>, <high>), (<field>, "
+        "'in', <value>...), (<field>, 'is_null'), (<field>, 'not_null'), or "
+        "(<expr>) with terms like these joined by 'and', 'or' and 'not', e.g. "
+        "'a > 1 or not (b in (1, 2) and c between 3 and 4)'");
   }
 
   Result<bool> execute_leaf(LeafFunctionExecuteContext &ctx) override {
     // parse args
-    auto field_name = ctx.args[0].as_string();
-    auto op = ctx.args[1].as_string();
-    auto value = ctx.args[2];
-
-    auto comparator_res = AnyValue::get_comparator(op);
-    if (comparator_res.has_error()) {
-      return comparator_res.unwrap_err();
+    if (ctx.args.empty() || !ctx.args[0].is_string() ||
+        (ctx.args.size() > 1 && !ctx.args[1].is_string())) {
+      return Error("expects a filter expression, or a field name and an "
+                   "operator");
     }
 
-    auto comparator = comparator_res.unwrap();
-
     // root == Query
     if (auto data_res = any_cast_ptr<datas::QueryRootData>(ctx.user_data);
         data_res) {
       auto data = data_res.value();
-      auto table = data->table;
-
-      auto field_idx_res = table->schema().get_field_index(field_name);
-      if (field_idx_res.has_error()) {
-        return field_idx_res.unwrap_err();
+      auto expr_res = parse_filter(ctx.args, data->pipeline->schema());
+      if (expr_res.has_error()) {
+        return expr_res.unwrap_err();
       }
-
-      auto new_table_res = table->filter([&](const auto &row, auto row_idx) {
-        auto field_value = row[field_idx_res.unwrap()];
-        return comparator(field_value, value);
-      });
-
-      if (new_table_res.has_error()) {
-        return new_table_res.unwrap_err();
+      auto expr = expr_res.unwrap();
+
+      // filter on indexed fields of the whole table, look the rows up
+      if (auto scan = std::dynamic_pointer_cast<ScanOperator>(data->pipeline);
+          scan) {
+        if (auto rows = expr.lookup(scan->source()); rows) {
+          data->pipeline = std::make_shared<ScanOperator>(rows.value());
+          if (expr.kind() == FilterExpr::Kind::Predicate) {
+            return true;
+          }
+        }
       }
 
-      data->table = make_table_ptr(new_table_res.unwrap());
+      // consecutive filters are the conjuncts of one expression, evaluated
+      // in the order that turns out cheapest
+      auto child = data->pipeline;
+      if (auto filter = std::dynamic_pointer_cast<FilterOperator>(child)) {
+        expr = FilterExpr::all_of({filter->expr(), std::move(expr)});
+        child = filter->child();
+      }
+      data->pipeline = std::make_shared<FilterOperator>(
+          child, std::move(expr), ctx.db->thread_pool());
       return true;
     }
 
-    // root == Update
+    // root == Update or Delete
+    datas::Filters *filters = nullptr;
+    TablePtr table;
     if (auto data_res = any_cast_ptr<datas::UpdateRootData>(ctx.user_data);
         data_res) {
-      auto data = data_res.value();
-      auto table = data->table;
-
-      auto field_idx_res = table->schema().get_field_index(field_name);
-      if (field_idx_res.has_error()) {
-        return field_idx_res.unwrap_err();
-      }
-
-      size_t field_idx = field_idx_res.unwrap();
-
-      data->filters.add_and_filter([field_idx,
-                                    comparator = std::move(comparator),
-                                    value](const auto &row, auto row_idx) {
-        auto field_value = row[field_idx];
-        return comparator(field_value, value);
-      });
-
+      filters = &data_res.value()->filters;
+      table = data_res.value()->table;
+    } else if (auto data_res =
+                   any_cast_ptr<datas::DeleteRootData>(ctx.user_data);
+               data_res) {
+      filters = &data_res.value()->filters;
+      table = data_res.value()->table;
+    } else {
       return true;
     }
 
-    // root == Delete
-    if (auto data_res = any_cast_ptr<datas::DeleteRootData>(ctx.user_data);
-        data_res) {
-      auto data = data_res.value();
-      auto table = data->table;
-
-      auto field_idx_res = table->schema().get_field_index(field_name);
-      if (field_idx_res.has_error()) {
-        return field_idx_res.unwrap_err();
-      }
+    auto expr_res = parse_filter(ctx.args, table->schema());
+    if (expr_res.has_error()) {
+      return expr_res.unwrap_err();
+    }
+    filters->add_expr_filter(expr_res.unwrap());
 
-      size_t field_idx = field_idx_res.unwrap();
+    return true;
+  }
 
-      data->filters.add_and_filter([field_idx,
-                                    comparator = std::move(comparator),
-                                    value](const auto &row, auto row_idx) {
-        auto field_value = row[field_idx];
-        return comparator(field_value, value);
-      });
+ private:
+  // an expression, or a predicate on a field
+  static Result<FilterExpr> parse_filter(const ValueList &args,
+                                         const TableSchema &schema) {
+    if (args.size() == 1) {
+      return FilterExpr::parse(args[0].as_string_view(), schema);
+    }
 
-      return true;
+    auto field_idx_res = schema.get_field_index(args[0].as_string());
+    if (field_idx_res.has_error()) {
+      return field_idx_res.unwrap_err();
     }
+    size_t field_idx = field_idx_res.unwrap();
 
-    return true;
+    auto predicate_res =
+        Predicate::parse(schema.get_field(field_idx).type,
+                         args[1].as_string_view(),
+                         ValueList(args.begin() + 2, args.end()));
+    if (predicate_res.has_error()) {
+      return predicate_res.unwrap_err();
+    }
+    return FilterExpr::predicate(field_idx, predicate_res.unwrap());
   }
 };
 
-Result<TablePtr> handle_aggregation_function(
-    std::string agg_func_name, TablePtr src_table,
-    const std::vector<std::string> &field_names,
-    function<void(AnyValue &acc, AnyValue elem)> agg_op,
-    function<void(vector<AnyValue> &agg_results, TablePtr src_table,
-                  const vector<size_t> &field_indices)>
-        result_transformer = nullptr) {
-  auto field_indices_res = src_table->schema().get_field_indices(field_names);
-  if (field_indices_res.has_error()) {
-    return field_indices_res.unwrap_err();
+static AnyType nullable_type(const AnyType &type) {
+  if (type.is_float() || type.is_null_float()) {
+    return AnyType::from_null_float();
+  }
+  if (type.is_string() || type.is_null_string()) {
+    return AnyType::from_null_string();
   }
-  auto field_indices = field_indices_res.unwrap();
+  return AnyType::from_any();
+}
 
-  vector<AnyValue> agg_results(field_indices.size());
+// aggregate functions right after `group_by` add their fields to its groups,
+// nullptr if the pipeline is not grouped
+static std::shared_ptr<GroupByOperator> grouping(datas::QueryRootData &data) {
+  auto group = std::dynamic_pointer_cast<GroupByOperator>(data.pipeline);
+  if (group == nullptr || group->key_indices().empty()) {
+    return nullptr;
+  }
+  return group;
+}
+
+// schema the fields of an aggregate function are looked up in
+static const TableSchema &aggregate_input_schema(datas::QueryRootData &data) {
+  if (auto group = grouping(data); group != nullptr) {
+    return group->child()->schema();
+  }
+  return data.pipeline->schema();
+}
 
-  for (auto row_idx = 0; row_idx < src_table->num_rows(); row_idx++) {
-    auto row = src_table->get_row(row_idx);
-    for (auto i = 0; i < field_indices.size(); i++) {
-      auto field_idx = field_indices[i];
-      auto field_value = row[field_idx];
-      agg_op(agg_results[i], field_value);
+static Result<bool> check_float_fields(const TableSchema &schema,
+                                       const std::vector<size_t> &indices) {
+  for (auto field_idx : indices) {
+    auto &field = schema.get_field(field_idx);
+    if (!field.type.is_null_float() && !field.type.is_float()) {
+      return Error("invalid field type: {}, name: {}", field.type.name(),
+                   field.name);
     }
   }
+  return true;
+}
+
+static Result<bool> add_aggregate_operator(LeafFunctionExecuteContext &ctx,
+                                           datas::QueryRootData &data,
+                                           GroupAggregate::Kind kind,
+                                           AggregateSpec spec) {
+  auto field_names = value_list_to_strings(ctx.args);
 
-  if (result_transformer != nullptr) {
-    result_transformer(agg_results, src_table, field_indices);
+  auto &schema = aggregate_input_schema(data);
+  auto field_indices_res = schema.get_field_indices(field_names);
+  if (field_indices_res.has_error()) {
+    return field_indices_res.unwrap_err();
   }
 
-  TableSchema out_schema;
-  for (size_t i = 0; i < field_names.size(); i++) {
-    auto name = fmt::format("{}({})", agg_func_name, field_names[i]);
+  auto &field_indices = field_indices_res.unwrap();
+  auto add_aggregates = [&](GroupByOperator &group) -> Result<bool> {
+    for (auto field_index : field_indices) {
+      auto res = group.add_aggregate(GroupAggregate{
+          .kind = kind,
+          .field_index = field_index,
+          .result_type = spec.result_type(schema.get_field(field_index).type),
+      });
+      if (res.has_error()) {
+        return res.unwrap_err();
+      }
+    }
+    return true;
+  };
 
-    out_schema.add_field(name, agg_results[i].type());
+  if (auto group = grouping(data); group != nullptr) {
+    return add_aggregates(*group);
   }
 
-  auto out_table = Table::create_ptr("", out_schema);
-  auto res1 = out_table->add_row(agg_results);
-  if (res1.has_error()) {
-    return res1.unwrap_err();
+  // sum, avg, min and max of distinct float fields are folded by a single
+  // group, straight from the column buffers with the vector kernels
+  std::set<size_t> distinct(field_indices.begin(), field_indices.end());
+  if (kind != GroupAggregate::Kind::Count &&
+      distinct.size() == field_indices.size() &&
+      check_float_fields(schema, field_indices).is_ok()) {
+    auto group = std::make_shared<GroupByOperator>(
+        data.pipeline, std::vector<size_t>{}, ctx.db->thread_pool());
+    if (auto res = add_aggregates(*group); res.has_error()) {
+      return res;
+    }
+    data.pipeline = group;
+    return true;
   }
 
-  return out_table;
+  data.pipeline = std::make_shared<AggregateOperator>(
+      data.pipeline, std::move(spec), field_indices_res.unwrap(),
+      ctx.db->thread_pool());
+
+  return true;
 }
 
-class AggMaxFunction : public helper::BaseLeafFunction {
+class GroupByFunction : public helper::BaseLeafFunction {
  public:
-  AggMaxFunction() : BaseFunction("max") {
-    set_signature_variadic({AnyType::from_string()});
+  GroupByFunction() : BaseFunction("group_by") {
+    set_signature_variadic(AnyType::from_string());
 
-    add_description("aggregation max(field1, field2, ...)");
+    add_description(
+        "group rows by fields (field1, field2, ...), the following "
+        "aggregations are computed per group");
   }
 
   Result<bool> execute_leaf(LeafFunctionExecuteContext &ctx) override {
@@ -844,31 +1069,70 @@ class AggMaxFunction : public helper::BaseLeafFunction {
       return Error("invalid root func: {}", ctx.root_func->name());
     }
     auto data = data_res.value();
-    auto table = data->table;
-
-    auto field_names = value_list_to_strings(ctx.args);
 
-    auto out_res = handle_aggregation_function(
-        "max", table, field_names, [](AnyValue &acc, AnyValue elem) {
-          if (acc.is_null()) {
-            acc = elem;
-          } else {
-            if (acc < elem) {
-              acc = elem;
-            }
-          }
-        });
+    if (ctx.args.size() == 0) {
+      return Error("group_by fields can not be empty");
+    }
 
-    if (out_res.has_error()) {
-      return out_res.unwrap_err();
+    auto field_names = value_list_to_strings(ctx.args);
+    auto field_indices_res =
+        data->pipeline->schema().get_field_indices(field_names);
+    if (field_indices_res.has_error()) {
+      return field_indices_res.unwrap_err();
     }
 
-    data->table = out_res.unwrap();
+    auto field_indices = field_indices_res.unwrap();
+    for (size_t i = 0; i < field_indices.size(); i++) {
+      for (size_t j = 0; j < i; j++) {
+        if (field_indices[i] == field_indices[j]) {
+          return Error("duplicate group_by field: {}", field_names[i]);
+        }
+      }
+    }
 
+    data->pipeline = std::make_shared<GroupByOperator>(
+        data->pipeline, std::move(field_indices), ctx.db->thread_pool());
     return true;
   }
 };
 
+class AggMaxFunction : public helper::BaseLeafFunction {
+ public:
+  AggMaxFunction() : BaseFunction("max") {
+    set_signature_variadic({AnyType::from_string()});
+
+    add_description("aggregation max(field1, field2, ...)");
+  }
+
+  Result<bool> execute_leaf(LeafFunctionExecuteContext &ctx) override {
+    auto data_res = any_cast_ptr<datas::QueryRootData>(ctx.user_data);
+    if (!data_res.has_value()) {
+      return Error("invalid root func: {}", ctx.root_func->name());
+    }
+
+    return add_aggregate_operator(
+        ctx, *data_res.value(), GroupAggregate::Kind::Max,
+        AggregateSpec{
+            .name = "max",
+            .result_type = nullable_type,
+            .update =
+                [](AnyValue &acc, const AnyValue &elem) {
+                  if (acc.is_null()) {
+                    acc = elem;
+                  } else {
+                    if (acc < elem) {
+                      acc = elem;
+                    }
+                  }
+                },
+            .summarize =
+                [](const Column &column, size_t chunk_index) {
+                  return column.chunk_max(chunk_index);
+                },
+        });
+  }
+};
+
 class AggMinFunction : public helper::BaseLeafFunction {
  public:
   AggMinFunction() : BaseFunction("min") {
@@ -883,38 +1147,88 @@ class AggMinFunction : public helper::BaseLeafFunction {
       return Error("invalid root func: {}", ctx.root_func->name());
     }
 
-    auto data = data_res.value();
-    auto table = data->table;
+    return add_aggregate_operator(
+        ctx, *data_res.value(), GroupAggregate::Kind::Min,
+        AggregateSpec{
+            .name = "min",
+            .result_type = nullable_type,
+            .update =
+                [](AnyValue &acc, const AnyValue &elem) {
+                  if (acc.is_null()) {
+                    acc = elem;
+                  } else {
+                    if (!elem.is_null() && acc > elem) {
+                      acc = elem;
+                    }
+                  }
+                },
+            .summarize =
+                [](const Column &column, size_t chunk_index) {
+                  return column.chunk_min(chunk_index);
+                },
+        });
+  }
+};
 
-    auto field_names = value_list_to_strings(ctx.args);
+class AggAvgFunction : public helper::BaseLeafFunction {
+ public:
+  AggAvgFunction() : BaseFunction("avg") {
+    set_signature_variadic({AnyType::from_string()});
 
-    auto out_res = handle_aggregation_function(
-        "min", table, field_names, [](AnyValue &acc, AnyValue elem) {
-          if (acc.is_null()) {
-            acc = elem;
-          } else {
-            if (!elem.is_null() && acc > elem) {
-              acc = elem;
-            }
-          }
-        });
+    add_description("aggregation avg(field)");
+  }
 
-    if (out_res.has_error()) {
-      return out_res.unwrap_err();
+  Result<bool> execute_leaf(LeafFunctionExecuteContext &ctx) override {
+    auto data_res = any_cast_ptr<datas::QueryRootData>(ctx.user_data);
+    if (!data_res.has_value()) {
+      return Error("invalid root func: {}", ctx.root_func->name());
     }
 
-    data->table = out_res.unwrap();
+    auto data = data_res.value();
+    auto &schema = aggregate_input_schema(*data);
 
-    return true;
+    auto field_names = value_list_to_strings(ctx.args);
+    auto field_indices = schema.get_field_indices(field_names);
+    if (field_indices.has_error()) {
+      return field_indices.unwrap_err();
+    }
+    if (auto res = check_float_fields(schema, field_indices.unwrap());
+        res.has_error()) {
+      return res.unwrap_err();
+    }
+
+    return add_aggregate_operator(
+        ctx, *data, GroupAggregate::Kind::Avg,
+        AggregateSpec{
+            .name = "avg",
+            .result_type =
+                [](const AnyType &) { return AnyType::from_float(); },
+            .update =
+                [](AnyValue &acc, const AnyValue &elem) {
+                  if (acc.is_null()) {
+                    acc = elem;
+                  } else {
+                    acc = acc.float_or_zero() + elem.float_or_zero();
+                  }
+                },
+            .finish =
+                [](const AnyValue &acc, size_t num_rows) {
+                  float agg_result = 0;
+                  if (!acc.is_null()) {
+                    agg_result = acc.float_or_zero();
+                  }
+                  return AnyValue::from_float(agg_result / num_rows);
+                },
+        });
   }
 };
 
-class AggAvgFunction : public helper::BaseLeafFunction {
+class AggSumFunction : public helper::BaseLeafFunction {
  public:
-  AggAvgFunction() : BaseFunction("avg") {
+  AggSumFunction() : BaseFunction("sum") {
     set_signature_variadic({AnyType::from_string()});
 
-    add_description("aggregation avg(field)");
+    add_description("aggregation sum(field1, field2, ...), null counts as 0");
   }
 
   Result<bool> execute_leaf(LeafFunctionExecuteContext &ctx) override {
@@ -924,51 +1238,210 @@ class AggAvgFunction : public helper::BaseLeafFunction {
     }
 
     auto data = data_res.value();
-    auto table = data->table;
+    auto &schema = aggregate_input_schema(*data);
 
     auto field_names = value_list_to_strings(ctx.args);
-    auto field_indices = table->schema().get_field_indices(field_names);
+    auto field_indices = schema.get_field_indices(field_names);
     if (field_indices.has_error()) {
       return field_indices.unwrap_err();
     }
-    for (auto field_idx : field_indices.unwrap()) {
-      auto &field = table->schema().get_field(field_idx);
-      if (!field.type.is_null_float() && !field.type.is_float()) {
-        return Error("invalid field type: {}, name: {}", field.type.name(),
-                     field.name);
-      }
+    if (auto res = check_float_fields(schema, field_indices.unwrap());
+        res.has_error()) {
+      return res.unwrap_err();
     }
 
-    auto out_res = handle_aggregation_function(
-        "avg", table, field_names,
-        [](AnyValue &acc, AnyValue elem) {
-          if (acc.is_null()) {
-            acc = elem;
-          } else {
-            acc = acc.as_float() + elem.as_float();
-          }
-        },
-        [](vector<AnyValue> &agg_results, TablePtr table,
-           const vector<size_t> &field_indices) {
-          for (auto i = 0; i < agg_results.size(); i++) {
-            float agg_result = 0;
-            if (!agg_results[i].is_null()) {
-              agg_result = agg_results[i].as_float();
-            }
-            agg_result = agg_result / table->num_rows();
+    return add_aggregate_operator(
+        ctx, *data, GroupAggregate::Kind::Sum,
+        AggregateSpec{
+            .name = "sum",
+            .result_type =
+                [](const AnyType &) { return AnyType::from_float(); },
+            .update =
+                [](AnyValue &acc, const AnyValue &elem) {
+                  acc = AnyValue::from_float(acc.float_or_zero() +
+                                             elem.float_or_zero());
+                },
+            .finish =
+                [](const AnyValue &acc, size_t) {
+                  return AnyValue::from_float(acc.float_or_zero());
+                },
+        });
+  }
+};
 
-            agg_results[i] = AnyValue::from_float(agg_result);
-          }
+class AggCountFunction : public helper::BaseLeafFunction {
+ public:
+  AggCountFunction() : BaseFunction("count") {
+    set_signature_variadic({AnyType::from_string()});
+
+    add_description(
+        "aggregation count(field1, field2, ...) of non-null values, count() "
+        "of rows");
+  }
+
+  Result<bool> execute_leaf(LeafFunctionExecuteContext &ctx) override {
+    auto data_res = any_cast_ptr<datas::QueryRootData>(ctx.user_data);
+    if (!data_res.has_value()) {
+      return Error("invalid root func: {}", ctx.root_func->name());
+    }
+    auto data = data_res.value();
+
+    if (ctx.args.size() == 0) {
+      GroupAggregate count{
+          .kind = GroupAggregate::Kind::Count,
+          .field_index = std::nullopt,
+          .result_type = AnyType::from_float(),
+      };
+      if (auto group = grouping(*data); group != nullptr) {
+        return group->add_aggregate(std::move(count));
+      }
+
+      // a single group of every row
+      auto group = std::make_shared<GroupByOperator>(
+          data->pipeline, std::vector<size_t>{}, ctx.db->thread_pool());
+      group->add_aggregate(std::move(count));
+      data->pipeline = group;
+      return true;
+    }
+
+    return add_aggregate_operator(
+        ctx, *data, GroupAggregate::Kind::Count,
+        AggregateSpec{
+            .name = "count",
+            .result_type =
+                [](const AnyType &) { return AnyType::from_float(); },
+            .update =
+                [](AnyValue &acc, const AnyValue &elem) {
+                  acc = AnyValue::from_float(acc.float_or_zero() +
+                                             (elem.is_null() ? 0 : 1));
+                },
+            .finish =
+                [](const AnyValue &acc, size_t) {
+                  return AnyValue::from_float(acc.float_or_zero());
+                },
+            .combine =
+                [](AnyValue &acc, const AnyValue &partial) {
+                  acc = AnyValue::from_float(acc.float_or_zero() +
+                                             partial.float_or_zero());
+                },
+            .summarize =
+                [](const Column &column, size_t chunk_index) {
+                  auto &chunk = column.chunk(chunk_index);
+                  return std::optional<AnyValue>(AnyValue::from_float(
+                      float(chunk.size - chunk.null_count)));
+                },
         });
+  }
+};
 
-    if (out_res.has_error()) {
-      return out_res.unwrap_err();
+class AggFunction : public helper::BaseLeafFunction {
+ public:
+  AggFunction() : BaseFunction("agg") {
+    set_signature_variadic(AnyType::from_string());
+
+    add_description(
+        "aggregations in a single pass (\"max:field\", \"avg:field\", "
+        "\"count:*\", ...), of count, sum, avg, min and max");
+  }
+
+  Result<bool> execute_leaf(LeafFunctionExecuteContext &ctx) override {
+    auto data_res = any_cast_ptr<datas::QueryRootData>(ctx.user_data);
+    if (!data_res.has_value()) {
+      return Error("invalid root func: {}", ctx.root_func->name());
     }
+    auto data = data_res.value();
 
-    data->table = out_res.unwrap();
+    if (ctx.args.size() == 0) {
+      return Error("agg aggregations can not be empty");
+    }
+
+    auto &schema = aggregate_input_schema(*data);
+    std::vector<GroupAggregate> aggregates;
+    for (auto &arg : value_list_to_strings(ctx.args)) {
+      auto res = parse_aggregate(schema, arg);
+      if (res.has_error()) {
+        return res.unwrap_err();
+      }
+      aggregates.push_back(res.unwrap());
+    }
 
+    auto group = grouping(*data);
+    if (group == nullptr) {
+      // a single group of every row
+      group = std::make_shared<GroupByOperator>(
+          data->pipeline, std::vector<size_t>{}, ctx.db->thread_pool());
+    }
+    for (auto &aggregate : aggregates) {
+      if (auto res = group->add_aggregate(aggregate); res.has_error()) {
+        return res.unwrap_err();
+      }
+    }
+    data->pipeline = group;
     return true;
   }
+
+ private:
+  // `<kind>:<field>`, or `count:*` for the number of rows
+  static Result<GroupAggregate> parse_aggregate(const TableSchema &schema,
+                                                const std::string &spec) {
+    auto colon = spec.find(':');
+    if (colon == std::string::npos) {
+      return Error("invalid aggregation: {}, expected <kind>:<field>", spec);
+    }
+    auto kind_name = spec.substr(0, colon);
+    auto field_name = spec.substr(colon + 1);
+
+    static const std::unordered_map<std::string, GroupAggregate::Kind> kinds{
+        {"count", GroupAggregate::Kind::Count},
+        {"sum", GroupAggregate::Kind::Sum},
+        {"avg", GroupAggregate::Kind::Avg},
+        {"min", GroupAggregate::Kind::Min},
+        {"max", GroupAggregate::Kind::Max},
+    };
+    auto it = kinds.find(kind_name);
+    if (it == kinds.end()) {
+      return Error("unknown aggregation: {}", kind_name);
+    }
+    auto kind = it->second;
+
+    if (field_name == "*") {
+      if (kind != GroupAggregate::Kind::Count) {
+        return Error("only count can aggregate *, got {}", spec);
+      }
+      return GroupAggregate{
+          .kind = kind,
+          .field_index = std::nullopt,
+          .result_type = AnyType::from_float(),
+      };
+    }
+
+    auto field_index_res = schema.get_field_index(field_name);
+    if (field_index_res.has_error()) {
+      return field_index_res.unwrap_err();
+    }
+    auto field_index = field_index_res.unwrap();
+    auto &field_type = schema.get_field(field_index).type;
+
+    if (kind == GroupAggregate::Kind::Min ||
+        kind == GroupAggregate::Kind::Max) {
+      return GroupAggregate{
+          .kind = kind,
+          .field_index = field_index,
+          .result_type = nullable_type(field_type),
+      };
+    }
+    if (kind != GroupAggregate::Kind::Count) {
+      if (auto res = check_float_fields(schema, {field_index});
+          res.has_error()) {
+        return res.unwrap_err();
+      }
+    }
+    return GroupAggregate{
+        .kind = kind,
+        .field_index = field_index,
+        .result_type = AnyType::from_float(),
+    };
+  }
 };
 
 // Update Function
@@ -1027,20 +1500,26 @@ class UpdateRootFunction : public helper::BaseRootFunction {
       field_updates.push_back({field_idx, field_name_update.value});
     }
 
-    auto u_res =
-        data->table->update_row([&](ValueList &values, size_t row_idx) {
-          if (data->filters.perdict(values, row_idx)) {
-            for (auto &field_update : field_updates) {
-              values[field_update.field_index] = field_update.value;
-            }
-          }
-        });
+    auto wal = ctx.db->wal();
+    uint64_t lsn = 0;
+    auto u_res = data->table->modify([&](Table &table) -> Result<bool> {
+      auto updated = data->filters.select(table);
+      auto res = table.update_rows(updated, [&](ValueList &values, size_t) {
+        for (auto &field_update : field_updates) {
+          values[field_update.field_index] = field_update.value;
+        }
+      });
+      if (res.is_ok() && wal != nullptr && !updated.empty()) {
+        lsn = log_change(*wal, table, WalRecord::update(table, updated));
+      }
+      return res;
+    });
     if (u_res.has_error()) {
       return u_res.unwrap_err();
     }
 
-    ctx.result = data->table;
-    return true;
+    ctx.result = u_res.unwrap();
+    return commit_change(wal, lsn);
   }
 };
 
@@ -1098,17 +1577,251 @@ class DeleteRootFunction : public helper::BaseRootFunction {
     }
     auto data = data_res.value();
 
-    auto res =
-        data->table->delete_rows([&](const ValueList &values, size_t row_idx) {
-          return data->filters.perdict(values, row_idx);
-        });
+    auto wal = ctx.db->wal();
+    uint64_t lsn = 0;
+    auto res = data->table->modify([&](Table &table) -> Result<bool> {
+      auto deleted = data->filters.select(table);
+      auto res = table.delete_rows(deleted);
+      if (res.is_ok() && wal != nullptr && !deleted.empty()) {
+        lsn = log_change(*wal, table, WalRecord::remove(table, deleted));
+      }
+      return res;
+    });
     if (res.has_error()) {
       return res.unwrap_err();
     }
 
-    ctx.result = data->table;
+    ctx.result = res.unwrap();
+    return commit_change(wal, lsn);
+  }
+};
+
+// Snapshot
+
+// the name and number of rows of every table of a snapshot
+static TablePtr snapshot_summary(const TablePtrList &tables) {
+  TableSchema schema;
+  schema.add_field("name", AnyType::from_string());
+  schema.add_field("rows", AnyType::from_float());
+
+  auto summary = Table::create_ptr("", schema);
+  for (auto &table : tables) {
+    summary->add_row({table->name(), float(table->num_rows())});
+  }
+  return summary;
+}
+
+class SaveSnapshotFunction : public helper::BaseRootFunction {
+ public:
+  SaveSnapshotFunction() : BaseFunction("save_snapshot") {
+    set_signature({AnyType::from_string()});
+    add_description(
+        "save_snapshot(path) save every table to a snapshot file, see "
+        "load_snapshot");
+  }
+
+  Result<bool> execute_root(RootFunctionExecuteContext &ctx) override {
+    return true;
+  }
+
+  Result<bool> finalize_root(RootFunctionFinalizeContext &ctx) override {
+    auto tables_res = ctx.db->list_tables();
+    if (tables_res.has_error()) {
+      return tables_res.unwrap_err();
+    }
+
+    // every table is saved as of the time it is listed
+    TablePtrList tables;
+    for (auto &table : tables_res.unwrap()) {
+      tables.push_back(table->snapshot());
+    }
+
+    auto res = save_snapshot(ctx.args[0].as_string(), tables);
+    if (res.has_error()) {
+      return res.unwrap_err();
+    }
+
+    ctx.result = snapshot_summary(tables);
+    return true;
+  }
+};
+
+class LoadSnapshotFunction : public helper::BaseRootFunction {
+ public:
+  LoadSnapshotFunction() : BaseFunction("load_snapshot") {
+    set_signature({AnyType::from_string()});
+    add_description(
+        "load_snapshot(path) create the tables of a snapshot file, none of "
+        "them may exist. With a write-ahead log, the tables are loaded from "
+        "a copy of the file the log owns");
+  }
+
+  Result<bool> execute_root(RootFunctionExecuteContext &ctx) override {
     return true;
   }
+
+  Result<bool> finalize_root(RootFunctionFinalizeContext &ctx) override {
+    // the write-ahead log refers to its copy instead of holding the rows, so
+    // the file may change once it is loaded
+    auto path = ctx.args[0].as_string();
+    std::optional<SnapshotSource> source;
+    if (auto wal = ctx.db->wal(); wal != nullptr) {
+      auto copy_res = wal->copy_snapshot(path);
+      if (copy_res.has_error()) {
+        return copy_res.unwrap_err();
+      }
+      source = copy_res.unwrap();
+      path = source->path;
+    }
+    auto remove_copy = [&] {
+      if (source.has_value()) {
+        std::remove(source->path.c_str());
+      }
+    };
+
+    auto tables_res = load_snapshot(
+        path, ctx.db->thread_pool(),
+        source.has_value() ? &source->checksum : nullptr);
+    if (tables_res.has_error()) {
+      remove_copy();
+      return tables_res.unwrap_err();
+    }
+    auto &tables = tables_res.unwrap();
+
+    std::vector<CreateTableParams> params_list;
+    for (auto &table : tables) {
+      params_list.push_back({.table = table, .source = source});
+    }
+    auto res = ctx.db->create_table_list(params_list);
+    if (res.has_error()) {
+      // the tables are created and logged even if the log failed to commit
+      auto created = ctx.db->get_table(tables.front()->name());
+      if (created.has_error() || created.unwrap() != tables.front()) {
+        remove_copy();
+      }
+      return res.unwrap_err();
+    }
+
+    ctx.result = snapshot_summary(tables);
+    return true;
+  }
+};
+
+// Checkpoint
+
+// local time, like 2024-01-31 12:00:00
+static std::string format_time(std::chrono::system_clock::time_point time) {
+  // std::localtime shares its result
+  static std::mutex mutex;
+  std::lock_guard lock(mutex);
+
+  auto t = std::chrono::system_clock::to_time_t(time);
+  char buf[32];
+  std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", std::localtime(&t));
+  return buf;
+}
+
+static std::string checkpoint_state(CheckpointInfo::State state) {
+  switch (state) {
+    case CheckpointInfo::State::Running:
+      return "running";
+    case CheckpointInfo::State::Done:
+      return "done";
+    default:
+      return "failed";
+  }
+}
+
+// a row per checkpoint, sizes are in MiB
+static TablePtr checkpoints_table(const std::vector<CheckpointInfo> &infos) {
+  TableSchema schema;
+  schema.add_field("id", AnyType::from_float());
+  schema.add_field("state", AnyType::from_string());
+  schema.add_field("trigger", AnyType::from_string());
+  schema.add_field("started", AnyType::from_string());
+  schema.add_field("duration_ms", AnyType::from_float());
+  schema.add_field("tables", AnyType::from_float());
+  schema.add_field("tables_written", AnyType::from_float());
+  schema.add_field("rows_written", AnyType::from_float());
+  schema.add_field("snapshot_mb", AnyType::from_float());
+  schema.add_field("wal_mb_before", AnyType::from_float());
+  schema.add_field("wal_mb_after", AnyType::from_float());
+  schema.add_field("error", AnyType::from_string());
+
+  auto mib = [](uint64_t bytes) { return float(bytes) / (1 << 20); };
+  auto table = Table::create_ptr("show_checkpoints", schema);
+  for (auto &info : infos) {
+    auto duration =
+        std::chrono::duration<float, std::milli>(info.duration).count();
+    table->add_row({float(info.id), checkpoint_state(info.state), info.trigger,
+                    format_time(info.started), duration, float(info.tables),
+                    float(info.tables_written), float(info.rows_written),
+                    mib(info.snapshot_size), mib(info.wal_size_before),
+                    mib(info.wal_size_after), info.error});
+  }
+  return table;
+}
+
+static Result<Checkpointer *> get_checkpointer(Database *db) {
+  if (db->checkpointer() == nullptr) {
+    return Error("checkpoints are disabled, start with --snapshot <path>");
+  }
+  return db->checkpointer();
+}
+
+class CheckpointFunction : public helper::BaseRootFunction {
+ public:
+  CheckpointFunction() : BaseFunction("checkpoint") {
+    set_signature({});
+    add_description(
+        "checkpoint() save every table to the snapshot and truncate the "
+        "write-ahead log, runs in the background and waits for it");
+  }
+
+  Result<bool> execute_root(RootFunctionExecuteContext &ctx) override {
+    return true;
+  }
+
+  Result<bool> finalize_root(RootFunctionFinalizeContext &ctx) override {
+    auto checkpointer = get_checkpointer(ctx.db);
+    if (checkpointer.has_error()) {
+      return checkpointer.unwrap_err();
+    }
+    auto info = checkpointer.unwrap()->checkpoint();
+    if (info.has_error()) {
+      return info.unwrap_err();
+    }
+    if (info.unwrap().state == CheckpointInfo::State::Failed) {
+      return Error("checkpoint {} failed: {}", info.unwrap().id,
+                   info.unwrap().error);
+    }
+
+    ctx.result = checkpoints_table({info.unwrap()});
+    return true;
+  }
+};
+
+class ShowCheckpointsFunction : public helper::BaseRootFunction {
+ public:
+  ShowCheckpointsFunction()
+      : BaseFunction("show_checkpoints", FunctionSignature::make({})) {
+    add_description(
+        "show the last checkpoints, their progress and duration, sizes are in "
+        "MiB");
+  }
+
+  Result<bool> execute_root(RootFunctionExecuteContext &ctx) override {
+    auto checkpointer = get_checkpointer(ctx.db);
+    if (checkpointer.has_error()) {
+      return checkpointer.unwrap_err();
+    }
+    return helper::execute_query_root(
+        ctx, checkpoints_table(checkpointer.unwrap()->history()));
+  }
+
+  Result<bool> finalize_root(RootFunctionFinalizeContext &ctx) override {
+    return helper::finalize_query_root(ctx);
+  }
 };
 
 class FunctionFactory {
@@ -1124,6 +1837,8 @@ class FunctionFactory {
     register_function<AddFieldFunction>();
     register_function<UpdateRootFunction>();
     register_function<DeleteRootFunction>();
+    register_function<CreateIndexFunction>();
+    register_function<CreateOrderedIndexFunction>();
     register_function<SetValueFunction>();
     register_function<InsertRootFunction>();
     register_function<AddRowFunction>();
@@ -1137,6 +1852,14 @@ class FunctionFactory {
     register_function<AggAvgFunction>();
     register_function<AggMaxFunction>();
     register_function<AggMinFunction>();
+    register_function<AggSumFunction>();
+    register_function<AggCountFunction>();
+    register_function<GroupByFunction>();
+    register_function<AggFunction>();
+    register_function<SaveSnapshotFunction>();
+    register_function<LoadSnapshotFunction>();
+    register_function<CheckpointFunction>();
+    register_function<ShowCheckpointsFunction>();
   }
 
   // register function
@@ -0,0 +1,1086 @@
+#include "lumidb/pipeline.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "fmt/core.h"
+#include "lumidb/simd.hh"
+#include "lumidb/table.hh"
+#include "lumidb/types.hh"
+
+using namespace std;
+using namespace lumidb;
+
+TableView lumidb::collect(Operator &op) {
+  if (auto view = op.remaining(); view.has_value()) {
+    return view.value();
+  }
+
+  std::optional<TableView> first;
+  RowIndicesList rows;
+  while (auto batch = op.next()) {
+    if (!first.has_value()) {
+      first = batch;
+    }
+    if (auto selection = batch->selection(); selection != nullptr) {
+      rows.insert(rows.end(), selection->begin(), selection->end());
+    } else {
+      for (size_t i = 0; i < batch->num_rows(); i++) {
+        rows.push_back(i);
+      }
+    }
+  }
+
+  if (!first.has_value()) {
+    return op.shape().with_rows({});
+  }
+  return first->with_rows(std::move(rows));
+}
+
+// Scan
+
+std::optional<TableView> ScanOperator::next() {
+  if (offset_ >= source_.num_rows()) {
+    return std::nullopt;
+  }
+
+  auto batch = source_.limit(offset_, kBatchSize);
+  offset_ += batch.num_rows();
+  return batch;
+}
+
+std::optional<TableView> ScanOperator::remaining() {
+  auto offset = offset_;
+  offset_ = source_.num_rows();
+
+  if (offset == 0) {
+    return source_;
+  }
+  return source_.limit(offset, source_.num_rows() - offset);
+}
+
+// Filter
+
+std::optional<TableView> FilterOperator::next() {
+  while (ready_.empty()) {
+    // pull one batch per worker and filter them in parallel
+    size_t width = pool_ != nullptr ? pool_->num_workers() : 1;
+
+    std::vector<TableView> batches;
+    while (batches.size() < width) {
+      auto batch = child_->next();
+      if (!batch.has_value()) {
+        break;
+      }
+      if (!expr_.may_match(batch.value())) {
+        continue;
+      }
+      batches.push_back(std::move(batch.value()));
+    }
+
+    if (batches.empty()) {
+      return std::nullopt;
+    }
+
+    std::vector<TableView> filtered(batches.size());
+    auto filter_batches = [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        filtered[i] = expr_.filter(batches[i]);
+      }
+    };
+
+    if (pool_ != nullptr) {
+      pool_->parallel_for(batches.size(), 1, filter_batches);
+    } else {
+      filter_batches(0, batches.size());
+    }
+
+    for (auto &batch : filtered) {
+      if (batch.num_rows() > 0) {
+        ready_.push_back(std::move(batch));
+      }
+    }
+  }
+
+  auto batch = std::move(ready_.front());
+  ready_.pop_front();
+  return batch;
+}
+
+// Project
+
+std::optional<TableView> ProjectOperator::next() {
+  auto batch = child_->next();
+  if (!batch.has_value()) {
+    return std::nullopt;
+  }
+  return batch->select(field_indices_);
+}
+
+std::optional<TableView> ProjectOperator::remaining() {
+  auto view = child_->remaining();
+  if (!view.has_value()) {
+    return std::nullopt;
+  }
+  return view->select(field_indices_);
+}
+
+// Limit
+
+std::optional<TableView> LimitOperator::next() {
+  if (produced_ >= count_) {
+    return std::nullopt;
+  }
+
+  auto batch = child_->next();
+  if (!batch.has_value()) {
+    return std::nullopt;
+  }
+
+  if (produced_ + batch->num_rows() > count_) {
+    batch = batch->limit(0, count_ - produced_);
+  }
+  produced_ += batch->num_rows();
+  return batch;
+}
+
+// Sort
+
+// a sorted run of base rows, read back a batch at a time
+struct SortOperator::Run {
+  // the spilled rows after the buffered ones, nullptr if the run is kept in
+  // memory
+  std::FILE *file = nullptr;
+  // rows left in the file
+  size_t spilled = 0;
+  RowIndicesList rows;
+  // next row in rows
+  size_t pos = 0;
+  // runs are numbered in input order, ties are taken from the earlier run
+  size_t seq = 0;
+  // the spilled rows couldn't be read back
+  bool failed = false;
+
+  ~Run() {
+    if (file != nullptr) {
+      std::fclose(file);
+    }
+  }
+
+  size_t row() const { return rows[pos]; }
+
+  // false once every row is taken, or if a read fails or comes short
+  bool advance() {
+    if (++pos < rows.size()) {
+      return true;
+    }
+
+    pos = 0;
+    rows.clear();
+    if (spilled > 0) {
+      rows.resize(std::min(spilled, kBatchSize));
+      size_t count = std::fread(rows.data(), sizeof(size_t), rows.size(), file);
+      if (count != rows.size() || std::ferror(file)) {
+        failed = true;
+        rows.clear();
+        return false;
+      }
+      spilled -= count;
+    }
+    return !rows.empty();
+  }
+};
+
+SortOperator::SortOperator(OperatorPtr child, std::vector<size_t> field_indices,
+                           bool asc, ThreadPool *pool, size_t memory_budget)
+    : child_(std::move(child)),
+      field_indices_(std::move(field_indices)),
+      asc_(asc),
+      pool_(pool),
+      memory_budget_(memory_budget) {
+  for (auto field_index : field_indices_) {
+    columns_.push_back(&child_->shape().column(field_index));
+  }
+}
+
+SortOperator::~SortOperator() = default;
+
+bool SortOperator::after(const Run &lhs, const Run &rhs) const {
+  for (auto column : columns_) {
+    int res = column->compare(lhs.row(), rhs.row());
+    if (res != 0) {
+      return asc_ ? res > 0 : res < 0;
+    }
+  }
+  return lhs.seq > rhs.seq;
+}
+
+void SortOperator::spill(RowIndicesList rows) {
+  auto run = std::make_unique<Run>();
+  run->seq = num_runs_++;
+  run->rows = sort_rows(columns_, std::move(rows), asc_, pool_);
+
+  // the first batch stays in memory, the rest is read back while merging
+  if (run->rows.size() > kBatchSize) {
+    size_t count = run->rows.size() - kBatchSize;
+    std::FILE *file = std::tmpfile();
+    if (file != nullptr &&
+        std::fwrite(run->rows.data() + kBatchSize, sizeof(size_t), count,
+                    file) == count &&
+        std::fflush(file) == 0 && std::fseek(file, 0, SEEK_SET) == 0) {
+      run->file = file;
+      run->spilled = count;
+      run->rows.resize(kBatchSize);
+      run->rows.shrink_to_fit();
+    } else if (file != nullptr) {
+      std::fclose(file);
+    }
+  }
+
+  runs_.push_back(std::move(run));
+}
+
+void SortOperator::sort() {
+  if (done_) {
+    return;
+  }
+  done_ = true;
+
+  size_t run_rows = memory_budget_ == 0
+                        ? SIZE_MAX
+                        : std::max(memory_budget_ / kSortRowBytes, kBatchSize);
+
+  // a scan hands over the whole view, which fits or may walk an ordered index
+  if (auto input = child_->remaining(); input.has_value()) {
+    if (input->num_rows() <= run_rows ||
+        (input->selects_all_rows() &&
+         input->ordered_index(field_indices_) != nullptr)) {
+      sorted_.emplace(input->sort(field_indices_, asc_, pool_));
+      return;
+    }
+
+    for (size_t begin = 0; begin < input->num_rows(); begin += run_rows) {
+      size_t end = std::min(input->num_rows(), begin + run_rows);
+      RowIndicesList rows(end - begin);
+      for (size_t i = begin; i < end; i++) {
+        rows[i - begin] = input->row_index(i);
+      }
+      spill(std::move(rows));
+    }
+  } else {
+    RowIndicesList rows;
+    while (auto batch = child_->next()) {
+      for (size_t i = 0; i < batch->num_rows(); i++) {
+        rows.push_back(batch->row_index(i));
+      }
+      if (rows.size() >= run_rows) {
+        spill(std::move(rows));
+        rows = {};
+      }
+    }
+
+    if (runs_.empty()) {
+      sorted_.emplace(shape().with_rows(std::move(rows))
+                          .sort(field_indices_, asc_, pool_));
+      return;
+    }
+    if (!rows.empty()) {
+      spill(std::move(rows));
+    }
+  }
+
+  std::make_heap(runs_.begin(), runs_.end(),
+                 [this](auto &lhs, auto &rhs) { return after(*lhs, *rhs); });
+}
+
+std::optional<TableView> SortOperator::next() {
+  sort();
+  if (sorted_.has_value()) {
+    return sorted_->next();
+  }
+
+  auto later = [this](auto &lhs, auto &rhs) { return after(*lhs, *rhs); };
+
+  RowIndicesList rows;
+  while (!runs_.empty() && rows.size() < kBatchSize) {
+    std::pop_heap(runs_.begin(), runs_.end(), later);
+    auto &run = *runs_.back();
+    rows.push_back(run.row());
+    if (run.advance()) {
+      std::push_heap(runs_.begin(), runs_.end(), later);
+    } else if (run.failed) {
+      error_ = Error("failed to read back a spilled sort run");
+      runs_.clear();
+      return std::nullopt;
+    } else {
+      runs_.pop_back();
+    }
+  }
+
+  if (rows.empty()) {
+    return std::nullopt;
+  }
+  return shape().with_rows(std::move(rows));
+}
+
+std::optional<Error> SortOperator::error() const {
+  return error_.has_value() ? error_ : child_->error();
+}
+
+std::optional<TableView> SortOperator::remaining() {
+  sort();
+  if (sorted_.has_value()) {
+    return sorted_->remaining();
+  }
+  // merged batch by batch
+  return std::nullopt;
+}
+
+// Top-K
+
+void TopKOperator::select() {
+  if (selected_.has_value()) {
+    return;
+  }
+
+  // a scan can hand over the whole view, which may walk an ordered index
+  if (auto input = child_->remaining(); input.has_value()) {
+    selected_.emplace(input->top_k(field_indices_, asc_, count_));
+    return;
+  }
+
+  // batches share the base table and fields of the shape
+  auto &shape = child_->shape();
+  std::vector<const Column *> columns;
+  for (auto field_index : field_indices_) {
+    columns.push_back(&shape.column(field_index));
+  }
+
+  TopKRows top(std::move(columns), asc_, count_);
+  while (auto batch = child_->next()) {
+    for (size_t i = 0; i < batch->num_rows(); i++) {
+      top.push(batch->row_index(i));
+    }
+  }
+  selected_.emplace(shape.with_rows(top.take()));
+}
+
+std::optional<TableView> TopKOperator::next() {
+  select();
+  return selected_->next();
+}
+
+std::optional<TableView> TopKOperator::remaining() {
+  select();
+  return selected_->remaining();
+}
+
+// Aggregate
+
+static TableSchema aggregate_schema(const AggregateSpec &spec,
+                                    const TableSchema &input_schema,
+                                    const std::vector<size_t> &field_indices) {
+  TableSchema schema;
+  for (auto field_index : field_indices) {
+    auto &field = input_schema.get_field(field_index);
+    schema.add_field(fmt::format("{}({})", spec.name, field.name),
+                     spec.result_type(field.type));
+  }
+  return schema;
+}
+
+AggregateOperator::AggregateOperator(OperatorPtr child, AggregateSpec spec,
+                                     std::vector<size_t> field_indices,
+                                     ThreadPool *pool)
+    : child_(std::move(child)),
+      spec_(std::move(spec)),
+      field_indices_(std::move(field_indices)),
+      pool_(pool),
+      shape_(Table::create_ptr(
+          "", aggregate_schema(spec_, child_->schema(), field_indices_))) {}
+
+std::optional<AnyValue> AggregateOperator::summarize(
+    const Morsel &morsel, const Column &column) const {
+  if (spec_.summarize == nullptr || !morsel.view->selects_all_rows() ||
+      morsel.begin % kColumnChunkSize != 0) {
+    return std::nullopt;
+  }
+
+  size_t chunk_index = morsel.begin / kColumnChunkSize;
+  if (morsel.end - morsel.begin != column.chunk(chunk_index).size) {
+    return std::nullopt;
+  }
+  return spec_.summarize(column, chunk_index);
+}
+
+void AggregateOperator::fold_morsels(const std::vector<Morsel> &morsels,
+                                     std::vector<AnyValue> &results) {
+  std::vector<std::vector<AnyValue>> partials(
+      morsels.size(), std::vector<AnyValue>(field_indices_.size()));
+
+  auto fold = [&](size_t begin, size_t end) {
+    for (size_t m = begin; m < end; m++) {
+      auto &morsel = morsels[m];
+      auto &partial = partials[m];
+      // one column at a time, so each pass runs over a single buffer
+      for (size_t i = 0; i < field_indices_.size(); i++) {
+        auto &column = morsel.view->column(field_indices_[i]);
+        if (auto summary = summarize(morsel, column); summary.has_value()) {
+          partial[i] = std::move(summary.value());
+          continue;
+        }
+        for (size_t idx = morsel.begin; idx < morsel.end; idx++) {
+          spec_.update(partial[i], column.get(morsel.view->row_index(idx)));
+        }
+      }
+    }
+  };
+
+  if (pool_ != nullptr) {
+    pool_->parallel_for(morsels.size(), 1, fold);
+  } else {
+    fold(0, morsels.size());
+  }
+
+  auto &combine = spec_.combine != nullptr ? spec_.combine : spec_.update;
+  for (auto &partial : partials) {
+    for (size_t i = 0; i < results.size(); i++) {
+      combine(results[i], partial[i]);
+    }
+  }
+}
+
+TableView AggregateOperator::aggregate() {
+  done_ = true;
+
+  std::vector<AnyValue> results(field_indices_.size());
+  size_t num_rows = 0;
+
+  if (auto view = child_->remaining(); view.has_value()) {
+    std::vector<Morsel> morsels;
+    for (size_t begin = 0; begin < view->num_rows(); begin += kBatchSize) {
+      size_t end = std::min(view->num_rows(), begin + kBatchSize);
+      morsels.push_back({&view.value(), begin, end});
+    }
+    fold_morsels(morsels, results);
+    num_rows = view->num_rows();
+  } else {
+    // pull one batch per worker at a time
+    size_t width = pool_ != nullptr ? pool_->num_workers() : 1;
+    std::vector<TableView> batches;
+    std::vector<Morsel> morsels;
+
+    bool exhausted = false;
+    while (!exhausted) {
+      batches.clear();
+      while (batches.size() < width) {
+        auto batch = child_->next();
+        if (!batch.has_value()) {
+          exhausted = true;
+          break;
+        }
+        batches.push_back(std::move(batch.value()));
+      }
+
+      morsels.clear();
+      for (auto &batch : batches) {
+        morsels.push_back({&batch, 0, batch.num_rows()});
+        num_rows += batch.num_rows();
+      }
+      fold_morsels(morsels, results);
+    }
+  }
+
+  if (spec_.finish != nullptr) {
+    for (auto &result : results) {
+      result = spec_.finish(result, num_rows);
+    }
+  }
+
+  auto table = Table::create_ptr("", shape_.schema());
+  table->add_row(results);
+  return TableView(table);
+}
+
+std::optional<TableView> AggregateOperator::next() {
+  if (done_) {
+    return std::nullopt;
+  }
+  return aggregate();
+}
+
+std::optional<TableView> AggregateOperator::remaining() {
+  if (done_) {
+    return shape_;
+  }
+  return aggregate();
+}
+
+// Group by
+
+// rows from which the groups are built in parallel partitions
+constexpr size_t kParallelGroupRows = 64 * 1024;
+
+static const char *aggregate_name(GroupAggregate::Kind kind) {
+  switch (kind) {
+    case GroupAggregate::Kind::Count:
+      return "count";
+    case GroupAggregate::Kind::Sum:
+      return "sum";
+    case GroupAggregate::Kind::Avg:
+      return "avg";
+    case GroupAggregate::Kind::Min:
+      return "min";
+    case GroupAggregate::Kind::Max:
+      return "max";
+  }
+  return "";
+}
+
+// the rows of the input whose hashes fall in a partition, and their groups
+struct GroupByOperator::Partition {
+  // positions of the rows in the input, in input order
+  std::vector<size_t> positions;
+  // group of every position
+  std::vector<uint32_t> groups;
+  // first position and number of rows of every group
+  std::vector<size_t> firsts;
+  std::vector<size_t> sizes;
+  // per aggregate and group, the count or sum, or the row holding the min or
+  // max, SIZE_MAX if the group has no value
+  std::vector<std::vector<double>> values;
+  std::vector<std::vector<size_t>> rows;
+};
+
+GroupByOperator::GroupByOperator(OperatorPtr child,
+                                 std::vector<size_t> key_indices,
+                                 ThreadPool *pool)
+    : child_(std::move(child)),
+      key_indices_(std::move(key_indices)),
+      pool_(pool) {
+  TableSchema schema;
+  for (auto key_index : key_indices_) {
+    auto &field = child_->schema().get_field(key_index);
+    schema.add_field(field.name, field.type);
+  }
+  shape_ = TableView(Table::create_ptr("", std::move(schema)));
+}
+
+Result<bool> GroupByOperator::add_aggregate(GroupAggregate aggregate) {
+  std::string name = aggregate_name(aggregate.kind);
+  if (aggregate.field_index.has_value()) {
+    auto &field = child_->schema().get_field(aggregate.field_index.value());
+    name = fmt::format("{}({})", name, field.name);
+  } else {
+    name += "(*)";
+  }
+
+  auto schema = shape_.schema();
+  if (auto res = schema.add_field(name, aggregate.result_type);
+      res.has_error()) {
+    return res.unwrap_err();
+  }
+
+  aggregates_.push_back(std::move(aggregate));
+  shape_ = TableView(Table::create_ptr("", std::move(schema)));
+  return true;
+}
+
+void GroupByOperator::group(const TableView &input,
+                            const std::vector<uint64_t> &hashes,
+                            Partition &partition) const {
+  auto &positions = partition.positions;
+  auto &groups = partition.groups;
+  auto &firsts = partition.firsts;
+  auto &sizes = partition.sizes;
+
+  groups.resize(positions.size());
+
+  std::vector<const Column *> keys;
+  for (auto key_index : key_indices_) {
+    keys.push_back(&input.column(key_index));
+  }
+  auto same_keys = [&](size_t lhs, size_t rhs) {
+    for (auto column : keys) {
+      if (!column->same(lhs, rhs)) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // linear probing, the table is kept at most half full. A slot keeps the
+  // hash of its group, so most mismatches don't touch the columns.
+  constexpr uint32_t kEmptySlot = UINT32_MAX;
+  struct Slot {
+    uint64_t hash;
+    uint32_t group;
+  };
+  std::vector<Slot> slots(16, Slot{0, kEmptySlot});
+  size_t mask = slots.size() - 1;
+
+  for (size_t k = 0; k < positions.size(); k++) {
+    uint64_t hash = hashes[positions[k]];
+    size_t row = input.row_index(positions[k]);
+
+    size_t i = hash & mask;
+    while (slots[i].group != kEmptySlot &&
+           (slots[i].hash != hash ||
+            !same_keys(input.row_index(firsts[slots[i].group]), row))) {
+      i = (i + 1) & mask;
+    }
+
+    uint32_t group = slots[i].group;
+    if (group == kEmptySlot) {
+      group = firsts.size();
+      firsts.push_back(positions[k]);
+      sizes.push_back(0);
+      slots[i] = {hash, group};
+
+      if (firsts.size() * 2 > slots.size()) {
+        std::vector<Slot> grown(slots.size() * 2, Slot{0, kEmptySlot});
+        mask = grown.size() - 1;
+        for (auto &slot : slots) {
+          if (slot.group == kEmptySlot) {
+            continue;
+          }
+          size_t j = slot.hash & mask;
+          while (grown[j].group != kEmptySlot) {
+            j = (j + 1) & mask;
+          }
+          grown[j] = slot;
+        }
+        slots = std::move(grown);
+      }
+    }
+
+    groups[k] = group;
+    sizes[group]++;
+  }
+}
+
+void GroupByOperator::fold(const TableView &input,
+                           Partition &partition) const {
+  auto &positions = partition.positions;
+  auto &groups = partition.groups;
+  size_t num_groups = partition.firsts.size();
+
+  // one aggregate at a time, so each pass reads a single column
+  for (auto &aggregate : aggregates_) {
+    auto &values = partition.values.emplace_back();
+    auto &rows = partition.rows.emplace_back();
+    if (!aggregate.field_index.has_value()) {
+      values.assign(partition.sizes.begin(), partition.sizes.end());
+      continue;
+    }
+
+    auto &column = input.column(aggregate.field_index.value());
+    switch (aggregate.kind) {
+      case GroupAggregate::Kind::Count:
+        values.assign(num_groups, 0);
+        for (size_t k = 0; k < positions.size(); k++) {
+          if (!column.is_null(input.row_index(positions[k]))) {
+            values[groups[k]]++;
+          }
+        }
+        break;
+      case GroupAggregate::Kind::Sum:
+      case GroupAggregate::Kind::Avg:
+        // float fields only, their null cells hold 0
+        values.assign(num_groups, 0);
+        for (size_t k = 0; k < positions.size(); k++) {
+          size_t row = input.row_index(positions[k]);
+          values[groups[k]] += column.chunk(row / kColumnChunkSize)
+                                   .floats[row % kColumnChunkSize];
+        }
+        break;
+      case GroupAggregate::Kind::Min:
+      case GroupAggregate::Kind::Max: {
+        // the first least or greatest value, like the min and max functions
+        int sign = aggregate.kind == GroupAggregate::Kind::Max ? 1 : -1;
+        rows.assign(num_groups, SIZE_MAX);
+        for (size_t k = 0; k < positions.size(); k++) {
+          size_t row = input.row_index(positions[k]);
+          if (column.is_null(row)) {
+            continue;
+          }
+          auto &best = rows[groups[k]];
+          if (best == SIZE_MAX ||
+              column.compare_values(row, best) * sign > 0) {
+            best = row;
+          }
+        }
+        break;
+      }
+    }
+  }
+}
+
+// the max or min of the non-null cells of a float chunk, null if there is
+// none, by the vector kernels. std::nullopt if the first such cell must be
+// picked among cells comparing equal to it, i.e. a NaN or a zero of either
+// sign.
+static std::optional<AnyValue> best_float(const Column::Chunk &chunk,
+                                          bool max) {
+  uint64_t non_null[kColumnChunkSize / 64];
+  for (size_t i = 0; i < chunk.null_bits.size(); i++) {
+    non_null[i] = ~chunk.null_bits[i];
+  }
+  auto summary = simd::summarize_floats(chunk.floats.data(), chunk.size,
+                                        non_null);
+  if (summary.count == 0) {
+    return AnyValue::from_null();
+  }
+  float best = max ? summary.max : summary.min;
+  if (summary.has_nan || best == 0) {
+    return std::nullopt;
+  }
+  return AnyValue::from_float(best);
+}
+
+// partial count or sum, or min or max, of a morsel
+struct GroupByOperator::Partial {
+  double value = 0;
+  AnyValue best;
+};
+
+void GroupByOperator::fold_all(const std::vector<Morsel> &morsels,
+                               std::vector<Partial> &partials) const {
+  if (aggregates_.empty()) {
+    return;
+  }
+  size_t first = partials.size() / aggregates_.size();
+  partials.resize((first + morsels.size()) * aggregates_.size());
+
+  auto fold_morsel = [&](size_t m) {
+    auto &input = *morsels[m].view;
+    size_t begin = morsels[m].begin, end = morsels[m].end;
+    bool contiguous = input.selects_all_rows();
+
+    for (size_t a = 0; a < aggregates_.size(); a++) {
+      auto &aggregate = aggregates_[a];
+      auto &partial = partials[(first + m) * aggregates_.size() + a];
+      if (!aggregate.field_index.has_value()) {
+        partial.value = end - begin;
+        continue;
+      }
+
+      auto &column = input.column(aggregate.field_index.value());
+      auto &chunk = column.chunk(begin / kColumnChunkSize);
+      switch (aggregate.kind) {
+        case GroupAggregate::Kind::Count:
+          if (contiguous) {
+            partial.value = chunk.size - chunk.null_count;
+            break;
+          }
+          for (size_t pos = begin; pos < end; pos++) {
+            partial.value += !column.is_null(input.row_index(pos));
+          }
+          break;
+        case GroupAggregate::Kind::Sum:
+        case GroupAggregate::Kind::Avg:
+          // float fields only, their null cells hold 0
+          if (contiguous) {
+            partial.value =
+                simd::summarize_floats(chunk.floats.data(), chunk.size).sum;
+            break;
+          }
+          for (size_t pos = begin; pos < end; pos++) {
+            size_t row = input.row_index(pos);
+            partial.value += column.chunk(row / kColumnChunkSize)
+                                 .floats[row % kColumnChunkSize];
+          }
+          break;
+        case GroupAggregate::Kind::Min:
+        case GroupAggregate::Kind::Max: {
+          bool max = aggregate.kind == GroupAggregate::Kind::Max;
+          if (contiguous) {
+            auto summary = max ? column.chunk_max(begin / kColumnChunkSize)
+                               : column.chunk_min(begin / kColumnChunkSize);
+            if (summary.has_value()) {
+              partial.best = std::move(summary.value());
+              break;
+            }
+            auto best = column.storage() == Column::Storage::Float
+                            ? best_float(chunk, max)
+                            : std::nullopt;
+            if (best.has_value()) {
+              partial.best = std::move(best.value());
+              break;
+            }
+          }
+          // the first least or greatest value, like the min and max functions
+          size_t best = SIZE_MAX;
+          int sign = max ? 1 : -1;
+          for (size_t pos = begin; pos < end; pos++) {
+            size_t row = input.row_index(pos);
+            if (!column.is_null(row) &&
+                (best == SIZE_MAX ||
+                 column.compare_values(row, best) * sign > 0)) {
+              best = row;
+            }
+          }
+          if (best != SIZE_MAX) {
+            partial.best = column.get(best);
+          }
+          break;
+        }
+      }
+    }
+  };
+
+  if (pool_ != nullptr) {
+    pool_->parallel_for(morsels.size(), 1, [&](size_t begin, size_t end) {
+      for (size_t m = begin; m < end; m++) {
+        fold_morsel(m);
+      }
+    });
+  } else {
+    for (size_t m = 0; m < morsels.size(); m++) {
+      fold_morsel(m);
+    }
+  }
+}
+
+ValueList GroupByOperator::combine_all(const std::vector<Partial> &partials,
+                                       size_t n) const {
+  // combined in input order, so ties keep the first value
+  ValueList values;
+  for (size_t a = 0; a < aggregates_.size(); a++) {
+    auto &aggregate = aggregates_[a];
+    double value = 0;
+    AnyValue best;
+    for (size_t i = a; i < partials.size(); i += aggregates_.size()) {
+      auto &partial = partials[i];
+      value += partial.value;
+      if (partial.best.is_null()) {
+        continue;
+      }
+      bool max = aggregate.kind == GroupAggregate::Kind::Max;
+      if (best.is_null() || (max ? best < partial.best : partial.best < best)) {
+        best = partial.best;
+      }
+    }
+
+    switch (aggregate.kind) {
+      case GroupAggregate::Kind::Count:
+      case GroupAggregate::Kind::Sum:
+        values.push_back(AnyValue::from_float(value));
+        break;
+      case GroupAggregate::Kind::Avg:
+        values.push_back(AnyValue::from_float(value / n));
+        break;
+      case GroupAggregate::Kind::Min:
+      case GroupAggregate::Kind::Max:
+        values.push_back(best);
+        break;
+    }
+  }
+  return values;
+}
+
+void GroupByOperator::aggregate_all() {
+  std::vector<Partial> partials;
+  size_t n = 0;
+
+  // a view of every base row is split on the chunks, so morsels cover whole
+  // chunks and read contiguous buffers
+  static_assert(kBatchSize == kColumnChunkSize);
+  if (auto view = child_->remaining(); view.has_value()) {
+    std::vector<Morsel> morsels;
+    for (size_t begin = 0; begin < view->num_rows(); begin += kBatchSize) {
+      size_t end = std::min(view->num_rows(), begin + kBatchSize);
+      morsels.push_back({&view.value(), begin, end});
+    }
+    fold_all(morsels, partials);
+    n = view->num_rows();
+  } else {
+    // the batches are folded as they are pulled, one per worker at a time,
+    // instead of being collected into a single view first
+    size_t width = pool_ != nullptr ? pool_->num_workers() : 1;
+    std::vector<TableView> batches;
+    std::vector<Morsel> morsels;
+
+    bool exhausted = false;
+    while (!exhausted) {
+      batches.clear();
+      while (batches.size() < width) {
+        auto batch = child_->next();
+        if (!batch.has_value()) {
+          exhausted = true;
+          break;
+        }
+        batches.push_back(std::move(batch.value()));
+      }
+
+      morsels.clear();
+      for (auto &batch : batches) {
+        morsels.push_back({&batch, 0, batch.num_rows()});
+        n += batch.num_rows();
+      }
+      fold_all(morsels, partials);
+    }
+  }
+
+  auto table = Table::create_ptr("", shape_.schema());
+  table->add_row(combine_all(partials, n));
+  result_.emplace(TableView(table));
+}
+
+void GroupByOperator::aggregate() {
+  if (key_indices_.empty()) {
+    aggregate_all();
+    return;
+  }
+
+  auto input = collect(*child_);
+  size_t n = input.num_rows();
+
+  std::vector<const Column *> keys;
+  for (auto key_index : key_indices_) {
+    keys.push_back(&input.column(key_index));
+  }
+  std::vector<uint64_t> hashes(n);
+  auto hash_rows = [&](size_t begin, size_t end) {
+    for (size_t pos = begin; pos < end; pos++) {
+      size_t row = input.row_index(pos);
+      uint64_t hash = 0;
+      for (auto column : keys) {
+        hash = (hash ^ column->hash(row)) * 0x9e3779b97f4a7c15ULL;
+      }
+      hashes[pos] = hash;
+    }
+  };
+
+  std::vector<Partition> partitions;
+  if (pool_ == nullptr || n < kParallelGroupRows) {
+    hash_rows(0, n);
+    auto &partition = partitions.emplace_back();
+    partition.positions.resize(n);
+    for (size_t pos = 0; pos < n; pos++) {
+      partition.positions[pos] = pos;
+    }
+    group(input, hashes, partition);
+    fold(input, partition);
+  } else {
+    pool_->parallel_for(n, kBatchSize, hash_rows);
+
+    // a few partitions per worker, chosen by the top bits of the hashes, the
+    // slots of their tables by the low bits
+    size_t bits = 1;
+    while ((size_t(1) << bits) < 4 * pool_->num_workers()) {
+      bits++;
+    }
+    size_t num_partitions = size_t(1) << bits;
+    auto partition_of = [&](size_t pos) { return hashes[pos] >> (64 - bits); };
+    partitions.resize(num_partitions);
+
+    // scatter the positions a morsel at a time, every morsel to its own
+    // offsets, so the partitions stay in input order
+    size_t num_morsels = (n + kBatchSize - 1) / kBatchSize;
+    std::vector<size_t> offsets(num_morsels * num_partitions);
+    pool_->parallel_for(num_morsels, 1, [&](size_t begin, size_t end) {
+      for (size_t m = begin; m < end; m++) {
+        size_t end_pos = std::min(n, (m + 1) * kBatchSize);
+        for (size_t pos = m * kBatchSize; pos < end_pos; pos++) {
+          offsets[m * num_partitions + partition_of(pos)]++;
+        }
+      }
+    });
+    for (size_t p = 0; p < num_partitions; p++) {
+      size_t total = 0;
+      for (size_t m = 0; m < num_morsels; m++) {
+        size_t count = offsets[m * num_partitions + p];
+        offsets[m * num_partitions + p] = total;
+        total += count;
+      }
+      partitions[p].positions.resize(total);
+    }
+    pool_->parallel_for(num_morsels, 1, [&](size_t begin, size_t end) {
+      for (size_t m = begin; m < end; m++) {
+        size_t end_pos = std::min(n, (m + 1) * kBatchSize);
+        for (size_t pos = m * kBatchSize; pos < end_pos; pos++) {
+          size_t p = partition_of(pos);
+          partitions[p].positions[offsets[m * num_partitions + p]++] = pos;
+        }
+      }
+    });
+
+    pool_->parallel_for(num_partitions, 1, [&](size_t begin, size_t end) {
+      for (size_t p = begin; p < end; p++) {
+        group(input, hashes, partitions[p]);
+        fold(input, partitions[p]);
+      }
+    });
+  }
+
+  // groups in the order they first appear
+  struct GroupRef {
+    size_t first;
+    size_t partition;
+    size_t group;
+  };
+  std::vector<GroupRef> refs;
+  for (size_t p = 0; p < partitions.size(); p++) {
+    for (size_t g = 0; g < partitions[p].firsts.size(); g++) {
+      refs.push_back({partitions[p].firsts[g], p, g});
+    }
+  }
+  if (partitions.size() > 1) {
+    std::sort(refs.begin(), refs.end(),
+              [](auto &lhs, auto &rhs) { return lhs.first < rhs.first; });
+  }
+
+  auto table = Table::create_ptr("", shape_.schema());
+  ValueList values;
+  for (auto &ref : refs) {
+    auto &partition = partitions[ref.partition];
+    values.clear();
+    for (auto key_index : key_indices_) {
+      values.push_back(input.get(ref.first, key_index));
+    }
+    for (size_t a = 0; a < aggregates_.size(); a++) {
+      auto &aggregate = aggregates_[a];
+      switch (aggregate.kind) {
+        case GroupAggregate::Kind::Count:
+        case GroupAggregate::Kind::Sum:
+          values.push_back(
+              AnyValue::from_float(partition.values[a][ref.group]));
+          break;
+        case GroupAggregate::Kind::Avg:
+          values.push_back(AnyValue::from_float(
+              partition.values[a][ref.group] / partition.sizes[ref.group]));
+          break;
+        case GroupAggregate::Kind::Min:
+        case GroupAggregate::Kind::Max: {
+          size_t row = partition.rows[a][ref.group];
+          values.push_back(
+              row == SIZE_MAX
+                  ? AnyValue::from_null()
+                  : input.column(aggregate.field_index.value()).get(row));
+          break;
+        }
+      }
+    }
+    table->add_row(values);
+  }
+  result_.emplace(TableView(table));
+}
+
+std::optional<TableView> GroupByOperator::next() {
+  if (!result_.has_value()) {
+    aggregate();
+  }
+  return result_->next();
+}
+
+std::optional<TableView> GroupByOperator::remaining() {
+  if (!result_.has_value()) {
+    aggregate();
+  }
+  return result_->remaining();
+}
@@ -0,0 +1,344 @@
+#include "lumidb/plan.hh"
+
+#include <algorithm>
+
+#include "lumidb/filter.hh"
+#include "lumidb/predicate.hh"
+
+using namespace lumidb;
+
+using Node = QueryPlan::Node;
+
+// Build
+
+static void add_unique(std::vector<std::string> &fields,
+                       const std::string &name) {
+  if (std::find(fields.begin(), fields.end(), name) == fields.end()) {
+    fields.push_back(name);
+  }
+}
+
+// the fields a `where` reads, resolved as `WhereFunction` does without
+// compiling the predicates
+static std::optional<std::vector<std::string>> filter_fields(
+    const ValueList &args, const TableSchema &schema) {
+  if (args.empty() || !args[0].is_string() ||
+      (args.size() > 1 && !args[1].is_string())) {
+    return std::nullopt;
+  }
+
+  std::vector<std::string> fields;
+  if (args.size() == 1) {
+    auto indices = FilterExpr::fields_of(args[0].as_string_view(), schema);
+    if (indices.has_error()) {
+      return std::nullopt;
+    }
+    for (auto field_idx : indices.unwrap()) {
+      add_unique(fields, schema.get_field(field_idx).name);
+    }
+    return fields;
+  }
+
+  if (schema.get_field_index(args[0].as_string()).has_error() ||
+      Predicate::check(args[1].as_string_view(), args.size() - 2)
+          .has_error()) {
+    return std::nullopt;
+  }
+  fields.push_back(args[0].as_string());
+  return fields;
+}
+
+// the fields of a `select` or a sort, std::nullopt if one doesn't resolve
+static std::optional<std::vector<std::string>> named_fields(
+    const ValueList &args, const TableSchema &schema) {
+  if (args.empty()) {
+    return std::nullopt;
+  }
+
+  std::vector<std::string> fields;
+  for (auto &arg : args) {
+    if (!arg.is_string() ||
+        schema.get_field_index(arg.as_string()).has_error()) {
+      return std::nullopt;
+    }
+    fields.push_back(arg.as_string());
+  }
+  return fields;
+}
+
+std::optional<QueryPlan> QueryPlan::build(const Query &query,
+                                          const TableSchema &schema) {
+  auto &functions = query.functions;
+  if (functions.empty() || functions[0].name != "query") {
+    return std::nullopt;
+  }
+
+  QueryPlan plan;
+  plan.root_ = functions[0];
+  plan.table_fields_ = schema.field_names();
+
+  // the fields a stage resolves, narrowed by the selects before it
+  TableSchema visible = schema;
+  size_t i = 1;
+  for (; i < functions.size(); i++) {
+    auto &function = functions[i];
+    auto &args = function.arguments;
+    Node node{.kind = Node::Kind::Filter, .function = function};
+
+    if (function.name == "where") {
+      auto fields = filter_fields(args, visible);
+      if (!fields) {
+        return std::nullopt;
+      }
+      node.fields = std::move(fields.value());
+    } else if (function.name == "select") {
+      auto fields = named_fields(args, visible);
+      if (!fields) {
+        return std::nullopt;
+      }
+
+      TableSchema selected;
+      for (auto &name : fields.value()) {
+        auto field_idx = visible.get_field_index(name).unwrap();
+        auto &field = visible.get_field(field_idx);
+        // a field selected twice can't be told apart by name
+        if (selected.add_field(name, field.type).has_error()) {
+          return std::nullopt;
+        }
+      }
+      visible = std::move(selected);
+      node.kind = Node::Kind::Project;
+      node.fields = std::move(fields.value());
+    } else if (function.name == "sort" || function.name == "sort_desc") {
+      auto fields = named_fields(args, visible);
+      if (!fields) {
+        return std::nullopt;
+      }
+      node.kind = Node::Kind::Sort;
+      node.fields = std::move(fields.value());
+    } else if (function.name == "limit") {
+      if (args.size() != 1 || !args[0].is_float() ||
+          !(args[0].as_float() >= 0)) {
+        return std::nullopt;
+      }
+      node.kind = Node::Kind::Limit;
+      node.limit = args[0].as_float();
+    } else {
+      break;
+    }
+
+    plan.nodes_.push_back(std::move(node));
+  }
+
+  plan.rest_.assign(functions.begin() + i, functions.end());
+  return plan;
+}
+
+// Rewrite
+
+void QueryPlan::optimize() {
+  auto output = take_projections();
+  push_down_filters();
+  drop_redundant_sorts();
+  fold_limits();
+  push_down_projection(std::move(output));
+}
+
+std::optional<std::vector<std::string>> QueryPlan::take_projections() {
+  std::optional<std::vector<std::string>> output;
+  std::vector<Node> nodes;
+  for (auto &node : nodes_) {
+    if (node.kind == Node::Kind::Project) {
+      output = std::move(node.fields);
+    } else {
+      nodes.push_back(std::move(node));
+    }
+  }
+  nodes_ = std::move(nodes);
+  return output;
+}
+
+// the args are the same values, `AnyValue::operator==` takes close floats
+// as equal
+static bool same_function(const QueryFunction &lhs, const QueryFunction &rhs) {
+  if (lhs.name != rhs.name || lhs.arguments.size() != rhs.arguments.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < lhs.arguments.size(); i++) {
+    auto &l = lhs.arguments[i];
+    auto &r = rhs.arguments[i];
+    if (l.is_float() != r.is_float() || l.is_string() != r.is_string() ||
+        l.is_null() != r.is_null() ||
+        (l.is_float() && l.as_float() != r.as_float()) ||
+        (l.is_string() && l.as_string_view() != r.as_string_view())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void QueryPlan::push_down_filters() {
+  std::vector<Node> nodes;
+  for (auto &node : nodes_) {
+    if (node.kind != Node::Kind::Filter) {
+      nodes.push_back(std::move(node));
+      continue;
+    }
+
+    // sorts keep the order of the rows that pass, pass them and the filters
+    // right before them
+    auto pos = nodes.size();
+    while (pos > 0 && (nodes[pos - 1].kind == Node::Kind::Sort ||
+                       nodes[pos - 1].kind == Node::Kind::Filter)) {
+      pos--;
+    }
+    // the filters the rows already passed
+    bool repeated = false;
+    for (auto i = pos; i < nodes.size(); i++) {
+      repeated = repeated || (nodes[i].kind == Node::Kind::Filter &&
+                              same_function(nodes[i].function, node.function));
+    }
+    if (repeated) {
+      continue;
+    }
+
+    while (pos < nodes.size() && nodes[pos].kind == Node::Kind::Filter) {
+      pos++;
+    }
+    nodes.insert(nodes.begin() + pos, std::move(node));
+  }
+  nodes_ = std::move(nodes);
+}
+
+void QueryPlan::drop_redundant_sorts() {
+  auto covers = [](const Node &sort, const Node &later) {
+    return std::all_of(sort.fields.begin(), sort.fields.end(),
+                       [&](const std::string &name) {
+                         return std::find(later.fields.begin(),
+                                          later.fields.end(),
+                                          name) != later.fields.end();
+                       });
+  };
+
+  // rows tied by a later sort are tied by an earlier sort on some of its
+  // fields too, which kept them in input order, so only the later order
+  // shows
+  std::vector<Node> nodes;
+  for (size_t i = 0; i < nodes_.size(); i++) {
+    bool overridden = false;
+    for (size_t j = i + 1; nodes_[i].kind == Node::Kind::Sort &&
+                           j < nodes_.size() &&
+                           nodes_[j].kind == Node::Kind::Sort;
+         j++) {
+      overridden = overridden || covers(nodes_[i], nodes_[j]);
+    }
+    if (!overridden) {
+      nodes.push_back(std::move(nodes_[i]));
+    }
+  }
+
+  // `count` doesn't see the order of the rows after the last limit
+  if (!rest_.empty() && rest_[0].name == "count") {
+    while (!nodes.empty() && nodes.back().kind == Node::Kind::Sort) {
+      nodes.pop_back();
+    }
+  }
+  nodes_ = std::move(nodes);
+}
+
+void QueryPlan::fold_limits() {
+  std::vector<Node> nodes;
+  for (auto &node : nodes_) {
+    if (node.kind == Node::Kind::Limit && !nodes.empty() &&
+        (nodes.back().kind == Node::Kind::Limit ||
+         nodes.back().kind == Node::Kind::Sort)) {
+      auto &limit = nodes.back().limit;
+      limit = limit ? std::min(*limit, *node.limit) : *node.limit;
+      continue;
+    }
+    nodes.push_back(std::move(node));
+  }
+  nodes_ = std::move(nodes);
+}
+
+std::vector<std::string> QueryPlan::fields_read(size_t begin) const {
+  std::vector<std::string> fields;
+  for (size_t i = begin; i < nodes_.size(); i++) {
+    for (auto &name : nodes_[i].fields) {
+      add_unique(fields, name);
+    }
+  }
+  return fields;
+}
+
+void QueryPlan::push_down_projection(
+    std::optional<std::vector<std::string>> output) {
+  if (!output || output.value() == table_fields_) {
+    return;
+  }
+
+  // right after the filters on the scan, which may be looked up in indexes
+  size_t pos = 0;
+  while (pos < nodes_.size() && nodes_[pos].kind == Node::Kind::Filter) {
+    pos++;
+  }
+
+  auto fields = output.value();
+  for (auto &name : fields_read(pos)) {
+    add_unique(fields, name);
+  }
+  if (fields != table_fields_) {
+    nodes_.insert(nodes_.begin() + pos,
+                  Node{.kind = Node::Kind::Project, .fields = fields});
+  }
+  if (fields != output.value()) {
+    nodes_.push_back(
+        Node{.kind = Node::Kind::Project, .fields = std::move(output.value())});
+  }
+}
+
+// Query
+
+static QueryFunction limit_function(float limit) {
+  return {"limit", {AnyValue::from_float(limit)}};
+}
+
+Query QueryPlan::to_query() const {
+  Query query;
+  query.functions.push_back(root_);
+  for (auto &node : nodes_) {
+    switch (node.kind) {
+      case Node::Kind::Filter:
+        query.functions.push_back(node.function);
+        break;
+      case Node::Kind::Project: {
+        ValueList args;
+        for (auto &name : node.fields) {
+          args.push_back(AnyValue::from_string(name));
+        }
+        query.functions.push_back({"select", std::move(args)});
+        break;
+      }
+      case Node::Kind::Sort:
+        query.functions.push_back(node.function);
+        if (node.limit) {
+          query.functions.push_back(limit_function(*node.limit));
+        }
+        break;
+      case Node::Kind::Limit:
+        query.functions.push_back(limit_function(*node.limit));
+        break;
+    }
+  }
+  query.functions.insert(query.functions.end(), rest_.begin(), rest_.end());
+  return query;
+}
+
+Query lumidb::optimize_query(const Query &query, const TableSchema &schema) {
+  auto plan = QueryPlan::build(query, schema);
+  if (!plan) {
+    return query;
+  }
+  plan->optimize();
+  return plan->to_query();
+}
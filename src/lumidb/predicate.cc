@@ -0,0 +1,670 @@
+#include "lumidb/predicate.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <string_view>
+#include <type_traits>
+
+#include "lumidb/simd.hh"
+
+using namespace lumidb;
+
+namespace {
+
+// bits [off, off + n) of a bitmap of num_words words, as the low bits of a
+// word, n <= 64
+uint64_t load_bits(const uint64_t *bits, size_t num_words, size_t off,
+                   size_t n) {
+  size_t idx = off / 64, shift = off % 64;
+  uint64_t word = bits[idx] >> shift;
+  if (shift != 0 && idx + 1 < num_words) {
+    word |= bits[idx + 1] << (64 - shift);
+  }
+  return n == 64 ? word : word & ((uint64_t(1) << n) - 1);
+}
+
+// or the low n bits of word into the bitmap from bit pos on, the other bits
+// of word must be 0
+void store_bits(uint64_t *bits, size_t pos, uint64_t word, size_t n) {
+  size_t idx = pos / 64, shift = pos % 64;
+  bits[idx] |= word << shift;
+  if (shift != 0 && shift + n > 64) {
+    bits[idx + 1] |= word >> (64 - shift);
+  }
+}
+
+// `cell <op> value` as `AnyValue::get_comparator(op)` on cells of a kind
+template <CompareOperator Op>
+struct Compare {
+  bool operator()(float cell, float value) const {
+    if constexpr (Op == CompareOperator::EQ) {
+      return compare_float(cell, value) == 0;
+    } else if constexpr (Op == CompareOperator::LT) {
+      return cell < value;
+    } else if constexpr (Op == CompareOperator::GT) {
+      return cell > value;
+    } else if constexpr (Op == CompareOperator::LE) {
+      return compare_float(cell, value) <= 0;
+    } else if constexpr (Op == CompareOperator::GE) {
+      return compare_float(cell, value) >= 0;
+    } else {
+      return compare_float(cell, value) != 0;
+    }
+  }
+
+  template <typename T>
+  bool operator()(const T &cell, const T &value) const {
+    if constexpr (Op == CompareOperator::EQ) {
+      return cell == value;
+    } else if constexpr (Op == CompareOperator::LT) {
+      return cell < value;
+    } else if constexpr (Op == CompareOperator::GT) {
+      return value < cell;
+    } else if constexpr (Op == CompareOperator::LE) {
+      return cell < value || cell == value;
+    } else if constexpr (Op == CompareOperator::GE) {
+      return value < cell || cell == value;
+    } else {
+      return !(cell == value);
+    }
+  }
+};
+
+// the rows of the set bits of the bitmap, row_at maps a bit to its row
+template <typename RowAt>
+RowIndicesList selected_rows(const SelectionBitmap &bitmap, RowAt row_at) {
+  size_t count = 0;
+  for (auto word : bitmap) {
+    count += __builtin_popcountll(word);
+  }
+
+  RowIndicesList rows(count);
+  size_t *out = rows.data();
+  for (size_t i = 0; i < bitmap.size(); i++) {
+    for (uint64_t word = bitmap[i]; word != 0; word &= word - 1) {
+      *out++ = row_at(i * 64 + __builtin_ctzll(word));
+    }
+  }
+  return rows;
+}
+
+// rows holds consecutive row indices in order, like the batches of a scan
+bool is_range(const RowIndicesList &rows) {
+  if (rows.empty() || rows.back() - rows.front() + 1 != rows.size()) {
+    return false;
+  }
+  // without an early exit, so the loop is vectorized
+  size_t diff = 0;
+  for (size_t i = 0; i < rows.size(); i++) {
+    diff |= rows[i] ^ (rows.front() + i);
+  }
+  return diff == 0;
+}
+
+}  // namespace
+
+namespace lumidb {
+
+struct PredicateKernels {
+  // the cells of a storage and how a cell is tested. Null cells of float and
+  // string storage are handled by the kernels.
+  struct FloatCells {
+    static const float *of(const Column::Chunk &chunk) {
+      return chunk.floats.data();
+    }
+    template <typename Test>
+    static bool test(const Predicate &p, Test test, const float *cells,
+                     size_t off) {
+      return test(p, cells[off]);
+    }
+  };
+
+  struct StringCells {
+    static const AnyValue *of(const Column::Chunk &chunk) {
+      return chunk.strings.data();
+    }
+    template <typename Test>
+    static bool test(const Predicate &p, Test test, const AnyValue *cells,
+                     size_t off) {
+      return test(p, cells[off].as_string_view());
+    }
+  };
+
+  // null cells are values of their own
+  struct GenericCells {
+    static const AnyValue *of(const Column::Chunk &chunk) {
+      return chunk.values.data();
+    }
+    template <typename Test>
+    static bool test(const Predicate &p, Test test, const AnyValue *cells,
+                     size_t off) {
+      return test(p, cells[off]);
+    }
+  };
+
+  // no value has the kind of the non-null cells, which all test the same
+  struct OtherKindCells {
+    static const void *of(const Column::Chunk &) { return nullptr; }
+    template <typename Test>
+    static bool test(const Predicate &p, Test, const void *, size_t) {
+      return p.other_kind_result_;
+    }
+  };
+
+  // the tests of a cell of each kind. Vectorized tests also compare n float
+  // cells into a bitmap.
+  template <CompareOperator Op>
+  struct CompareTest {
+    static constexpr bool kVectorized = true;
+    static void compare_floats(const Predicate &p, const float *cells,
+                               size_t n, uint64_t *bits) {
+      simd::compare_floats(Op, cells, n, p.number_, bits);
+    }
+    bool operator()(const Predicate &p, float cell) const {
+      return Compare<Op>()(cell, p.number_);
+    }
+    bool operator()(const Predicate &p, std::string_view cell) const {
+      return Compare<Op>()(cell, std::string_view(p.string_));
+    }
+    bool operator()(const Predicate &p, const AnyValue &cell) const {
+      return Compare<Op>()(cell, p.values_[0]);
+    }
+  };
+
+  struct BetweenTest {
+    static constexpr bool kVectorized = true;
+    static void compare_floats(const Predicate &p, const float *cells,
+                               size_t n, uint64_t *bits) {
+      uint64_t high[kColumnChunkSize / 64];
+      simd::compare_floats(CompareOperator::GE, cells, n, p.number_, bits);
+      simd::compare_floats(CompareOperator::LE, cells, n, p.high_number_,
+                           high);
+      for (size_t i = 0; i < (n + 63) / 64; i++) {
+        bits[i] &= high[i];
+      }
+    }
+    template <typename T, typename V>
+    static bool test(const T &cell, const V &low, const V &high) {
+      return Compare<CompareOperator::GE>()(cell, low) &&
+             Compare<CompareOperator::LE>()(cell, high);
+    }
+    bool operator()(const Predicate &p, float cell) const {
+      return test(cell, p.number_, p.high_number_);
+    }
+    bool operator()(const Predicate &p, std::string_view cell) const {
+      return test(cell, std::string_view(p.string_),
+                  std::string_view(p.high_string_));
+    }
+    bool operator()(const Predicate &p, const AnyValue &cell) const {
+      return test(cell, p.values_[0], p.values_[1]);
+    }
+  };
+
+  struct InTest {
+    static constexpr bool kVectorized = false;
+    static void compare_floats(const Predicate &, const float *, size_t,
+                               uint64_t *) {}
+    bool operator()(const Predicate &p, float cell) const {
+      return p.contains(cell);
+    }
+    bool operator()(const Predicate &p, std::string_view cell) const {
+      return p.contains(cell);
+    }
+    bool operator()(const Predicate &p, const AnyValue &cell) const {
+      if (cell.is_float()) {
+        return p.contains(cell.as_float());
+      } else if (cell.is_string()) {
+        return p.contains(cell.as_string_view());
+      }
+      return p.null_result_;
+    }
+  };
+
+  template <typename Cells, typename Test, bool Nullable>
+  static void range(const Predicate &p, const Column::Chunk &chunk,
+                    size_t begin, size_t end, uint64_t *bits, size_t pos) {
+    auto cells = Cells::of(chunk);
+    Test test;
+    uint64_t null_mask = p.null_result_ ? ~uint64_t(0) : 0;
+    // float cells are compared by the vector kernels
+    constexpr bool vectorized =
+        std::is_same_v<Cells, FloatCells> && Test::kVectorized;
+    uint64_t words[vectorized ? kColumnChunkSize / 64 : 1];
+    if constexpr (vectorized) {
+      Test::compare_floats(p, cells + begin, end - begin, words);
+    }
+    for (size_t off = begin; off < end; off += 64) {
+      size_t n = std::min<size_t>(64, end - off);
+      uint64_t word = 0;
+      if constexpr (vectorized) {
+        word = words[(off - begin) / 64];
+      } else {
+        for (size_t j = 0; j < n; j++) {
+          word |= uint64_t(Cells::test(p, test, cells, off + j)) << j;
+        }
+      }
+      if constexpr (Nullable) {
+        uint64_t nulls =
+            load_bits(chunk.null_bits.data(), chunk.null_bits.size(), off, n);
+        word = (word & ~nulls) | (nulls & null_mask);
+      }
+      store_bits(bits, pos + (off - begin), word, n);
+    }
+  }
+
+  template <typename Cells, typename Test, bool Nullable>
+  static void gather(const Predicate &p, const Column &column,
+                     const size_t *rows, size_t count, uint64_t *bits) {
+    Test test;
+    for (size_t i = 0; i < count; i += 64) {
+      size_t n = std::min<size_t>(64, count - i);
+      uint64_t word = 0;
+      for (size_t j = 0; j < n; j++) {
+        size_t row = rows[i + j];
+        auto &chunk = column.chunk(row / kColumnChunkSize);
+        size_t off = row % kColumnChunkSize;
+        bool pass;
+        if (Nullable && ((chunk.null_bits[off / 64] >> (off % 64)) & 1)) {
+          pass = p.null_result_;
+        } else {
+          pass = Cells::test(p, test, Cells::of(chunk), off);
+        }
+        word |= uint64_t(pass) << j;
+      }
+      bits[i / 64] = word;
+    }
+  }
+
+  template <typename Cells, typename Test>
+  static void assign(Predicate &p) {
+    // generic cells carry their nulls
+    constexpr bool nullable = !std::is_same_v<Cells, GenericCells>;
+    p.range_kernels_[0] = range<Cells, Test, false>;
+    p.range_kernels_[1] = range<Cells, Test, nullable>;
+    p.gather_kernels_[0] = gather<Cells, Test, false>;
+    p.gather_kernels_[1] = gather<Cells, Test, nullable>;
+  }
+
+  template <typename Cells>
+  static void assign_compare(Predicate &p, CompareOperator op) {
+    switch (op) {
+      case CompareOperator::EQ:
+        return assign<Cells, CompareTest<CompareOperator::EQ>>(p);
+      case CompareOperator::LT:
+        return assign<Cells, CompareTest<CompareOperator::LT>>(p);
+      case CompareOperator::GT:
+        return assign<Cells, CompareTest<CompareOperator::GT>>(p);
+      case CompareOperator::LE:
+        return assign<Cells, CompareTest<CompareOperator::LE>>(p);
+      case CompareOperator::GE:
+        return assign<Cells, CompareTest<CompareOperator::GE>>(p);
+      case CompareOperator::NE:
+        return assign<Cells, CompareTest<CompareOperator::NE>>(p);
+    }
+  }
+
+  // the kernels of float or string storage, sample is a cell of the storage
+  // kind. unpack(value, high) stores a value of that kind as the value or
+  // the high bound.
+  template <typename Cells, typename Unpack>
+  static void assign_typed(Predicate &p, const AnyValue &sample,
+                           Unpack unpack) {
+    auto &values = p.values_;
+    auto of_kind = [&](const AnyValue &value) {
+      return value.kind() == sample.kind();
+    };
+    switch (p.kind_) {
+      case Predicate::Kind::Compare:
+        if (!of_kind(values[0])) {
+          return assign<OtherKindCells, CompareTest<CompareOperator::EQ>>(p);
+        }
+        unpack(values[0], false);
+        return assign_compare<Cells>(p, p.op_);
+      case Predicate::Kind::Between: {
+        bool low = of_kind(values[0]), high = of_kind(values[1]);
+        if (low && high) {
+          unpack(values[0], false);
+          unpack(values[1], true);
+          return assign<Cells, BetweenTest>(p);
+        }
+        // a bound of another kind passes every cell or none
+        bool low_passes =
+            low || Compare<CompareOperator::GE>()(sample, values[0]);
+        bool high_passes =
+            high || Compare<CompareOperator::LE>()(sample, values[1]);
+        p.other_kind_result_ = low_passes && high_passes;
+        if (p.other_kind_result_ && low) {
+          unpack(values[0], false);
+          return assign_compare<Cells>(p, CompareOperator::GE);
+        }
+        if (p.other_kind_result_ && high) {
+          unpack(values[1], false);
+          return assign_compare<Cells>(p, CompareOperator::LE);
+        }
+        return assign<OtherKindCells, BetweenTest>(p);
+      }
+      case Predicate::Kind::In:
+        if (std::none_of(values.begin(), values.end(), of_kind)) {
+          return assign<OtherKindCells, InTest>(p);
+        }
+        return assign<Cells, InTest>(p);
+      case Predicate::Kind::IsNull:
+      case Predicate::Kind::NotNull:
+        return assign<OtherKindCells, InTest>(p);
+    }
+  }
+};
+
+}  // namespace lumidb
+
+Predicate::Predicate(const AnyType &field_type, CompareOperator op,
+                     AnyValue value)
+    : Predicate(Kind::Compare, op, {std::move(value)}) {
+  compile(field_type);
+}
+
+Predicate::Predicate(Kind kind, CompareOperator op, ValueList values)
+    : kind_(kind), op_(op), values_(std::move(values)) {}
+
+Predicate Predicate::between(const AnyType &field_type, AnyValue low,
+                             AnyValue high) {
+  Predicate predicate(Kind::Between, CompareOperator::EQ,
+                      {std::move(low), std::move(high)});
+  predicate.compile(field_type);
+  return predicate;
+}
+
+Predicate Predicate::in(const AnyType &field_type, ValueList values) {
+  Predicate predicate(Kind::In, CompareOperator::EQ, std::move(values));
+  predicate.compile(field_type);
+  return predicate;
+}
+
+Predicate Predicate::is_null(const AnyType &field_type) {
+  Predicate predicate(Kind::IsNull, CompareOperator::EQ, {});
+  predicate.compile(field_type);
+  return predicate;
+}
+
+Predicate Predicate::not_null(const AnyType &field_type) {
+  Predicate predicate(Kind::NotNull, CompareOperator::EQ, {});
+  predicate.compile(field_type);
+  return predicate;
+}
+
+Result<bool> Predicate::check(std::string_view op, size_t num_values) {
+  if (op == "between") {
+    if (num_values != 2) {
+      return Error("between takes 2 values, got {}", num_values);
+    }
+    return true;
+  } else if (op == "in") {
+    if (num_values == 0) {
+      return Error("in takes at least 1 value");
+    }
+    return true;
+  } else if (op == "is_null" || op == "not_null") {
+    if (num_values != 0) {
+      return Error("{} takes no value, got {}", op, num_values);
+    }
+    return true;
+  }
+
+  auto compare_op = AnyValue::parse_compare_operator(op);
+  if (compare_op.has_error()) {
+    return compare_op.unwrap_err();
+  }
+  if (num_values != 1) {
+    return Error("{} takes 1 value, got {}", op, num_values);
+  }
+  return true;
+}
+
+Result<Predicate> Predicate::parse(const AnyType &field_type,
+                                   std::string_view op, ValueList values) {
+  if (auto res = check(op, values.size()); res.has_error()) {
+    return res.unwrap_err();
+  }
+
+  if (op == "between") {
+    return between(field_type, std::move(values[0]), std::move(values[1]));
+  } else if (op == "in") {
+    return in(field_type, std::move(values));
+  } else if (op == "is_null") {
+    return is_null(field_type);
+  } else if (op == "not_null") {
+    return not_null(field_type);
+  }
+  return Predicate(field_type,
+                   AnyValue::parse_compare_operator(op).unwrap(),
+                   std::move(values[0]));
+}
+
+void Predicate::compile(const AnyType &field_type) {
+  if (kind_ == Kind::In) {
+    for (auto &value : values_) {
+      if (value.is_float() && std::isnan(value.as_float())) {
+        has_nan_member_ = true;
+      } else if (value.is_float()) {
+        for (auto key : Column::lookup_keys(value)) {
+          float_members_[key].push_back(value.as_float());
+        }
+      } else if (value.is_string()) {
+        auto str = value.as_string_view();
+        string_members_[std::hash<std::string_view>()(str)].emplace_back(str);
+      }
+    }
+  }
+
+  null_result_ = test(AnyValue::from_null());
+  other_kind_result_ = false;
+
+  using Kernels = PredicateKernels;
+  switch (Column::storage_of(field_type)) {
+    case Column::Storage::Float: {
+      auto sample = AnyValue::from_float(0);
+      other_kind_result_ = test(sample);
+      Kernels::assign_typed<Kernels::FloatCells>(
+          *this, sample, [this](const AnyValue &value, bool high) {
+            (high ? high_number_ : number_) = value.as_float();
+          });
+      break;
+    }
+    case Column::Storage::String: {
+      auto sample = AnyValue::from_string("");
+      other_kind_result_ = test(sample);
+      Kernels::assign_typed<Kernels::StringCells>(
+          *this, sample, [this](const AnyValue &value, bool high) {
+            (high ? high_string_ : string_) = value.as_string();
+          });
+      break;
+    }
+    case Column::Storage::Generic:
+      switch (kind_) {
+        case Kind::Compare:
+          Kernels::assign_compare<Kernels::GenericCells>(*this, op_);
+          break;
+        case Kind::Between:
+          Kernels::assign<Kernels::GenericCells, Kernels::BetweenTest>(*this);
+          break;
+        case Kind::In:
+          Kernels::assign<Kernels::GenericCells, Kernels::InTest>(*this);
+          break;
+        case Kind::IsNull:
+        case Kind::NotNull:
+          // the null bits of generic cells are kept too
+          other_kind_result_ = kind_ == Kind::NotNull;
+          Kernels::assign<Kernels::OtherKindCells, Kernels::InTest>(*this);
+          break;
+      }
+      break;
+  }
+}
+
+bool Predicate::test(const AnyValue &cell) const {
+  switch (kind_) {
+    case Kind::Compare:
+      return AnyValue::get_comparator(op_)(cell, values_[0]);
+    case Kind::Between:
+      return PredicateKernels::BetweenTest::test(cell, values_[0],
+                                                 values_[1]);
+    case Kind::In:
+      return std::any_of(values_.begin(), values_.end(),
+                         [&](const AnyValue &value) { return cell == value; });
+    case Kind::IsNull:
+      return cell.is_null();
+    case Kind::NotNull:
+      return !cell.is_null();
+  }
+  return false;
+}
+
+bool Predicate::contains(float cell) const {
+  if (has_nan_member_) {
+    return true;
+  }
+  auto it = float_members_.find(Column::index_key(AnyValue::from_float(cell)));
+  if (it == float_members_.end()) {
+    return false;
+  }
+  return std::any_of(it->second.begin(), it->second.end(), [&](float value) {
+    return compare_float(cell, value) == 0;
+  });
+}
+
+bool Predicate::contains(std::string_view cell) const {
+  auto it = string_members_.find(std::hash<std::string_view>()(cell));
+  if (it == string_members_.end()) {
+    return false;
+  }
+  return std::find(it->second.begin(), it->second.end(), cell) !=
+         it->second.end();
+}
+
+bool Predicate::may_match(const Column &column, size_t chunk_index) const {
+  auto &chunk = column.chunk(chunk_index);
+  switch (kind_) {
+    case Kind::Compare:
+      return column.may_match(chunk_index, op_, values_[0]);
+    case Kind::Between:
+      return column.may_match(chunk_index, CompareOperator::GE, values_[0]) &&
+             column.may_match(chunk_index, CompareOperator::LE, values_[1]);
+    case Kind::In:
+      return std::any_of(
+          values_.begin(), values_.end(), [&](const AnyValue &value) {
+            return column.may_match(chunk_index, CompareOperator::EQ, value);
+          });
+    case Kind::IsNull:
+      return chunk.null_count > 0;
+    case Kind::NotNull:
+      return chunk.null_count < chunk.size;
+  }
+  return true;
+}
+
+bool Predicate::may_match(const TableView &view, size_t field_index) const {
+  return view.may_match(field_index,
+                        [&](const Column &column, size_t chunk_index) {
+                          return may_match(column, chunk_index);
+                        });
+}
+
+std::optional<RowIndicesList> Predicate::lookup(const Table &table,
+                                                size_t field_index) const {
+  auto &column = table.column(field_index);
+  auto equal = [&](const AnyValue &value) {
+    if (column.can_lookup(value)) {
+      return std::optional(column.lookup(value));
+    }
+    return table.range(field_index, CompareOperator::EQ, value);
+  };
+
+  switch (kind_) {
+    case Kind::Compare:
+      if (op_ == CompareOperator::EQ) {
+        return equal(values_[0]);
+      }
+      return table.range(field_index, op_, values_[0]);
+    case Kind::Between:
+      return table.range(field_index, {{CompareOperator::GE, values_[0]},
+                                       {CompareOperator::LE, values_[1]}});
+    case Kind::In: {
+      RowIndicesList rows;
+      for (auto &value : values_) {
+        auto matched = equal(value);
+        if (!matched) {
+          return std::nullopt;
+        }
+        rows.insert(rows.end(), matched->begin(), matched->end());
+      }
+      std::sort(rows.begin(), rows.end());
+      rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+      return rows;
+    }
+    case Kind::IsNull:
+      return table.range(field_index, CompareOperator::EQ,
+                         AnyValue::from_null());
+    case Kind::NotNull:
+      return table.range(field_index, CompareOperator::GT,
+                         AnyValue::from_null());
+  }
+  return std::nullopt;
+}
+
+std::optional<TableView> Predicate::lookup(const TableView &view,
+                                           size_t field_index) const {
+  if (!view.selects_all_rows()) {
+    return std::nullopt;
+  }
+  auto rows = lookup(*view.table(), view.base_field_index(field_index));
+  if (!rows) {
+    return std::nullopt;
+  }
+  return view.with_rows(std::move(rows.value()));
+}
+
+void Predicate::evaluate(const Column &column, size_t begin, size_t end,
+                         SelectionBitmap &bitmap) const {
+  bitmap.assign((end - begin + 63) / 64, 0);
+  for (size_t row = begin; row < end;) {
+    auto &chunk = column.chunk(row / kColumnChunkSize);
+    size_t off = row % kColumnChunkSize;
+    size_t n = std::min(end - row, chunk.size - off);
+    range_kernels_[chunk.null_count > 0](*this, chunk, off, off + n,
+                                         bitmap.data(), row - begin);
+    row += n;
+  }
+}
+
+void Predicate::evaluate(const Column &column, const RowIndicesList &rows,
+                         SelectionBitmap &bitmap) const {
+  if (is_range(rows)) {
+    return evaluate(column, rows.front(), rows.back() + 1, bitmap);
+  }
+  bitmap.assign((rows.size() + 63) / 64, 0);
+  gather_kernels_[column.has_nulls()](*this, column, rows.data(), rows.size(),
+                                      bitmap.data());
+}
+
+RowIndicesList Predicate::select(const Column &column, size_t begin,
+                                 size_t end) const {
+  SelectionBitmap bitmap;
+  evaluate(column, begin, end, bitmap);
+  return selected_rows(bitmap, [&](size_t i) { return begin + i; });
+}
+
+RowIndicesList Predicate::select(const Column &column,
+                                 const RowIndicesList &rows) const {
+  SelectionBitmap bitmap;
+  evaluate(column, rows, bitmap);
+  return selected_rows(bitmap, [&](size_t i) { return rows[i]; });
+}
+
+TableView Predicate::filter(const TableView &view, size_t field_index) const {
+  auto &column = view.column(field_index);
+  if (view.selects_all_rows()) {
+    return view.with_rows(select(column, 0, view.num_rows()));
+  }
+  return view.with_rows(select(column, *view.selection()));
+}
@@ -0,0 +1,372 @@
+#include "lumidb/simd.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define LUMIDB_SIMD_X86 1
+#include <immintrin.h>
+#define LUMIDB_TARGET_SSE2 __attribute__((target("sse2")))
+#define LUMIDB_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+using namespace lumidb;
+using namespace lumidb::simd;
+
+namespace {
+
+// of `compare_float`
+constexpr float kEpsilon = 0.0001f;
+
+using CompareKernel = void (*)(const float *cells, size_t n, float value,
+                               uint64_t *bits);
+// the sum, min, max and NaN flag of the summary
+using SummarizeKernel = void (*)(const float *cells, size_t n,
+                                 const uint64_t *mask, FloatSummary &summary);
+
+struct Kernels {
+  // by `CompareOperator`
+  CompareKernel compare[6];
+  // by whether there is a mask
+  SummarizeKernel summarize[2];
+};
+
+bool is_selected(const uint64_t *mask, size_t i) {
+  return (mask[i / 64] >> (i % 64)) & 1;
+}
+
+// scalar
+
+template <CompareOperator Op>
+bool compare_cell(float cell, float value) {
+  if constexpr (Op == CompareOperator::EQ) {
+    return compare_float(cell, value) == 0;
+  } else if constexpr (Op == CompareOperator::LT) {
+    return cell < value;
+  } else if constexpr (Op == CompareOperator::GT) {
+    return cell > value;
+  } else if constexpr (Op == CompareOperator::LE) {
+    return compare_float(cell, value) <= 0;
+  } else if constexpr (Op == CompareOperator::GE) {
+    return compare_float(cell, value) >= 0;
+  } else {
+    return compare_float(cell, value) != 0;
+  }
+}
+
+template <CompareOperator Op>
+void compare_scalar(const float *cells, size_t n, float value, uint64_t *bits) {
+  for (size_t i = 0; i < n; i += 64) {
+    size_t count = std::min<size_t>(64, n - i);
+    uint64_t word = 0;
+    for (size_t j = 0; j < count; j++) {
+      word |= uint64_t(compare_cell<Op>(cells[i + j], value)) << j;
+    }
+    bits[i / 64] = word;
+  }
+}
+
+// fold cells [begin, n) into the summary
+template <bool Masked>
+void summarize_scalar(const float *cells, size_t begin, size_t n,
+                      const uint64_t *mask, FloatSummary &summary) {
+  for (size_t i = begin; i < n; i++) {
+    if (Masked && !is_selected(mask, i)) {
+      continue;
+    }
+    float cell = cells[i];
+    summary.sum += cell;
+    if (cell != cell) {
+      summary.has_nan = true;
+      continue;
+    }
+    summary.min = std::min(summary.min, cell);
+    summary.max = std::max(summary.max, cell);
+  }
+}
+
+template <bool Masked>
+void summarize_scalar(const float *cells, size_t n, const uint64_t *mask,
+                      FloatSummary &summary) {
+  summarize_scalar<Masked>(cells, 0, n, mask, summary);
+}
+
+const Kernels kScalarKernels{
+    {compare_scalar<CompareOperator::EQ>, compare_scalar<CompareOperator::LT>,
+     compare_scalar<CompareOperator::GT>, compare_scalar<CompareOperator::LE>,
+     compare_scalar<CompareOperator::GE>, compare_scalar<CompareOperator::NE>},
+    {summarize_scalar<false>, summarize_scalar<true>},
+};
+
+#ifdef LUMIDB_SIMD_X86
+
+// SSE2, 4 cells per vector
+
+template <CompareOperator Op>
+LUMIDB_TARGET_SSE2 uint64_t compare_sse2(__m128 cells, __m128 value) {
+  if constexpr (Op == CompareOperator::LT) {
+    return _mm_movemask_ps(_mm_cmplt_ps(cells, value));
+  } else if constexpr (Op == CompareOperator::GT) {
+    return _mm_movemask_ps(_mm_cmpgt_ps(cells, value));
+  }
+  // the others compare the difference with epsilon, NaN is within it
+  __m128 diff = _mm_sub_ps(cells, value);
+  int below = _mm_movemask_ps(_mm_cmplt_ps(diff, _mm_set1_ps(-kEpsilon)));
+  int above = _mm_movemask_ps(_mm_cmpgt_ps(diff, _mm_set1_ps(kEpsilon)));
+  if constexpr (Op == CompareOperator::EQ) {
+    return ~(below | above) & 0xf;
+  } else if constexpr (Op == CompareOperator::LE) {
+    return ~above & 0xf;
+  } else if constexpr (Op == CompareOperator::GE) {
+    return ~below & 0xf;
+  } else {
+    return below | above;
+  }
+}
+
+template <CompareOperator Op>
+LUMIDB_TARGET_SSE2 void compare_sse2(const float *cells, size_t n, float value,
+                                     uint64_t *bits) {
+  __m128 v = _mm_set1_ps(value);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    uint64_t word = 0;
+    for (size_t j = 0; j < 64; j += 4) {
+      word |= compare_sse2<Op>(_mm_loadu_ps(cells + i + j), v) << j;
+    }
+    bits[i / 64] = word;
+  }
+  compare_scalar<Op>(cells + i, n - i, value, bits + i / 64);
+}
+
+template <bool Masked>
+LUMIDB_TARGET_SSE2 void summarize_sse2(const float *cells, size_t n,
+                                       const uint64_t *mask,
+                                       FloatSummary &summary) {
+  const __m128i lane_bits = _mm_setr_epi32(1, 2, 4, 8);
+  const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+  const __m128 neg_inf = _mm_sub_ps(_mm_setzero_ps(), inf);
+  __m128d sum_lo = _mm_setzero_pd(), sum_hi = _mm_setzero_pd();
+  __m128 min = inf, max = neg_inf, nan = _mm_setzero_ps();
+
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 c = _mm_loadu_ps(cells + i);
+    __m128 selected = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    if constexpr (Masked) {
+      __m128i lanes =
+          _mm_set1_epi32(int((mask[i / 64] >> (i % 64)) & 0xf));
+      selected = _mm_castsi128_ps(
+          _mm_cmpeq_epi32(_mm_and_si128(lanes, lane_bits), lane_bits));
+      c = _mm_and_ps(c, selected);
+    }
+    sum_lo = _mm_add_pd(sum_lo, _mm_cvtps_pd(c));
+    sum_hi = _mm_add_pd(sum_hi, _mm_cvtps_pd(_mm_movehl_ps(c, c)));
+
+    __m128 unordered = _mm_cmpunord_ps(c, c);
+    nan = _mm_or_ps(nan, unordered);
+    __m128 usable = _mm_andnot_ps(unordered, selected);
+    min = _mm_min_ps(min, _mm_or_ps(_mm_and_ps(usable, c),
+                                    _mm_andnot_ps(usable, inf)));
+    max = _mm_max_ps(max, _mm_or_ps(_mm_and_ps(usable, c),
+                                    _mm_andnot_ps(usable, neg_inf)));
+  }
+
+  double sums[2];
+  _mm_storeu_pd(sums, _mm_add_pd(sum_lo, sum_hi));
+  summary.sum += sums[0] + sums[1];
+  float mins[4], maxs[4];
+  _mm_storeu_ps(mins, min);
+  _mm_storeu_ps(maxs, max);
+  for (size_t j = 0; j < 4; j++) {
+    summary.min = std::min(summary.min, mins[j]);
+    summary.max = std::max(summary.max, maxs[j]);
+  }
+  summary.has_nan |= _mm_movemask_ps(nan) != 0;
+  summarize_scalar<Masked>(cells, i, n, mask, summary);
+}
+
+const Kernels kSSE2Kernels{
+    {compare_sse2<CompareOperator::EQ>, compare_sse2<CompareOperator::LT>,
+     compare_sse2<CompareOperator::GT>, compare_sse2<CompareOperator::LE>,
+     compare_sse2<CompareOperator::GE>, compare_sse2<CompareOperator::NE>},
+    {summarize_sse2<false>, summarize_sse2<true>},
+};
+
+// AVX2, 8 cells per vector
+
+template <CompareOperator Op>
+LUMIDB_TARGET_AVX2 uint64_t compare_avx2(__m256 cells, __m256 value) {
+  if constexpr (Op == CompareOperator::LT) {
+    return _mm256_movemask_ps(_mm256_cmp_ps(cells, value, _CMP_LT_OQ));
+  } else if constexpr (Op == CompareOperator::GT) {
+    return _mm256_movemask_ps(_mm256_cmp_ps(cells, value, _CMP_GT_OQ));
+  }
+  // the others compare the difference with epsilon, NaN is within it
+  __m256 diff = _mm256_sub_ps(cells, value);
+  int below = _mm256_movemask_ps(
+      _mm256_cmp_ps(diff, _mm256_set1_ps(-kEpsilon), _CMP_LT_OQ));
+  int above = _mm256_movemask_ps(
+      _mm256_cmp_ps(diff, _mm256_set1_ps(kEpsilon), _CMP_GT_OQ));
+  if constexpr (Op == CompareOperator::EQ) {
+    return ~(below | above) & 0xff;
+  } else if constexpr (Op == CompareOperator::LE) {
+    return ~above & 0xff;
+  } else if constexpr (Op == CompareOperator::GE) {
+    return ~below & 0xff;
+  } else {
+    return below | above;
+  }
+}
+
+template <CompareOperator Op>
+LUMIDB_TARGET_AVX2 void compare_avx2(const float *cells, size_t n, float value,
+                                     uint64_t *bits) {
+  __m256 v = _mm256_set1_ps(value);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    uint64_t word = 0;
+    for (size_t j = 0; j < 64; j += 8) {
+      word |= compare_avx2<Op>(_mm256_loadu_ps(cells + i + j), v) << j;
+    }
+    bits[i / 64] = word;
+  }
+  compare_scalar<Op>(cells + i, n - i, value, bits + i / 64);
+}
+
+template <bool Masked>
+LUMIDB_TARGET_AVX2 void summarize_avx2(const float *cells, size_t n,
+                                       const uint64_t *mask,
+                                       FloatSummary &summary) {
+  const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+  const __m256 neg_inf = _mm256_sub_ps(_mm256_setzero_ps(), inf);
+  __m256d sum_lo = _mm256_setzero_pd(), sum_hi = _mm256_setzero_pd();
+  __m256 min = inf, max = neg_inf, nan = _mm256_setzero_ps();
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 c = _mm256_loadu_ps(cells + i);
+    __m256 selected = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    if constexpr (Masked) {
+      __m256i lanes =
+          _mm256_set1_epi32(int((mask[i / 64] >> (i % 64)) & 0xff));
+      selected = _mm256_castsi256_ps(
+          _mm256_cmpeq_epi32(_mm256_and_si256(lanes, lane_bits), lane_bits));
+      c = _mm256_and_ps(c, selected);
+    }
+    sum_lo =
+        _mm256_add_pd(sum_lo, _mm256_cvtps_pd(_mm256_castps256_ps128(c)));
+    sum_hi =
+        _mm256_add_pd(sum_hi, _mm256_cvtps_pd(_mm256_extractf128_ps(c, 1)));
+
+    __m256 unordered = _mm256_cmp_ps(c, c, _CMP_UNORD_Q);
+    nan = _mm256_or_ps(nan, unordered);
+    __m256 usable = _mm256_andnot_ps(unordered, selected);
+    min = _mm256_min_ps(min, _mm256_blendv_ps(inf, c, usable));
+    max = _mm256_max_ps(max, _mm256_blendv_ps(neg_inf, c, usable));
+  }
+
+  double sums[4];
+  _mm256_storeu_pd(sums, _mm256_add_pd(sum_lo, sum_hi));
+  summary.sum += sums[0] + sums[1] + sums[2] + sums[3];
+  float mins[8], maxs[8];
+  _mm256_storeu_ps(mins, min);
+  _mm256_storeu_ps(maxs, max);
+  for (size_t j = 0; j < 8; j++) {
+    summary.min = std::min(summary.min, mins[j]);
+    summary.max = std::max(summary.max, maxs[j]);
+  }
+  summary.has_nan |= _mm256_movemask_ps(nan) != 0;
+  summarize_scalar<Masked>(cells, i, n, mask, summary);
+}
+
+const Kernels kAVX2Kernels{
+    {compare_avx2<CompareOperator::EQ>, compare_avx2<CompareOperator::LT>,
+     compare_avx2<CompareOperator::GT>, compare_avx2<CompareOperator::LE>,
+     compare_avx2<CompareOperator::GE>, compare_avx2<CompareOperator::NE>},
+    {summarize_avx2<false>, summarize_avx2<true>},
+};
+
+#endif
+
+std::atomic<Isa> &active_isa() {
+  static std::atomic<Isa> isa{detected_isa()};
+  return isa;
+}
+
+const Kernels &kernels() {
+  switch (active_isa().load(std::memory_order_relaxed)) {
+#ifdef LUMIDB_SIMD_X86
+    case Isa::AVX2:
+      return kAVX2Kernels;
+    case Isa::SSE2:
+      return kSSE2Kernels;
+#endif
+    default:
+      return kScalarKernels;
+  }
+}
+
+}  // namespace
+
+const char *simd::isa_name(Isa isa) {
+  switch (isa) {
+    case Isa::Scalar:
+      return "scalar";
+    case Isa::SSE2:
+      return "sse2";
+    case Isa::AVX2:
+      return "avx2";
+  }
+  return "unknown";
+}
+
+Isa simd::detected_isa() {
+#ifdef LUMIDB_SIMD_X86
+  static const Isa detected = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return Isa::AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+      return Isa::SSE2;
+    }
+    return Isa::Scalar;
+  }();
+  return detected;
+#else
+  return Isa::Scalar;
+#endif
+}
+
+Isa simd::isa() { return active_isa().load(std::memory_order_relaxed); }
+
+void simd::set_isa(Isa isa) {
+  active_isa().store(std::min(isa, detected_isa()), std::memory_order_relaxed);
+}
+
+void simd::compare_floats(CompareOperator op, const float *cells, size_t n,
+                          float value, uint64_t *bits) {
+  kernels().compare[static_cast<size_t>(op)](cells, n, value, bits);
+}
+
+FloatSummary simd::summarize_floats(const float *cells, size_t n,
+                                    const uint64_t *mask) {
+  FloatSummary summary;
+  summary.count = n;
+  if (mask != nullptr) {
+    summary.count = 0;
+    for (size_t i = 0; i < n; i += 64) {
+      uint64_t word = mask[i / 64];
+      if (n - i < 64) {
+        word &= (uint64_t(1) << (n - i)) - 1;
+      }
+      summary.count += __builtin_popcountll(word);
+    }
+  }
+  kernels().summarize[mask != nullptr](cells, n, mask, summary);
+  return summary;
+}
@@ -0,0 +1,1721 @@
+#include "lumidb/storage.hh"
+
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "fmt/core.h"
+#include "lumidb/executor.hh"
+#include "lumidb/table.hh"
+#include "lumidb/types.hh"
+#include "lumidb/utils.hh"
+
+#ifdef LUMIDB_PLATFORM_WINDOWS
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace lumidb;
+
+namespace {
+
+constexpr char kSnapshotMagic[8] = {'L', 'U', 'M', 'I', 'S', 'N', 'A', 'P'};
+// written as a u32, reads differently on a machine of the other byte order
+constexpr uint32_t kByteOrderTag = 0x01020304;
+constexpr size_t kHeaderSize = 32;
+
+// zone map flags of a chunk
+constexpr uint8_t kExactBounds = 1;
+constexpr uint8_t kHasNaN = 2;
+
+// appends plain values to a buffer
+class Encoder {
+ public:
+  template <typename T>
+  void put(T value) {
+    put_bytes(&value, sizeof(value));
+  }
+
+  void put_bytes(const void *data, size_t size) {
+    buffer_.append(static_cast<const char *>(data), size);
+  }
+
+  void put_string(std::string_view str) {
+    put<uint64_t>(str.size());
+    put_bytes(str.data(), str.size());
+  }
+
+  void put_value(const AnyValue &value) {
+    put<uint8_t>(static_cast<uint8_t>(value.kind()));
+    if (value.is_float()) {
+      put<float>(value.as_float());
+    } else if (value.is_string()) {
+      put_string(value.as_string_view());
+    }
+  }
+
+  // pad to a multiple of 8 bytes
+  void align() { buffer_.resize((buffer_.size() + 7) / 8 * 8, '\0'); }
+
+  const std::string &buffer() const { return buffer_; }
+  std::string release() { return std::move(buffer_); }
+  void clear() { buffer_.clear(); }
+
+ private:
+  std::string buffer_;
+};
+
+// reads plain values written by `Encoder`, every read fails once the data
+// is exhausted
+class Decoder {
+ public:
+  explicit Decoder(std::string_view data) : data_(data) {}
+
+  template <typename T>
+  bool get(T &value) {
+    std::string_view bytes;
+    if (!get_bytes(sizeof(value), bytes)) {
+      return false;
+    }
+    std::memcpy(&value, bytes.data(), sizeof(value));
+    return true;
+  }
+
+  bool get_bytes(size_t size, std::string_view &bytes) {
+    if (size > data_.size()) {
+      return false;
+    }
+    bytes = data_.substr(0, size);
+    data_.remove_prefix(size);
+    return true;
+  }
+
+  bool get_string(std::string_view &str) {
+    uint64_t size;
+    return get(size) && get_bytes(size, str);
+  }
+
+  bool get_value(AnyValue &value) {
+    uint8_t kind;
+    if (!get(kind)) {
+      return false;
+    }
+    switch (static_cast<ValueTypeKind>(kind)) {
+      case ValueTypeKind::T_NULL:
+        value = AnyValue::from_null();
+        return true;
+      case ValueTypeKind::T_FLOAT: {
+        float f;
+        if (!get(f)) {
+          return false;
+        }
+        value = AnyValue::from_float(f);
+        return true;
+      }
+      case ValueTypeKind::T_STRING: {
+        std::string_view str;
+        if (!get_string(str)) {
+          return false;
+        }
+        value = AnyValue::from_string(str);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // bytes left
+  size_t size() const { return data_.size(); }
+  std::string_view rest() const { return data_; }
+
+ private:
+  std::string_view data_;
+};
+
+size_t null_words(size_t cells) { return (cells + 63) / 64; }
+
+bool sync_file(std::FILE *file) {
+#ifdef LUMIDB_PLATFORM_WINDOWS
+  return _commit(_fileno(file)) == 0;
+#else
+  return fsync(fileno(file)) == 0;
+#endif
+}
+
+// replace the file at path by the one at tmp_path
+bool replace_file(const std::string &tmp_path, const std::string &path) {
+#ifdef LUMIDB_PLATFORM_WINDOWS
+  // rename doesn't replace an existing file on windows
+  std::remove(path.c_str());
+#endif
+  return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+// the block of a chunk: the null bitmap, then the floats, the string offsets
+// and bytes, or the values
+void encode_chunk(const Column::Chunk &chunk, Column::Storage storage,
+                  Encoder &block) {
+  block.put_bytes(chunk.null_bits.data(),
+                  null_words(chunk.size) * sizeof(uint64_t));
+  switch (storage) {
+    case Column::Storage::Float:
+      block.put_bytes(chunk.floats.data(), chunk.size * sizeof(float));
+      break;
+    case Column::Storage::String: {
+      uint64_t offset = 0;
+      block.put(offset);
+      for (auto &str : chunk.strings) {
+        offset += str.as_string_view().size();
+        block.put(offset);
+      }
+      for (auto &str : chunk.strings) {
+        auto view = str.as_string_view();
+        block.put_bytes(view.data(), view.size());
+      }
+      break;
+    }
+    case Column::Storage::Generic:
+      for (auto &value : chunk.values) {
+        block.put_value(value);
+      }
+      break;
+  }
+  block.align();
+}
+
+// where a chunk is stored and what is needed to rebuild it
+struct ChunkEntry {
+  uint64_t offset;
+  uint64_t size;
+  uint64_t cells;
+  uint64_t null_count;
+  uint64_t checksum;
+  uint8_t zone_flags;
+  AnyValue min;
+  AnyValue max;
+};
+
+bool decode_chunk_entry(Decoder &meta, ChunkEntry &entry) {
+  return meta.get(entry.offset) && meta.get(entry.size) &&
+         meta.get(entry.cells) && meta.get(entry.null_count) &&
+         meta.get(entry.checksum) && meta.get(entry.zone_flags) &&
+         meta.get_value(entry.min) && meta.get_value(entry.max);
+}
+
+// rebuild a chunk from its block, nullptr if the block is corrupted
+std::shared_ptr<Column::Chunk> decode_chunk(std::string_view data,
+                                            const ChunkEntry &entry,
+                                            Column::Storage storage) {
+  std::string_view bytes = data.substr(entry.offset, entry.size);
+  if (checksum(bytes.data(), bytes.size()) != entry.checksum) {
+    return nullptr;
+  }
+
+  auto chunk = std::make_shared<Column::Chunk>();
+  chunk->size = entry.cells;
+  chunk->null_count = entry.null_count;
+  chunk->min = entry.min;
+  chunk->max = entry.max;
+  chunk->exact_bounds = entry.zone_flags & kExactBounds;
+  chunk->has_nan = entry.zone_flags & kHasNaN;
+
+  Decoder block(bytes);
+  std::string_view null_bits;
+  if (!block.get_bytes(null_words(entry.cells) * sizeof(uint64_t),
+                       null_bits)) {
+    return nullptr;
+  }
+  chunk->null_bits.resize(null_words(entry.cells));
+  std::memcpy(chunk->null_bits.data(), null_bits.data(), null_bits.size());
+
+  switch (storage) {
+    case Column::Storage::Float: {
+      std::string_view floats;
+      if (!block.get_bytes(entry.cells * sizeof(float), floats)) {
+        return nullptr;
+      }
+      chunk->floats.resize(entry.cells);
+      std::memcpy(chunk->floats.data(), floats.data(), floats.size());
+      break;
+    }
+    case Column::Storage::String: {
+      std::string_view offsets, strings;
+      uint64_t first, last;
+      if (!block.get_bytes((entry.cells + 1) * sizeof(uint64_t), offsets)) {
+        return nullptr;
+      }
+      std::memcpy(&first, offsets.data(), sizeof(first));
+      std::memcpy(&last, offsets.data() + entry.cells * sizeof(uint64_t),
+                  sizeof(last));
+      if (first != 0 || !block.get_bytes(last, strings)) {
+        return nullptr;
+      }
+
+      chunk->strings.reserve(entry.cells);
+      uint64_t begin = 0;
+      for (size_t i = 1; i <= entry.cells; i++) {
+        uint64_t end;
+        std::memcpy(&end, offsets.data() + i * sizeof(uint64_t), sizeof(end));
+        if (end < begin || end > last) {
+          return nullptr;
+        }
+        chunk->strings.push_back(
+            AnyValue::from_string(strings.substr(begin, end - begin)));
+        begin = end;
+      }
+      break;
+    }
+    case Column::Storage::Generic:
+      chunk->values.resize(entry.cells);
+      for (auto &value : chunk->values) {
+        if (!block.get_value(value)) {
+          return nullptr;
+        }
+      }
+      break;
+  }
+  return chunk;
+}
+
+// a table read from the meta section, its chunks are loaded afterwards
+struct TableEntry {
+  TablePtr table;
+  std::vector<size_t> hash_indexes;
+  std::vector<std::vector<size_t>> ordered_indexes;
+  // per field
+  std::vector<std::vector<ChunkEntry>> chunks;
+};
+
+Result<TableEntry> decode_table_entry(Decoder &meta, size_t blocks_end) {
+  auto corrupted = [] { return Error("corrupted snapshot meta"); };
+
+  std::string_view name;
+  uint64_t num_rows, wal_lsn, num_fields;
+  if (!meta.get_string(name) || !meta.get(num_rows) || !meta.get(wal_lsn) ||
+      !meta.get(num_fields)) {
+    return corrupted();
+  }
+
+  TableSchema schema;
+  std::vector<size_t> hash_indexes;
+  for (size_t i = 0; i < num_fields; i++) {
+    std::string_view field_name, type_name;
+    uint8_t indexed;
+    if (!meta.get_string(field_name) || !meta.get_string(type_name) ||
+        !meta.get(indexed)) {
+      return corrupted();
+    }
+    auto type = AnyType::parse_string(std::string(type_name));
+    if (type.has_error()) {
+      return type.unwrap_err().add_message("corrupted snapshot meta");
+    }
+    auto res = schema.add_field(std::string(field_name), type.unwrap());
+    if (res.has_error()) {
+      return res.unwrap_err().add_message("corrupted snapshot meta");
+    }
+    if (indexed) {
+      hash_indexes.push_back(i);
+    }
+  }
+
+  TableEntry entry{
+      .table = Table::create_ptr(std::string(name), schema),
+      .hash_indexes = hash_indexes,
+  };
+  entry.table->set_wal_lsn(wal_lsn);
+
+  uint64_t num_ordered_indexes;
+  if (!meta.get(num_ordered_indexes)) {
+    return corrupted();
+  }
+  for (size_t i = 0; i < num_ordered_indexes; i++) {
+    uint64_t size;
+    if (!meta.get(size)) {
+      return corrupted();
+    }
+    std::vector<size_t> fields;
+    for (size_t j = 0; j < size; j++) {
+      uint64_t field;
+      if (!meta.get(field) || field >= num_fields) {
+        return corrupted();
+      }
+      fields.push_back(field);
+    }
+    entry.ordered_indexes.push_back(fields);
+  }
+
+  // every chunk but the last of a column is full, and the blocks lie
+  // between the header and the meta
+  for (size_t i = 0; i < num_fields; i++) {
+    uint64_t num_chunks;
+    if (!meta.get(num_chunks)) {
+      return corrupted();
+    }
+    auto &chunks = entry.chunks.emplace_back();
+    uint64_t cells = 0;
+    for (size_t j = 0; j < num_chunks; j++) {
+      auto &chunk = chunks.emplace_back();
+      if (!decode_chunk_entry(meta, chunk) || chunk.cells == 0 ||
+          chunk.cells > kColumnChunkSize || chunk.null_count > chunk.cells ||
+          (j + 1 < num_chunks && chunk.cells != kColumnChunkSize) ||
+          chunk.offset < kHeaderSize || chunk.offset > blocks_end ||
+          chunk.size > blocks_end - chunk.offset) {
+        return corrupted();
+      }
+      cells += chunk.cells;
+    }
+    if (cells != num_rows) {
+      return corrupted();
+    }
+  }
+
+  return entry;
+}
+
+}  // namespace
+
+Result<bool> lumidb::save_snapshot(const std::string &path,
+                                   const TablePtrList &tables,
+                                   const SnapshotProgress &progress) {
+  std::string tmp_path = path + ".tmp";
+  std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    return Error("failed to open file: {}", tmp_path);
+  }
+
+  // the header is written last, once the meta offset is known
+  out.write(std::string(kHeaderSize, '\0').data(), kHeaderSize);
+
+  uint64_t offset = kHeaderSize;
+  Encoder meta, block;
+  meta.put<uint64_t>(tables.size());
+  for (auto &table : tables) {
+    auto &schema = table->schema();
+    meta.put_string(table->name());
+    meta.put<uint64_t>(table->num_rows());
+    meta.put<uint64_t>(table->wal_lsn());
+    meta.put<uint64_t>(schema.fields_size());
+    for (size_t i = 0; i < schema.fields_size(); i++) {
+      meta.put_string(schema.get_field(i).name);
+      meta.put_string(schema.get_field(i).type.name());
+      meta.put<uint8_t>(table->column(i).indexed());
+    }
+
+    meta.put<uint64_t>(table->ordered_indexes().size());
+    for (auto &index : table->ordered_indexes()) {
+      meta.put<uint64_t>(index.fields.size());
+      for (auto field : index.fields) {
+        meta.put<uint64_t>(field);
+      }
+    }
+
+    for (size_t i = 0; i < schema.fields_size(); i++) {
+      auto &column = table->column(i);
+      meta.put<uint64_t>(column.num_chunks());
+      for (size_t c = 0; c < column.num_chunks(); c++) {
+        auto &chunk = column.chunk(c);
+
+        block.clear();
+        encode_chunk(chunk, column.storage(), block);
+        out.write(block.buffer().data(), block.buffer().size());
+
+        meta.put<uint64_t>(offset);
+        meta.put<uint64_t>(block.buffer().size());
+        meta.put<uint64_t>(chunk.size);
+        meta.put<uint64_t>(chunk.null_count);
+        meta.put<uint64_t>(
+            checksum(block.buffer().data(), block.buffer().size()));
+        meta.put<uint8_t>((chunk.exact_bounds ? kExactBounds : 0) |
+                          (chunk.has_nan ? kHasNaN : 0));
+        meta.put_value(chunk.min);
+        meta.put_value(chunk.max);
+        offset += block.buffer().size();
+      }
+    }
+
+    if (progress) {
+      progress(*table);
+    }
+  }
+
+  out.write(meta.buffer().data(), meta.buffer().size());
+  uint64_t meta_checksum = checksum(meta.buffer().data(), meta.buffer().size());
+  out.write(reinterpret_cast<const char *>(&meta_checksum),
+            sizeof(meta_checksum));
+
+  Encoder header;
+  header.put_bytes(kSnapshotMagic, sizeof(kSnapshotMagic));
+  header.put<uint32_t>(kSnapshotVersion);
+  header.put<uint32_t>(kByteOrderTag);
+  header.put<uint64_t>(offset);
+  header.put<uint64_t>(meta.buffer().size());
+  out.seekp(0);
+  out.write(header.buffer().data(), header.buffer().size());
+
+  out.close();
+
+  // durable before it replaces the old snapshot, the log may be truncated
+  // right after
+  std::FILE *written = out ? std::fopen(tmp_path.c_str(), "rb") : nullptr;
+  bool synced = written != nullptr && sync_file(written);
+  if (written != nullptr) {
+    std::fclose(written);
+  }
+  if (!synced) {
+    std::remove(tmp_path.c_str());
+    return Error("failed to write file: {}", tmp_path);
+  }
+
+  if (!replace_file(tmp_path, path)) {
+    std::remove(tmp_path.c_str());
+    return Error("failed to rename {} to {}", tmp_path, path);
+  }
+  return true;
+}
+
+Result<TablePtrList> lumidb::load_snapshot(const std::string &path,
+                                           ThreadPool *pool,
+                                           uint64_t *snapshot_checksum) {
+  auto file_res = MappedFile::open(path);
+  if (file_res.has_error()) {
+    return file_res.unwrap_err();
+  }
+  auto file = file_res.unwrap();
+  auto data = file->data();
+
+  Decoder header(data);
+  std::string_view magic;
+  uint32_t version, byte_order;
+  uint64_t meta_offset, meta_size;
+  if (!header.get_bytes(sizeof(kSnapshotMagic), magic) ||
+      magic != std::string_view(kSnapshotMagic, sizeof(kSnapshotMagic))) {
+    return Error("not a snapshot file: {}", path);
+  }
+  if (!header.get(version) || !header.get(byte_order)) {
+    return Error("corrupted snapshot header");
+  }
+  if (version != kSnapshotVersion) {
+    return Error("unsupported snapshot version: {}, expected {}", version,
+                 kSnapshotVersion);
+  }
+  if (byte_order != kByteOrderTag) {
+    return Error("snapshot written on a machine of another byte order");
+  }
+  if (!header.get(meta_offset) || !header.get(meta_size) ||
+      meta_offset < kHeaderSize || meta_offset > data.size() ||
+      data.size() - meta_offset != meta_size + sizeof(uint64_t)) {
+    return Error("corrupted snapshot header");
+  }
+
+  uint64_t meta_checksum;
+  std::memcpy(&meta_checksum, data.data() + meta_offset + meta_size,
+              sizeof(meta_checksum));
+  if (checksum(data.data() + meta_offset, meta_size) != meta_checksum) {
+    return Error("snapshot meta checksum mismatch");
+  }
+
+  Decoder meta(data.substr(meta_offset, meta_size));
+  uint64_t num_tables;
+  if (!meta.get(num_tables)) {
+    return Error("corrupted snapshot meta");
+  }
+  std::vector<TableEntry> entries;
+  for (size_t i = 0; i < num_tables; i++) {
+    auto entry = decode_table_entry(meta, meta_offset);
+    if (entry.has_error()) {
+      return entry.unwrap_err();
+    }
+    entries.push_back(std::move(entry.unwrap()));
+  }
+
+  // every chunk is verified and rebuilt on its own
+  struct ChunkTask {
+    const ChunkEntry *entry;
+    Column::Storage storage;
+    std::shared_ptr<Column::Chunk> chunk;
+  };
+  std::vector<ChunkTask> tasks;
+  for (auto &entry : entries) {
+    for (size_t i = 0; i < entry.chunks.size(); i++) {
+      auto storage = entry.table->column(i).storage();
+      for (auto &chunk : entry.chunks[i]) {
+        tasks.push_back({&chunk, storage});
+      }
+    }
+  }
+
+  auto decode_chunks = [&](size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+      tasks[i].chunk = decode_chunk(data, *tasks[i].entry, tasks[i].storage);
+    }
+  };
+  if (pool != nullptr) {
+    pool->parallel_for(tasks.size(), 1, decode_chunks);
+  } else {
+    decode_chunks(0, tasks.size());
+  }
+
+  TablePtrList tables;
+  auto task = tasks.begin();
+  for (auto &entry : entries) {
+    auto &table = entry.table;
+    std::vector<Column> columns;
+    for (size_t i = 0; i < entry.chunks.size(); i++) {
+      auto &column = columns.emplace_back(table->schema().get_field(i).type);
+      for (size_t c = 0; c < entry.chunks[i].size(); c++, task++) {
+        if (task->chunk == nullptr) {
+          return Error("corrupted snapshot chunk, table={}, field={}, chunk={}",
+                       table->name(), table->schema().get_field(i).name, c);
+        }
+        column.add_chunk(std::move(task->chunk));
+      }
+    }
+    table->add_columns(columns);
+    // the chunks must only be held by the table, or indexing copies them
+    columns.clear();
+
+    // indexes are not stored, they are rebuilt from the cells
+    for (auto field : entry.hash_indexes) {
+      table->create_index(field);
+    }
+    for (auto &fields : entry.ordered_indexes) {
+      auto res = table->create_ordered_index(fields);
+      if (res.has_error()) {
+        return res.unwrap_err();
+      }
+    }
+    tables.push_back(table);
+  }
+  if (snapshot_checksum != nullptr) {
+    *snapshot_checksum = meta_checksum;
+  }
+  return tables;
+}
+
+// Write-ahead log
+
+namespace {
+
+constexpr size_t kWalFrameHeaderSize = 3 * sizeof(uint64_t);
+
+// read the next frame of a log, false at its end or at a torn or corrupted
+// frame
+bool read_frame(Decoder &log, uint64_t &lsn, std::string_view &payload) {
+  uint64_t size, sum;
+  return log.size() >= kWalFrameHeaderSize && log.get(size) && log.get(lsn) &&
+         log.get(sum) && log.get_bytes(size, payload) &&
+         checksum(&lsn, sizeof(lsn), checksum(payload.data(), size)) == sum;
+}
+
+// the type of a record and the table it changes
+bool decode_record_table(std::string_view payload, WalRecord::Type &type,
+                         std::string_view &table_name) {
+  Decoder record(payload);
+  uint8_t type_tag;
+  if (!record.get(type_tag) || !record.get_string(table_name)) {
+    return false;
+  }
+  type = static_cast<WalRecord::Type>(type_tag);
+  return true;
+}
+
+void encode_schema(Encoder &record, const TableSchema &schema) {
+  record.put<uint64_t>(schema.fields_size());
+  for (auto &field : schema.fields()) {
+    record.put_string(field.name);
+    record.put_string(field.type.name());
+  }
+}
+
+bool decode_schema(Decoder &record, TableSchema &schema) {
+  uint64_t num_fields;
+  if (!record.get(num_fields)) {
+    return false;
+  }
+  for (size_t i = 0; i < num_fields; i++) {
+    std::string_view field_name, type_name;
+    if (!record.get_string(field_name) || !record.get_string(type_name)) {
+      return false;
+    }
+    auto field_type = AnyType::parse_string(std::string(type_name));
+    if (field_type.has_error() ||
+        schema.add_field(std::string(field_name), field_type.unwrap())
+            .has_error()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// the snapshot copy a record of a table loaded from a snapshot refers to
+bool decode_snapshot_copy(std::string_view payload, std::string_view &copy) {
+  Decoder record(payload);
+  uint8_t type_tag;
+  std::string_view table_name;
+  TableSchema schema;
+  return record.get(type_tag) && record.get_string(table_name) &&
+         decode_schema(record, schema) && record.get_string(copy);
+}
+
+bool same_schema(const TableSchema &a, const TableSchema &b) {
+  if (a.fields_size() != b.fields_size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.fields_size(); i++) {
+    auto &field = a.get_field(i);
+    auto &other = b.get_field(i);
+    if (field.name != other.name || field.type.name() != other.type.name()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// the rows from first_row on, field by field
+void encode_rows(Encoder &record, const Table &table, size_t first_row) {
+  record.put<uint64_t>(table.num_rows() - first_row);
+  for (size_t i = 0; i < table.schema().fields_size(); i++) {
+    auto &column = table.column(i);
+    for (size_t row = first_row; row < table.num_rows(); row++) {
+      record.put_value(column.get(row));
+    }
+  }
+}
+
+bool decode_rows(Decoder &record, Table &table) {
+  uint64_t num_rows;
+  if (!record.get(num_rows)) {
+    return false;
+  }
+
+  std::vector<Column> columns;
+  for (auto &field : table.schema().fields()) {
+    auto &column = columns.emplace_back(field.type);
+    column.reserve(num_rows);
+    for (size_t row = 0; row < num_rows; row++) {
+      AnyValue value;
+      if (!record.get_value(value) || !value.is_instance_of(field.type)) {
+        return false;
+      }
+      column.push_back(value);
+    }
+  }
+  table.add_columns(columns);
+  return true;
+}
+
+void encode_fields(Encoder &record, const std::vector<size_t> &fields) {
+  record.put<uint64_t>(fields.size());
+  for (auto field : fields) {
+    record.put<uint64_t>(field);
+  }
+}
+
+bool decode_fields(Decoder &record, const Table &table,
+                   std::vector<size_t> &fields) {
+  uint64_t size;
+  if (!record.get(size)) {
+    return false;
+  }
+  for (size_t i = 0; i < size; i++) {
+    uint64_t field;
+    if (!record.get(field) || field >= table.schema().fields_size()) {
+      return false;
+    }
+    fields.push_back(field);
+  }
+  return true;
+}
+
+Encoder begin_record(WalRecord::Type type, const std::string &table_name) {
+  Encoder record;
+  record.put<uint8_t>(static_cast<uint8_t>(type));
+  record.put_string(table_name);
+  return record;
+}
+
+// apply a change to a table that doesn't hold it yet
+Result<bool> apply_change(WalRecord::Type type, Decoder &record,
+                          Table &table) {
+  auto corrupted = [] { return Error("corrupted wal record"); };
+
+  switch (type) {
+    case WalRecord::Type::Insert:
+      if (!decode_rows(record, table)) {
+        return corrupted();
+      }
+      return true;
+
+    case WalRecord::Type::Update: {
+      uint64_t num_rows;
+      if (!record.get(num_rows)) {
+        return corrupted();
+      }
+      RowIndicesList rows;
+      std::vector<ValueList> values(num_rows);
+      for (auto &row : values) {
+        uint64_t row_index;
+        if (!record.get(row_index) || row_index >= table.num_rows()) {
+          return corrupted();
+        }
+        rows.push_back(row_index);
+        row.resize(table.schema().fields_size());
+        for (auto &value : row) {
+          if (!record.get_value(value)) {
+            return corrupted();
+          }
+        }
+        if (table.schema().check_row(row).has_error()) {
+          return corrupted();
+        }
+      }
+
+      // rows are passed to the updater in the given order
+      size_t next = 0;
+      return table.update_rows(
+          rows, [&](ValueList &row, size_t) { row = values[next++]; });
+    }
+
+    case WalRecord::Type::Delete: {
+      uint64_t num_rows;
+      if (!record.get(num_rows)) {
+        return corrupted();
+      }
+      RowIndicesList rows;
+      for (size_t i = 0; i < num_rows; i++) {
+        uint64_t row_index;
+        if (!record.get(row_index) || row_index >= table.num_rows()) {
+          return corrupted();
+        }
+        rows.push_back(row_index);
+      }
+      return table.delete_rows(rows,
+                               [](const ValueList &, size_t) { return true; });
+    }
+
+    case WalRecord::Type::CreateIndex: {
+      uint64_t field;
+      if (!record.get(field)) {
+        return corrupted();
+      }
+      return table.create_index(field);
+    }
+
+    case WalRecord::Type::CreateOrderedIndex: {
+      std::vector<size_t> fields;
+      if (!decode_fields(record, table, fields)) {
+        return corrupted();
+      }
+      return table.create_ordered_index(fields);
+    }
+
+    default:
+      return corrupted();
+  }
+}
+
+// what the records replayed so far leave to the next ones
+struct ReplayState {
+  // the rows of the parts replayed so far of the inserts logged batch by
+  // batch, by table
+  std::map<std::string, std::vector<std::string_view>> parts;
+  // the lsn of the last drop of every table in the log
+  std::map<std::string, uint64_t> dropped;
+  // the directory of the log, holding its snapshot copies
+  std::filesystem::path dir;
+
+  // the tables of a snapshot not created yet, every table of a snapshot is
+  // loaded at once but must only be created once
+  struct Snapshot {
+    uint64_t checksum = 0;
+    std::map<std::string, TablePtr> tables;
+  };
+  std::map<std::string, Snapshot> snapshots;
+};
+
+// a table of the snapshot a record refers to, which must not have changed
+Result<TablePtr> take_snapshot_table(Database &db, ReplayState &state,
+                                     const std::string &path,
+                                     uint64_t checksum,
+                                     const std::string &name) {
+  auto &snapshot = state.snapshots[path];
+  auto it = snapshot.tables.find(name);
+  if (snapshot.checksum != checksum || it == snapshot.tables.end()) {
+    uint64_t file_checksum;
+    auto tables = load_snapshot(path, db.thread_pool(), &file_checksum);
+    if (tables.has_error()) {
+      return tables.unwrap_err().add_message(
+          "failed to load the snapshot of table {}", name);
+    }
+    if (file_checksum != checksum) {
+      return Error("snapshot {} of table {} changed since it was loaded", path,
+                   name);
+    }
+    snapshot.checksum = checksum;
+    snapshot.tables.clear();
+    for (auto &table : tables.unwrap()) {
+      snapshot.tables[table->name()] = table;
+    }
+    it = snapshot.tables.find(name);
+    if (it == snapshot.tables.end()) {
+      return Error("table {} missing from snapshot {}", name, path);
+    }
+  }
+
+  auto table = it->second;
+  snapshot.tables.erase(it);
+  return table;
+}
+
+Result<bool> apply_record(Database &db, uint64_t lsn, std::string_view data,
+                          ReplayState &state) {
+  auto corrupted = [] { return Error("corrupted wal record"); };
+
+  Decoder record(data);
+  uint8_t type_tag;
+  std::string_view name_view;
+  if (!record.get(type_tag) || !record.get_string(name_view)) {
+    return corrupted();
+  }
+  auto type = static_cast<WalRecord::Type>(type_tag);
+  std::string name(name_view);
+  auto existing = db.get_table(name);
+
+  if (type == WalRecord::Type::InsertPart) {
+    uint64_t part;
+    uint8_t last;
+    if (!record.get(part) || !record.get(last)) {
+      return corrupted();
+    }
+    // a first part starts an insert, the parts of an insert that failed
+    // before its last part are dropped
+    auto &parts = state.parts[name];
+    if (part == 0) {
+      parts.clear();
+    }
+    if (part != parts.size()) {
+      parts.clear();
+      return true;
+    }
+    parts.push_back(record.rest());
+    if (!last) {
+      return true;
+    }
+
+    auto rows = std::move(parts);
+    state.parts.erase(name);
+    if (existing.has_error() || existing.unwrap()->wal_lsn() >= lsn) {
+      return true;
+    }
+    auto res = existing.unwrap()->modify([&](Table &table) -> Result<bool> {
+      for (auto part_rows : rows) {
+        Decoder part_record(part_rows);
+        if (!decode_rows(part_record, table)) {
+          return corrupted();
+        }
+      }
+      table.set_wal_lsn(lsn);
+      return true;
+    });
+    if (res.has_error()) {
+      return res.unwrap_err();
+    }
+    return true;
+  }
+  // an insert in progress when its table was dropped doesn't go on
+  if (type == WalRecord::Type::CreateTable ||
+      type == WalRecord::Type::CreateTableFromSnapshot ||
+      type == WalRecord::Type::DropTable) {
+    state.parts.erase(name);
+  }
+
+  if (type == WalRecord::Type::CreateTableFromSnapshot) {
+    // a table dropped later is not read again, its copy may be gone
+    auto drop = state.dropped.find(name);
+    if (existing.is_ok() ||
+        (drop != state.dropped.end() && drop->second > lsn)) {
+      return true;
+    }
+
+    TableSchema schema;
+    std::string_view path;
+    uint64_t checksum;
+    if (!decode_schema(record, schema) || !record.get_string(path) ||
+        !record.get(checksum)) {
+      return corrupted();
+    }
+    auto table_res = take_snapshot_table(
+        db, state, (state.dir / path).string(), checksum, name);
+    if (table_res.has_error()) {
+      return table_res.unwrap_err();
+    }
+    auto table = table_res.unwrap();
+    if (!same_schema(table->schema(), schema)) {
+      return Error("snapshot {} of table {} changed since it was loaded", path,
+                   name);
+    }
+    table->set_wal_lsn(lsn);
+
+    auto res = db.create_table({.table = table});
+    if (res.has_error()) {
+      return res.unwrap_err();
+    }
+    return true;
+  }
+
+  if (type == WalRecord::Type::CreateTable) {
+    if (existing.is_ok()) {
+      return true;
+    }
+
+    TableSchema schema;
+    if (!decode_schema(record, schema)) {
+      return corrupted();
+    }
+
+    auto table = Table::create_ptr(name, schema);
+    std::vector<size_t> hash_indexes;
+    uint64_t num_ordered_indexes;
+    if (!decode_rows(record, *table) ||
+        !decode_fields(record, *table, hash_indexes) ||
+        !record.get(num_ordered_indexes)) {
+      return corrupted();
+    }
+    for (auto field : hash_indexes) {
+      table->create_index(field);
+    }
+    for (size_t i = 0; i < num_ordered_indexes; i++) {
+      std::vector<size_t> fields;
+      if (!decode_fields(record, *table, fields) ||
+          table->create_ordered_index(fields).has_error()) {
+        return corrupted();
+      }
+    }
+    table->set_wal_lsn(lsn);
+
+    auto res = db.create_table({.table = table});
+    if (res.has_error()) {
+      return res.unwrap_err();
+    }
+    return true;
+  }
+
+  // the table was dropped by a later record, or the change is already held
+  if (existing.has_error() || existing.unwrap()->wal_lsn() >= lsn) {
+    return true;
+  }
+  if (type == WalRecord::Type::DropTable) {
+    return db.drop_table(name);
+  }
+
+  auto res = existing.unwrap()->modify([&](Table &table) -> Result<bool> {
+    auto res = apply_change(type, record, table);
+    if (res.has_error()) {
+      return res;
+    }
+    table.set_wal_lsn(lsn);
+    return true;
+  });
+  if (res.has_error()) {
+    return res.unwrap_err();
+  }
+  return true;
+}
+
+}  // namespace
+
+Result<WalOptions> lumidb::parse_wal_sync(const std::string &policy,
+                                          WalOptions options) {
+  if (policy == "commit") {
+    options.sync = WalSync::Commit;
+    return options;
+  }
+  if (policy == "off") {
+    options.sync = WalSync::Off;
+    return options;
+  }
+
+  size_t digits = 0;
+  while (digits < policy.size() && std::isdigit(policy[digits])) {
+    digits++;
+  }
+  if (digits == 0 || policy.substr(digits) != "ms") {
+    return Error("invalid wal sync policy: {}, expected commit, off or <N>ms",
+                 policy);
+  }
+  options.sync = WalSync::Interval;
+  options.interval = std::chrono::milliseconds(
+      std::max<long long>(std::stoll(policy.substr(0, digits)), 1));
+  return options;
+}
+
+WalRecord WalRecord::create_table(const Table &table) {
+  auto record = begin_record(Type::CreateTable, table.name());
+  auto &schema = table.schema();
+  encode_schema(record, schema);
+  encode_rows(record, table, 0);
+
+  std::vector<size_t> hash_indexes;
+  for (size_t i = 0; i < schema.fields_size(); i++) {
+    if (table.column(i).indexed()) {
+      hash_indexes.push_back(i);
+    }
+  }
+  encode_fields(record, hash_indexes);
+  record.put<uint64_t>(table.ordered_indexes().size());
+  for (auto &index : table.ordered_indexes()) {
+    encode_fields(record, index.fields);
+  }
+  return WalRecord(record.release());
+}
+
+WalRecord WalRecord::create_table(const Table &table,
+                                  const SnapshotSource &source) {
+  auto record = begin_record(Type::CreateTableFromSnapshot, table.name());
+  encode_schema(record, table.schema());
+  // the copy is found next to the log, which may be moved with it
+  record.put_string(std::filesystem::path(source.path).filename().string());
+  record.put<uint64_t>(source.checksum);
+  return WalRecord(record.release());
+}
+
+WalRecord WalRecord::drop_table(const std::string &name) {
+  return WalRecord(begin_record(Type::DropTable, name).release());
+}
+
+WalRecord WalRecord::insert(const Table &table, size_t first_row) {
+  auto record = begin_record(Type::Insert, table.name());
+  encode_rows(record, table, first_row);
+  return WalRecord(record.release());
+}
+
+WalRecord WalRecord::insert_part(const Table &table, size_t first_row,
+                                 uint64_t part, bool last) {
+  auto record = begin_record(Type::InsertPart, table.name());
+  record.put<uint64_t>(part);
+  record.put<uint8_t>(last);
+  encode_rows(record, table, first_row);
+  return WalRecord(record.release());
+}
+
+WalRecord WalRecord::update(const Table &table, const RowIndicesList &rows) {
+  auto record = begin_record(Type::Update, table.name());
+  record.put<uint64_t>(rows.size());
+  for (auto row : rows) {
+    record.put<uint64_t>(row);
+    for (size_t i = 0; i < table.schema().fields_size(); i++) {
+      record.put_value(table.column(i).get(row));
+    }
+  }
+  return WalRecord(record.release());
+}
+
+WalRecord WalRecord::remove(const Table &table, const RowIndicesList &rows) {
+  auto record = begin_record(Type::Delete, table.name());
+  encode_fields(record, rows);
+  return WalRecord(record.release());
+}
+
+WalRecord WalRecord::create_index(const Table &table, size_t field_index) {
+  auto record = begin_record(Type::CreateIndex, table.name());
+  record.put<uint64_t>(field_index);
+  return WalRecord(record.release());
+}
+
+WalRecord WalRecord::create_ordered_index(const Table &table,
+                                          const std::vector<size_t> &fields) {
+  auto record = begin_record(Type::CreateOrderedIndex, table.name());
+  encode_fields(record, fields);
+  return WalRecord(record.release());
+}
+
+WriteAheadLog::WriteAheadLog(WalOptions options, std::FILE *file,
+                             uint64_t next_lsn, uint64_t size)
+    : options_(std::move(options)),
+      file_(file),
+      next_lsn_(next_lsn),
+      buffered_lsn_(next_lsn - 1),
+      written_lsn_(next_lsn - 1),
+      synced_lsn_(next_lsn - 1),
+      size_(size) {}
+
+Result<WriteAheadLogPtr> WriteAheadLog::open(const WalOptions &options,
+                                             uint64_t next_lsn) {
+  std::FILE *file = std::fopen(options.path.c_str(), "ab");
+  if (file == nullptr) {
+    return Error("failed to open wal: {}, {}", options.path,
+                 std::strerror(errno));
+  }
+  std::error_code ec;
+  uint64_t size = std::filesystem::file_size(options.path, ec);
+  if (ec) {
+    std::fclose(file);
+    return Error("failed to open wal: {}, {}", options.path, ec.message());
+  }
+
+  auto wal =
+      WriteAheadLogPtr(new WriteAheadLog(options, file, next_lsn, size));
+  if (options.sync == WalSync::Interval) {
+    wal->flusher_ = std::thread([wal = wal.get()] { wal->run_flusher(); });
+  }
+  return wal;
+}
+
+WriteAheadLog::~WriteAheadLog() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  stop_flusher_.notify_all();
+  if (flusher_.joinable()) {
+    flusher_.join();
+  }
+
+  std::unique_lock lock(mutex_);
+  flushed_.wait(lock, [&] { return !flushing_; });
+  if (synced_lsn_ < buffered_lsn_) {
+    flush(lock, true);
+  }
+  if (file_ != nullptr) {
+    std::fclose(file_);
+  }
+}
+
+uint64_t WriteAheadLog::append(WalRecord &&record) {
+  auto &payload = record.payload_;
+  uint64_t payload_checksum = checksum(payload.data(), payload.size());
+
+  std::lock_guard lock(mutex_);
+  uint64_t lsn = next_lsn_++;
+  auto &frame = buffer_.emplace_back();
+  frame.header[0] = payload.size();
+  frame.header[1] = lsn;
+  frame.header[2] = checksum(&lsn, sizeof(lsn), payload_checksum);
+  frame.payload = std::move(payload);
+  buffered_lsn_ = lsn;
+  return lsn;
+}
+
+Result<bool> WriteAheadLog::commit(uint64_t lsn) {
+  std::unique_lock lock(mutex_);
+  if (options_.sync == WalSync::Interval) {
+    if (error_.has_value()) {
+      return error_.value();
+    }
+    return true;
+  }
+
+  bool sync = options_.sync == WalSync::Commit;
+  while ((sync ? synced_lsn_ : written_lsn_) < lsn) {
+    if (error_.has_value()) {
+      return error_.value();
+    }
+    // the records buffered while another commit writes are written by the
+    // next one at once
+    if (flushing_) {
+      flushed_.wait(lock);
+      continue;
+    }
+    flush(lock, sync);
+  }
+  return true;
+}
+
+void WriteAheadLog::flush(std::unique_lock<std::mutex> &lock, bool sync) {
+  flushing_ = true;
+  std::vector<Frame> batch;
+  batch.swap(buffer_);
+  uint64_t lsn = buffered_lsn_;
+  lock.unlock();
+
+  // the file is closed if truncating failed to reopen it
+  bool ok = file_ != nullptr;
+  uint64_t batch_size = 0;
+  for (auto &frame : batch) {
+    ok = ok &&
+         std::fwrite(frame.header, 1, sizeof(frame.header), file_) ==
+             sizeof(frame.header) &&
+         std::fwrite(frame.payload.data(), 1, frame.payload.size(), file_) ==
+             frame.payload.size();
+    batch_size += sizeof(frame.header) + frame.payload.size();
+  }
+  ok = ok && std::fflush(file_) == 0 && (!sync || sync_file(file_));
+  int err = errno;
+
+  lock.lock();
+  flushing_ = false;
+  if (ok) {
+    size_ += batch_size;
+    written_lsn_ = lsn;
+    if (sync) {
+      synced_lsn_ = lsn;
+    }
+  } else if (!error_.has_value()) {
+    error_ = Error("failed to write wal: {}, {}", options_.path,
+                   std::strerror(err));
+  }
+  flushed_.notify_all();
+}
+
+uint64_t WriteAheadLog::size() const {
+  std::lock_guard lock(mutex_);
+  return size_;
+}
+
+Result<bool> WriteAheadLog::truncate(const TablePtrList &tables) {
+  // write every record appended so far, the file then holds the records of
+  // the snapshot
+  uint64_t prefix_size;
+  {
+    std::unique_lock lock(mutex_);
+    flushed_.wait(lock, [&] { return !flushing_; });
+    if (!buffer_.empty()) {
+      flush(lock, false);
+    }
+    if (error_.has_value()) {
+      return error_.value();
+    }
+    prefix_size = size_;
+  }
+  if (prefix_size == 0) {
+    return true;
+  }
+
+  std::map<std::string_view, uint64_t> held;
+  for (auto &table : tables) {
+    held[table->name()] = table->wal_lsn();
+  }
+
+  std::string kept;
+  // the snapshot copies of the dropped records, removed unless a kept one
+  // refers to them too
+  std::set<std::string> released, referenced;
+  {
+    auto file_res = MappedFile::open(options_.path);
+    if (file_res.has_error()) {
+      return file_res.unwrap_err();
+    }
+    auto data = file_res.unwrap()->data().substr(0, prefix_size);
+
+    // a table missing from the snapshot was dropped before it was taken, or
+    // created after. Its records up to the last drop are of dropped tables.
+    std::map<std::string_view, uint64_t> dropped;
+    for (int pass = 0; pass < 2; pass++) {
+      Decoder log(data);
+      while (log.size() > 0) {
+        size_t offset = data.size() - log.size();
+        uint64_t lsn;
+        std::string_view payload, name;
+        WalRecord::Type type;
+        if (!read_frame(log, lsn, payload) ||
+            !decode_record_table(payload, type, name)) {
+          return Error("corrupted wal: {}, at offset {}", options_.path,
+                       offset);
+        }
+
+        auto it = held.find(name);
+        if (pass == 0) {
+          if (it == held.end() && type == WalRecord::Type::DropTable) {
+            dropped[name] = lsn;
+          }
+          continue;
+        }
+
+        bool keep = it != held.end() ? lsn > it->second : lsn > dropped[name];
+        if (keep) {
+          kept.append(data.substr(offset, data.size() - log.size() - offset));
+        }
+        std::string_view copy;
+        if (type == WalRecord::Type::CreateTableFromSnapshot &&
+            decode_snapshot_copy(payload, copy)) {
+          (keep ? referenced : released).insert(std::string(copy));
+        }
+      }
+    }
+  }
+
+  std::string tmp_path = options_.path + ".tmp";
+  auto write_tmp = [&](const std::string &tail) -> Result<bool> {
+    std::FILE *tmp = std::fopen(tmp_path.c_str(), "wb");
+    bool ok = tmp != nullptr &&
+              std::fwrite(kept.data(), 1, kept.size(), tmp) == kept.size() &&
+              std::fwrite(tail.data(), 1, tail.size(), tmp) == tail.size() &&
+              std::fflush(tmp) == 0 && sync_file(tmp);
+    int err = errno;
+    if (tmp != nullptr) {
+      ok = std::fclose(tmp) == 0 && ok;
+    }
+    if (!ok) {
+      std::remove(tmp_path.c_str());
+      return Error("failed to write wal: {}, {}", tmp_path,
+                   std::strerror(err));
+    }
+    return true;
+  };
+
+  // appending waits from here on, only for the records written meanwhile to
+  // be copied
+  std::unique_lock lock(mutex_);
+  flushed_.wait(lock, [&] { return !flushing_; });
+
+  std::string tail(size_ - prefix_size, '\0');
+  std::ifstream in(options_.path, std::ios::binary);
+  in.seekg(prefix_size);
+  if (!in.read(tail.data(), tail.size())) {
+    return Error("failed to read wal: {}", options_.path);
+  }
+  for (auto &frame : buffer_) {
+    tail.append(reinterpret_cast<const char *>(frame.header),
+                sizeof(frame.header));
+    tail.append(frame.payload);
+  }
+  auto res = write_tmp(tail);
+  if (res.has_error()) {
+    return res;
+  }
+
+  std::fclose(file_);
+  bool replaced = replace_file(tmp_path, options_.path);
+  file_ = std::fopen(options_.path.c_str(), "ab");
+  if (file_ == nullptr) {
+    error_ = Error("failed to open wal: {}, {}", options_.path,
+                   std::strerror(errno));
+    return error_.value();
+  }
+  if (!replaced) {
+    std::remove(tmp_path.c_str());
+    return Error("failed to rename {} to {}", tmp_path, options_.path);
+  }
+
+  // the buffered records were written and synced with the kept ones
+  buffer_.clear();
+  written_lsn_ = synced_lsn_ = buffered_lsn_;
+  size_ = kept.size() + tail.size();
+  lock.unlock();
+
+  auto dir = std::filesystem::path(options_.path).parent_path();
+  for (auto &copy : released) {
+    if (referenced.count(copy) == 0) {
+      std::error_code ec;
+      std::filesystem::remove(dir / copy, ec);
+    }
+  }
+  return true;
+}
+
+Result<SnapshotSource> WriteAheadLog::copy_snapshot(const std::string &path) {
+  auto file_res = MappedFile::open(path);
+  if (file_res.has_error()) {
+    return file_res.unwrap_err();
+  }
+  auto data = file_res.unwrap()->data();
+
+  // named after the log, unique among the copies of the log
+  uint64_t number;
+  {
+    std::lock_guard lock(mutex_);
+    number = snapshot_copies_++;
+  }
+  auto time = std::chrono::system_clock::now().time_since_epoch();
+  auto copy_path = fmt::format(
+      "{}.snap.{}.{}", options_.path,
+      std::chrono::duration_cast<std::chrono::microseconds>(time).count(),
+      number);
+
+  std::string tmp_path = copy_path + ".tmp";
+  std::FILE *tmp = std::fopen(tmp_path.c_str(), "wb");
+  bool ok = tmp != nullptr &&
+            std::fwrite(data.data(), 1, data.size(), tmp) == data.size() &&
+            std::fflush(tmp) == 0 && sync_file(tmp);
+  int err = errno;
+  if (tmp != nullptr) {
+    ok = std::fclose(tmp) == 0 && ok;
+  }
+  if (ok && !replace_file(tmp_path, copy_path)) {
+    ok = false;
+    err = errno;
+  }
+  if (!ok) {
+    std::remove(tmp_path.c_str());
+    return Error("failed to copy snapshot {} to {}, {}", path, copy_path,
+                 std::strerror(err));
+  }
+  return SnapshotSource{.path = copy_path, .checksum = 0};
+}
+
+void WriteAheadLog::run_flusher() {
+  std::unique_lock lock(mutex_);
+  while (!stopping_) {
+    stop_flusher_.wait_for(lock, options_.interval);
+    if (!flushing_ && synced_lsn_ < buffered_lsn_) {
+      flush(lock, true);
+    }
+  }
+}
+
+Result<uint64_t> lumidb::replay_wal(const std::string &path, Database &db) {
+  std::error_code ec;
+  if (!std::filesystem::exists(path, ec)) {
+    return 0;
+  }
+
+  auto file_res = MappedFile::open(path);
+  if (file_res.has_error()) {
+    return file_res.unwrap_err();
+  }
+  auto file = file_res.unwrap();
+  auto data = file->data();
+
+  Decoder log(data);
+  uint64_t last_lsn = 0;
+  size_t valid_size = 0;
+  uint64_t lsn;
+  std::string_view payload;
+  ReplayState state;
+  state.dir = std::filesystem::path(path).parent_path();
+  while (read_frame(log, lsn, payload)) {
+    WalRecord::Type type;
+    std::string_view name;
+    if (decode_record_table(payload, type, name) &&
+        type == WalRecord::Type::DropTable) {
+      state.dropped[std::string(name)] = lsn;
+    }
+  }
+
+  log = Decoder(data);
+  while (read_frame(log, lsn, payload)) {
+    auto res = apply_record(db, lsn, payload, state);
+    if (res.has_error()) {
+      return res.unwrap_err().add_message("failed to replay wal record, lsn={}",
+                                          lsn);
+    }
+    last_lsn = lsn;
+    valid_size = data.size() - log.size();
+  }
+
+  if (valid_size < data.size()) {
+    db.logging(Logger::Warning,
+               fmt::format("wal {} has a torn tail of {} bytes, truncated",
+                           path, data.size() - valid_size));
+    file.reset();
+    std::filesystem::resize_file(path, valid_size, ec);
+    if (ec) {
+      return Error("failed to truncate wal: {}, {}", path, ec.message());
+    }
+  }
+  return last_lsn;
+}
+
+// Checkpoints
+
+namespace {
+
+// checkpoints kept in the history
+constexpr size_t kCheckpointHistory = 64;
+// how often the size of the log is checked
+constexpr std::chrono::milliseconds kCheckpointPoll{100};
+
+}  // namespace
+
+Checkpointer::Checkpointer(Database &db, CheckpointOptions options)
+    : db_(db), options_(std::move(options)) {}
+
+Result<CheckpointerPtr> Checkpointer::start(Database &db,
+                                            CheckpointOptions options) {
+  if (options.path.empty()) {
+    return Error("checkpoint snapshot path is empty");
+  }
+
+  auto checkpointer =
+      CheckpointerPtr(new Checkpointer(db, std::move(options)));
+  checkpointer->thread_ =
+      std::thread([checkpointer = checkpointer.get()] { checkpointer->run(); });
+  return checkpointer;
+}
+
+Checkpointer::~Checkpointer() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  finished_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+Result<CheckpointInfo> Checkpointer::checkpoint() {
+  std::unique_lock lock(mutex_);
+  // a running checkpoint may have snapshotted the tables before the call
+  uint64_t id = next_id_;
+  requested_ = true;
+  wake_.notify_all();
+
+  finished_.wait(lock, [&] { return stopping_ || finished_id_ >= id; });
+  if (finished_id_ < id) {
+    return Error("checkpointer stopped");
+  }
+  for (auto &info : history_) {
+    if (info.id >= id) {
+      return info;
+    }
+  }
+  return Error("checkpoint {} not found", id);
+}
+
+std::vector<CheckpointInfo> Checkpointer::history() const {
+  std::lock_guard lock(mutex_);
+  std::vector<CheckpointInfo> history(history_.begin(), history_.end());
+  if (!history.empty() &&
+      history.back().state == CheckpointInfo::State::Running) {
+    history.back().duration = std::chrono::steady_clock::now() - running_since_;
+  }
+  return history;
+}
+
+void Checkpointer::run() {
+  std::unique_lock lock(mutex_);
+  auto last = std::chrono::steady_clock::now();
+  uint64_t last_wal_size = db_.wal() != nullptr ? db_.wal()->size() : 0;
+
+  while (!stopping_) {
+    auto interval = options_.interval.count() > 0
+                        ? std::min(options_.interval, kCheckpointPoll)
+                        : kCheckpointPoll;
+    wake_.wait_for(lock, interval, [&] { return stopping_ || requested_; });
+    if (stopping_) {
+      break;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    auto wal = db_.wal();
+    std::string trigger;
+    if (requested_) {
+      trigger = "manual";
+    } else if (options_.interval.count() > 0 &&
+               now - last >= options_.interval) {
+      trigger = "interval";
+    } else if (wal != nullptr && options_.wal_size > 0 &&
+               wal->size() >= last_wal_size + options_.wal_size) {
+      trigger = "wal_size";
+    } else {
+      continue;
+    }
+    requested_ = false;
+
+    lock.unlock();
+    auto info = run_checkpoint(trigger);
+    lock.lock();
+
+    finished_id_ = info.id;
+    finished_.notify_all();
+    last = std::chrono::steady_clock::now();
+    // a failed checkpoint is retried once the log grew as much again
+    last_wal_size = wal != nullptr ? wal->size() : 0;
+  }
+}
+
+CheckpointInfo Checkpointer::run_checkpoint(const std::string &trigger) {
+  CheckpointInfo info{
+      .id = 0,
+      .state = CheckpointInfo::State::Running,
+      .trigger = trigger,
+      .started = std::chrono::system_clock::now(),
+      .duration = {},
+      .tables = 0,
+      .tables_written = 0,
+      .rows_written = 0,
+      .snapshot_size = 0,
+      .wal_size_before = 0,
+      .wal_size_after = 0,
+      .error = "",
+  };
+  {
+    std::lock_guard lock(mutex_);
+    info.id = next_id_++;
+    running_since_ = std::chrono::steady_clock::now();
+    history_.push_back(info);
+    if (history_.size() > kCheckpointHistory) {
+      history_.pop_front();
+    }
+  }
+
+  auto checkpoint = [&]() -> Result<bool> {
+    auto tables_res = db_.list_tables();
+    if (tables_res.has_error()) {
+      return tables_res.unwrap_err();
+    }
+
+    // copy-on-write versions, writers keep modifying the tables
+    TablePtrList tables;
+    for (auto &table : tables_res.unwrap()) {
+      tables.push_back(table->snapshot());
+    }
+    update([&](CheckpointInfo &info) { info.tables = tables.size(); });
+
+    auto res = save_snapshot(options_.path, tables, [&](const Table &table) {
+      update([&](CheckpointInfo &info) {
+        info.tables_written++;
+        info.rows_written += table.num_rows();
+      });
+    });
+    if (res.has_error()) {
+      return res;
+    }
+
+    std::error_code ec;
+    uint64_t snapshot_size = std::filesystem::file_size(options_.path, ec);
+    update([&](CheckpointInfo &info) { info.snapshot_size = snapshot_size; });
+
+    auto wal = db_.wal();
+    if (wal == nullptr) {
+      return true;
+    }
+    uint64_t wal_size_before = wal->size();
+    res = wal->truncate(tables);
+    uint64_t wal_size_after = wal->size();
+    update([&](CheckpointInfo &info) {
+      info.wal_size_before = wal_size_before;
+      info.wal_size_after = wal_size_after;
+    });
+    return res;
+  };
+
+  auto res = checkpoint();
+  if (res.has_error()) {
+    db_.logging(Logger::Warning,
+                fmt::format("checkpoint {} failed: {}", info.id,
+                            res.unwrap_err().message));
+  }
+
+  std::lock_guard lock(mutex_);
+  auto &last = history_.back();
+  last.state = res.has_error() ? CheckpointInfo::State::Failed
+                               : CheckpointInfo::State::Done;
+  last.duration = std::chrono::steady_clock::now() - running_since_;
+  if (res.has_error()) {
+    last.error = res.unwrap_err().message;
+  }
+  return last;
+}
+
+void Checkpointer::update(
+    const std::function<void(CheckpointInfo &info)> &updater) {
+  std::lock_guard lock(mutex_);
+  updater(history_.back());
+}
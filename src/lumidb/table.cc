@@ -2,11 +2,26 @@
 #include "lumidb/table.hh"
 
 #include <algorithm>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <unordered_set>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <ostream>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
+#include "lumidb/executor.hh"
+#include "lumidb/utils.hh"
 #include "tabulate/table.hpp"
 
 using namespace std;
@@ -108,6 +123,1242 @@ struct RenderTableData {
   vector<vector<string>> rows;
 };
 
+// Column
+
+// floats within the epsilon of `compare_float` fall in the same or adjacent
+// buckets, allowing for the rounding of the float difference
+static constexpr double kFloatBucketWidth = 0.0001;
+static constexpr int kFloatBucketProbes = 2;
+static constexpr uint64_t kNanIndexKey = 0x7ff8000000000001;
+
+static double float_bucket(float value) {
+  // + 0.0 folds -0.0 into 0.0
+  return std::floor(static_cast<double>(value) / kFloatBucketWidth) + 0.0;
+}
+
+static uint64_t float_bucket_key(double bucket) {
+  uint64_t bits;
+  std::memcpy(&bits, &bucket, sizeof(bits));
+  return bits;
+}
+
+uint64_t Column::index_key(const AnyValue &value) {
+  if (value.is_float()) {
+    if (std::isnan(value.as_float())) {
+      return kNanIndexKey;
+    }
+    return float_bucket_key(float_bucket(value.as_float()));
+  }
+  return std::hash<std::string_view>()(value.as_string_view());
+}
+
+void Column::index_cell(Chunk &chunk, size_t off) {
+  if (is_null_in(chunk, off)) {
+    return;
+  }
+  chunk.index[index_key(get_in(chunk, off))].push_back(off);
+}
+
+void Column::unindex_cell(Chunk &chunk, size_t off) {
+  if (is_null_in(chunk, off)) {
+    return;
+  }
+
+  auto it = chunk.index.find(index_key(get_in(chunk, off)));
+  if (it == chunk.index.end()) {
+    return;
+  }
+
+  auto &offsets = it->second;
+  offsets.erase(std::find(offsets.begin(), offsets.end(), off));
+  if (offsets.empty()) {
+    chunk.index.erase(it);
+  }
+}
+
+std::vector<uint64_t> Column::lookup_keys(const AnyValue &value) {
+  std::vector<uint64_t> keys;
+  if (value.is_float()) {
+    double bucket = float_bucket(value.as_float());
+    for (int i = -kFloatBucketProbes; i <= kFloatBucketProbes; i++) {
+      keys.push_back(float_bucket_key(bucket + i));
+    }
+    // NaN cells compare equal to every float
+    keys.push_back(kNanIndexKey);
+  } else {
+    keys.push_back(index_key(value));
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  return keys;
+}
+
+RowIndicesList Column::lookup(const AnyValue &value) const {
+  auto keys = lookup_keys(value);
+
+  RowIndicesList rows;
+  std::vector<uint16_t> offsets;
+  for (size_t c = 0; c < chunks_->size(); c++) {
+    auto &chunk = *(*chunks_)[c];
+
+    offsets.clear();
+    for (auto key : keys) {
+      auto it = chunk.index.find(key);
+      if (it != chunk.index.end()) {
+        offsets.insert(offsets.end(), it->second.begin(), it->second.end());
+      }
+    }
+    std::sort(offsets.begin(), offsets.end());
+
+    // keys may collide, check the cells
+    for (auto off : offsets) {
+      if (get_in(chunk, off) == value) {
+        rows.push_back(c * kColumnChunkSize + off);
+      }
+    }
+  }
+
+  return rows;
+}
+
+bool Column::may_match(size_t chunk_index, CompareOperator op,
+                       const AnyValue &value) const {
+  auto &chunk = *(*chunks_)[chunk_index];
+  if (storage_ == Storage::Generic || chunk.has_nan) {
+    return true;
+  }
+
+  if (chunk.null_count > 0) {
+    auto null = AnyValue::from_null();
+    if (AnyValue::get_comparator(op)(null, value)) {
+      return true;
+    }
+  }
+  if (chunk.min.is_null()) {
+    return false;
+  }
+
+  switch (op) {
+    case CompareOperator::EQ:
+      // floats within the epsilon are equal
+      if (value.is_float() && chunk.min.is_float()) {
+        return compare_float(chunk.max.as_float(), value.as_float()) >= 0 &&
+               compare_float(chunk.min.as_float(), value.as_float()) <= 0;
+      }
+      return !(value < chunk.min) && !(chunk.max < value);
+    case CompareOperator::LT:
+      return chunk.min < value;
+    case CompareOperator::GT:
+      return value < chunk.max;
+    case CompareOperator::LE:
+      return may_match(chunk_index, CompareOperator::LT, value) ||
+             may_match(chunk_index, CompareOperator::EQ, value);
+    case CompareOperator::GE:
+      return may_match(chunk_index, CompareOperator::GT, value) ||
+             may_match(chunk_index, CompareOperator::EQ, value);
+    case CompareOperator::NE:
+      // every cell lies within the bounds
+      return !(chunk.min == value && chunk.max == value);
+  }
+  return true;
+}
+
+std::optional<AnyValue> Column::chunk_max(size_t chunk_index) const {
+  auto &chunk = *(*chunks_)[chunk_index];
+  if (storage_ == Storage::Generic || chunk.has_nan || !chunk.exact_bounds) {
+    return std::nullopt;
+  }
+  return chunk.max;
+}
+
+std::optional<AnyValue> Column::chunk_min(size_t chunk_index) const {
+  auto &chunk = *(*chunks_)[chunk_index];
+  if (storage_ == Storage::Generic || chunk.has_nan || !chunk.exact_bounds) {
+    return std::nullopt;
+  }
+  return chunk.min;
+}
+
+void Column::widen_zone(Chunk &chunk, size_t off) {
+  if (storage_ == Storage::Generic || is_null_in(chunk, off)) {
+    return;
+  }
+
+  auto value = get_in(chunk, off);
+  if (value.is_float() && std::isnan(value.as_float())) {
+    chunk.has_nan = true;
+    return;
+  }
+
+  if (chunk.min.is_null()) {
+    chunk.min = value;
+    chunk.max = value;
+    return;
+  }
+
+  // a bound is the first cell holding it. Appended cells come after it, but
+  // a cell written in place that ties a bound may precede it.
+  bool appended = off + 1 == chunk.size;
+  if (value < chunk.min) {
+    chunk.min = value;
+  } else if (!appended && !(chunk.min < value)) {
+    chunk.exact_bounds = false;
+  }
+  if (chunk.max < value) {
+    chunk.max = value;
+  } else if (!appended && !(value < chunk.max)) {
+    chunk.exact_bounds = false;
+  }
+}
+
+void Column::widen_zone(Chunk &chunk, size_t begin, size_t end) {
+  if (storage_ == Storage::Generic) {
+    return;
+  }
+
+  // the first least and greatest non-null cells of the range, as appending
+  // them one by one would set the bounds
+  std::optional<size_t> min_off, max_off;
+  if (storage_ == Storage::Float) {
+    auto &floats = chunk.floats;
+    for (size_t off = begin; off < end; off++) {
+      if (is_null_in(chunk, off)) {
+        continue;
+      }
+      float v = floats[off];
+      if (std::isnan(v)) {
+        chunk.has_nan = true;
+        continue;
+      }
+      if (!min_off || v < floats[*min_off]) {
+        min_off = off;
+      }
+      if (!max_off || floats[*max_off] < v) {
+        max_off = off;
+      }
+    }
+  } else {
+    auto &strings = chunk.strings;
+    for (size_t off = begin; off < end; off++) {
+      if (is_null_in(chunk, off)) {
+        continue;
+      }
+      auto v = strings[off].as_string_view();
+      if (!min_off || v < strings[*min_off].as_string_view()) {
+        min_off = off;
+      }
+      if (!max_off || strings[*max_off].as_string_view() < v) {
+        max_off = off;
+      }
+    }
+  }
+  if (!min_off) {
+    return;
+  }
+
+  auto min = get_in(chunk, *min_off), max = get_in(chunk, *max_off);
+  if (chunk.min.is_null() || min < chunk.min) {
+    chunk.min = std::move(min);
+  }
+  if (chunk.max.is_null() || chunk.max < max) {
+    chunk.max = std::move(max);
+  }
+}
+
+void Column::append_slice(const Chunk &src, size_t begin, size_t end) {
+  while (begin < end) {
+    auto &chunk = append_chunk();
+    size_t first = chunk.size;
+    size_t n = std::min(end - begin, kColumnChunkSize - first);
+
+    switch (storage_) {
+      case Storage::Float:
+        chunk.floats.insert(chunk.floats.end(), src.floats.begin() + begin,
+                            src.floats.begin() + begin + n);
+        break;
+      case Storage::String:
+        chunk.strings.insert(chunk.strings.end(), src.strings.begin() + begin,
+                             src.strings.begin() + begin + n);
+        break;
+      case Storage::Generic:
+        chunk.values.insert(chunk.values.end(), src.values.begin() + begin,
+                            src.values.begin() + begin + n);
+        break;
+    }
+
+    // copy the null bits a word at a time
+    chunk.null_bits.resize((first + n + 63) / 64);
+    size_t num_nulls = 0;
+    for (size_t done = 0; done < n;) {
+      size_t src_pos = begin + done, dst_pos = first + done;
+      size_t k = std::min({n - done, 64 - dst_pos % 64, 64 - src_pos % 64});
+      uint64_t word = src.null_bits[src_pos / 64] >> (src_pos % 64);
+      if (k < 64) {
+        word &= (uint64_t(1) << k) - 1;
+      }
+      chunk.null_bits[dst_pos / 64] |= word << (dst_pos % 64);
+      num_nulls += __builtin_popcountll(word);
+      done += k;
+    }
+    chunk.size += n;
+    chunk.null_count += num_nulls;
+    size_ += n;
+    null_count_ += num_nulls;
+
+    if (indexed_) {
+      for (size_t off = first; off < chunk.size; off++) {
+        index_cell(chunk, off);
+      }
+    }
+    widen_zone(chunk, first, chunk.size);
+    begin += n;
+  }
+}
+
+void Column::unzone_cell(Chunk &chunk, size_t off) {
+  if (storage_ == Storage::Generic || is_null_in(chunk, off)) {
+    return;
+  }
+
+  // the bounds stay valid, but may no longer be held by a cell
+  auto value = get_in(chunk, off);
+  if (!(chunk.min < value) || !(value < chunk.max)) {
+    chunk.exact_bounds = false;
+  }
+}
+
+uint64_t Column::sort_key(size_t idx, size_t segment) const {
+  auto &chunk = chunk_at(idx);
+  size_t off = idx % kColumnChunkSize;
+
+  const AnyValue *value = nullptr;
+  if (storage_ == Storage::Generic) {
+    value = &chunk.values[off];
+  } else if (is_null_in(chunk, off)) {
+    return 0;
+  } else if (storage_ == Storage::String) {
+    value = &chunk.strings[off];
+  }
+
+  uint64_t kind = static_cast<uint64_t>(
+      value != nullptr ? value->kind() : ValueTypeKind::T_FLOAT);
+  if (kind == static_cast<uint64_t>(ValueTypeKind::T_FLOAT)) {
+    float v = value != nullptr ? value->as_float() : chunk.floats[off];
+    // -0 and 0 compare equal, every NaN is keyed alike
+    if (v == 0) {
+      v = 0;
+    } else if (std::isnan(v)) {
+      v = std::numeric_limits<float>::quiet_NaN();
+    }
+    uint32_t bits;
+    std::memcpy(&bits, &v, sizeof(bits));
+    return kind << 56 | ((bits & 0x80000000) ? ~bits : bits | 0x80000000);
+  }
+  if (kind != static_cast<uint64_t>(ValueTypeKind::T_STRING)) {
+    return kind << 56;
+  }
+
+  // segment 0 holds 6 bytes after the kind, the others 7
+  auto str = value->as_string_view();
+  size_t begin = segment == 0 ? 0 : 6 + 7 * (segment - 1);
+  size_t size = segment == 0 ? 6 : 7;
+  size_t left = str.size() > begin ? str.size() - begin : 0;
+
+  uint64_t key = segment == 0 ? kind << 56 : 0;
+  for (size_t i = 0; i < size && i < left; i++) {
+    key |= uint64_t(uint8_t(str[begin + i])) << (8 * (size - i));
+  }
+  return key | std::min(left, size + 1);
+}
+
+static bool same_float(float lhs, float rhs) {
+  return lhs == rhs || (std::isnan(lhs) && std::isnan(rhs));
+}
+
+bool Column::same(size_t lhs, size_t rhs) const {
+  auto &chunk1 = chunk_at(lhs);
+  auto &chunk2 = chunk_at(rhs);
+  size_t off1 = lhs % kColumnChunkSize, off2 = rhs % kColumnChunkSize;
+
+  if (storage_ == Storage::Generic) {
+    auto &v1 = chunk1.values[off1];
+    auto &v2 = chunk2.values[off2];
+    if (v1.kind() != v2.kind()) {
+      return false;
+    }
+    if (v1.is_float()) {
+      return same_float(v1.as_float(), v2.as_float());
+    }
+    return v1.is_null() || v1.as_string_view() == v2.as_string_view();
+  }
+
+  bool null1 = is_null_in(chunk1, off1), null2 = is_null_in(chunk2, off2);
+  if (null1 || null2) {
+    return null1 == null2;
+  }
+  if (storage_ == Storage::Float) {
+    return same_float(chunk1.floats[off1], chunk2.floats[off2]);
+  }
+  return chunk1.strings[off1].as_string_view() ==
+         chunk2.strings[off2].as_string_view();
+}
+
+uint64_t Column::hash(size_t idx) const {
+  auto &chunk = chunk_at(idx);
+  size_t off = idx % kColumnChunkSize;
+
+  const AnyValue *value = nullptr;
+  if (storage_ == Storage::String && !is_null_in(chunk, off)) {
+    value = &chunk.strings[off];
+  } else if (storage_ == Storage::Generic && chunk.values[off].is_string()) {
+    value = &chunk.values[off];
+  }
+
+  // the sort key of a float or null holds the whole value
+  uint64_t h = value != nullptr
+                   ? std::hash<std::string_view>()(value->as_string_view())
+                   : sort_key(idx);
+  // finalizer of murmur3, spreads the bits of float keys
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Sort
+
+namespace {
+
+// rows per task while the sort keys are extracted
+constexpr size_t kSortMorselSize = 16 * 1024;
+// fewer rows are sorted in a single run
+constexpr size_t kParallelSortRows = 64 * 1024;
+// fewer rows with equal keys are compared cell by cell
+constexpr size_t kRadixSortRows = 64;
+
+struct SortEntry {
+  // sort key of the row, inverted for a descending sort
+  uint64_t key;
+  // position of the row in the input
+  size_t pos;
+};
+
+// stable LSD radix sort by key, skipping the bytes every key shares. scratch
+// must hold as many entries.
+void radix_sort(SortEntry *data, SortEntry *scratch, size_t n) {
+  size_t counts[8][256] = {};
+  for (size_t i = 0; i < n; i++) {
+    for (size_t b = 0; b < 8; b++) {
+      counts[b][(data[i].key >> (8 * b)) & 0xff]++;
+    }
+  }
+
+  SortEntry *src = data, *dst = scratch;
+  for (size_t b = 0; b < 8; b++) {
+    if (counts[b][(src[0].key >> (8 * b)) & 0xff] == n) {
+      continue;
+    }
+    size_t offsets[256];
+    size_t offset = 0;
+    for (size_t i = 0; i < 256; i++) {
+      offsets[i] = offset;
+      offset += counts[b][i];
+    }
+    for (size_t i = 0; i < n; i++) {
+      dst[offsets[(src[i].key >> (8 * b)) & 0xff]++] = src[i];
+    }
+    std::swap(src, dst);
+  }
+  if (src != data) {
+    std::copy(src, src + n, data);
+  }
+}
+
+class RowSorter {
+ public:
+  RowSorter(const std::vector<const Column *> &columns,
+            const RowIndicesList &rows, bool asc)
+      : columns_(columns), rows_(rows), asc_(asc) {}
+
+  uint64_t key(size_t pos, size_t field, size_t segment) const {
+    uint64_t key = columns_[field]->sort_key(rows_[pos], segment);
+    return asc_ ? key : ~key;
+  }
+
+  // order entries with equal keys up to a segment of a field, sorted by
+  // position
+  void refine(SortEntry *entries, size_t n, size_t field, size_t segment) {
+    if (field == columns_.size()) {
+      return;
+    }
+    if (n < kRadixSortRows) {
+      compare(entries, n, field);
+      return;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      entries[i].key = key(entries[i].pos, field, segment);
+    }
+    scratch_.resize(std::max(scratch_.size(), n));
+    radix_sort(entries, scratch_.data(), n);
+    for_each_tie(entries, n, field, segment,
+                 [&](SortEntry *ties, size_t size, size_t field,
+                     size_t segment) { refine(ties, size, field, segment); });
+  }
+
+  // call fn for every group of entries with equal keys of the segment of the
+  // field with the level the group must be ordered by next
+  template <typename F>
+  void for_each_tie(SortEntry *entries, size_t n, size_t field,
+                    size_t segment, const F &fn) const {
+    size_t end;
+    for (size_t begin = 0; begin < n; begin = end) {
+      end = begin + 1;
+      while (end < n && entries[end].key == entries[begin].key) {
+        end++;
+      }
+      if (end - begin < 2) {
+        continue;
+      }
+      uint64_t key = asc_ ? entries[begin].key : ~entries[begin].key;
+      if (Column::sort_key_continues(key, segment)) {
+        fn(entries + begin, end - begin, field, segment + 1);
+      } else if (field + 1 < columns_.size()) {
+        fn(entries + begin, end - begin, field + 1, 0);
+      }
+    }
+  }
+
+ private:
+  // entries with equal cells before the field, ordered by the cells
+  void compare(SortEntry *entries, size_t n, size_t field) const {
+    auto before = [&](const SortEntry &lhs, const SortEntry &rhs) {
+      for (size_t f = field; f < columns_.size(); f++) {
+        int res = columns_[f]->compare(rows_[lhs.pos], rows_[rhs.pos]);
+        if (res != 0) {
+          return asc_ ? res < 0 : res > 0;
+        }
+      }
+      return lhs.pos < rhs.pos;
+    };
+    std::sort(entries, entries + n, before);
+  }
+
+ private:
+  const std::vector<const Column *> &columns_;
+  const RowIndicesList &rows_;
+  bool asc_;
+  std::vector<SortEntry> scratch_;
+};
+
+}  // namespace
+
+RowIndicesList lumidb::sort_rows(const std::vector<const Column *> &columns,
+                                 RowIndicesList rows, bool asc,
+                                 ThreadPool *pool) {
+  size_t n = rows.size();
+  if (n < 2 || columns.empty()) {
+    return rows;
+  }
+
+  auto run = [&](size_t size, size_t morsel_size,
+                 const ThreadPool::RangeTask &task) {
+    if (pool != nullptr) {
+      pool->parallel_for(size, morsel_size, task);
+    } else {
+      task(0, size);
+    }
+  };
+
+  RowSorter sorter(columns, rows, asc);
+  std::vector<SortEntry> entries(n);
+  run(n, kSortMorselSize, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      entries[i] = {sorter.key(i, 0, 0), i};
+    }
+  });
+
+  // a run per worker, merged pairwise. Runs are in input order and merging
+  // takes equal keys from the left run first, so ties keep their order.
+  size_t num_runs = pool != nullptr && n >= kParallelSortRows
+                        ? std::max<size_t>(pool->num_workers(), 1)
+                        : 1;
+  std::vector<size_t> bounds;
+  for (size_t r = 0; r <= num_runs; r++) {
+    bounds.push_back(n * r / num_runs);
+  }
+
+  std::vector<SortEntry> scratch(n);
+  run(num_runs, 1, [&](size_t begin, size_t end) {
+    for (size_t r = begin; r < end; r++) {
+      radix_sort(entries.data() + bounds[r], scratch.data() + bounds[r],
+                 bounds[r + 1] - bounds[r]);
+    }
+  });
+
+  auto by_key = [](const SortEntry &lhs, const SortEntry &rhs) {
+    return lhs.key < rhs.key;
+  };
+  while (bounds.size() > 2) {
+    std::vector<size_t> merged;
+    for (size_t i = 0; i < bounds.size(); i += 2) {
+      merged.push_back(bounds[i]);
+    }
+    if (merged.back() != n) {
+      merged.push_back(n);
+    }
+
+    run(merged.size() - 1, 1, [&](size_t begin, size_t end) {
+      for (size_t m = begin; m < end; m++) {
+        size_t first = merged[m], last = merged[m + 1];
+        size_t middle = std::min(bounds[2 * m + 1], last);
+        std::merge(entries.begin() + first, entries.begin() + middle,
+                   entries.begin() + middle, entries.begin() + last,
+                   scratch.begin() + first, by_key);
+      }
+    });
+    entries.swap(scratch);
+    bounds = std::move(merged);
+  }
+  scratch = {};
+
+  // groups of equal first keys are refined in parallel
+  struct Tie {
+    SortEntry *entries;
+    size_t size;
+    size_t field;
+    size_t segment;
+  };
+  std::vector<Tie> ties;
+  sorter.for_each_tie(entries.data(), n, 0, 0,
+                      [&](SortEntry *entries, size_t size, size_t field,
+                          size_t segment) {
+                        ties.push_back({entries, size, field, segment});
+                      });
+  run(ties.size(), 1, [&](size_t begin, size_t end) {
+    RowSorter refiner(columns, rows, asc);
+    for (size_t t = begin; t < end; t++) {
+      refiner.refine(ties[t].entries, ties[t].size, ties[t].field,
+                     ties[t].segment);
+    }
+  });
+
+  RowIndicesList sorted(n);
+  run(n, kSortMorselSize, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      sorted[i] = rows[entries[i].pos];
+    }
+  });
+  return sorted;
+}
+
+// TopKRows
+
+bool TopKRows::before(const Entry &lhs, const Entry &rhs) const {
+  for (auto column : columns_) {
+    int res = column->compare(lhs.row, rhs.row);
+    if (res != 0) {
+      return asc_ ? res < 0 : res > 0;
+    }
+  }
+  return lhs.seq < rhs.seq;
+}
+
+void TopKRows::push(size_t row) {
+  auto less = [this](const Entry &lhs, const Entry &rhs) {
+    return before(lhs, rhs);
+  };
+
+  Entry entry{row, pushed_++};
+  if (heap_.size() < count_) {
+    heap_.push_back(entry);
+    std::push_heap(heap_.begin(), heap_.end(), less);
+  } else if (count_ > 0 && before(entry, heap_.front())) {
+    std::pop_heap(heap_.begin(), heap_.end(), less);
+    heap_.back() = entry;
+    std::push_heap(heap_.begin(), heap_.end(), less);
+  }
+}
+
+RowIndicesList TopKRows::take() {
+  std::sort_heap(heap_.begin(), heap_.end(),
+                 [this](const Entry &lhs, const Entry &rhs) {
+                   return before(lhs, rhs);
+                 });
+
+  RowIndicesList rows;
+  rows.reserve(heap_.size());
+  for (auto &entry : heap_) {
+    rows.push_back(entry.row);
+  }
+  heap_.clear();
+  return rows;
+}
+
+// TableView
+
+TableView::TableView(TablePtr table)
+    : table_(std::move(table)), schema_(table_->schema()) {
+  fields_.resize(schema_.fields_size());
+  for (size_t i = 0; i < fields_.size(); i++) {
+    fields_[i] = i;
+  }
+}
+
+TableView::TableView(TablePtr table, std::shared_ptr<const RowIndicesList> rows,
+                     std::vector<size_t> fields)
+    : table_(std::move(table)),
+      rows_(std::move(rows)),
+      fields_(std::move(fields)) {
+  for (auto field_index : fields_) {
+    auto &field = table_->schema().get_field(field_index);
+    schema_.add_field(field.name, field.type);
+  }
+}
+
+bool TableView::is_identity() const {
+  if (rows_ != nullptr || fields_.size() != table_->schema().fields_size()) {
+    return false;
+  }
+
+  for (size_t i = 0; i < fields_.size(); i++) {
+    if (fields_[i] != i) {
+      return false;
+    }
+  }
+  return true;
+}
+
+TableView TableView::limit(size_t offset, size_t count) const {
+  size_t begin = std::min(offset, num_rows());
+  size_t end = begin + std::min(count, num_rows() - begin);
+  auto rows = std::make_shared<RowIndicesList>(end - begin);
+  if (rows_ != nullptr) {
+    std::copy(rows_->begin() + begin, rows_->begin() + end, rows->begin());
+  } else {
+    std::iota(rows->begin(), rows->end(), begin);
+  }
+
+  return TableView(table_, std::move(rows), fields_);
+}
+
+std::optional<TableView> TableView::lookup(size_t field_index,
+                                           const AnyValue &value) const {
+  auto &column = this->column(field_index);
+  if (rows_ != nullptr || !column.can_lookup(value)) {
+    return std::nullopt;
+  }
+
+  return with_rows(column.lookup(value));
+}
+
+bool TableView::may_match(size_t field_index, CompareOperator op,
+                          const AnyValue &value) const {
+  return may_match(field_index, [&](const Column &column, size_t c) {
+    return column.may_match(c, op, value);
+  });
+}
+
+bool TableView::may_match(
+    size_t field_index,
+    const std::function<bool(const Column &, size_t)> &chunk_may_match) const {
+  auto &column = this->column(field_index);
+  return may_match([&](size_t c) { return chunk_may_match(column, c); });
+}
+
+bool TableView::may_match(
+    const std::function<bool(size_t chunk_index)> &chunk_may_match) const {
+  if (rows_ == nullptr) {
+    size_t num_chunks =
+        (table_->num_rows() + kColumnChunkSize - 1) / kColumnChunkSize;
+    for (size_t c = 0; c < num_chunks; c++) {
+      if (chunk_may_match(c)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // batches are mostly runs of rows within a chunk
+  size_t checked = SIZE_MAX;
+  for (auto row : *rows_) {
+    size_t c = row / kColumnChunkSize;
+    if (c != checked) {
+      if (chunk_may_match(c)) {
+        return true;
+      }
+      checked = c;
+    }
+  }
+  return false;
+}
+
+std::optional<TableView> TableView::range(
+    size_t field_index, const std::vector<RangeBound> &bounds) const {
+  if (rows_ != nullptr) {
+    return std::nullopt;
+  }
+
+  auto rows = table_->range(fields_[field_index], bounds);
+  if (!rows.has_value()) {
+    return std::nullopt;
+  }
+  return with_rows(std::move(rows.value()));
+}
+
+TableView TableView::with_rows(RowIndicesList rows) const {
+  return TableView(table_, std::make_shared<RowIndicesList>(std::move(rows)),
+                   fields_);
+}
+
+TableView TableView::select(const std::vector<size_t> &field_indices) const {
+  std::vector<size_t> fields;
+  fields.reserve(field_indices.size());
+  for (auto field_index : field_indices) {
+    fields.push_back(fields_[field_index]);
+  }
+
+  return TableView(table_, rows_, std::move(fields));
+}
+
+Result<TableView> TableView::select(
+    const std::vector<std::string> &field_names) const {
+  auto res1 = schema_.get_field_indices(field_names);
+  if (res1.has_error()) {
+    return res1.unwrap_err();
+  }
+
+  return select(res1.unwrap());
+}
+
+const OrderedIndex *TableView::ordered_index(
+    const std::vector<size_t> &field_indices) const {
+  std::vector<size_t> base_fields;
+  for (auto field_index : field_indices) {
+    base_fields.push_back(fields_[field_index]);
+  }
+  return table_->ordered_index(base_fields);
+}
+
+TableView TableView::sort(const std::vector<size_t> &field_indices,
+                          bool asc, ThreadPool *pool) const {
+  // an index scan visits every base row, a comparison sort of a small
+  // selection is cheaper. Ties follow the row order in the index, so the
+  // selection must be in row order too.
+  if (auto index = ordered_index(field_indices); index != nullptr) {
+    double n = num_rows();
+    if (rows_ == nullptr ||
+        (n * std::log2(n + 1) >= table_->num_rows() &&
+         std::is_sorted(rows_->begin(), rows_->end()))) {
+      return sort_by_index(*index, asc);
+    }
+  }
+
+  RowIndicesList rows(num_rows());
+  for (size_t i = 0; i < rows.size(); i++) {
+    rows[i] = row_index(i);
+  }
+
+  std::vector<const Column *> columns;
+  for (auto field_index : field_indices) {
+    columns.push_back(&column(field_index));
+  }
+
+  return with_rows(sort_rows(columns, std::move(rows), asc, pool));
+}
+
+Result<TableView> TableView::sort(const std::vector<std::string> &field_names,
+                                  bool asc) const {
+  auto res1 = schema_.get_field_indices(field_names);
+  if (res1.has_error()) {
+    return res1.unwrap_err();
+  }
+
+  return sort(res1.unwrap(), asc);
+}
+
+TableView TableView::top_k(const std::vector<size_t> &field_indices,
+                           bool asc, size_t count) const {
+  std::vector<const Column *> columns;
+  for (auto field_index : field_indices) {
+    columns.push_back(&column(field_index));
+  }
+
+  if (auto index = ordered_index(field_indices);
+      index != nullptr && rows_ == nullptr) {
+    return sort_by_index(*index, asc, count);
+  }
+
+  TopKRows top(std::move(columns), asc, count);
+  for (size_t i = 0; i < num_rows(); i++) {
+    top.push(row_index(i));
+  }
+  return with_rows(top.take());
+}
+
+TableView TableView::sort_by_index(const OrderedIndex &index, bool asc,
+                                   size_t count) const {
+  if (rows_ == nullptr && asc) {
+    auto order = table_->ordered_rows(index, count);
+    if (order->size() == table_->num_rows()) {
+      return TableView(table_, std::move(order), fields_);
+    }
+    return with_rows(RowIndicesList(order->begin(), order->end()));
+  }
+
+  auto order_ptr = table_->ordered_rows(index);
+
+  std::vector<bool> selected;
+  if (rows_ != nullptr) {
+    selected.resize(table_->num_rows());
+    for (auto row : *rows_) {
+      selected[row] = true;
+    }
+  }
+  auto is_selected = [&](size_t row) {
+    return rows_ == nullptr || selected[row];
+  };
+
+  auto &order = *order_ptr;
+  auto rows = std::make_shared<RowIndicesList>();
+  rows->reserve(std::min(count, num_rows()));
+
+  if (asc) {
+    for (size_t i = 0; i < order.size() && rows->size() < count; i++) {
+      if (is_selected(order[i])) {
+        rows->push_back(order[i]);
+      }
+    }
+  } else {
+    // walk the groups of equal keys backwards, ties stay in row order
+    size_t end = order.size();
+    while (end > 0 && rows->size() < count) {
+      size_t begin = end - 1;
+      while (begin > 0 && table_->compare_rows(order[begin - 1], order[end - 1],
+                                               index.fields) == 0) {
+        begin--;
+      }
+      for (size_t i = begin; i < end && rows->size() < count; i++) {
+        if (is_selected(order[i])) {
+          rows->push_back(order[i]);
+        }
+      }
+      end = begin;
+    }
+  }
+
+  return TableView(table_, std::move(rows), fields_);
+}
+
+TablePtr TableView::materialize() const {
+  if (is_identity()) {
+    return table_;
+  }
+
+  auto table = Table::create_ptr(table_->name(), schema_);
+  for (size_t i = 0; i < fields_.size(); i++) {
+    auto &column = table_->column(fields_[i]);
+    table->columns_[i] = rows_ != nullptr ? column.take(*rows_) : column;
+  }
+  table->num_rows_ = num_rows();
+
+  return table;
+}
+
+// Table
+
+TablePtr Table::snapshot() const {
+  std::lock_guard lock(sync_.version_mutex());
+  return std::make_shared<Table>(*this);
+}
+
+Result<TablePtr> Table::modify(const Writer &writer) {
+  std::lock_guard write_lock(sync_.write_mutex());
+  if (sync_.dropped()) {
+    return Error("table dropped: {}", name_);
+  }
+
+  // the copy shares every chunk with the current version, the writer copies
+  // only the chunks it touches
+  std::unique_lock lock(sync_.version_mutex());
+  Table next = *this;
+  lock.unlock();
+
+  auto res = writer(next);
+  if (res.has_error()) {
+    return res.unwrap_err();
+  }
+  next.version_++;
+
+  auto published = std::make_shared<Table>(next);
+
+  lock.lock();
+  columns_ = std::move(next.columns_);
+  num_rows_ = next.num_rows_;
+  ordered_indexes_ = std::move(next.ordered_indexes_);
+  version_ = next.version_;
+  wal_lsn_ = next.wal_lsn_;
+  return published;
+}
+
+void Table::mark_dropped() {
+  std::lock_guard write_lock(sync_.write_mutex());
+  sync_.set_dropped();
+}
+
+Result<bool> Table::create_ordered_index(
+    const std::vector<size_t> &field_indices) {
+  if (field_indices.empty()) {
+    return Error("ordered index fields can not be empty");
+  }
+  for (auto field_index : field_indices) {
+    if (field_index >= columns_.size()) {
+      return Error("index field index out of range: {}", field_index);
+    }
+  }
+  if (ordered_index(field_indices) != nullptr) {
+    return true;
+  }
+
+  auto order = std::make_shared<RowIndicesList>(num_rows_);
+  for (size_t i = 0; i < num_rows_; i++) {
+    (*order)[i] = i;
+  }
+  std::stable_sort(order->begin(), order->end(), [&](size_t lhs, size_t rhs) {
+    return compare_rows(lhs, rhs, field_indices) < 0;
+  });
+
+  ordered_indexes_.push_back({field_indices, {std::move(order)}});
+  return true;
+}
+
+const OrderedIndex *Table::ordered_index(
+    const std::vector<size_t> &field_indices) const {
+  for (auto &index : ordered_indexes_) {
+    if (index.fields == field_indices) {
+      return &index;
+    }
+  }
+  return nullptr;
+}
+
+std::shared_ptr<const RowIndicesList> Table::ordered_rows(
+    const OrderedIndex &index, size_t count) const {
+  if (index.runs.size() == 1 && count >= index.runs[0]->size()) {
+    return index.runs[0];
+  }
+
+  // k-way merge of the runs, a heap of the next row of every run
+  using Cursor = std::pair<RowIndicesList::const_iterator,
+                           RowIndicesList::const_iterator>;
+  auto greater = [&](const Cursor &lhs, const Cursor &rhs) {
+    return index_less(*rhs.first, *lhs.first, index.fields);
+  };
+  std::vector<Cursor> heap;
+  size_t num_rows = 0;
+  for (auto &run : index.runs) {
+    heap.emplace_back(run->begin(), run->end());
+    num_rows += run->size();
+  }
+  std::make_heap(heap.begin(), heap.end(), greater);
+
+  auto order = std::make_shared<RowIndicesList>();
+  order->reserve(std::min(count, num_rows));
+  while (!heap.empty() && order->size() < count) {
+    std::pop_heap(heap.begin(), heap.end(), greater);
+    auto &cursor = heap.back();
+    order->push_back(*cursor.first++);
+    if (cursor.first == cursor.second) {
+      heap.pop_back();
+    } else {
+      std::push_heap(heap.begin(), heap.end(), greater);
+    }
+  }
+  return order;
+}
+
+std::optional<RowIndicesList> Table::range(
+    size_t field_index, const std::vector<RangeBound> &bounds) const {
+  auto &column = columns_[field_index];
+  if (column.may_hold_nan()) {
+    return std::nullopt;
+  }
+  for (auto &bound : bounds) {
+    bool is_nan = bound.value.is_float() && std::isnan(bound.value.as_float());
+    if (bound.op == CompareOperator::NE || is_nan) {
+      return std::nullopt;
+    }
+  }
+
+  auto it = std::find_if(
+      ordered_indexes_.begin(), ordered_indexes_.end(),
+      [&](const OrderedIndex &index) { return index.fields[0] == field_index; });
+  if (it == ordered_indexes_.end()) {
+    return std::nullopt;
+  }
+
+  // the order follows `AnyValue::operator<` on the first field, so in every
+  // run the rows below a lower bound are a prefix and the rows above an upper
+  // bound a suffix
+  auto passes = [&](CompareOperator op, const AnyValue &value) {
+    auto compare = AnyValue::get_comparator(op);
+    return [&column, compare, &value](size_t row) {
+      return compare(column.get(row), value);
+    };
+  };
+  using Iter = RowIndicesList::const_iterator;
+  std::vector<std::pair<Iter, Iter>> matches;
+  size_t num_matched = 0;
+  for (auto &run : it->runs) {
+    auto begin = run->begin(), end = run->end();
+    for (auto &bound : bounds) {
+      auto op = bound.op;
+      // equal is both at least and at most the value
+      if (op == CompareOperator::GT || op == CompareOperator::GE ||
+          op == CompareOperator::EQ) {
+        auto lower = passes(
+            op == CompareOperator::GT ? op : CompareOperator::GE, bound.value);
+        begin = std::partition_point(begin, end,
+                                     [&](size_t row) { return !lower(row); });
+      }
+      if (op == CompareOperator::LT || op == CompareOperator::LE ||
+          op == CompareOperator::EQ) {
+        auto upper = passes(
+            op == CompareOperator::LT ? op : CompareOperator::LE, bound.value);
+        end = std::partition_point(begin, end, upper);
+      }
+    }
+    matches.emplace_back(begin, end);
+    num_matched += end - begin;
+  }
+
+  // back to row order, sorting pays off for a few rows only
+  RowIndicesList rows;
+  rows.reserve(num_matched);
+  if (num_matched * 16 < num_rows_) {
+    for (auto [begin, end] : matches) {
+      rows.insert(rows.end(), begin, end);
+    }
+    std::sort(rows.begin(), rows.end());
+  } else {
+    std::vector<bool> matched(num_rows_);
+    for (auto [begin, end] : matches) {
+      for (auto row = begin; row != end; ++row) {
+        matched[*row] = true;
+      }
+    }
+    for (size_t row = 0; row < num_rows_; row++) {
+      if (matched[row]) {
+        rows.push_back(row);
+      }
+    }
+  }
+  return rows;
+}
+
+void Table::index_appended_rows(size_t first_row) {
+  if (first_row == num_rows_) {
+    return;
+  }
+
+  for (auto &index : ordered_indexes_) {
+    RowIndicesList appended(num_rows_ - first_row);
+    for (size_t i = 0; i < appended.size(); i++) {
+      appended[i] = first_row + i;
+    }
+    add_index_run(index, std::move(appended));
+  }
+}
+
+void Table::reindex_rows(const RowIndicesList &rows) {
+  if (rows.empty()) {
+    return;
+  }
+
+  std::vector<bool> moved(num_rows_);
+  for (auto row : rows) {
+    moved[row] = true;
+  }
+
+  // the moved rows leave their runs and come back as a run of their own
+  for (auto &index : ordered_indexes_) {
+    std::vector<std::shared_ptr<const RowIndicesList>> runs;
+    for (auto &run : index.runs) {
+      if (std::none_of(run->begin(), run->end(),
+                       [&](size_t row) { return moved[row]; })) {
+        runs.push_back(run);
+        continue;
+      }
+      auto kept = std::make_shared<RowIndicesList>();
+      kept->reserve(run->size());
+      for (auto row : *run) {
+        if (!moved[row]) {
+          kept->push_back(row);
+        }
+      }
+      if (!kept->empty()) {
+        runs.push_back(std::move(kept));
+      }
+    }
+    index.runs = std::move(runs);
+    add_index_run(index, rows);
+  }
+}
+
+void Table::remap_ordered_indexes(const std::vector<bool> &keep) {
+  if (ordered_indexes_.empty()) {
+    return;
+  }
+
+  // old row index => new row index of the kept rows
+  RowIndicesList new_index(keep.size());
+  size_t num_kept = 0;
+  for (size_t row = 0; row < keep.size(); row++) {
+    new_index[row] = num_kept;
+    num_kept += keep[row];
+  }
+
+  // renumbering keeps the order of every run
+  for (auto &index : ordered_indexes_) {
+    std::vector<std::shared_ptr<const RowIndicesList>> runs;
+    for (auto &run : index.runs) {
+      auto remapped = std::make_shared<RowIndicesList>();
+      for (auto row : *run) {
+        if (keep[row]) {
+          remapped->push_back(new_index[row]);
+        }
+      }
+      if (!remapped->empty()) {
+        runs.push_back(std::move(remapped));
+      }
+    }
+    index.runs = std::move(runs);
+  }
+}
+
+void Table::add_index_run(OrderedIndex &index, RowIndicesList run) const {
+  auto less = [&](size_t lhs, size_t rhs) {
+    return index_less(lhs, rhs, index.fields);
+  };
+  std::sort(run.begin(), run.end(), less);
+
+  auto &runs = index.runs;
+  runs.push_back(std::make_shared<RowIndicesList>(std::move(run)));
+  while (runs.size() >= 2 &&
+         runs[runs.size() - 2]->size() <= 2 * runs.back()->size()) {
+    auto &prev = *runs[runs.size() - 2];
+    auto &last = *runs.back();
+    auto merged = std::make_shared<RowIndicesList>();
+    merged->reserve(prev.size() + last.size());
+    std::merge(prev.begin(), prev.end(), last.begin(), last.end(),
+               std::back_inserter(*merged), less);
+    runs.pop_back();
+    runs.back() = std::move(merged);
+  }
+}
+
 std::ostream &Table::dump(std::ostream &out) const {
   auto data = RenderTableData::from_table(*this);
   return data.dump(out);
@@ -115,4 +1366,182 @@ std::ostream &Table::dump(std::ostream &out) const {
 
 std::ostream &lumidb::operator<<(std::ostream &out, const Table &table) {
   return table.dump(out);
-}
\ No newline at end of file
+}
+
+// CSV
+
+namespace {
+
+// the columns parsed from a range of csv lines, parsing stops at the first
+// bad line
+struct CSVRange {
+  const char *begin;
+  const char *end;
+  std::vector<Column> columns;
+  size_t num_lines = 0;
+  // builds the error of the bad line from its row index in the file
+  std::function<Error(size_t row_index)> error = nullptr;
+};
+
+void parse_csv_range(CSVRange &range, const TableSchema &schema,
+                     const std::vector<std::string> &headers,
+                     const std::vector<size_t> &field_indices,
+                     std::string_view delim) {
+  for (auto &field : schema.fields()) {
+    range.columns.emplace_back(field.type);
+  }
+
+  // lines are split like `parse_csv` does: a trailing empty field is dropped
+  // and every field is trimmed
+  std::vector<std::string_view> cells;
+  const char *pos = range.begin;
+  while (pos < range.end) {
+    const char *line_end = find_newline(pos, range.end);
+    std::string_view line(pos, line_end - pos);
+    pos = line_end + 1;
+
+    cells.clear();
+    size_t split;
+    while ((split = line.find(delim)) != line.npos) {
+      cells.push_back(line.substr(0, split));
+      line.remove_prefix(split + delim.size());
+    }
+    if (!line.empty()) {
+      cells.push_back(line);
+    }
+
+    if (cells.size() != field_indices.size()) {
+      range.error = [expected = field_indices.size(),
+                     got = cells.size()](size_t row_index) {
+        return Error(
+            "row size not matched with headers, line={}, expected={}, got={}",
+            row_index + 1, expected, got);
+      };
+      return;
+    }
+
+    for (size_t i = 0; i < cells.size(); i++) {
+      auto cell = trim(cells[i]);
+      size_t field_index = field_indices[i];
+      auto value = AnyValue::parse_from_string(
+          schema.get_field(field_index).type, cell);
+      if (value.has_error()) {
+        range.error = [err = value.unwrap_err(), i, header = headers[i],
+                       cell = std::string(cell)](size_t row_index) {
+          return err.add_message(
+              "failed to parse value from csv file, row_no={}, col_no={}, "
+              "header={}, value={}",
+              row_index, i, header, cell);
+        };
+        return;
+      }
+      range.columns[field_index].push_back(value.unwrap());
+    }
+    range.num_lines++;
+  }
+}
+
+// start of the line after the one pos is in, or end
+const char *next_line(const char *pos, const char *end) {
+  return std::min(find_newline(pos, end) + 1, end);
+}
+
+}  // namespace
+
+Result<CSVReader> CSVReader::open(std::string_view data,
+                                  const TableSchema &schema,
+                                  std::string_view delim) {
+  if (data.empty()) {
+    return Error("empty file");
+  }
+
+  CSVReader reader;
+  reader.data_ = data;
+  reader.schema_ = schema;
+  reader.delim_ = std::string(delim);
+
+  const char *begin = data.data(), *end = data.data() + data.size();
+  const char *header_end = find_newline(begin, end);
+  for (auto &header : split({begin, size_t(header_end - begin)}, delim)) {
+    reader.headers_.push_back(std::string(trim(header)));
+  }
+
+  auto field_indices_res = schema.get_field_indices(reader.headers_);
+  if (!field_indices_res) {
+    return field_indices_res.unwrap_err().add_message("invalid csv file");
+  }
+  auto &field_indices = field_indices_res.unwrap();
+  if (field_indices.size() != schema.fields_size() ||
+      std::unordered_set<size_t>(field_indices.begin(), field_indices.end())
+              .size() != field_indices.size()) {
+    return Error("invalid csv file, field size mismatch");
+  }
+  reader.field_indices_ = field_indices;
+
+  reader.pos_ = next_line(begin, end);
+  return reader;
+}
+
+Result<bool> CSVReader::read_batch(Table &table, ThreadPool *pool,
+                                   size_t range_size) {
+  const char *end = data_.data() + data_.size();
+  size_t num_ranges = pool != nullptr ? std::max<size_t>(pool->num_workers(), 1)
+                                      : 1;
+
+  // ranges of about range_size bytes, every range starts at the beginning
+  // of a line
+  std::vector<CSVRange> ranges;
+  const char *pos = pos_;
+  while (ranges.size() < num_ranges && pos < end) {
+    const char *range_end =
+        next_line(pos + std::min<size_t>(range_size, end - pos) - 1, end);
+    ranges.push_back({pos, range_end});
+    pos = range_end;
+  }
+
+  auto parse_ranges = [&](size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+      parse_csv_range(ranges[i], schema_, headers_, field_indices_, delim_);
+    }
+  };
+  if (pool != nullptr) {
+    pool->parallel_for(ranges.size(), 1, parse_ranges);
+  } else {
+    parse_ranges(0, ranges.size());
+  }
+
+  // nothing is appended if a range has a bad line
+  size_t num_rows = num_rows_;
+  for (auto &range : ranges) {
+    if (range.error != nullptr) {
+      return range.error(num_rows + range.num_lines);
+    }
+    num_rows += range.num_lines;
+  }
+
+  for (auto &range : ranges) {
+    table.add_columns(range.columns);
+    range.columns.clear();
+  }
+  num_rows_ = num_rows;
+  pos_ = pos;
+  return true;
+}
+
+Result<Table> lumidb::load_csv_table(std::string_view data,
+                                     const TableSchema &schema,
+                                     ThreadPool *pool, std::string_view delim) {
+  auto reader = CSVReader::open(data, schema, delim);
+  if (reader.has_error()) {
+    return reader.unwrap_err();
+  }
+
+  Table table("", schema);
+  while (!reader->done()) {
+    auto res = reader->read_batch(table, pool);
+    if (res.has_error()) {
+      return res.unwrap_err();
+    }
+  }
+  return table;
+}
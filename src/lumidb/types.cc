@@ -1,5 +1,7 @@
 #include "lumidb/types.hh"
 
+#include <charconv>
+#include <cmath>
 #include <exception>
 #include <sstream>
 #include <stdexcept>
@@ -11,17 +13,6 @@
 using namespace std;
 using namespace lumidb;
 
-int lumidb::compare_float(float a, float b, float epsilon) {
-  float diff = a - b;
-  if (diff < -epsilon) {
-    return -1;
-  } else if (diff > epsilon) {
-    return 1;
-  } else {
-    return 0;
-  }
-}
-
 std::string lumidb::float2string(float v) {
   char buf[256];
   snprintf(buf, sizeof(buf), "%.2f", v);
@@ -54,7 +45,7 @@ std::ostream &lumidb::operator<<(std::ostream &os, const AnyValue &value) {
       os << float2string(value.as_float());
       break;
     case ValueTypeKind::T_STRING:
-      os << std::quoted(value.as_string(), '\'');
+      os << std::quoted(value.as_string_view(), '\'');
       break;
     case ValueTypeKind::T_NULL:
       os << "null";
@@ -81,6 +72,18 @@ Result<AnyValue> AnyValue::parse_from_string(const AnyType &type,
         return AnyValue::from_null();
       }
 
+      // from_chars needs no copy and no locale. Cells it can't take whole,
+      // like "+1" or hex, and subnormals, which stod rejects, go through stod.
+      {
+        double value;
+        auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(),
+                                         value);
+        if (ec == std::errc() && end == str.data() + str.size() &&
+            std::fpclassify(value) != FP_SUBNORMAL) {
+          return AnyValue::from_float(value);
+        }
+      }
+
       try {
         return AnyValue::from_float(std::stod(std::string(str)));
       } catch (const std::exception &e) {
@@ -113,20 +116,30 @@ Result<AnyValue> AnyValue::parse_from_string(const AnyType &type,
   }
 }
 
-Result<AnyValue::Comparator> AnyValue::get_comparator(std::string op) {
-  CompareOperator compare_op;
-
+Result<CompareOperator> AnyValue::parse_compare_operator(std::string_view op) {
   if (op == "=") {
-    compare_op = CompareOperator::EQ;
+    return CompareOperator::EQ;
   } else if (op == "<") {
-    compare_op = CompareOperator::LT;
+    return CompareOperator::LT;
   } else if (op == ">") {
-    compare_op = CompareOperator::GT;
-  } else {
-    return Error("unsupported operator: {}", op);
+    return CompareOperator::GT;
+  } else if (op == "<=") {
+    return CompareOperator::LE;
+  } else if (op == ">=") {
+    return CompareOperator::GE;
+  } else if (op == "!=") {
+    return CompareOperator::NE;
+  }
+  return Error("unsupported operator: {}", op);
+}
+
+Result<AnyValue::Comparator> AnyValue::get_comparator(std::string op) {
+  auto compare_op = parse_compare_operator(op);
+  if (compare_op.has_error()) {
+    return compare_op.unwrap_err();
   }
 
-  return AnyValue::get_comparator(compare_op);
+  return AnyValue::get_comparator(compare_op.unwrap());
 }
 
 AnyValue::Comparator AnyValue::get_comparator(CompareOperator op) {
@@ -138,7 +151,17 @@ AnyValue::Comparator AnyValue::get_comparator(CompareOperator op) {
       return [](const AnyValue &lhs, const AnyValue &rhs) { return lhs < rhs; };
     case CompareOperator::GT:
       return [](const AnyValue &lhs, const AnyValue &rhs) { return lhs > rhs; };
-      break;
+    case CompareOperator::LE:
+      return [](const AnyValue &lhs, const AnyValue &rhs) {
+        return lhs < rhs || lhs == rhs;
+      };
+    case CompareOperator::GE:
+      return [](const AnyValue &lhs, const AnyValue &rhs) {
+        return lhs > rhs || lhs == rhs;
+      };
+    case CompareOperator::NE:
+      return
+          [](const AnyValue &lhs, const AnyValue &rhs) { return lhs != rhs; };
   }
   throw std::runtime_error("unsupported operator");
 }
@@ -1,11 +1,27 @@
 #include "lumidb/utils.hh"
 
+#include <algorithm>
 #include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
 #include <optional>
+#include <sstream>
 #include <string>
 
 #include "lumidb/types.hh"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifndef LUMIDB_PLATFORM_WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using namespace std;
 using namespace lumidb;
 
@@ -72,3 +88,135 @@ Result<CSVObject> lumidb::parse_csv(std::istream &is, std::string_view delim) {
   return obj;
 }
 
+const char *lumidb::find_newline(const char *begin, const char *end) {
+#if defined(__SSE2__)
+  // 16 bytes per step, the mask has a bit set for every newline
+  const __m128i newline = _mm_set1_epi8('\n');
+  while (end - begin >= 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+    if (mask != 0) {
+      return begin + __builtin_ctz(mask);
+    }
+    begin += 16;
+  }
+#endif
+  auto found = std::memchr(begin, '\n', end - begin);
+  return found != nullptr ? static_cast<const char *>(found) : end;
+}
+
+namespace {
+
+constexpr uint64_t kChecksumPrime1 = 0x9e3779b185ebca87ULL;
+constexpr uint64_t kChecksumPrime2 = 0xc2b2ae3d27d4eb4fULL;
+
+uint64_t checksum_round(uint64_t acc, uint64_t word) {
+  acc += word * kChecksumPrime2;
+  acc = (acc << 31) | (acc >> 33);
+  return acc * kChecksumPrime1;
+}
+
+}  // namespace
+
+uint64_t lumidb::checksum(const void *data, size_t size, uint64_t seed) {
+  auto bytes = static_cast<const char *>(data);
+  const char *end = bytes + size;
+
+  // four independent lanes of 8 bytes, so the multiplies overlap
+  uint64_t lanes[4] = {seed + kChecksumPrime1 + kChecksumPrime2,
+                       seed + kChecksumPrime2, seed, seed - kChecksumPrime1};
+  while (end - bytes >= 32) {
+    for (auto &lane : lanes) {
+      uint64_t word;
+      std::memcpy(&word, bytes, sizeof(word));
+      lane = checksum_round(lane, word);
+      bytes += sizeof(word);
+    }
+  }
+
+  uint64_t acc = size;
+  for (auto lane : lanes) {
+    acc = checksum_round(acc, lane);
+  }
+  while (end - bytes >= 8) {
+    uint64_t word;
+    std::memcpy(&word, bytes, sizeof(word));
+    acc = checksum_round(acc, word);
+    bytes += sizeof(word);
+  }
+  uint64_t tail = 0;
+  std::memcpy(&tail, bytes, end - bytes);
+  acc = checksum_round(acc, tail);
+
+  // avalanche the last bits
+  acc ^= acc >> 33;
+  acc *= kChecksumPrime2;
+  acc ^= acc >> 29;
+  return acc;
+}
+
+Result<MappedFilePtr> MappedFile::open(const std::string &path) {
+  auto file = std::make_shared<MappedFile>();
+
+#ifndef LUMIDB_PLATFORM_WINDOWS
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return Error("failed to open file: {}, {}", path, std::strerror(errno));
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    return Error("failed to stat file: {}, {}", path, std::strerror(errno));
+  }
+
+  // an empty file can't be mapped
+  if (st.st_size > 0) {
+    void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      ::close(fd);
+      return Error("failed to map file: {}, {}", path, std::strerror(errno));
+    }
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+    file->data_ = static_cast<const char *>(addr);
+    file->size_ = st.st_size;
+    file->mapped_ = true;
+  }
+  ::close(fd);
+#else
+  std::ifstream ifs(path, std::ios::binary);
+  if (!ifs) {
+    return Error("failed to open file: {}", path);
+  }
+  std::ostringstream os;
+  os << ifs.rdbuf();
+  file->buffer_ = os.str();
+  file->data_ = file->buffer_.data();
+  file->size_ = file->buffer_.size();
+#endif
+
+  return file;
+}
+
+void MappedFile::release(size_t size) {
+#ifndef LUMIDB_PLATFORM_WINDOWS
+  if (!mapped_) {
+    return;
+  }
+  // data_ is page aligned, only whole pages are released
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t released = std::min(size, size_) / page_size * page_size;
+  if (released > 0) {
+    madvise(const_cast<char *>(data_), released, MADV_DONTNEED);
+  }
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifndef LUMIDB_PLATFORM_WINDOWS
+  if (mapped_) {
+    munmap(const_cast<char *>(data_), size_);
+  }
+#endif
+}
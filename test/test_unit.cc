@@ -1,17 +1,39 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <future>
 #include <map>
+#include <numeric>
 #include <set>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
 #include "acutest.h"
+#include "lumidb/db.hh"
+#include "lumidb/executor.hh"
+#include "lumidb/filter.hh"
+#include "lumidb/pipeline.hh"
+#include "lumidb/plan.hh"
+#include "lumidb/predicate.hh"
 #include "lumidb/query.hh"
 #include "lumidb/repl.hh"
+#include "lumidb/simd.hh"
+#include "lumidb/storage.hh"
+#include "lumidb/table.hh"
 #include "lumidb/types.hh"
 #include "lumidb/utils.hh"
 #include "testlib.hh"
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 using namespace std;
 using namespace lumidb;
 
@@ -207,6 +229,458 @@ void test_parse_csv() {
   }
 }
 
+void test_load_csv_table() {
+  TableSchema schema;
+  schema.add_field("id", AnyType::from_float());
+  schema.add_field("name", AnyType::from_null_string());
+
+  // big enough to be parsed in several ranges
+  string data = "name, id\n";
+  for (int i = 0; i < 200000; i++) {
+    data += fmt::format("s{},{}\n", i, i);
+  }
+
+  ThreadPool pool(4);
+  auto table = load_csv_table(data, schema, &pool);
+  TEST_CHECK(table.is_ok());
+  TEST_CHECK(table->num_rows() == 200000);
+  ValueList expected{AnyValue(123456.0f), AnyValue::from_string("s123456")};
+  TEST_CHECK(table->get_row(123456) == expected);
+
+  // the first bad line is reported with its line number in the file
+  data += "s,x\n";
+  data += "s,1,2\n";
+  auto bad = load_csv_table(data, schema, &pool);
+  TEST_CHECK(bad.has_error());
+  TEST_CHECK(bad.message().find("row_no=200000") != string::npos);
+
+  TEST_CHECK(load_csv_table("", schema).has_error());
+  TEST_CHECK(load_csv_table("id,other\n", schema).has_error());
+  TEST_CHECK(load_csv_table("id,name", schema)->num_rows() == 0);
+
+  // batches of small ranges, a bad line fails its batch only
+  string lines = "id,name\n1,a\n2,b\n3,c\nx,d\n";
+  auto reader = CSVReader::open(lines, schema);
+  TEST_CHECK(reader.is_ok());
+  Table streamed("", schema);
+  TEST_CHECK(reader->read_batch(streamed, nullptr, 4).is_ok());
+  ThreadPool pair(2);
+  TEST_CHECK(reader->read_batch(streamed, &pair, 4).is_ok());
+  TEST_CHECK(streamed.num_rows() == 3);
+  auto failed = reader->read_batch(streamed, &pair, 4);
+  TEST_CHECK(failed.has_error());
+  TEST_CHECK(failed.message().find("row_no=3") != string::npos);
+  TEST_CHECK(streamed.num_rows() == 3);
+  TEST_CHECK(!reader->done());
+
+  const char text[] = "0123456789abcdefghij\nk";
+  TEST_CHECK(find_newline(text, text + 22) == text + 20);
+  TEST_CHECK(find_newline(text, text + 20) == text + 20);
+}
+
+void test_snapshot() {
+  TableSchema schema;
+  schema.add_field("id", AnyType::from_float());
+  schema.add_field("name", AnyType::from_null_string());
+  schema.add_field("any", AnyType::from_any());
+
+  auto table = Table::create_ptr("t", schema);
+  for (int i = 0; i < 5000; i++) {
+    auto name = i % 7 == 0 ? AnyValue() : AnyValue(fmt::format("name{}", i));
+    table->add_row({AnyValue(float(i)), name, AnyValue(float(-i))});
+  }
+  table->create_index(1);
+  table->create_ordered_index({0});
+  auto empty = Table::create_ptr("empty", schema);
+
+  string path = "test_snapshot.snap";
+  TEST_CHECK(save_snapshot(path, {table, empty}).is_ok());
+
+  ThreadPool pool(4);
+  auto loaded = load_snapshot(path, &pool);
+  TEST_CHECK(loaded.is_ok());
+  TEST_CHECK(loaded->size() == 2);
+  auto &copy = *loaded->at(0);
+  TEST_CHECK(copy.name() == "t");
+  TEST_CHECK(copy.rows() == table->rows());
+  TEST_CHECK(copy.column(1).indexed());
+  TEST_CHECK(copy.ordered_index({0}) != nullptr);
+  TEST_CHECK(copy.column(0).chunk_max(1) == AnyValue(4095.0f));
+  TEST_CHECK(loaded->at(1)->num_rows() == 0);
+
+  // the tables are created all at once or not at all
+  auto db = create_database({.num_workers = 2}).unwrap();
+  TEST_CHECK(db->create_table({.table = Table::create_ptr("empty", schema)})
+                 .is_ok());
+  auto load = parse_query("load_snapshot(\"" + path + "\")").unwrap();
+  TEST_CHECK(db->execute(load).get().has_error());
+  TEST_CHECK(db->get_table("t").has_error());
+  TEST_CHECK(db->drop_table("empty").is_ok());
+  TEST_CHECK(db->execute(load).get().is_ok());
+  TEST_CHECK(db->get_table("t").unwrap()->rows() == table->rows());
+  TEST_CHECK(db->create_table_list({{.table = Table::create_ptr("u", schema)},
+                                    {.table = Table::create_ptr("u", schema)}})
+                 .has_error());
+  TEST_CHECK(db->get_table("u").has_error());
+
+  // a header cut short after the magic
+  string truncated_path = "test_snapshot_truncated.snap";
+  {
+    std::ifstream in(path, std::ios::binary);
+    std::ofstream out(truncated_path, std::ios::binary);
+    char bytes[10];
+    in.read(bytes, sizeof(bytes));
+    out.write(bytes, sizeof(bytes));
+  }
+  auto truncated = load_snapshot(truncated_path);
+  TEST_CHECK(truncated.has_error() &&
+             truncated.unwrap_err().to_string().find(
+                 "corrupted snapshot header") != string::npos);
+  std::remove(truncated_path.c_str());
+
+  // a flipped byte in a chunk is detected
+  {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(100);
+    file.put('x');
+  }
+  TEST_CHECK(load_snapshot(path).has_error());
+  std::remove(path.c_str());
+  TEST_CHECK(load_snapshot(path).has_error());
+}
+
+void test_wal() {
+  string path = "test_wal.log";
+  std::remove(path.c_str());
+
+  auto run = [](DatabasePtr &db, const string &query) {
+    return db->execute(parse_query(query).unwrap()).get();
+  };
+
+  {
+    auto db = create_database({.num_workers = 2}).unwrap();
+    TEST_CHECK(db->open_wal({.path = path}).is_ok());
+    run(db, R"(create_table("t") | add_field("k", "string?"))");
+    run(db, R"(insert("t") | add_row("a") | add_row("b") | add_row(null))");
+    run(db, R"(update("t") | where("k", "=", "b") | set_value("k", "c"))");
+    run(db, R"(delete("t") | where("k", "=", "a"))");
+
+    // the records of a dropped table don't apply to the one created after
+    run(db, R"(create_table("u") | add_field("k", "float"))");
+    run(db, R"(insert("u") | add_row(1))");
+    TEST_CHECK(db->drop_table("u").is_ok());
+    run(db, R"(create_table("u") | add_field("k", "string"))");
+    run(db, R"(insert("u") | add_row("x"))");
+  }
+
+  // the changes are replayed, and logged after the replayed ones
+  for (int i = 0; i < 2; i++) {
+    auto db = create_database({.num_workers = 2}).unwrap();
+    TEST_CHECK(db->open_wal({.path = path}).is_ok());
+    auto rows = db->get_table("t").unwrap()->rows();
+    vector<ValueList> expected{{AnyValue::from_string("c")}, {AnyValue()}};
+    TEST_CHECK(rows == expected);
+    TEST_CHECK(run(db, R"(create_table("t") | add_field("k", "float"))")
+                   .has_error());
+    auto u = db->get_table("u").unwrap();
+    TEST_CHECK(u->schema().get_field(0).type.name() == "string");
+    TEST_CHECK(u->rows() == vector<ValueList>{{AnyValue::from_string("x")}});
+  }
+
+  // a writer holding a table while it is dropped is done before the drop, or
+  // fails, so its changes are not replayed on a table created after
+  {
+    auto db = create_database({.num_workers = 2}).unwrap();
+    TEST_CHECK(db->open_wal({.path = path}).is_ok());
+    run(db, R"(create_table("v") | add_field("k", "float"))");
+    auto dropped = db->get_table("v").unwrap();
+    std::promise<void> started, resume;
+    auto writer = std::async(std::launch::async, [&] {
+      return dropped->modify([&](Table &table) -> Result<bool> {
+        started.set_value();
+        resume.get_future().wait();
+        table.add_row({AnyValue(1.0f)});
+        table.set_wal_lsn(db->wal()->append(WalRecord::insert(table, 0)));
+        return true;
+      });
+    });
+    started.get_future().wait();
+    auto drop =
+        std::async(std::launch::async, [&] { return db->drop_table("v"); });
+    TEST_CHECK(drop.wait_for(std::chrono::milliseconds(20)) ==
+               std::future_status::timeout);
+    resume.set_value();
+    TEST_CHECK(writer.get().is_ok());
+    TEST_CHECK(drop.get().is_ok());
+    TEST_CHECK(dropped->modify([](Table &) -> Result<bool> { return true; })
+                   .has_error());
+    run(db, R"(create_table("v") | add_field("k", "string"))");
+  }
+  {
+    auto db = create_database({.num_workers = 2}).unwrap();
+    TEST_CHECK(db->open_wal({.path = path}).is_ok());
+    auto v = db->get_table("v").unwrap();
+    TEST_CHECK(v->schema().get_field(0).type.name() == "string");
+    TEST_CHECK(v->num_rows() == 0);
+    TEST_CHECK(db->drop_table("v").is_ok());
+  }
+
+  // a torn or corrupted last record is dropped, and the log truncated
+  // before it
+  auto valid_size = std::filesystem::file_size(path);
+  auto damage_tail = [&](bool torn) {
+    {
+      auto db = create_database({.num_workers = 2}).unwrap();
+      TEST_CHECK(db->open_wal({.path = path}).is_ok());
+      run(db, R"(insert("t") | add_row("d"))");
+    }
+    auto size = std::filesystem::file_size(path);
+    TEST_CHECK(size > valid_size);
+    if (torn) {
+      std::filesystem::resize_file(path, size - 1);
+    } else {
+      std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+      file.seekp(size - 1);
+      file.put('\xff');
+    }
+
+    auto db = create_database({.num_workers = 2}).unwrap();
+    TEST_CHECK(db->open_wal({.path = path}).is_ok());
+    TEST_CHECK(db->get_table("t").unwrap()->num_rows() == 2);
+    TEST_CHECK(std::filesystem::file_size(path) == valid_size);
+  };
+  damage_tail(true);
+  damage_tail(false);
+  std::remove(path.c_str());
+
+  // the records are written without waiting for a sync, or synced in the
+  // background, and replayed all the same
+  for (auto sync : {WalSync::Off, WalSync::Interval}) {
+    {
+      auto db = create_database({.num_workers = 2}).unwrap();
+      TEST_CHECK(db->open_wal({.path = path,
+                               .sync = sync,
+                               .interval = std::chrono::milliseconds(5)})
+                     .is_ok());
+      run(db, R"(create_table("t") | add_field("k", "float"))");
+      run(db, R"(insert("t") | add_row(1) | add_row(2))");
+      for (int i = 0; i < 200 && db->wal()->size() == 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      }
+      TEST_CHECK(db->wal()->size() > 0);
+      run(db, R"(insert("t") | add_row(3))");
+    }
+    auto db = create_database({.num_workers = 2}).unwrap();
+    TEST_CHECK(db->open_wal({.path = path}).is_ok());
+    TEST_CHECK(db->get_table("t").unwrap()->num_rows() == 3);
+    std::remove(path.c_str());
+  }
+
+  // concurrent commits share the writes and syncs, and every one of them is
+  // replayed
+  size_t num_inserts = 200;
+  {
+    auto db = create_database({.num_workers = 4}).unwrap();
+    TEST_CHECK(db->open_wal({.path = path}).is_ok());
+    run(db, R"(create_table("t") | add_field("k", "float"))");
+    vector<std::future<Result<TablePtr>>> inserts;
+    for (size_t i = 0; i < num_inserts; i++) {
+      inserts.push_back(db->execute(
+          parse_query(fmt::format(R"(insert("t") | add_row({}))", i))
+              .unwrap()));
+    }
+    for (auto &insert : inserts) {
+      TEST_CHECK(insert.get().is_ok());
+    }
+  }
+  {
+    auto db = create_database({.num_workers = 2}).unwrap();
+    TEST_CHECK(db->open_wal({.path = path}).is_ok());
+    std::set<float> keys;
+    for (auto &row : db->get_table("t").unwrap()->rows()) {
+      keys.insert(row[0].as_float());
+    }
+    TEST_CHECK(keys.size() == num_inserts);
+    TEST_CHECK(*keys.rbegin() == num_inserts - 1);
+  }
+  std::remove(path.c_str());
+
+  TEST_CHECK(parse_wal_sync("50ms")->sync == WalSync::Interval);
+  TEST_CHECK(parse_wal_sync("50ms")->interval.count() == 50);
+  TEST_CHECK(parse_wal_sync("off")->sync == WalSync::Off);
+  TEST_CHECK(parse_wal_sync("ms").has_error());
+}
+
+void test_wal_load_csv() {
+  string path = "test_wal_load_csv.log";
+  string csv_path = "test_wal_load_csv.csv";
+  std::remove(path.c_str());
+
+  auto run = [](DatabasePtr &db, const string &query) {
+    return db->execute(parse_query(query).unwrap()).get();
+  };
+  auto write_csv = [&](size_t rows, bool bad_tail) {
+    std::ofstream out(csv_path);
+    out << "k\n";
+    for (size_t i = 0; i < rows; i++) {
+      out << 1000000 + i << "\n";
+    }
+    if (bad_tail) {
+      out << "x\n";
+    }
+  };
+
+  // a few batches of one worker, logged as parts of one insert
+  size_t num_rows = 400000;
+  {
+    auto db = create_database({.num_workers = 1}).unwrap();
+    TEST_CHECK(db->open_wal({.path = path}).is_ok());
+    run(db, R"(create_table("t") | add_field("k", "float"))");
+    write_csv(num_rows, false);
+    TEST_CHECK(
+        run(db, "insert(\"t\") | load_csv(\"" + csv_path + "\")").is_ok());
+    // a bad line in the last batch fails the insert after its first parts
+    // were logged
+    write_csv(num_rows, true);
+    TEST_CHECK(run(db, "insert(\"t\") | load_csv(\"" + csv_path + "\")")
+                   .has_error());
+    TEST_CHECK(db->get_table("t").unwrap()->num_rows() == num_rows);
+  }
+
+  auto db = create_database({.num_workers = 1}).unwrap();
+  auto last_lsn = replay_wal(path, *db);
+  TEST_CHECK(last_lsn.is_ok());
+  // the parts after the create, and the first parts of the failed insert
+  auto table = db->get_table("t").unwrap();
+  TEST_CHECK(table->wal_lsn() > 2 && table->wal_lsn() < last_lsn.unwrap());
+  TEST_CHECK(table->num_rows() == num_rows);
+  TEST_CHECK(table->column(0).get(0).as_float() == 1000000);
+  TEST_CHECK(table->column(0).get(num_rows - 1).as_float() ==
+             1000000 + num_rows - 1);
+
+  std::remove(path.c_str());
+  std::remove(csv_path.c_str());
+}
+
+void test_wal_snapshot_source() {
+  string snapshot_path = "test_wal_source.snap";
+  string other_path = "test_wal_source_other.snap";
+  string checkpoint_path = "test_wal_source_checkpoint.snap";
+  string path = "test_wal_source.log";
+  std::remove(path.c_str());
+  std::remove(checkpoint_path.c_str());
+
+  auto run = [](DatabasePtr &db, const string &query) {
+    return db->execute(parse_query(query).unwrap()).get();
+  };
+  // the snapshot copies owned by the log
+  auto num_copies = [&] {
+    size_t copies = 0;
+    for (auto &entry : std::filesystem::directory_iterator(".")) {
+      copies += entry.path().filename().string().rfind(path + ".snap.", 0) == 0;
+    }
+    return copies;
+  };
+
+  TableSchema schema;
+  schema.add_field("k", AnyType::from_float());
+  auto table = Table::create_ptr("t", schema);
+  for (int i = 0; i < 5000; i++) {
+    table->add_row({AnyValue(float(i))});
+  }
+  table->create_index(0);
+  TEST_CHECK(save_snapshot(snapshot_path, {table}).is_ok());
+  TEST_CHECK(save_snapshot(other_path, {Table::create_ptr("u", schema)})
+                 .is_ok());
+
+  // the log refers to copies of the snapshots instead of holding their rows,
+  // the loaded files may be overwritten or removed
+  {
+    auto db = create_database({.num_workers = 2}).unwrap();
+    TEST_CHECK(db->open_wal({.path = path}).is_ok());
+    TEST_CHECK(run(db, "load_snapshot(\"" + snapshot_path + "\")").is_ok());
+    TEST_CHECK(run(db, "load_snapshot(\"" + other_path + "\")").is_ok());
+    TEST_CHECK(run(db, "load_snapshot(\"" + other_path + "\")").has_error());
+    TEST_CHECK(num_copies() == 2);
+    run(db, R"(insert("t") | add_row(5000))");
+    TEST_CHECK(db->wal()->size() < 1024);
+    TEST_CHECK(run(db, "save_snapshot(\"" + snapshot_path + "\")").is_ok());
+  }
+  std::remove(other_path.c_str());
+
+  auto expected = table->rows();
+  expected.push_back({AnyValue(5000.0f)});
+  {
+    auto db = create_database({.num_workers = 2}).unwrap();
+    TEST_CHECK(db->open_wal({.path = path}).is_ok());
+    auto replayed = db->get_table("t").unwrap();
+    TEST_CHECK(replayed->rows() == expected);
+    TEST_CHECK(replayed->column(0).indexed());
+    TEST_CHECK(db->get_table("u").is_ok());
+
+    // a checkpoint holding the tables releases the copies
+    TEST_CHECK(db->drop_table("u").is_ok());
+    TEST_CHECK(db->start_checkpointer({.path = checkpoint_path}).is_ok());
+    TEST_CHECK(run(db, "checkpoint()").is_ok());
+    TEST_CHECK(num_copies() == 0);
+  }
+
+  auto db = create_database({.num_workers = 2}).unwrap();
+  TEST_CHECK(run(db, "load_snapshot(\"" + checkpoint_path + "\")").is_ok());
+  TEST_CHECK(db->open_wal({.path = path}).is_ok());
+  TEST_CHECK(db->get_table("t").unwrap()->rows() == expected);
+  TEST_CHECK(db->get_table("u").has_error());
+
+  std::remove(snapshot_path.c_str());
+  std::remove(checkpoint_path.c_str());
+  std::remove(path.c_str());
+}
+
+void test_checkpoint() {
+  string snapshot_path = "test_checkpoint.snap";
+  string wal_path = "test_checkpoint.log";
+  std::remove(snapshot_path.c_str());
+  std::remove(wal_path.c_str());
+
+  auto run = [](DatabasePtr &db, const string &query) {
+    return db->execute(parse_query(query).unwrap()).get();
+  };
+
+  {
+    auto db = create_database({.num_workers = 2}).unwrap();
+    TEST_CHECK(db->open_wal({.path = wal_path}).is_ok());
+    TEST_CHECK(db->start_checkpointer({.path = snapshot_path}).is_ok());
+    run(db, R"(create_table("t") | add_field("k", "float"))");
+    run(db, R"(create_table("u") | add_field("k", "float"))");
+    run(db, R"(insert("t") | add_row(1) | add_row(2))");
+    db->drop_table("u");
+
+    // every record is held by the snapshot
+    TEST_CHECK(run(db, "checkpoint()").is_ok());
+    TEST_CHECK(db->wal()->size() == 0);
+
+    run(db, R"(insert("t") | add_row(3))");
+    auto checkpoints = run(db, "show_checkpoints()").unwrap()->rows();
+    TEST_CHECK(checkpoints.size() == 1);
+    TEST_CHECK(checkpoints[0][1].as_string() == "done");
+    TEST_CHECK(checkpoints[0][6].as_float() == 1);
+  }
+
+  // the snapshot, then the records logged after the checkpoint
+  auto db = create_database({.num_workers = 2}).unwrap();
+  TEST_CHECK(run(db, "load_snapshot(\"" + snapshot_path + "\")").is_ok());
+  TEST_CHECK(db->open_wal({.path = wal_path}).is_ok());
+  vector<ValueList> expected{{AnyValue::from_float(1)},
+                             {AnyValue::from_float(2)},
+                             {AnyValue::from_float(3)}};
+  TEST_CHECK(db->get_table("t").unwrap()->rows() == expected);
+  TEST_CHECK(db->get_table("u").has_error());
+  TEST_CHECK(run(db, "checkpoint()").has_error());
+
+  std::remove(snapshot_path.c_str());
+  std::remove(wal_path.c_str());
+}
+
 void test_trie_tree() {
   struct TrieQuery {
     string prefix;
@@ -260,11 +734,1169 @@ void test_trie_tree() {
   }
 }
 
+void test_any_value() {
+  TEST_CHECK(sizeof(AnyValue) == 16);
+
+  auto short_str = AnyValue::from_string("张三");
+  auto long_str = AnyValue::from_string("a string longer than inline capacity");
+  TEST_CHECK(short_str.as_string() == "张三");
+  TEST_CHECK(long_str.as_string() == "a string longer than inline capacity");
+
+  // copies share the long string buffer
+  AnyValue copied = long_str;
+  AnyValue moved = std::move(copied);
+  TEST_CHECK(moved == long_str);
+  TEST_CHECK(copied.is_null());
+  TEST_CHECK(moved.as_string_view().data() ==
+             long_str.as_string_view().data());
+
+  // shared strings keep their full length
+  std::string text(100000, 'x');
+  text.back() = 'y';
+  auto big_str = AnyValue::from_string(text);
+  TEST_CHECK(big_str.as_string_view().size() == text.size());
+  TEST_CHECK(big_str.as_string() == text);
+  TEST_CHECK(AnyValue(big_str).as_string_view().size() == text.size());
+
+  // as_float is strict, float_or_zero reads other kinds as 0
+  TEST_EXCEPTION(short_str.as_float(), std::runtime_error);
+  TEST_EXCEPTION(AnyValue::from_null().as_float(), std::runtime_error);
+  TEST_CHECK(AnyValue::from_null().float_or_zero() == 0);
+  TEST_CHECK(AnyValue(2.5f).as_float() == 2.5f);
+
+  TEST_CHECK(AnyValue::from_null() < AnyValue(1.0f));
+  TEST_CHECK(AnyValue(1.0f) < short_str);
+  TEST_CHECK(AnyValue(1.0f) == AnyValue(1.00001f));
+  TEST_CHECK(AnyValue::from_string("abc") < AnyValue::from_string("abd"));
+  TEST_CHECK(long_str.type().is_string());
+  TEST_CHECK(AnyValue::from_null().type().is_null());
+}
+
+void test_table_columns() {
+  TableSchema schema;
+  schema.add_field("name", AnyType::from_string());
+  schema.add_field("score", AnyType::from_null_float());
+
+  Table table("stu", schema);
+  auto res = table.add_row_list(
+      {{AnyValue::from_string("Alice"), AnyValue(80.0f)},
+       {AnyValue::from_string("Bob"), AnyValue::from_null()},
+       {AnyValue::from_string("Cindy"), AnyValue(95.0f)}});
+  TEST_CHECK(res.is_ok());
+  TEST_CHECK(table.num_rows() == 3);
+  TEST_CHECK(table.add_row({AnyValue(1.0f), AnyValue(1.0f)}).has_error());
+
+  auto &score = table.column(1);
+  TEST_CHECK(score.storage() == Column::Storage::Float);
+  TEST_CHECK(score.is_null(1) && !score.is_null(0));
+  TEST_CHECK(score.get(2) == AnyValue(95.0f));
+  TEST_CHECK(table.get_row(1)[1].is_null());
+
+  auto sorted = table.sort(vector<string>{"score"}, false).unwrap();
+  TEST_CHECK(sorted.get_row(0)[0] == AnyValue::from_string("Cindy"));
+  TEST_CHECK(sorted.get_row(2)[0] == AnyValue::from_string("Bob"));
+
+  auto above =
+      Predicate::parse(schema.get_field(1).type, ">", {AnyValue(85.0f)});
+  auto filtered = above->filter(TableView(std::make_shared<Table>(table)), 1);
+  TEST_CHECK(filtered.num_rows() == 1);
+
+  table.update_row([](ValueList &row, size_t) {
+    if (row[1].is_null()) row[1] = AnyValue(60.0f);
+  });
+  TEST_CHECK(!table.column(1).has_nulls());
+
+  table.delete_rows([](const ValueList &row, size_t) {
+    return row[0] == AnyValue::from_string("Alice");
+  });
+  TEST_CHECK(table.num_rows() == 2);
+  TEST_CHECK(table.get_row(0)[1] == AnyValue(60.0f));
+}
+
+void test_table_view() {
+  TableSchema schema;
+  schema.add_field("name", AnyType::from_string());
+  schema.add_field("score", AnyType::from_float());
+
+  auto table = Table::create_ptr("stu", schema);
+  for (int i = 0; i < 10; i++) {
+    table->add_row({AnyValue::from_string(fmt::format("stu-{}", i)),
+                    AnyValue(float(i * 10))});
+  }
+
+  TableView view(table);
+  TEST_CHECK(view.is_identity());
+  TEST_CHECK(view.materialize() == table);
+
+  auto filtered =
+      FilterExpr::parse("score > 25 and score < 75", schema)
+          ->filter(view)
+          .sort(vector<size_t>{1}, false)
+          .select(vector<size_t>{0});
+  TEST_CHECK(filtered.num_rows() == 5);
+  TEST_CHECK(filtered.row_index(0) == 7);
+  TEST_CHECK(filtered.get(4, 0) == AnyValue::from_string("stu-3"));
+
+  auto out = filtered.limit(0, 2).materialize();
+  TEST_CHECK(out != table);
+  TEST_CHECK(out->num_rows() == 2);
+  TEST_CHECK(out->schema().field_names() == vector<string>{"name"});
+  TEST_CHECK(out->get_row(1)[0] == AnyValue::from_string("stu-6"));
+}
+
+void test_table_snapshot() {
+  TableSchema schema;
+  schema.add_field("id", AnyType::from_float());
+
+  auto table = Table::create_ptr("nums", schema);
+  for (int i = 0; i < 5000; i++) {
+    table->add_row({AnyValue(float(i))});
+  }
+
+  auto before = table->snapshot();
+  TEST_CHECK(table->snapshot()->column(0).shares_chunks(before->column(0)));
+  auto after_res = table->modify([](Table &t) {
+    return t.update_row([](ValueList &row, size_t row_idx) {
+      if (row_idx == 10) {
+        row[0] = AnyValue(-1.0f);
+      }
+    });
+  });
+  TEST_CHECK(after_res.is_ok());
+  auto after = after_res.unwrap();
+
+  // the old snapshot is untouched, only the modified chunk is copied
+  TEST_CHECK(before->column(0).get(10) == AnyValue(10.0f));
+  TEST_CHECK(after->column(0).get(10) == AnyValue(-1.0f));
+  TEST_CHECK(table->snapshot()->column(0).get(10) == AnyValue(-1.0f));
+  TEST_CHECK(after->column(0).num_chunks() == 3);
+  TEST_CHECK(!after->column(0).shares_chunks(before->column(0)));
+  TEST_CHECK(!after->column(0).shares_chunk(before->column(0), 0));
+  TEST_CHECK(after->column(0).shares_chunk(before->column(0), 1));
+  TEST_CHECK(after->column(0).shares_chunk(before->column(0), 2));
+  TEST_CHECK(after->version() == before->version() + 1);
+
+  // a failed writer publishes nothing
+  auto failed = table->modify([](Table &t) -> Result<bool> {
+    t.add_row({AnyValue(0.0f)});
+    return Error("failed");
+  });
+  TEST_CHECK(failed.has_error());
+  TEST_CHECK(table->snapshot()->num_rows() == 5000);
+}
+
+void test_table_index() {
+  TableSchema schema;
+  schema.add_field("name", AnyType::from_string());
+  schema.add_field("score", AnyType::from_null_float());
+
+  Table table("students", schema);
+  TEST_CHECK(table.create_index(1).is_ok());
+  for (int i = 0; i < 5000; i++) {
+    table.add_row({AnyValue::from_string(fmt::format("s{}", i)),
+                   i % 10 == 0 ? AnyValue() : AnyValue(float(i % 7))});
+  }
+  TEST_CHECK(table.create_index(0).is_ok());
+
+  auto &names = table.column(0);
+  TEST_CHECK(names.lookup(AnyValue::from_string("s4321")) ==
+             RowIndicesList{4321});
+  TEST_CHECK(names.lookup(AnyValue::from_string("none")).empty());
+
+  // same matches as a scan, floats within the epsilon are equal
+  auto scan = [&](const AnyValue &value) {
+    RowIndicesList rows;
+    for (size_t i = 0; i < table.num_rows(); i++) {
+      if (table.column(1).get(i) == value) {
+        rows.push_back(i);
+      }
+    }
+    return rows;
+  };
+  auto three = AnyValue(3.00009f);
+  TEST_CHECK(table.column(1).lookup(three) == scan(three));
+  TEST_CHECK(!table.column(1).can_lookup(AnyValue()));
+
+  // kept up to date by updates and deletes
+  table.update_rows(RowIndicesList{3, 4500}, [](ValueList &row, size_t) {
+    row[1] = AnyValue(3.0f);
+  });
+  table.delete_rows([](const ValueList &row, size_t) {
+    return row[0] == AnyValue::from_string("s17");
+  });
+  TEST_CHECK(table.column(1).lookup(three) == scan(three));
+  TEST_CHECK(names.lookup(AnyValue::from_string("s4321")) ==
+             RowIndicesList{4320});
+}
+
+void test_sort_rows() {
+  TableSchema schema;
+  schema.add_field("f", AnyType::from_null_float());
+  schema.add_field("s", AnyType::from_null_string());
+  schema.add_field("a", AnyType::from_any());
+
+  // few distinct keys, long common string prefixes, nulls and -0
+  auto table = Table::create_ptr("t", schema);
+  vector<AnyValue> floats{AnyValue(), AnyValue(-1.5f), AnyValue(-0.0f),
+                          AnyValue(0.0f), AnyValue(2.0f)};
+  vector<AnyValue> strings{AnyValue(), AnyValue::from_string("prefix"),
+                           AnyValue::from_string("prefix-a"),
+                           AnyValue::from_string("prefix-b"),
+                           AnyValue::from_string("")};
+  for (size_t i = 0; i < 100000; i++) {
+    auto &f = floats[i * 7 % floats.size()];
+    auto &s = strings[i * 13 % 11 % strings.size()];
+    table->add_row({f, s, i % 3 == 0 ? s : f});
+  }
+
+  ThreadPool pool(4);
+  for (auto fields : vector<vector<size_t>>{{0}, {1}, {2}, {1, 0}, {0, 2}}) {
+    vector<const Column *> columns;
+    for (auto field : fields) {
+      columns.push_back(&table->column(field));
+    }
+    for (bool asc : {true, false}) {
+      RowIndicesList expected(table->num_rows());
+      for (size_t i = 0; i < expected.size(); i++) {
+        expected[i] = i;
+      }
+      std::stable_sort(expected.begin(), expected.end(),
+                       [&](size_t lhs, size_t rhs) {
+                         for (auto column : columns) {
+                           int res = column->compare(lhs, rhs);
+                           if (res != 0) {
+                             return asc ? res < 0 : res > 0;
+                           }
+                         }
+                         return false;
+                       });
+      TEST_CHECK(sort_rows(columns, expected, asc, &pool) == expected);
+
+      RowIndicesList rows(table->num_rows());
+      for (size_t i = 0; i < rows.size(); i++) {
+        rows[i] = i;
+      }
+      TEST_CHECK(sort_rows(columns, rows, asc, &pool) == expected);
+      TEST_CHECK(sort_rows(columns, rows, asc) == expected);
+    }
+  }
+
+  // NaN after every other float, by the radix sort, top-K and index walks
+  TableSchema nan_schema;
+  nan_schema.add_field("id", AnyType::from_float());
+  nan_schema.add_field("a", AnyType::from_null_float());
+  auto nans = Table::create_ptr("nans", nan_schema);
+  float nan = std::numeric_limits<float>::quiet_NaN();
+  float inf = std::numeric_limits<float>::infinity();
+  vector<AnyValue> cells{AnyValue(3.0f), AnyValue(nan),     AnyValue(7.0f),
+                         AnyValue(5.0f), AnyValue(4.99995f), AnyValue(),
+                         AnyValue(nan),  AnyValue(inf)};
+  for (size_t i = 0; i < cells.size(); i++) {
+    nans->add_row({AnyValue(float(i + 1)), cells[i]});
+  }
+  auto ids = [&](const TableView &view) {
+    vector<float> ids;
+    for (size_t i = 0; i < view.num_rows(); i++) {
+      ids.push_back(nans->column(0).get(view.row_index(i)).as_float());
+    }
+    return ids;
+  };
+  vector<float> asc_ids{6, 1, 5, 4, 3, 8, 2, 7};
+  vector<float> desc_ids{2, 7, 8, 3, 4, 5, 1, 6};
+  for (bool indexed : {false, true}) {
+    if (indexed) {
+      TEST_CHECK(nans->create_ordered_index({1}).is_ok());
+    }
+    for (bool asc : {true, false}) {
+      auto &expected = asc ? asc_ids : desc_ids;
+      TableView view(nans);
+      vector<size_t> fields{1};
+      TEST_CHECK(ids(view.sort(fields, asc)) == expected);
+      TEST_CHECK(ids(view.sort(fields, asc, &pool)) == expected);
+      TEST_CHECK(ids(view.top_k(fields, asc, expected.size())) == expected);
+      TEST_CHECK(ids(view.top_k(fields, asc, 3)) ==
+                 vector<float>(expected.begin(), expected.begin() + 3));
+      TEST_MSG("indexed: %d, asc: %d", indexed, asc);
+    }
+  }
+}
+
+void test_ordered_index() {
+  TableSchema schema;
+  schema.add_field("name", AnyType::from_string());
+  schema.add_field("score", AnyType::from_null_float());
+
+  auto table = Table::create_ptr("students", schema);
+  TEST_CHECK(table->create_ordered_index({1}).is_ok());
+  for (int i = 0; i < 5000; i++) {
+    table->add_row({AnyValue::from_string(fmt::format("s{}", i)),
+                    i % 10 == 0 ? AnyValue() : AnyValue(float(i % 7))});
+  }
+
+  // same rows and tie order as a stable sort of every row
+  auto check_sort = [&](bool asc) {
+    RowIndicesList expected(table->num_rows());
+    for (size_t i = 0; i < expected.size(); i++) {
+      expected[i] = i;
+    }
+    std::stable_sort(expected.begin(), expected.end(), [&](auto l, auto r) {
+      int res = table->compare_rows(l, r, {1});
+      return asc ? res < 0 : res > 0;
+    });
+
+    auto sorted = TableView(table).sort(vector<size_t>{1}, asc);
+    bool same = sorted.num_rows() == expected.size();
+    for (size_t i = 0; same && i < expected.size(); i++) {
+      same = sorted.get(i, 0) == table->column(0).get(expected[i]);
+    }
+    return same;
+  };
+  auto scan = [&](CompareOperator op, const AnyValue &value) {
+    auto comparator = AnyValue::get_comparator(op);
+    RowIndicesList rows;
+    for (size_t i = 0; i < table->num_rows(); i++) {
+      if (comparator(table->column(1).get(i), value)) {
+        rows.push_back(i);
+      }
+    }
+    return rows;
+  };
+
+  // single row appends keep O(log n) sorted runs, an append shares them
+  auto &runs = table->ordered_index({1})->runs;
+  TEST_CHECK(runs.size() <= 13);
+  auto first_run = runs[0];
+  table->add_row({AnyValue::from_string("s5000"), AnyValue(2.0f)});
+  TEST_CHECK(table->ordered_index({1})->runs[0] == first_run);
+
+  TEST_CHECK(check_sort(true));
+  TEST_CHECK(check_sort(false));
+  auto top = TableView(table).top_k(vector<size_t>{1}, true, 600);
+  TEST_CHECK(top.num_rows() == 600 && top.get(599, 1) == AnyValue(0.0f) &&
+             top.get(499, 1).is_null());
+  TEST_CHECK(table->range(1, CompareOperator::LT, AnyValue(3.0f)) ==
+             scan(CompareOperator::LT, AnyValue(3.0f)));
+  TEST_CHECK(table->range(1, CompareOperator::GT, AnyValue(5.5f)) ==
+             scan(CompareOperator::GT, AnyValue(5.5f)));
+  TEST_CHECK(!table->range(0, CompareOperator::LT, AnyValue(1.0f)));
+
+  // kept up to date by updates and deletes
+  table->update_rows(RowIndicesList{3, 4500}, [](ValueList &row, size_t) {
+    row[1] = AnyValue(-1.0f);
+  });
+  table->delete_rows([](const ValueList &row, size_t) {
+    return row[0] == AnyValue::from_string("s17");
+  });
+  TEST_CHECK(check_sort(true));
+  TEST_CHECK(check_sort(false));
+  TEST_CHECK(table->range(1, CompareOperator::LT, AnyValue(0.0f)) ==
+             scan(CompareOperator::LT, AnyValue(0.0f)));
+
+  // and by appends after them
+  for (int i = 0; i < 100; i++) {
+    table->add_row({AnyValue::from_string(fmt::format("t{}", i)),
+                    AnyValue(float(i % 9) - 1)});
+  }
+  TEST_CHECK(check_sort(true));
+  TEST_CHECK(check_sort(false));
+  TEST_CHECK(table->range(1, CompareOperator::GE, AnyValue(6.0f)) ==
+             scan(CompareOperator::GE, AnyValue(6.0f)));
+}
+
+void test_zone_map() {
+  Column column(AnyType::from_null_float());
+  for (size_t i = 0; i < 3 * kColumnChunkSize; i++) {
+    column.push_back(i % 100 == 0 ? AnyValue() : AnyValue(float(i)));
+  }
+
+  auto eq = CompareOperator::EQ, lt = CompareOperator::LT,
+       gt = CompareOperator::GT;
+  TEST_CHECK(!column.may_match(0, gt, AnyValue(3000.0f)));
+  TEST_CHECK(column.may_match(1, gt, AnyValue(3000.0f)));
+  // null cells are less than every value
+  TEST_CHECK(column.may_match(2, lt, AnyValue(1.0f)));
+  TEST_CHECK(!column.may_match(2, eq, AnyValue(1.0f)));
+  TEST_CHECK(column.may_match(0, eq, AnyValue(2047.00005f)));
+  TEST_CHECK(!column.may_match(0, eq, AnyValue::from_string("1")));
+  TEST_CHECK(column.chunk_max(1) == AnyValue(4095.0f));
+  TEST_CHECK(column.chunk_min(0) == AnyValue(1.0f));
+
+  // overwriting a bound keeps the bounds, but they are no longer exact
+  column.set(4095, AnyValue(5.0f));
+  TEST_CHECK(column.may_match(1, gt, AnyValue(4094.5f)));
+  TEST_CHECK(!column.chunk_max(1).has_value());
+  column.set(4000, AnyValue(9000.0f));
+  TEST_CHECK(column.may_match(1, eq, AnyValue(9000.0f)));
+
+  // appending columns off a chunk boundary copies buffer slices, with the
+  // same cells, null counts and zone maps as appending cell by cell
+  for (auto type : {AnyType::from_null_float(), AnyType::from_null_string(),
+                    AnyType::from_any()}) {
+    auto cell = [&](size_t i) {
+      if (i % 7 == 0) {
+        return AnyValue();
+      }
+      auto v = float((i * 37) % 1000);
+      return type.is_null_string()
+                 ? AnyValue::from_string(fmt::format("long string {}", v))
+                 : AnyValue(i % 500 == 1 ? NAN : v);
+    };
+
+    Column expected(type), appended(type);
+    size_t num_cells = 0;
+    for (size_t piece : {size_t(100), kColumnChunkSize + 1, size_t(3000),
+                         size_t(1), 2 * kColumnChunkSize}) {
+      Column part(type);
+      for (size_t i = 0; i < piece; i++, num_cells++) {
+        expected.push_back(cell(num_cells));
+        part.push_back(cell(num_cells));
+      }
+      appended.append(part);
+    }
+
+    bool same = appended.size() == num_cells &&
+                appended.num_chunks() == expected.num_chunks() &&
+                appended.has_nulls() == expected.has_nulls();
+    for (size_t i = 0; same && i < num_cells; i++) {
+      same = appended.is_null(i) == expected.is_null(i) &&
+             appended.holds(i, expected.get(i));
+    }
+    for (size_t c = 0; same && c < expected.num_chunks(); c++) {
+      auto &lhs = appended.chunk(c), &rhs = expected.chunk(c);
+      same = lhs.size == rhs.size && lhs.null_count == rhs.null_count &&
+             lhs.has_nan == rhs.has_nan &&
+             appended.chunk_min(c) == expected.chunk_min(c) &&
+             appended.chunk_max(c) == expected.chunk_max(c);
+    }
+    TEST_CHECK_(same, "type %s", type.name().c_str());
+  }
+}
+
+void test_predicate() {
+  TableSchema schema;
+  schema.add_field("f", AnyType::from_null_float());
+  schema.add_field("s", AnyType::from_null_string());
+  schema.add_field("a", AnyType::from_any());
+
+  // the second chunk has no null cell
+  float nan = std::numeric_limits<float>::quiet_NaN();
+  auto table = Table::create_ptr("t", schema);
+  vector<AnyValue> strings{AnyValue::from_string("a"),
+                           AnyValue::from_string("b"),
+                           AnyValue::from_string("")};
+  for (size_t i = 0; i < 3 * kColumnChunkSize + 100; i++) {
+    bool null = i % 7 == 0 && i / kColumnChunkSize != 1;
+    AnyValue f = i % 101 == 0 ? AnyValue(nan) : AnyValue(float(i % 10));
+    auto &s = strings[i % strings.size()];
+    table->add_row({null ? AnyValue() : f, null ? AnyValue() : s,
+                    i % 2 == 0 ? f : s});
+  }
+
+  vector<AnyValue> values{AnyValue(),          AnyValue(3.0f),
+                          AnyValue(3.00005f),  AnyValue(nan),
+                          strings[1],          strings[2]};
+  RowIndicesList strided, scanned;
+  for (size_t i = 5; i < table->num_rows(); i += 3) {
+    strided.push_back(i);
+  }
+  for (size_t i = 2000; i < 2000 + kBatchSize; i++) {
+    scanned.push_back(i);
+  }
+
+  // every form of predicate with the reference semantics of `AnyValue`
+  using Reference = std::function<bool(const AnyValue &)>;
+  auto cases_of = [&](const AnyType &type) {
+    vector<std::pair<Predicate, Reference>> cases;
+    for (auto op : {CompareOperator::EQ, CompareOperator::LT,
+                    CompareOperator::GT, CompareOperator::LE,
+                    CompareOperator::GE, CompareOperator::NE}) {
+      auto comparator = AnyValue::get_comparator(op);
+      for (auto &value : values) {
+        cases.emplace_back(Predicate(type, op, value), [=](auto &cell) {
+          return comparator(cell, value);
+        });
+      }
+    }
+    auto ge = AnyValue::get_comparator(CompareOperator::GE);
+    auto le = AnyValue::get_comparator(CompareOperator::LE);
+    for (auto &low : values) {
+      for (auto &high : values) {
+        cases.emplace_back(Predicate::between(type, low, high),
+                           [=](auto &cell) {
+                             return ge(cell, low) && le(cell, high);
+                           });
+      }
+    }
+    for (auto list : vector<ValueList>{{values[1], values[4]},
+                                       {values[0], values[2], values[5]},
+                                       {values[3], values[4]},
+                                       {AnyValue(7.0f), strings[0]}}) {
+      cases.emplace_back(Predicate::in(type, list), [=](auto &cell) {
+        return std::find(list.begin(), list.end(), cell) != list.end();
+      });
+    }
+    cases.emplace_back(Predicate::is_null(type),
+                       [](auto &cell) { return cell.is_null(); });
+    cases.emplace_back(Predicate::not_null(type),
+                       [](auto &cell) { return !cell.is_null(); });
+    return cases;
+  };
+
+  RowIndicesList all(table->num_rows());
+  std::iota(all.begin(), all.end(), 0);
+  for (size_t field = 0; field < 3; field++) {
+    auto &column = table->column(field);
+    for (auto &test_case : cases_of(schema.get_field(field).type)) {
+      auto &predicate = test_case.first;
+      auto &reference = test_case.second;
+      auto expected = [&](const RowIndicesList &rows) {
+        RowIndicesList passed;
+        for (auto row : rows) {
+          if (reference(column.get(row))) {
+            passed.push_back(row);
+          }
+        }
+        return passed;
+      };
+
+      auto passed = expected(all);
+      TEST_CHECK(predicate.select(column, 0, all.size()) == passed);
+      RowIndicesList unaligned(all.begin() + 100, all.begin() + 5000);
+      TEST_CHECK(predicate.select(column, 100, 5000) == expected(unaligned));
+      TEST_CHECK(predicate.select(column, strided) == expected(strided));
+      TEST_CHECK(predicate.select(column, scanned) == expected(scanned));
+
+      // zone maps never rule out a passing row
+      for (auto row : passed) {
+        TEST_CHECK(predicate.may_match(column, row / kColumnChunkSize));
+      }
+    }
+  }
+
+  // lookups in the indexes agree with the kernels, the ordered index can't
+  // be used on a column holding NaN
+  auto indexed = Table::create_ptr("t", schema);
+  for (size_t i = 0; i < 2 * kColumnChunkSize; i++) {
+    bool null = i % 7 == 0;
+    auto &s = strings[i % strings.size()];
+    indexed->add_row({null ? AnyValue() : AnyValue(float(i % 10)),
+                      null ? AnyValue() : s, s});
+  }
+  indexed->create_ordered_index({0});
+  indexed->create_index(1);
+  size_t num_looked_up = 0;
+  for (size_t field = 0; field < 2; field++) {
+    auto &column = indexed->column(field);
+    auto cases = cases_of(schema.get_field(field).type);
+    for (auto &[predicate, reference] : cases) {
+      auto rows = predicate.lookup(*indexed, field);
+      if (rows) {
+        TEST_CHECK(*rows == predicate.select(column, 0, indexed->num_rows()));
+        num_looked_up++;
+      }
+    }
+  }
+  TEST_CHECK(num_looked_up > 50);
+  TEST_CHECK(Predicate::between(schema.get_field(0).type, AnyValue(2.0f),
+                                AnyValue(4.0f))
+                 .lookup(*indexed, 0));
+  TEST_CHECK(Predicate::in(schema.get_field(1).type, {strings[0], strings[1]})
+                 .lookup(*indexed, 1));
+  TEST_CHECK(!Predicate::is_null(schema.get_field(0).type).lookup(*table, 0));
+
+  auto type = schema.get_field(0).type;
+  TEST_CHECK(!Predicate::parse(type, "<=", {AnyValue(1.0f)}).has_error());
+  TEST_CHECK(Predicate::parse(type, "between", {AnyValue(1.0f)}).has_error());
+  TEST_CHECK(Predicate::parse(type, "in", {}).has_error());
+  TEST_CHECK(Predicate::parse(type, "is_null", {AnyValue()}).has_error());
+  TEST_CHECK(Predicate::parse(type, "like", {AnyValue()}).has_error());
+}
+
+void test_simd() {
+  float nan = std::numeric_limits<float>::quiet_NaN();
+  vector<float> cells;
+  for (size_t i = 0; i < 2000; i++) {
+    float special[] = {nan, -0.0f, 0.0f, 3.00005f, 3.0002f};
+    cells.push_back(i % 9 == 0 ? special[i / 9 % 5] : float(i % 13) - 6);
+  }
+  vector<uint64_t> mask((cells.size() + 63) / 64);
+  for (size_t i = 0; i < cells.size(); i += 3) {
+    mask[i / 64] |= uint64_t(1) << (i % 64);
+  }
+
+  auto detected = simd::detected_isa();
+  for (auto isa : {simd::Isa::Scalar, simd::Isa::SSE2, simd::Isa::AVX2}) {
+    if (isa > detected) {
+      continue;
+    }
+    simd::set_isa(isa);
+
+    for (size_t n : {0, 1, 63, 64, 100, 2000}) {
+      for (auto op : {CompareOperator::EQ, CompareOperator::LT,
+                      CompareOperator::GT, CompareOperator::LE,
+                      CompareOperator::GE, CompareOperator::NE}) {
+        auto comparator = AnyValue::get_comparator(op);
+        for (float value : {3.0f, 0.0f, nan}) {
+          vector<uint64_t> bits((n + 63) / 64);
+          simd::compare_floats(op, cells.data(), n, value, bits.data());
+          bool same = true;
+          for (size_t i = 0; i < n; i++) {
+            bool bit = (bits[i / 64] >> (i % 64)) & 1;
+            same &= bit == comparator(AnyValue(cells[i]), AnyValue(value));
+          }
+          TEST_CHECK(same);
+        }
+      }
+
+      for (bool masked : {false, true}) {
+        auto summary = simd::summarize_floats(cells.data(), n,
+                                              masked ? mask.data() : nullptr);
+        size_t count = 0;
+        double sum = 0;
+        float min = INFINITY, max = -INFINITY;
+        for (size_t i = 0; i < n; i++) {
+          if (masked && i % 3 != 0) {
+            continue;
+          }
+          count++;
+          sum += cells[i];
+          if (!std::isnan(cells[i])) {
+            min = std::min(min, cells[i]);
+            max = std::max(max, cells[i]);
+          }
+        }
+        // the partial sums are exact in any order
+        TEST_CHECK(summary.count == count);
+        TEST_CHECK(summary.has_nan == std::isnan(sum));
+        TEST_CHECK(summary.has_nan ? std::isnan(summary.sum)
+                                   : summary.sum == sum);
+        TEST_CHECK(summary.min == min && summary.max == max);
+      }
+    }
+  }
+  simd::set_isa(detected);
+}
+
+void test_pipeline() {
+  TableSchema schema;
+  schema.add_field("id", AnyType::from_float());
+
+  auto table = Table::create_ptr("nums", schema);
+  for (int i = 0; i < 10000; i++) {
+    table->add_row({AnyValue(float(i))});
+  }
+
+  auto scan = std::make_shared<ScanOperator>(TableView(table));
+  OperatorPtr op = std::make_shared<FilterOperator>(
+      scan, 0,
+      Predicate::between(AnyType::from_float(), AnyValue(100.0f),
+                         AnyValue(10000.0f)));
+  op = std::make_shared<LimitOperator>(op, 10);
+
+  auto out = collect(*op);
+  TEST_CHECK(out.num_rows() == 10);
+  TEST_CHECK(out.get(9, 0) == AnyValue(109.0f));
+  // limit stops pulling after the first batch
+  TEST_CHECK(scan->remaining()->num_rows() == table->num_rows() - kBatchSize);
+
+  op = std::make_shared<ScanOperator>(TableView(table));
+  op = std::make_shared<SortOperator>(op, vector<size_t>{0}, false);
+  op = std::make_shared<AggregateOperator>(
+      op,
+      AggregateSpec{
+          .name = "count",
+          .result_type = [](const AnyType &) { return AnyType::from_float(); },
+          .update = [](AnyValue &, const AnyValue &) {},
+          .finish = [](const AnyValue &, size_t rows) {
+            return AnyValue(float(rows));
+          }},
+      vector<size_t>{0});
+  TEST_CHECK(op->schema().field_names() == vector<string>{"count(id)"});
+  out = collect(*op);
+  TEST_CHECK(out.num_rows() == 1 && out.get(0, 0) == AnyValue(10000.0f));
+
+  // top-k matches a sort followed by a limit, ties in input order
+  schema.add_field("group", AnyType::from_float());
+  auto pairs = Table::create_ptr("pairs", schema);
+  for (int i = 0; i < 10000; i++) {
+    pairs->add_row({AnyValue(float(i)), AnyValue(float(i * 7 % 10))});
+  }
+  auto filtered = [&] {
+    OperatorPtr op = std::make_shared<ScanOperator>(TableView(pairs));
+    return std::make_shared<FilterOperator>(
+        op, 1,
+        Predicate(AnyType::from_float(), CompareOperator::NE, AnyValue(3.0f)));
+  };
+  for (bool asc : {true, false}) {
+    op = std::make_shared<SortOperator>(filtered(), vector<size_t>{1}, asc);
+    op = std::make_shared<LimitOperator>(op, 2500);
+    auto sorted = collect(*op).materialize()->rows();
+
+    op = std::make_shared<TopKOperator>(filtered(), vector<size_t>{1}, asc,
+                                        2500);
+    TEST_CHECK(collect(*op).materialize()->rows() == sorted);
+  }
+
+  // over the memory budget, runs of kBatchSize rows are spilled and merged
+  for (bool asc : {true, false}) {
+    for (bool scan : {true, false}) {
+      auto input = [&]() -> OperatorPtr {
+        if (scan) {
+          return std::make_shared<ScanOperator>(TableView(pairs));
+        }
+        return filtered();
+      };
+      op = std::make_shared<SortOperator>(input(), vector<size_t>{1}, asc);
+      auto sorted = collect(*op).materialize()->rows();
+
+      auto spilled =
+          std::make_shared<SortOperator>(input(), vector<size_t>{1}, asc,
+                                         nullptr, kSortRowBytes * kBatchSize);
+      TEST_CHECK(collect(*spilled).materialize()->rows() == sorted);
+      TEST_CHECK(spilled->num_runs() >= 3);
+    }
+  }
+
+#ifdef __linux__
+  // a spilled run that can't be read back fails the sort instead of ending it
+  // early: once the runs are spilled, their temp files are replaced by a
+  // write-only descriptor
+  auto spilled = std::make_shared<SortOperator>(
+      std::make_shared<ScanOperator>(TableView(pairs)), vector<size_t>{1},
+      true, nullptr, kSortRowBytes * kBatchSize * 4);
+  TEST_CHECK(spilled->next().has_value() && !spilled->error().has_value());
+  int null_fd = ::open("/dev/null", O_WRONLY);
+  size_t num_replaced = 0;
+  for (auto &entry : std::filesystem::directory_iterator("/proc/self/fd")) {
+    std::error_code ec;
+    auto target = std::filesystem::read_symlink(entry.path(), ec).string();
+    string deleted = " (deleted)";
+    if (!ec && target.rfind("/tmp/", 0) == 0 &&
+        target.size() > deleted.size() &&
+        target.compare(target.size() - deleted.size(), deleted.size(),
+                       deleted) == 0) {
+      TEST_CHECK(::dup2(null_fd, std::stoi(entry.path().filename())) >= 0);
+      num_replaced++;
+    }
+  }
+  ::close(null_fd);
+  TEST_CHECK(num_replaced > 0);
+  size_t num_rows = kBatchSize;
+  while (auto batch = spilled->next()) {
+    num_rows += batch->num_rows();
+  }
+  TEST_CHECK(num_rows < pairs->num_rows());
+  TEST_CHECK(spilled->error().has_value());
+
+  // the query fails with it
+  op = std::make_shared<AggregateOperator>(
+      spilled, AggregateSpec{.name = "count",
+                             .result_type = [](const AnyType &) {
+                               return AnyType::from_float();
+                             },
+                             .update = [](AnyValue &, const AnyValue &) {}},
+      vector<size_t>{0});
+  collect(*op);
+  TEST_CHECK(op->error().has_value());
+#endif
+
+  // a scan of every row walks the ordered index
+  TEST_CHECK(pairs->create_ordered_index(vector<size_t>{1}).is_ok());
+  op = std::make_shared<ScanOperator>(TableView(pairs));
+  op = std::make_shared<TopKOperator>(op, vector<size_t>{1}, false, 3);
+  out = collect(*op);
+  TEST_CHECK(out.num_rows() == 3 && out.get(0, 0) == AnyValue(7.0f) &&
+             out.get(2, 0) == AnyValue(27.0f));
+}
+
+void test_group_by() {
+  auto run = [](DatabasePtr &db, const string &query) {
+    return db->execute(parse_query(query).unwrap()).get();
+  };
+
+  auto db = create_database({.num_workers = 2}).unwrap();
+  run(db, R"(create_table("t") | add_field("cls", "string?") |
+             add_field("score", "float?"))");
+  // a single group of every row, even without rows
+  auto out = run(db, R"(query("t") | count())").unwrap();
+  TEST_CHECK(out->rows() == vector<ValueList>{{AnyValue::from_float(0)}});
+
+  run(db, R"(insert("t") | add_row("a", 1) | add_row("b", 2) |
+             add_row("a", null) | add_row(null, 4) | add_row("b", 0) |
+             add_row("a", 3))");
+  out = run(db, R"(query("t") | group_by("cls") | count() | count("score") |
+                   sum("score") | min("score") | max("score"))")
+            .unwrap();
+  TEST_CHECK(out->schema().field_names() ==
+             (vector<string>{"cls", "count(*)", "count(score)", "sum(score)",
+                             "min(score)", "max(score)"}));
+  auto f = [](float v) { return AnyValue::from_float(v); };
+  vector<ValueList> expected{
+      {AnyValue::from_string("a"), f(3), f(2), f(4), f(1), f(3)},
+      {AnyValue::from_string("b"), f(2), f(2), f(2), f(0), f(2)},
+      {AnyValue(), f(1), f(1), f(4), f(4), f(4)}};
+  TEST_CHECK(out->rows() == expected);
+  TEST_CHECK(run(db, R"(query("t") | group_by("cls") | sum("cls"))")
+                 .has_error());
+
+  // floats are grouped exactly, -0 with 0 and NaN with NaN
+  TableSchema schema;
+  schema.add_field("k", AnyType::from_float());
+  schema.add_field("v", AnyType::from_float());
+  auto table = Table::create_ptr("floats", schema);
+  float nan = std::numeric_limits<float>::quiet_NaN();
+  for (float k : {-0.0f, 1.0f, nan, 0.0f, nan, 1.00001f}) {
+    table->add_row({AnyValue(k), AnyValue(1.0f)});
+  }
+  auto group = std::make_shared<GroupByOperator>(
+      std::make_shared<ScanOperator>(TableView(table)), vector<size_t>{0});
+  TEST_CHECK(group->add_aggregate({.kind = GroupAggregate::Kind::Count,
+                                   .result_type = AnyType::from_float()})
+                 .is_ok());
+  auto groups = collect(*group).materialize()->rows();
+  TEST_CHECK(groups.size() == 4 && groups[0][1] == f(2) &&
+             groups[2][1] == f(2) && std::isnan(groups[2][0].as_float()));
+
+  // the parallel partitioned build matches the serial one
+  schema.add_field("s", AnyType::from_null_string());
+  auto pairs = Table::create_ptr("pairs", schema);
+  for (size_t i = 0; i < 100000; i++) {
+    auto s = i % 7 == 0 ? AnyValue()
+                        : AnyValue::from_string(std::to_string(i % 3));
+    pairs->add_row({AnyValue(float(i * 7919 % 20000)),
+                    AnyValue(float(i % 100)), s});
+  }
+  ThreadPool pool(4);
+  vector<vector<ValueList>> results;
+  for (auto pool_ptr : {(ThreadPool *)nullptr, &pool}) {
+    auto group = std::make_shared<GroupByOperator>(
+        std::make_shared<ScanOperator>(TableView(pairs)),
+        vector<size_t>{2, 0}, pool_ptr);
+    for (auto kind : {GroupAggregate::Kind::Sum, GroupAggregate::Kind::Avg,
+                      GroupAggregate::Kind::Max}) {
+      TEST_CHECK(group->add_aggregate({.kind = kind,
+                                       .field_index = 1,
+                                       .result_type = AnyType::from_any()})
+                     .is_ok());
+    }
+    results.push_back(collect(*group).materialize()->rows());
+  }
+  std::set<std::pair<int, size_t>> keys;
+  for (size_t i = 0; i < 100000; i++) {
+    keys.insert({i % 7 == 0 ? -1 : int(i % 3), i * 7919 % 20000});
+  }
+  TEST_CHECK(results[0].size() == keys.size());
+  TEST_CHECK(results[0] == results[1]);
+
+  // agg computes them all in one pass, like the single aggregations
+  run(db, R"(create_table("nums") | add_field("k", "float") |
+             add_field("v", "float?") | add_field("s", "string?"))");
+  auto nums = db->get_table("nums").unwrap();
+  for (size_t i = 0; i < 10000; i++) {
+    nums->add_row({AnyValue(float(i % 10)),
+                   i % 5 == 0 ? AnyValue() : AnyValue(float(i * 37 % 1000)),
+                   i % 3 == 0 ? AnyValue() : AnyValue::from_string(
+                                                 std::to_string(i % 777))});
+  }
+  for (string source : {R"(query("nums"))",
+                        R"(query("nums") | where("k", ">", 2))"}) {
+    out = run(db, source + R"( | agg("max:v", "min:s", "count:*",
+                                     "count:v", "sum:v", "avg:v"))")
+              .unwrap();
+    vector<string> singles{R"(max("v"))", R"(min("s"))", R"(count())",
+                           R"(count("v"))", R"(sum("v"))", R"(avg("v"))"};
+    ValueList expected;
+    for (auto &single : singles) {
+      auto res = run(db, source + " | " + single).unwrap();
+      expected.push_back(res->rows()[0][0]);
+    }
+    TEST_CHECK(out->rows() == vector<ValueList>{expected});
+  }
+  // the filtered batches are folded as they are pulled
+  out = run(db, R"(query("nums") | where("k", ">", 2) |
+                   agg("count:*", "count:v"))")
+            .unwrap();
+  vector<ValueList> counts{{f(7000), f(6000)}};
+  TEST_CHECK(out->rows() == counts);
+  out = run(db, R"(query("nums") | group_by("k") | agg("count:*", "max:v"))")
+            .unwrap();
+  TEST_CHECK(out->num_rows() == 10 && out->rows()[9][1] == f(1000));
+  TEST_CHECK(run(db, R"(query("nums") | agg("sum:s"))").has_error());
+  TEST_CHECK(run(db, R"(query("nums") | agg("max:*"))").has_error());
+}
+
+void test_thread_pool() {
+  ThreadPool pool(4);
+  TEST_CHECK(pool.num_workers() == 4);
+
+  vector<int> hits(10000);
+  pool.parallel_for(hits.size(), 100, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      hits[i]++;
+    }
+  });
+  TEST_CHECK(std::all_of(hits.begin(), hits.end(),
+                         [](int hit) { return hit == 1; }));
+
+  // nested parallel_for from a worker must not deadlock
+  std::promise<size_t> nested;
+  pool.add_task([&]() {
+    std::atomic<size_t> sum = 0;
+    pool.parallel_for(1000, 10, [&](size_t begin, size_t end) {
+      sum += end - begin;
+    });
+    nested.set_value(sum);
+  });
+  TEST_CHECK(nested.get_future().get() == 1000);
+
+  // a failed morsel is rethrown to the caller, the pool keeps working
+  TEST_EXCEPTION(pool.parallel_for(1000, 10,
+                                   [](size_t begin, size_t) {
+                                     if (begin == 500) {
+                                       throw std::runtime_error("morsel");
+                                     }
+                                   }),
+                 std::runtime_error);
+  std::atomic<size_t> num_done = 0;
+  std::promise<void> all_done;
+  for (size_t i = 0; i < 1000; i++) {
+    pool.add_task([&]() {
+      if (num_done.fetch_add(1) + 1 == 1000) {
+        all_done.set_value();
+      }
+    });
+  }
+  all_done.get_future().wait();
+  TEST_CHECK(num_done == 1000);
+
+  // the parallel filter keeps the batch order
+  TableSchema schema;
+  schema.add_field("id", AnyType::from_float());
+  auto table = Table::create_ptr("nums", schema);
+  for (int i = 0; i < 10000; i++) {
+    table->add_row({AnyValue(float(i))});
+  }
+
+  OperatorPtr op = std::make_shared<ScanOperator>(TableView(table));
+  op = std::make_shared<FilterOperator>(
+      op, 0,
+      Predicate(AnyType::from_float(), CompareOperator::GE, AnyValue(6666.0f)),
+      &pool);
+  auto out = collect(*op);
+  TEST_CHECK(out.num_rows() == 3334);
+  TEST_CHECK(out.get(3333, 0) == AnyValue(9999.0f));
+}
+
+void test_filter_expr() {
+  TableSchema schema;
+  schema.add_field("f", AnyType::from_null_float());
+  schema.add_field("s", AnyType::from_null_string());
+
+  auto table = Table::create_ptr("t", schema);
+  vector<AnyValue> strings{AnyValue::from_string("a"),
+                           AnyValue::from_string("b"),
+                           AnyValue::from_string("")};
+  for (size_t i = 0; i < 3 * kColumnChunkSize + 100; i++) {
+    table->add_row({i % 11 == 0 ? AnyValue() : AnyValue(float(i % 10)),
+                    i % 13 == 0 ? AnyValue() : strings[i % 3]});
+  }
+  table->create_index(1);
+
+  auto lt = AnyValue::get_comparator(CompareOperator::LT);
+  auto gt = AnyValue::get_comparator(CompareOperator::GT);
+  auto a = strings[0], b = strings[1], empty = strings[2];
+  vector<std::pair<std::string, std::function<bool(AnyValue, AnyValue)>>>
+      cases{
+          {"f < 3 or s = 'b'",
+           [&](auto f, auto s) { return lt(f, AnyValue(3.0f)) || s == b; }},
+          {"not (f between 2 and 5) and s in ('a', \"\")",
+           [&](auto f, auto s) {
+             bool between = !lt(f, AnyValue(2.0f)) && !gt(f, AnyValue(5.0f));
+             return !between && (s == a || s == empty);
+           }},
+          {"f is_null or (f > 7 and not s = 'a') or `s` not_null and f = 1",
+           [&](auto f, auto s) {
+             return f.is_null() || (gt(f, AnyValue(7.0f)) && !(s == a)) ||
+                    (!s.is_null() && f == AnyValue(1.0f));
+           }},
+          {"s = 'a' or s = 'b'",
+           [&](auto f, auto s) { return s == a || s == b; }},
+      };
+
+  auto column_of = [&](size_t field_index) -> const Column & {
+    return table->column(field_index);
+  };
+  for (auto &[text, reference] : cases) {
+    auto expr = FilterExpr::parse(text, schema);
+    TEST_CHECK(!expr.has_error());
+    TEST_MSG("%s", text.c_str());
+
+    // backwards, over enough batches to reorder the children
+    RowIndicesList rows, expected;
+    for (size_t i = table->num_rows(); i-- > 0;) {
+      rows.push_back(i);
+      if (reference(table->column(0).get(i), table->column(1).get(i))) {
+        expected.push_back(i);
+      }
+    }
+    for (int round = 0; round < 3; round++) {
+      RowIndicesList selected;
+      for (size_t begin = 0; begin < rows.size(); begin += 100) {
+        RowIndicesList batch(rows.begin() + begin,
+                             rows.begin() + std::min(rows.size(), begin + 100));
+        auto passed = expr->select(column_of, batch);
+        selected.insert(selected.end(), passed.begin(), passed.end());
+      }
+      TEST_CHECK(selected == expected);
+    }
+
+    // the lookups hold every passing row
+    std::reverse(expected.begin(), expected.end());
+    if (auto looked_up = expr->lookup(*table); looked_up) {
+      TEST_CHECK(std::includes(looked_up->begin(), looked_up->end(),
+                               expected.begin(), expected.end()));
+    }
+  }
+  TEST_CHECK(FilterExpr::parse("s = 'a' or s = 'b'", schema)->lookup(*table));
+  TEST_CHECK(!FilterExpr::parse("s = 'a' or f = 1", schema)->lookup(*table));
+
+  for (auto text : {"f <", "g = 1", "f = 1 or", "(f = 1", "f in 1",
+                    "f between 1", "f = 1 s = 'a'"}) {
+    TEST_CHECK(FilterExpr::parse(text, schema).has_error());
+    TEST_MSG("%s", text);
+  }
+}
+
+void test_query_plan() {
+  TableSchema schema;
+  schema.add_field("a", AnyType::from_null_float());
+  schema.add_field("b", AnyType::from_null_string());
+  schema.add_field("c", AnyType::from_null_float());
+
+  vector<std::pair<string, string>> cases{
+      // filters below sorts, the projection right after them
+      {R"(query("t") | sort("a") | where("b", "=", "x") | select("c"))",
+       R"(query("t") | where("b", "=", "x") | select("c", "a") | sort("a") |
+          select("c"))"},
+      // a top-K
+      {R"(query("t") | sort_desc("a") | select("a", "b") | limit(3))",
+       R"(query("t") | select("a", "b") | sort_desc("a") | limit(3))"},
+      // filters stay after limits, overridden sorts and limits are merged
+      {R"(query("t") | sort("a") | sort("b", "a") | limit(5) | limit(2) |
+          where("c > 1 or a is_null"))",
+       R"(query("t") | sort("b", "a") | limit(2) |
+          where("c > 1 or a is_null"))"},
+      // repeated filters, sorts before count, selects of every field
+      {R"(query("t") | where("a", ">", 1) | sort("b") | where("a", ">", 1) |
+          select("a", "b", "c") | count())",
+       R"(query("t") | where("a", ">", 1) | count())"},
+      {R"(query("t") | sort("a") | where("a", ">", 1.00001) |
+          where("a", ">", 1))",
+       R"(query("t") | where("a", ">", 1.00001) | where("a", ">", 1) |
+          sort("a"))"},
+      // run as written to fail as written
+      {R"(query("t") | sort("a") | where("d", "=", 1))",
+       R"(query("t") | sort("a") | where("d", "=", 1))"},
+      {R"(query("t") | select("a") | sort("a") | where("b", "=", "x"))",
+       R"(query("t") | select("a") | sort("a") | where("b", "=", "x"))"},
+      {R"(delete("t") | where("a", "=", 1))",
+       R"(delete("t") | where("a", "=", 1))"},
+  };
+  for (auto &test_case : cases) {
+    auto query = parse_query(test_case.first).unwrap();
+    auto expected = parse_query(test_case.second).unwrap();
+    TEST_CHECK(optimize_query(query, schema) == expected);
+    TEST_MSG("%s", fmt::format("{}", optimize_query(query, schema)).c_str());
+  }
+
+  // plans check filters without compiling them
+  TEST_CHECK(FilterExpr::fields_of("c > 1 or not (a in (1, 2) and c = 3)",
+                                   schema)
+                 .unwrap() == (vector<size_t>{2, 0, 2}));
+  TEST_CHECK(FilterExpr::fields_of("a between 1", schema).has_error());
+  TEST_CHECK(Predicate::check("in", 2).is_ok());
+  TEST_CHECK(Predicate::check("=", 2).has_error());
+  TEST_CHECK(Predicate::check("~", 1).has_error());
+
+  auto run = [](DatabasePtr &db, const string &query) {
+    return db->execute(parse_query(query).unwrap()).get();
+  };
+  auto db = create_database({.num_workers = 2}).unwrap();
+  run(db, R"(create_table("t") | add_field("a", "float?") |
+             add_field("b", "string?") | add_field("c", "float?"))");
+  run(db, R"(insert("t") | add_row(3, "x", 1) | add_row(1, "y", 2) |
+             add_row(2, "x", 3) | add_row(null, "x", 4) | add_row(2, "x", 5))");
+  auto out =
+      run(db, R"(query("t") | sort("a") | where("b", "=", "x") | select("c"))")
+          .unwrap();
+  auto f = [](float v) { return AnyValue::from_float(v); };
+  TEST_CHECK(out->schema().field_names() == vector<string>{"c"});
+  TEST_CHECK(out->rows() ==
+             (vector<ValueList>{{f(4)}, {f(3)}, {f(5)}, {f(1)}}));
+  out = run(db, R"(query("t") | sort_desc("a") | select("c", "a") | limit(2) |
+                   select("c"))")
+            .unwrap();
+  TEST_CHECK(out->rows() == (vector<ValueList>{{f(1)}, {f(3)}}));
+  auto err = run(db, R"(query("t") | select("a") | where("b", "=", "x"))");
+  TEST_CHECK(err.has_error());
+}
+
+void test_concurrent_queries() {
+  auto run = [](DatabasePtr &db, const string &query) {
+    return db->execute(parse_query(query).unwrap());
+  };
+
+  auto db = create_database({.num_workers = 4}).unwrap();
+  run(db, R"(create_table("t") | add_field("k", "float"))").get();
+  run(db, R"(create_table("u") | add_field("k", "float"))").get();
+  run(db, R"(insert("t") | add_row(0) | add_row(0) | add_row(0))").get();
+  auto before = run(db, R"(query("t"))").get().unwrap();
+
+  // writers to both tables race with readers, which see every insert of 3
+  // rows whole or not at all
+  vector<std::future<Result<TablePtr>>> writes, reads;
+  for (int i = 0; i < 50; i++) {
+    for (auto table : {"t", "u"}) {
+      writes.push_back(run(db, fmt::format(R"(insert("{}") | add_row({}) |
+                                              add_row({}) | add_row({}))",
+                                           table, i, i, i)));
+    }
+    reads.push_back(run(db, R"(query("t") | count())"));
+    reads.push_back(run(db, R"(query("t") | where("k", "=", 0) | count())"));
+  }
+  for (auto &write : writes) {
+    TEST_CHECK(write.get().is_ok());
+  }
+  for (auto &read : reads) {
+    auto count = read.get().unwrap()->rows()[0][0].as_float();
+    TEST_CHECK(count >= 3 && int(count) % 3 == 0);
+  }
+
+  auto count = [&](const string &query) {
+    return run(db, query).get().unwrap()->rows()[0][0].as_float();
+  };
+  TEST_CHECK(count(R"(query("t") | count())") == 153);
+  TEST_CHECK(count(R"(query("u") | count())") == 150);
+  // results don't alias the tables they are read from
+  TEST_CHECK(before->num_rows() == 3);
+}
+
 #ifndef DEBUG_MAIN
 TEST_LIST = {TEST_FUNC(test_strings_trim),        TEST_FUNC(test_strings_split),
              TEST_FUNC(test_tokenize_query_kind), TEST_FUNC(test_parse_query),
              TEST_FUNC(test_tokenize_query_loc),  TEST_FUNC(test_parse_csv),
-             TEST_FUNC(test_trie_tree),           {NULL, NULL}};
+             TEST_FUNC(test_trie_tree),           TEST_FUNC(test_table_columns),
+             TEST_FUNC(test_any_value),           TEST_FUNC(test_table_view),
+             TEST_FUNC(test_table_snapshot),      TEST_FUNC(test_table_index),
+             TEST_FUNC(test_ordered_index),       TEST_FUNC(test_zone_map),
+             TEST_FUNC(test_pipeline),            TEST_FUNC(test_thread_pool),
+             TEST_FUNC(test_load_csv_table),      TEST_FUNC(test_snapshot),
+             TEST_FUNC(test_wal),                 TEST_FUNC(test_wal_load_csv),
+             TEST_FUNC(test_wal_snapshot_source), TEST_FUNC(test_checkpoint),
+             TEST_FUNC(test_sort_rows),           TEST_FUNC(test_group_by),
+             TEST_FUNC(test_predicate),           TEST_FUNC(test_simd),
+             TEST_FUNC(test_filter_expr),         TEST_FUNC(test_query_plan),
+             TEST_FUNC(test_concurrent_queries), {NULL, NULL}};
 #endif
 
 #ifdef DEBUG_MAIN